@@ -0,0 +1,71 @@
+// See LICENSE.txt for license details.
+
+#include "BufferedPrint.h"
+#include "SpiBus.h"
+
+BufferedPrint::BufferedPrint()
+  : _target(NULL)
+{
+#if BUFFERED_PRINT_SIZE > 0
+  _length = 0;
+#endif
+}
+
+void BufferedPrint::attach(Print& target) {
+  detach();
+  _target = &target;
+}
+
+void BufferedPrint::detach() {
+  flush();
+  _target = NULL;
+}
+
+#if BUFFERED_PRINT_SIZE > 0
+
+size_t BufferedPrint::write(uint8_t c) {
+  if (_target == NULL) {
+    return 0;
+  }
+  
+  if (_length == BUFFERED_PRINT_SIZE) {
+    flush();
+  }
+  
+  _buffer[_length++] = c;
+  return 1;
+}
+
+size_t BufferedPrint::write(const uint8_t* buffer, size_t size) {
+  size_t written = 0;
+  
+  while (written < size && write(buffer[written])) {
+    written++;
+  }
+  
+  return written;
+}
+
+void BufferedPrint::flush() {
+  if (_target != NULL && _length > 0) {
+    spiBusAcquire(SPI_DEVICE_ETHERNET);
+    _target->write(_buffer, _length);
+    spiBusRelease(SPI_DEVICE_ETHERNET);
+  }
+  
+  _length = 0;
+}
+
+#else
+
+size_t BufferedPrint::write(uint8_t c) {
+  return _target ? _target->write(c) : 0;
+}
+
+size_t BufferedPrint::write(const uint8_t* buffer, size_t size) {
+  return _target ? _target->write(buffer, size) : 0;
+}
+
+void BufferedPrint::flush() {}
+
+#endif // #if BUFFERED_PRINT_SIZE > 0
@@ -0,0 +1,46 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_BUFFERED_PRINT_H
+#define POURLOGIC_BUFFERED_PRINT_H
+
+#include <Arduino.h>
+#include <Print.h>
+
+#include "config.h"
+
+#define BUFFERED_PRINT_SIZE SETTINGS_HTTP_TX_BUFFER //!< Bytes written to the target at a time (at most 255; 0 passes every call straight through)
+
+/*!
+ * Requests are printed a field at a time, and each print to an
+ * EthernetClient is a send(): the data is copied into the W5100's
+ * transmit buffer, a SEND command is issued and the chip is polled until
+ * the segment has gone, so every field is its own TCP segment and its own
+ * string of SPI register accesses.
+ *
+ * A buffered print collects what is printed, up to #BUFFERED_PRINT_SIZE
+ * bytes, and writes it to the target in one write(buf, len): one
+ * segment, and one burst on the bus (see SpiBus.h), per buffer rather
+ * than per field. #flush once the whole request has been printed.
+ *
+ * \brief Writes a Print in bursts.
+ */
+class BufferedPrint : public Print {
+  public:
+    BufferedPrint();
+    
+    void attach(Print& target); //!< Write to the target (anything left for the last one is written first)
+    void detach();              //!< ... and stop
+    
+    virtual size_t write(uint8_t c);
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    void flush();               //!< Write out what is buffered
+    
+  private:
+    Print* _target;
+#if BUFFERED_PRINT_SIZE > 0
+    uint8_t _buffer[BUFFERED_PRINT_SIZE];
+    uint8_t _length; //!< Bytes buffered
+#endif
+};
+
+#endif // #ifndef POURLOGIC_BUFFERED_PRINT_H
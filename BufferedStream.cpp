@@ -0,0 +1,100 @@
+// See LICENSE.txt for license details.
+
+#include "BufferedStream.h"
+#include "SpiBus.h"
+
+#ifdef SETTINGS_BENCHMARK
+#define COUNT(field, n) (counts.field += (n))
+#else
+#define COUNT(field, n)
+#endif
+
+BufferedStream::BufferedStream()
+  : _source(NULL)
+{
+  detach();
+}
+
+void BufferedStream::attach(Client& source) {
+  detach();
+  _source = &source;
+}
+
+void BufferedStream::detach() {
+  _source = NULL;
+#if BUFFERED_STREAM_SIZE > 0
+  _head = _tail = 0;
+#endif
+#ifdef SETTINGS_BENCHMARK
+  memset(&counts, 0, sizeof(counts));
+#endif
+}
+
+#if BUFFERED_STREAM_SIZE > 0
+
+boolean BufferedStream::_fill() {
+  int length;
+  
+  if (_source == NULL) {
+    return false;
+  }
+  
+  spiBusAcquire(SPI_DEVICE_ETHERNET);
+  COUNT(available, 1);
+  length = _source->available();
+  if (length > 0) {
+    // All of it (or as much as fits) in one go
+    COUNT(reads, 1);
+    length = _source->read(_buffer, min(length, BUFFERED_STREAM_SIZE));
+  }
+  spiBusRelease(SPI_DEVICE_ETHERNET);
+  
+  if (length <= 0) {
+    return false;
+  }
+  COUNT(bytes, length);
+  
+  _head = 0;
+  _tail = length;
+  return true;
+}
+
+int BufferedStream::available() {
+  if (_head == _tail && !_fill()) {
+    return 0;
+  }
+  
+  return _tail - _head;
+}
+
+int BufferedStream::peek() {
+  return available() ? _buffer[_head] : -1;
+}
+
+int BufferedStream::read() {
+  return available() ? _buffer[_head++] : -1;
+}
+
+#else
+
+int BufferedStream::available() {
+  COUNT(available, 1);
+  return _source ? _source->available() : 0;
+}
+
+int BufferedStream::peek() {
+  COUNT(peeks, 1);
+  return _source ? _source->peek() : -1;
+}
+
+int BufferedStream::read() {
+  int c;
+  
+  COUNT(reads, 1);
+  c = _source ? _source->read() : -1;
+  COUNT(bytes, c >= 0);
+  
+  return c;
+}
+
+#endif // #if BUFFERED_STREAM_SIZE > 0
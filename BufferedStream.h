@@ -0,0 +1,69 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_BUFFERED_STREAM_H
+#define POURLOGIC_BUFFERED_STREAM_H
+
+#include <Arduino.h>
+#include <Stream.h>
+#include <Client.h>
+
+#include "config.h"
+
+#define BUFFERED_STREAM_SIZE SETTINGS_HTTP_RX_BUFFER //!< Bytes taken from the source at a time (at most 255; 0 passes every call straight through)
+
+#ifdef SETTINGS_BENCHMARK
+/*! Calls made on the source (see test/benchmark for what each costs on the W5100).
+ */
+struct BufferedStreamCounts {
+  unsigned int available; //!< available() calls
+  unsigned int reads;     //!< read() and read(buf, len) calls
+  unsigned int peeks;     //!< peek() calls
+  unsigned int bytes;     //!< Bytes read
+};
+#endif
+
+/*!
+ * Each EthernetClient call is a string of W5100 register accesses over
+ * SPI: available() reads the received size (twice, until it reads the same
+ * twice), and read() does that again, reads the read pointer, the data and
+ * writes the read pointer back, then issues a RECV command. Read a byte at
+ * a time, as the parsers in StreamUtil.h do (with a waitForAvailable()
+ * before each), that is some fifteen SPI frames per byte.
+ *
+ * A buffered stream takes whatever the source has available, up to
+ * #BUFFERED_STREAM_SIZE bytes, in one read(buf, len), and serves
+ * available(), peek() and read() from RAM until it runs out. The W5100
+ * still moves the data a byte per frame, but the rest is paid once per
+ * burst rather than once per byte.
+ *
+ * \brief Reads a Client in bursts.
+ */
+class BufferedStream : public Stream {
+  public:
+    BufferedStream();
+    
+    void attach(Client& source); //!< Read from the source (anything left from the last one is dropped)
+    void detach();               //!< Stop reading from it
+    
+    virtual int available();
+    virtual int peek();
+    virtual int read();
+    virtual size_t write(uint8_t) { return 0; } //!< Read-only
+    virtual void flush() {}
+    
+#ifdef SETTINGS_BENCHMARK
+    BufferedStreamCounts counts; //!< Since #attach
+#endif
+    
+  private:
+    Client* _source;
+#if BUFFERED_STREAM_SIZE > 0
+    uint8_t _buffer[BUFFERED_STREAM_SIZE];
+    uint8_t _head;   //!< Next byte to serve
+    uint8_t _tail;   //!< End of the bytes buffered
+    
+    boolean _fill(); //!< Refill an empty buffer from the source; false if it had nothing
+#endif
+};
+
+#endif // #ifndef POURLOGIC_BUFFERED_STREAM_H
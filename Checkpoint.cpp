@@ -0,0 +1,151 @@
+// See LICENSE.txt for license details.
+
+#include "Checkpoint.h"
+
+#ifdef SETTINGS_CHECKPOINT
+
+#include "Clock.h"
+
+PourCheckpoint pourCheckpoint(SETTINGS_CHECKPOINT_EEPROM_OFFSET, SETTINGS_CHECKPOINT_PERIOD_MS);
+
+//!< Check byte for a slot
+static uint8_t _check(const uint8_t* data, uint8_t length) {
+  uint8_t check = 0x5C;
+  
+  while (length--) {
+    check = (check << 1 | check >> 7) ^ *data++;
+  }
+  
+  return check;
+}
+
+PourCheckpoint::PourCheckpoint(int base_offset, unsigned long period_ms)
+  : _base_offset(base_offset), _period_ms(period_ms), _state(CHECKPOINT_NONE), _slot(CHECKPOINT_SLOTS - 1), _sequence(0), _saved_uL(0), _saved_ms(0)
+{
+  uint8_t data[SLOT_SIZE];
+  boolean found = false;
+  
+  // The current slot: the good one with the latest sequence number (they are at most a few apart, so this survives wrapping)
+  for (uint8_t slot = 0; slot < CHECKPOINT_SLOTS; slot++) {
+    if (_load(slot, data) && (!found || (uint8_t) (data[0] - _sequence) < 0x80)) {
+      found = true;
+      _slot = slot;
+      _sequence = data[0];
+      _state = data[1];
+      memcpy(&_saved_uL, data + 2, 4);
+    }
+  }
+}
+
+void PourCheckpoint::_write(int offset, const uint8_t* data, uint8_t length) {
+  for (uint8_t i = 0; i < length; i++) {
+    // Only write if it has changed
+    if (EEPROM.read(_base_offset + offset + i) != data[i]) {
+      EEPROM.write(_base_offset + offset + i, data[i]);
+    }
+  }
+}
+
+void PourCheckpoint::_save(uint8_t state, unsigned long volume_uL) {
+  uint8_t slot[SLOT_SIZE];
+  
+  _slot = (_slot + 1) % CHECKPOINT_SLOTS;
+  _sequence++;
+  slot[0] = _sequence;
+  slot[1] = state;
+  memcpy(slot + 2, &volume_uL, 4);
+  slot[6] = _check(slot, 6);
+  
+  _write(SLOT_OFFSET + _slot * SLOT_SIZE, slot, SLOT_SIZE);
+  _state = state;
+  _saved_uL = volume_uL;
+  _saved_ms = clockMillis();
+}
+
+boolean PourCheckpoint::_load(uint8_t slot, uint8_t data[SLOT_SIZE]) {
+  for (uint8_t i = 0; i < SLOT_SIZE; i++) {
+    data[i] = EEPROM.read(_base_offset + SLOT_OFFSET + slot * SLOT_SIZE + i);
+  }
+  
+  return data[6] == _check(data, 6);
+}
+
+void PourCheckpoint::begin(String const& tag, uint32_t nonce) {
+  uint8_t tag_bytes[CHECKPOINT_TAG_LENGTH];
+  
+  memset(tag_bytes, 0, sizeof(tag_bytes));
+  for (uint8_t i = 0; i < CHECKPOINT_TAG_LENGTH && i < tag.length(); i++) {
+    tag_bytes[i] = tag[i];
+  }
+  
+  // Out of date while it is being rewritten
+  if (_state != CHECKPOINT_NONE) {
+    _save(CHECKPOINT_NONE, 0);
+  }
+  _write(TAG_OFFSET, tag_bytes, CHECKPOINT_TAG_LENGTH);
+  _write(NONCE_OFFSET, (const uint8_t*) &nonce, 4);
+  _save(CHECKPOINT_POURING, 0);
+}
+
+void PourCheckpoint::update(unsigned long volume_uL) {
+  if (_state == CHECKPOINT_POURING && volume_uL != _saved_uL && (_saved_uL == 0 || clockMillis() - _saved_ms >= _period_ms)) {
+    _save(CHECKPOINT_POURING, volume_uL);
+  }
+}
+
+void PourCheckpoint::finish(unsigned long volume_uL) {
+  _save(CHECKPOINT_REPORTING, volume_uL);
+}
+
+void PourCheckpoint::sent(uint32_t nonce) {
+  uint32_t kept;
+  
+  if (_state != CHECKPOINT_REPORTING) {
+    return;
+  }
+  
+  for (uint8_t i = 0; i < 4; i++) {
+    ((uint8_t*) &kept)[i] = EEPROM.read(_base_offset + NONCE_OFFSET + i);
+  }
+  
+  if (kept == nonce) {
+    _save(CHECKPOINT_SENT, _saved_uL);
+  }
+}
+
+void PourCheckpoint::hold(unsigned long volume_uL) {
+  if (volume_uL != _saved_uL) {
+    _save(CHECKPOINT_POURING, volume_uL);
+  }
+}
+
+void PourCheckpoint::clear() {
+  if (_state != CHECKPOINT_NONE) {
+    _save(CHECKPOINT_NONE, _saved_uL);
+  }
+}
+
+boolean PourCheckpoint::recover(String& tag, uint32_t& nonce, unsigned long& volume_uL) {
+  char tag_data[CHECKPOINT_TAG_LENGTH+1];
+  
+  if (_state != CHECKPOINT_POURING && _state != CHECKPOINT_REPORTING && _state != CHECKPOINT_SENT) {
+    return false; // Nothing (or never written)
+  }
+  
+  for (uint8_t i = 0; i < CHECKPOINT_TAG_LENGTH; i++) {
+    tag_data[i] = EEPROM.read(_base_offset + TAG_OFFSET + i);
+  }
+  tag_data[CHECKPOINT_TAG_LENGTH] = '\0';
+  tag = tag_data;
+  
+  for (uint8_t i = 0; i < 4; i++) {
+    ((uint8_t*) &nonce)[i] = EEPROM.read(_base_offset + NONCE_OFFSET + i);
+  }
+  
+  // The latest good save (read when constructed)
+  volume_uL = _saved_uL;
+  
+  return true;
+}
+
+#endif // #ifdef SETTINGS_CHECKPOINT
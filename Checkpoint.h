@@ -0,0 +1,106 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_CHECKPOINT_H
+#define POURLOGIC_CHECKPOINT_H
+
+#include <Arduino.h>
+#include <String.h>
+#include <EEPROM.h>
+
+#include "config.h"
+
+#ifdef SETTINGS_CHECKPOINT
+
+#define CHECKPOINT_TAG_LENGTH 10 //!< Tag data kept (as read from the reader)
+#define CHECKPOINT_SLOTS 4       //!< Slots the state and volume are written to in turn (spreading the wear)
+
+/*! States of a checkpoint.
+ */
+enum CheckpointState {
+  CHECKPOINT_NONE = 0,       //!< Nothing to recover
+  CHECKPOINT_POURING = 0x5A, //!< A pour is under way
+  CHECKPOINT_REPORTING = 0xA5, //!< The pour is over; its result is queued but has not been sent
+  CHECKPOINT_SENT = 0x3C      //!< Its result has been sent, and may have been recorded
+};
+
+/*!
+ * A checkpoint is the patron's tag, the nonce of the pour request that
+ * allowed the pour and the volume poured so far, kept in EEPROM from the
+ * time the valve opens until the outbox has emptied after the pour.
+ * After a reset (e.g. by the watchdog, see Watchdog.h) #recover returns
+ * it so the result can be reported before anyone else is served. A
+ * result that was only queued is reported again; one that had been sent
+ * (#sent) may already be recorded, so it is only reported again if the
+ * server records a result once however often it arrives
+ * (#SETTINGS_IDEMPOTENT_RESULTS), rather than bill the patron twice.
+ *
+ * Only the latest pour is kept: one starting while the last one's result
+ * is still queued takes its place. So a pour whose result finds the
+ * outbox full is kept as if still pouring (#hold) until there is room
+ * for it, and no one else pours in the meantime.
+ *
+ * <pre>
+ *   +0   tag (10 bytes)
+ *   +10  nonce (4 bytes)
+ *   +14  slot 0: sequence, state (#CheckpointState), volume in uL (4 bytes), check byte
+ *   +21  slot 1 .. slot 3: ...
+ * </pre>
+ *
+ * The state and the volume are saved together, each save to the next of
+ * #CHECKPOINT_SLOTS slots in turn. The slot with the latest sequence
+ * number is the current one. A write cut short by a power failure
+ * spoils at most the slot being written (its check byte no longer
+ * matches), which leaves the save before it current. The tag and nonce
+ * are only rewritten after a save of #CHECKPOINT_NONE, so a cut there
+ * leaves nothing to recover rather than a mix of two pours.
+ *
+ * A save happens when a pour starts (two: out of date, then pouring),
+ * as soon as flow starts (so a reset early in a pour still leaves
+ * something to report), at most once every
+ * #SETTINGS_CHECKPOINT_PERIOD_MS while pouring, and at each later change
+ * of state: seven or eight a pour. Taking turns over four slots quarters
+ * the wear on each, so a cell's 100,000 writes last for 400,000 saves,
+ * or about 50,000 pours. Only the bytes that change are written.
+ *
+ * \brief The pour in progress, kept in EEPROM.
+ */
+class PourCheckpoint {
+  public:
+    PourCheckpoint(int base_offset, unsigned long period_ms);
+    
+    void begin(String const& tag, uint32_t nonce); //!< A pour is starting
+    void update(unsigned long volume_uL);           //!< Volume poured so far (saved if a period has passed since the last save)
+    void finish(unsigned long volume_uL);           //!< The pour is over and its result queued
+    void sent(uint32_t nonce);                      //!< The result of the pour granted with #nonce is being sent
+    void hold(unsigned long volume_uL);             //!< The pour is over, but its result couldn't be queued yet
+    void clear();                                   //!< The pour's result has been sent (or there is nothing to report)
+    
+    //!< The pour in progress when the controller was reset, if any. Its result should be reported and the checkpoint finished.
+    boolean recover(String& tag, uint32_t& nonce, unsigned long& volume_uL);
+    
+    uint8_t state() { return _state; } //!< A #CheckpointState
+    
+  private:
+    static const int TAG_OFFSET = 0;
+    static const int NONCE_OFFSET = TAG_OFFSET + CHECKPOINT_TAG_LENGTH;
+    static const int SLOT_OFFSET = NONCE_OFFSET + 4;
+    static const int SLOT_SIZE = 7;
+    
+    int _base_offset;
+    unsigned long _period_ms;
+    uint8_t _state;              //!< State last saved
+    uint8_t _slot;               //!< Slot last written
+    uint8_t _sequence;           //!< ... and its sequence number
+    unsigned long _saved_uL;     //!< Volume last saved
+    unsigned long _saved_ms;     //!< When it was saved
+    
+    void _write(int offset, const uint8_t* data, uint8_t length); //!< Write the bytes that differ
+    void _save(uint8_t state, unsigned long volume_uL);           //!< Write the state and volume to the next slot
+    boolean _load(uint8_t slot, uint8_t data[SLOT_SIZE]);         //!< Read a slot; false if it is spoilt
+};
+
+extern PourCheckpoint pourCheckpoint;
+
+#endif // #ifdef SETTINGS_CHECKPOINT
+
+#endif // #ifndef POURLOGIC_CHECKPOINT_H
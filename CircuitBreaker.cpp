@@ -0,0 +1,40 @@
+// See LICENSE.txt for license details.
+
+#include "CircuitBreaker.h"
+
+#ifdef SETTINGS_CIRCUIT_BREAKER
+
+#include "Clock.h"
+
+CircuitBreaker::CircuitBreaker()
+  : _open(false), _failures(0), _since_ms(0), _wait_ms(BREAKER_MIN_PROBE_MS)
+{
+}
+
+boolean CircuitBreaker::probeDue() {
+  return _open && clockMillis() - _since_ms >= _wait_ms;
+}
+
+void CircuitBreaker::reached() {
+  _open = false;
+  _failures = 0;
+  _wait_ms = BREAKER_MIN_PROBE_MS;
+}
+
+void CircuitBreaker::failed() {
+  if (_open) {
+    return; // a request from before it opened; only probes count now
+  }
+  
+  if (++_failures >= BREAKER_MAX_FAILURES) {
+    _open = true;
+    _since_ms = clockMillis();
+  }
+}
+
+void CircuitBreaker::probeFailed() {
+  _wait_ms = min(_wait_ms * 2, (unsigned long) BREAKER_MAX_PROBE_MS);
+  _since_ms = clockMillis();
+}
+
+#endif // #ifdef SETTINGS_CIRCUIT_BREAKER
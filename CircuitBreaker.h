@@ -0,0 +1,58 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_CIRCUIT_BREAKER_H
+#define POURLOGIC_CIRCUIT_BREAKER_H
+
+#include <Arduino.h>
+
+#include "config.h"
+
+#ifdef SETTINGS_CIRCUIT_BREAKER
+
+#define BREAKER_MAX_FAILURES SETTINGS_BREAKER_FAILURES     //!< Requests in a row that fail to reach a server before the breaker opens
+#define BREAKER_MIN_PROBE_MS SETTINGS_BREAKER_PROBE_MS     //!< Time from opening to the first probe
+#define BREAKER_MAX_PROBE_MS SETTINGS_BREAKER_MAX_PROBE_MS //!< Longest time between probes
+
+/*!
+ * When no server can be reached, every request waits out its connect
+ * (or response) timeout before failing, and so does every patron after
+ * it. The breaker counts requests in a row that failed to reach a server
+ * (couldn't connect, or no response came); after #BREAKER_MAX_FAILURES
+ * of them it opens, and requests fail at once rather than being sent.
+ *
+ * <pre>
+ *   closed --(N failures in a row)--> open --(probe answers)--> closed
+ *                                      ^  |
+ *                                      +--+ (probe fails: wait twice as long)
+ * </pre>
+ *
+ * While it is open, the owner probes for a server in the background,
+ * #BREAKER_MIN_PROBE_MS after it opened, then twice as long after each
+ * failed probe, up to #BREAKER_MAX_PROBE_MS. The first request (or
+ * probe) to reach a server closes it. A request the server answered
+ * badly (wrong status, bad HMAC) still reached it, so counts as reaching.
+ *
+ * \brief Fail fast while the servers are unreachable.
+ */
+class CircuitBreaker {
+
+  public:
+    CircuitBreaker();
+    
+    boolean open() { return _open; } //!< Whether requests should fail without being sent
+    boolean probeDue();              //!< Whether it is open and it is time to probe for a server
+    
+    void reached();                  //!< A request (or probe) reached a server; closes the breaker
+    void failed();                   //!< A request failed to reach a server
+    void probeFailed();              //!< A probe failed to reach a server; wait longer for the next
+    
+  private:
+    boolean _open;
+    uint8_t _failures;           //!< Failures in a row (while closed)
+    unsigned long _since_ms;     //!< When it opened, or the last probe failed
+    unsigned long _wait_ms;      //!< Time from #_since_ms to the next probe
+};
+
+#endif // #ifdef SETTINGS_CIRCUIT_BREAKER
+
+#endif // #ifndef POURLOGIC_CIRCUIT_BREAKER_H
@@ -0,0 +1,9 @@
+// See LICENSE.txt for license details.
+
+#include "Clock.h"
+
+#ifndef SETTINGS_TRACE_REPLAY
+
+unsigned long clock_slept_ms = 0;
+
+#endif // #ifndef SETTINGS_TRACE_REPLAY
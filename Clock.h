@@ -0,0 +1,40 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_CLOCK_H
+#define POURLOGIC_CLOCK_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/*! \file Clock.h
+ * \brief The controller's notion of time.
+ *
+ * Everything that times out or measures time goes through these rather
+ * than millis(), micros() and delay() directly. Normally they are the
+ * same thing. When replaying a trace (#SETTINGS_TRACE_REPLAY) they are
+ * driven by the trace instead (see #TraceReplay), so a recorded session
+ * can be reproduced exactly, and, when replaying as fast as possible,
+ * waiting costs nothing.
+ *
+ * millis() and micros() stop while powered down (see #sleepPowerDown),
+ * so time spent asleep is added back in through #clockSlept.
+ */
+
+#ifdef SETTINGS_TRACE_REPLAY
+
+unsigned long clockMillis();          //!< Virtual milliseconds since start of replay
+unsigned long clockMicros();          //!< Virtual microseconds since start of replay
+void clockDelay(unsigned long ms);    //!< Let virtual time pass, delivering any events due
+
+#else
+
+extern unsigned long clock_slept_ms; //!< Time spent powered down, which millis() doesn't count
+
+inline unsigned long clockMillis() { return millis() + clock_slept_ms; }
+inline unsigned long clockMicros() { return micros() + clock_slept_ms * 1000UL; }
+inline void clockDelay(unsigned long ms) { delay(ms); }
+inline void clockSlept(unsigned long ms) { clock_slept_ms += ms; } //!< Count time spent powered down
+
+#endif // #ifdef SETTINGS_TRACE_REPLAY
+
+#endif // #ifndef POURLOGIC_CLOCK_H
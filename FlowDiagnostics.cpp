@@ -0,0 +1,139 @@
+// See LICENSE.txt for license details.
+
+#include "FlowDiagnostics.h"
+
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+
+#define PROBE_TICKS (FLOW_DIAGNOSTICS_PROBE_US / 4) //!< Timer1 ticks (16 MHz / 64) per probe
+
+static uint8_t probe_users = 0;                  //!< Pours being timed
+static volatile unsigned long probe_last_us;     //!< When the probe last ran
+static volatile unsigned int probe_max_late_us;  //!< Longest the probe has waited since it started
+
+//!< Timer1 probe: any time since it last ran beyond its period is time it was kept waiting.
+ISR(TIMER1_COMPA_vect) {
+  unsigned long now_us = micros();
+  unsigned long late_us = now_us - probe_last_us;
+
+  probe_last_us = now_us;
+
+  if (late_us > FLOW_DIAGNOSTICS_PROBE_US) {
+    late_us -= FLOW_DIAGNOSTICS_PROBE_US;
+    if (late_us > probe_max_late_us) {
+      probe_max_late_us = (late_us > 0xFFFF) ? 0xFFFF : late_us;
+    }
+  }
+}
+
+/**
+ * Pours that overlap share the probe; each notes the longest wait since
+ * the first of them began.
+ */
+void flowDiagnosticsBegin(FlowDiagnostics& diagnostics) {
+  memset(&diagnostics, 0, sizeof(diagnostics));
+  diagnostics.min_interval_us = 0xFFFFFFFFUL;
+
+  if (probe_users++ > 0) {
+    return;
+  }
+
+  noInterrupts();
+  probe_last_us = micros();
+  probe_max_late_us = 0;
+
+  // CTC on OCR1A, prescaler 64
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);
+  TCNT1 = 0;
+  OCR1A = PROBE_TICKS - 1;
+  TIFR1 = _BV(OCF1A);
+  TIMSK1 |= _BV(OCIE1A);
+  interrupts();
+}
+
+/**
+ * Runs in the counting interrupt, so only adds and compares, except for
+ * a couple of divisions when an interval is long.
+ */
+void flowDiagnosticsPulse(FlowDiagnostics& diagnostics, unsigned long now_us) {
+  unsigned long interval_us, smoothed_us, jitter_us, spans;
+
+  if (diagnostics.pulses++ == 0) {
+    diagnostics.last_us = now_us;
+    return;
+  }
+
+  interval_us = now_us - diagnostics.last_us;
+  diagnostics.last_us = now_us;
+
+  if (interval_us < diagnostics.min_interval_us) {
+    diagnostics.min_interval_us = interval_us;
+  }
+  if (interval_us > diagnostics.max_interval_us) {
+    diagnostics.max_interval_us = interval_us;
+  }
+
+  smoothed_us = diagnostics.interval_x8 >> 3;
+
+  if (diagnostics.settled >= FLOW_DIAGNOSTICS_SETTLE && smoothed_us > 0) {
+    if (interval_us >= FLOW_DIAGNOSTICS_PAUSE_FACTOR * smoothed_us) {
+      diagnostics.settled = 0; // the flow paused; learn its rate again
+      diagnostics.interval_x8 = 0;
+      return;
+    }
+
+    if (2 * interval_us >= FLOW_DIAGNOSTICS_LONG_HALVES * smoothed_us) {
+      spans = (interval_us + smoothed_us / 2) / smoothed_us; // pulses' worth of time (two or more)
+      diagnostics.long_intervals++;
+      diagnostics.suspect_missed += spans - 1;
+      interval_us /= spans; // smooth the time between the pulses it should have held
+    }
+    else {
+      jitter_us = (interval_us > smoothed_us) ? interval_us - smoothed_us : smoothed_us - interval_us;
+      if (jitter_us > diagnostics.max_jitter_us) {
+        diagnostics.max_jitter_us = jitter_us;
+      }
+    }
+  }
+  else {
+    diagnostics.settled++;
+  }
+
+  // AVG += (T - AVG) / 8, as FlowMeter smooths the time between pulses
+  diagnostics.interval_x8 = (diagnostics.interval_x8 == 0) ? interval_us << 3 : diagnostics.interval_x8 - smoothed_us + interval_us;
+}
+
+void flowDiagnosticsEnd(FlowDiagnostics& diagnostics) {
+  noInterrupts();
+  diagnostics.max_blocked_us = probe_max_late_us;
+  interrupts();
+
+  if (diagnostics.min_interval_us == 0xFFFFFFFFUL) {
+    diagnostics.min_interval_us = 0; // fewer than two pulses
+  }
+
+  if (probe_users == 0 || --probe_users > 0) {
+    return;
+  }
+
+  TIMSK1 &= ~_BV(OCIE1A);
+  TCCR1B = 0;
+}
+
+void flowDiagnosticsPrint(Print& target, FlowDiagnostics const& diagnostics) {
+  target.print(diagnostics.pulses);
+  target.print(' ');
+  target.print(diagnostics.min_interval_us);
+  target.print(' ');
+  target.print(diagnostics.max_interval_us);
+  target.print(' ');
+  target.print(diagnostics.max_jitter_us);
+  target.print(' ');
+  target.print(diagnostics.long_intervals);
+  target.print(' ');
+  target.print(diagnostics.suspect_missed);
+  target.print(' ');
+  target.print(diagnostics.max_blocked_us);
+}
+
+#endif // #ifdef SETTINGS_FLOW_DIAGNOSTICS
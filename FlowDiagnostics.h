@@ -0,0 +1,85 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_FLOW_DIAGNOSTICS_H
+#define POURLOGIC_FLOW_DIAGNOSTICS_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/*! \file FlowDiagnostics.h
+ * \brief Timing flow meter pulses, to see whether any are being missed.
+ *
+ * A flow meter pulse is counted by an interrupt. If interrupts are held
+ * off (by another handler, or by code that turns them off, such as
+ * SoftwareSerial sending a byte) for longer than a pulse, the pulse is
+ * lost and the pour is under-reported, with nothing to show for it.
+ *
+ * With #SETTINGS_FLOW_DIAGNOSTICS, each pulse a meter counts is also
+ * timed (micros(), in the handler), and for each pour the meter keeps:
+ *   - the shortest and longest times between pulses,
+ *   - jitter: the largest difference between a time between pulses and
+ *     the smoothed time between pulses (how late the handler ran, if
+ *     the flow was steady),
+ *   - times between pulses that are implausibly long for the flow at
+ *     the time (half as long again as the smoothed time, or more; see
+ *     #FLOW_DIAGNOSTICS_LONG_HALVES), and the pulses they would have
+ *     held had the flow kept up; a longer pause
+ *     (#FLOW_DIAGNOSTICS_PAUSE_FACTOR times) is taken to be the
+ *     patron's, and
+ *   - the longest interrupts were held off while pouring.
+ *
+ * The last is measured with Timer1: its compare interrupt is due every
+ * #FLOW_DIAGNOSTICS_PROBE_US and notes how long it has been since it
+ * last ran; any more than the period is time it was kept waiting.
+ * Windows of more than a couple of milliseconds are under-reported
+ * (micros() misses Timer0 overflows too), but are far beyond what a
+ * flow meter's pulses survive anyway.
+ *
+ * A real pour's flow varies, so jitter and long intervals are upper
+ * bounds on what interrupt latency did to it; against a steady signal
+ * (see #SETTINGS_FLOW_STRESS and test/isr_stress) they are exact.
+ */
+
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+
+#define FLOW_DIAGNOSTICS_PROBE_US 1000   //!< Period of the Timer1 probe (prescaler 64: 4 us ticks)
+#define FLOW_DIAGNOSTICS_SETTLE 8        //!< Pulses timed before intervals are judged (after the start, or a pause)
+#define FLOW_DIAGNOSTICS_LONG_HALVES 3   //!< An interval this many halves of the smoothed one (or more) suggests missed pulses (one missed makes two)
+#define FLOW_DIAGNOSTICS_PAUSE_FACTOR 8  //!< ... and this many times (or more), a pause in the flow
+
+/*! Timings of one pour's pulses. Updated from the counting interrupt;
+ * read it once the meter has stopped reading.
+ */
+struct FlowDiagnostics {
+  unsigned short pulses;          //!< Pulses timed
+  unsigned long min_interval_us;  //!< Shortest time between pulses
+  unsigned long max_interval_us;  //!< Longest time between pulses
+  unsigned long max_jitter_us;    //!< Largest difference between a (plausible) time between pulses and the smoothed time
+  unsigned short long_intervals;  //!< Times between pulses implausibly long for the flow
+  unsigned short suspect_missed;  //!< Pulses those would have held
+  unsigned int max_blocked_us;    //!< Longest interrupts were held off during the pour
+
+  unsigned long last_us;          //!< When the last pulse was counted
+  unsigned long interval_x8;      //!< Smoothed time between pulses, times 8
+  uint8_t settled;                //!< Pulses timed since the start or a pause (up to #FLOW_DIAGNOSTICS_SETTLE)
+};
+
+/*! \brief Start timing a pour's pulses (and, if it isn't already, the Timer1 probe).
+ */
+void flowDiagnosticsBegin(FlowDiagnostics& diagnostics);
+
+/*! \brief Time a pulse counted at #now_us (from micros()); call from the counting interrupt.
+ */
+void flowDiagnosticsPulse(FlowDiagnostics& diagnostics, unsigned long now_us);
+
+/*! \brief Stop timing; notes the longest interrupts were held off since #flowDiagnosticsBegin (stopping the probe if no other pour needs it).
+ */
+void flowDiagnosticsEnd(FlowDiagnostics& diagnostics);
+
+/*! \brief Print "<pulses> <min us> <max us> <jitter us> <long intervals> <suspect missed> <blocked us>" (no newline).
+ */
+void flowDiagnosticsPrint(Print& target, FlowDiagnostics const& diagnostics);
+
+#endif // #ifdef SETTINGS_FLOW_DIAGNOSTICS
+
+#endif // #ifndef POURLOGIC_FLOW_DIAGNOSTICS_H
@@ -1,35 +1,106 @@
 // See LICENSE.txt for license details.
 
 #include "FlowMeter.h"
+#include "Clock.h"
+#include "Trace.h"
+#include "PinChangeCounter.h"
+#include "Watchdog.h"
+#include "Checkpoint.h"
 
-/*! Active flow meter instance (only one FlowMeter active at a time)
- */
-static FlowMeter *active_flow_meter = NULL;
+#ifndef SETTINGS_FLOW_PCINT
+FlowMeter* volatile FlowMeter::_reading[FLOW_METER_MAX_INTERRUPTS] = {NULL, NULL};
+
+// attachInterrupt() handlers take no arguments, so each interrupt gets its own
+void FlowMeter::_pulse0() { pulse(0); }
+void FlowMeter::_pulse1() { pulse(1); }
+#endif
 
-/*! Flow meter interrupt handler. It increments the pulse count on the #activeFlowMeter.
+/*! Flow meter interrupt handler. It increments the pulse count of the meter reading on the tap.
+ * Also called by #TraceReplay with recorded pulses.
  */
-void FlowMeter::pulse() {
-  if (active_flow_meter != NULL) {
-    active_flow_meter->_pulse_count++;
+void FlowMeter::pulse(uint8_t tap) {
+#ifdef SETTINGS_FLOW_PCINT
+  if (tap < PIN_CHANGE_MAX_COUNTERS) {
+    pinChangeCounterInject(tap); // not from the pin (see TraceReplay); counts from before #_startReading are dropped then
+  }
+#else
+  FlowMeter* meter = (tap < FLOW_METER_MAX_INTERRUPTS) ? _reading[tap] : NULL;
+  
+  if (meter != NULL) {
+    meter->_pulse_count++;
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+    flowDiagnosticsPulse(meter->_diagnostics, micros());
+#endif
+#ifdef SETTINGS_TRACE_RECORD
+    traceRecorder.pulseFromISR(tap);
+#endif
   }
+#endif // #ifdef SETTINGS_FLOW_PCINT
 }
 
 /**
- * Attaches the active flow meter and its interrupts. Resets #_pulse_count to 0.
+ * Makes this the interrupt's meter and attaches the interrupt. Resets #_pulse_count to 0.
  */
 void FlowMeter::_startReading() {
   _pulse_count = 0;
-  active_flow_meter = this;
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+  flowDiagnosticsBegin(_diagnostics);
+#endif
   
-  attachInterrupt(_interrupt_number, FlowMeter::pulse, RISING);
+#ifdef SETTINGS_FLOW_PCINT
+  pinChangeCounterStart(_counter);
+#else
+  if (_interrupt_number < FLOW_METER_MAX_INTERRUPTS) {
+    _reading[_interrupt_number] = this;
+    attachInterrupt(_interrupt_number, (_interrupt_number == 0) ? FlowMeter::_pulse0 : FlowMeter::_pulse1, RISING);
+  }
+#endif
 }
 
 /**
- * Detaches the active flow meter and its interrupts.
+ * Detaches the interrupt and clears the interrupt's meter.
  */
 void FlowMeter::_stopReading() {
-  detachInterrupt(_interrupt_number);
-  active_flow_meter = NULL;
+#ifdef SETTINGS_FLOW_PCINT
+  pinChangeCounterStop(_counter);
+#else
+  if (_interrupt_number < FLOW_METER_MAX_INTERRUPTS) {
+    detachInterrupt(_interrupt_number);
+    _reading[_interrupt_number] = NULL;
+  }
+#endif
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+  flowDiagnosticsEnd(_diagnostics);
+#endif
+}
+
+unsigned short FlowMeter::_count() {
+#ifdef SETTINGS_FLOW_PCINT
+  return pinChangeCounterRead(_counter);
+#else
+  unsigned short count;
+  
+  // Quickly grab and copy _pulse_count (it's updated by an interrupt)
+  noInterrupts();
+  count = _pulse_count;
+  interrupts();
+  
+  return count;
+#endif
+}
+
+/**
+ * A meter whose counter couldn't be attached (no pin-change counters
+ * left) or whose interrupt number doesn't exist counts nothing; it
+ * reads nothing, at once, rather than run the pour's timeouts with the
+ * valve open.
+ */
+boolean FlowMeter::attached() {
+#ifdef SETTINGS_FLOW_PCINT
+  return _counter >= 0;
+#else
+  return _interrupt_number >= 0 && _interrupt_number < FLOW_METER_MAX_INTERRUPTS;
+#endif
 }
 
 /**
@@ -37,35 +108,126 @@ void FlowMeter::_stopReading() {
  * \param interruptPin The pin the flow meter iterrupts on.
  * \param interruptNumber The interupt number typically corresponds to the pin. Check your chip's documentation for the pin <=> interrupt number relation.
  */
-FlowMeter::FlowMeter(int interrupt_pin, int interrupt_number)
+FlowMeter::FlowMeter(int interrupt_pin, int interrupt_number, unsigned long ul_per_pulse)
   : _interrupt_pin(interrupt_pin), _interrupt_number(interrupt_number)
 {
+  setCalibration(ul_per_pulse);
+  
+#ifdef SETTINGS_FLOW_ADAPTIVE_END
+  _first_pulse.sampled = false;
+  _gap.sampled = false;
+#endif
+
   // Set up pins
   pinMode(interrupt_pin, INPUT);
+  
+#ifdef SETTINGS_FLOW_PCINT
+  _counter = pinChangeCounterAttach(interrupt_pin);
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+  if (_counter >= 0) {
+    pinChangeCounterDiagnose(_counter, &_diagnostics);
+  }
+#endif
+#endif
+}
+
+/**
+ * Sets the number of microlitres represented by one pulse.
+ * \param ul_per_pulse The calibration constant, k (see #calibrate), in uL/pulse. Zero restores #DEFAULT_UL_PER_PULSE.
+ */
+void FlowMeter::setCalibration(unsigned long ul_per_pulse) {
+  _ul_per_pulse = (ul_per_pulse > 0) ? ul_per_pulse : DEFAULT_UL_PER_PULSE;
 }
 
-//!< Convert volume (in mL) to pulses
-unsigned short FlowMeter::volumeToPulseCount(float volume) {
-  return volume / SETTINGS_FLOW_PULSES_TO_ML;
+#ifdef SETTINGS_FLOW_ADAPTIVE_END
+void FlowMeter::_sample(Estimate& estimate, unsigned long ms) {
+  int delta;
+  
+  ms = min(ms, (unsigned long) FLOW_METER_MAX_FIRST_PULSE_MS); // keeps the fixed point in range
+  
+  if (!estimate.sampled) {
+    estimate.avg_x8 = ms << 3;
+    estimate.var_x4 = ms << 1; // half of it, times 4
+    estimate.sampled = true;
+    return;
+  }
+  
+  // VAR += (|AVG - T| - VAR) / 4, AVG += (T - AVG) / 8
+  delta = (int) ms - (int) (estimate.avg_x8 >> 3);
+  estimate.var_x4 = estimate.var_x4 - (estimate.var_x4 >> 2) + abs(delta);
+  estimate.avg_x8 = estimate.avg_x8 - (estimate.avg_x8 >> 3) + ms;
+}
+
+unsigned long FlowMeter::_bound(Estimate const& estimate, unsigned long unsampled_ms) {
+  if (!estimate.sampled) {
+    return unsampled_ms;
+  }
+  
+  return (estimate.avg_x8 >> 3) + estimate.var_x4;
+}
+#endif
+
+//!< Convert volume (in uL) to pulses
+unsigned short FlowMeter::volumeToPulseCount(unsigned long volume_uL) {
+  unsigned long count = volume_uL / _ul_per_pulse;
+  
+  // Saturate rather than wrap for volumes beyond what the counter can hold
+  return (count > 0xFFFF) ? 0xFFFF : (unsigned short) count;
 }
 
-//!< Convert # of pulses to volume (in mL)
-float FlowMeter::pulseCountToVolume(unsigned short count) {
-  return count * SETTINGS_FLOW_PULSES_TO_ML;
+//!< Convert # of pulses to volume (in uL)
+unsigned long FlowMeter::pulseCountToVolume(unsigned short count) {
+  return (unsigned long) count * _ul_per_pulse;
 }
 
 /**
- * Returns the poured volume in millileters.
- * \param maxVolume_mL The function will return after this many millilitres have been poured. If this is zero or negative then there is no limit.
+ * Returns the poured volume in microlitres.
+ * \param max_volume_uL The function will return after this many microlitres have been poured. If this is zero then there is no limit.
  * \param last_pulse_timeout_ms The function will return after this many milliseconds since flow was last detected.
  * \param total_timeout_ms Causes the function to return after this many milliseconds since the function was called.
  * \param delay_ms The time to wait between checking any of the terminating conditions.
+ *
+ * With #SETTINGS_FLOW_ADAPTIVE_END, #last_pulse_timeout_ms is only the
+ * longest wait for flow to carry on. Flow must start within the time
+ * patrons at this tap usually take (plus four times its variation;
+ * #SETTINGS_FLOW_FIRST_PULSE_MS until a pour has been seen), and once
+ * it has, the pour ends when there has been no flow for the longer of:
+ *   - the longest pause this tap's pours usually come back from (plus
+ *     four times its variation), up to #FLOW_METER_MAX_LEARNED_GAP_MS,
+ *     and
+ *   - #FLOW_METER_GAP_INTERVALS times the smoothed time between pulses,
+ *     so a pour that tails off is given longer than one cut off sharply,
+ * but no less than #FLOW_METER_MIN_GAP_MS (above a patron's pause to
+ * tilt a glass, which the pauses learned can't be trusted to cover: a
+ * pause that ends a pour is never learned). Both times are learned (in
+ * RAM) from every pour, as ServerPool learns round-trip times. Until a
+ * pause has been learned, the pauses are taken to need the most they
+ * may. Only a pour flowing slower than a pulse every
+ * #last_pulse_timeout_ms / #FLOW_METER_GAP_INTERVALS waits that long
+ * (see test/adaptive_end).
  */
-float FlowMeter::readVolume_mL(int max_volume_mL, unsigned long last_pulse_timeout_ms, unsigned long total_timeout_ms, unsigned long delay_ms) {  
-  unsigned short max_volume_pulses = volumeToPulseCount(max_volume_mL); //!< We convert the volume to a number of pulses to avoid floating point arithmetic.
+unsigned long FlowMeter::readVolume_uL(unsigned long max_volume_uL, unsigned long last_pulse_timeout_ms, unsigned long total_timeout_ms, unsigned long delay_ms) {  
+  unsigned short max_volume_pulses = volumeToPulseCount(max_volume_uL); //!< We convert the volume to a number of pulses so the loop only compares counts.
   unsigned short pulse_count_history[2] = {0, 0}; //!< The current (0) and previous (1) pulse counts for checking terminating conditions
-  unsigned long start_time_ms = millis(); //!< The total timeout reference
+  unsigned long start_time_ms = clockMillis(); //!< The total timeout reference
   unsigned long time_of_last_pulse_ms = start_time_ms; //!< The end-of-pour timeout reference
+#ifdef SETTINGS_FLOW_ADAPTIVE_END
+  unsigned long now_ms;
+  unsigned long first_pulse_ms = constrain(_bound(_first_pulse, SETTINGS_FLOW_FIRST_PULSE_MS), FLOW_METER_MIN_FIRST_PULSE_MS, FLOW_METER_MAX_FIRST_PULSE_MS);
+  unsigned long interval_x8 = 0; //!< Smoothed time between pulses while flowing, times 8
+  unsigned long longest_gap_ms = 0; //!< Longest pause the flow came back from
+  unsigned long end_gap_ms = 0; //!< Time without flow that ends the pour
+#endif
+  
+  // Nothing would be counted; don't leave the valve open for the timeouts
+  if (!attached()) {
+    return 0;
+  }
+  
+  // A limit smaller than one pulse still means "limited", not "no limit"
+  if (max_volume_uL > 0 && max_volume_pulses == 0) {
+    max_volume_pulses = 1;
+  }
   
   // Attach interrupt on rising flow meter pin
   _startReading();
@@ -73,14 +235,31 @@ float FlowMeter::readVolume_mL(int max_volume_mL, unsigned long last_pulse_timeo
   // Capture pulses and think...
   for(;;) {
 	  
-    // Quickly grab and copy _pulse_count to a non-volitile variable
-    noInterrupts();
-    pulse_count_history[0] = _pulse_count;
-    interrupts();
+    pulse_count_history[0] = _count();
+    watchdogKick();
 
     // Remember moment of last detected pulse 
     if (pulse_count_history[0] > pulse_count_history[1]) {
-      time_of_last_pulse_ms = millis();
+#ifdef SETTINGS_FLOW_ADAPTIVE_END
+      now_ms = clockMillis();
+      if (pulse_count_history[1] == 0) {
+        _sample(_first_pulse, now_ms - start_time_ms);
+      }
+      else {
+        // How long the flow paused, and how fast it is flowing
+        unsigned long gap_ms = now_ms - time_of_last_pulse_ms;
+        unsigned long interval_ms = gap_ms / (pulse_count_history[0] - pulse_count_history[1]);
+        
+        longest_gap_ms = max(longest_gap_ms, gap_ms);
+        interval_x8 = (interval_x8 == 0) ? interval_ms << 3 : interval_x8 - (interval_x8 >> 3) + interval_ms;
+      }
+      time_of_last_pulse_ms = now_ms;
+#else
+      time_of_last_pulse_ms = clockMillis();
+#endif
+#ifdef SETTINGS_CHECKPOINT
+      pourCheckpoint.update(pulseCountToVolume(pulse_count_history[0])); // survive a reset mid-pour
+#endif
     }
     
     // Have we reached the maximum volume?
@@ -89,14 +268,31 @@ float FlowMeter::readVolume_mL(int max_volume_mL, unsigned long last_pulse_timeo
       break;
     }
 
+#ifdef SETTINGS_FLOW_ADAPTIVE_END
+    // Time out if flow never started, or has clearly stopped
+    if (pulse_count_history[0] == 0) {
+      if (clockMillis() - start_time_ms > first_pulse_ms) {
+        break;
+      }
+    }
+    else {
+      end_gap_ms = min(_bound(_gap, FLOW_METER_MAX_LEARNED_GAP_MS), (unsigned long) FLOW_METER_MAX_LEARNED_GAP_MS);
+      end_gap_ms = max(end_gap_ms, FLOW_METER_GAP_INTERVALS * (interval_x8 >> 3));
+      end_gap_ms = constrain(end_gap_ms, FLOW_METER_MIN_GAP_MS, last_pulse_timeout_ms);
+      if (clockMillis() - time_of_last_pulse_ms > end_gap_ms) {
+        break;
+      }
+    }
+#else
     // Time out if it has been too long since last detected flow
-    if (millis() > time_of_last_pulse_ms + last_pulse_timeout_ms) {
+    if (clockMillis() > time_of_last_pulse_ms + last_pulse_timeout_ms) {
       //Serial.println("Timeout since last detected flow...");
       break;
     }
+#endif
 
     // Time out if we have been reading for too long 
-    if (millis() >= start_time_ms + total_timeout_ms) {
+    if (clockMillis() >= start_time_ms + total_timeout_ms) {
       //Serial.println("Timeout since start of read...");
       break;
     }
@@ -105,14 +301,21 @@ float FlowMeter::readVolume_mL(int max_volume_mL, unsigned long last_pulse_timeo
     pulse_count_history[1] = pulse_count_history[0];
 
     // Wait for a bit
-    delay(delay_ms);
+    clockDelay(delay_ms);
   }
   
   // Detach flow meter interrupt
   _stopReading();
   
+#ifdef SETTINGS_FLOW_ADAPTIVE_END
+  // Learn the pauses a pour makes
+  if (longest_gap_ms > 0) {
+    _sample(_gap, longest_gap_ms);
+  }
+#endif
+  
   // Return the total poured volume
-  return pulseCountToVolume(_pulse_count);
+  return pulseCountToVolume(_count());
 }
 
 /**
@@ -153,6 +356,7 @@ float FlowMeter::readVolume_mL(int max_volume_mL, unsigned long last_pulse_timeo
  * manner:
  *                          k = 200 mL / 98 pulses
  *                          k = 2.040... mL/pulse
+ *                          k = 2041 uL/pulse (#SETTINGS_FLOW_UL_PER_PULSE)
  *
  * This value should be determined upon first set up and need not be
  * changed afterward. If operating conditions do change, don't hesitate
@@ -164,24 +368,26 @@ float FlowMeter::readVolume_mL(int max_volume_mL, unsigned long last_pulse_timeo
  */
 unsigned long FlowMeter::calibrate(unsigned short target_pulse_count, unsigned long last_pulse_timeout_ms, unsigned long total_timeout_ms, unsigned long delay_ms) {
   unsigned short pulse_count_history[2] = {0, 0}; //!< The current (0) and previous (1) pulse counts for checking terminating conditions
-  unsigned long start_time_ms = millis(); //!< The total timeout reference
+  unsigned long start_time_ms = clockMillis(); //!< The total timeout reference
   unsigned long time_of_last_pulse_ms = start_time_ms; //!< The end-of-pour timeout reference (initially, sufficiently large)
   boolean success = false;
   
+  if (!attached()) {
+    return 0;
+  }
+  
   // Attach interrupt on rising flow meter pin
   _startReading();
 
   // Capture pulses and think...
   for(;;) {
 	  
-    // Quickly grab and copy _pulse_count to a non-volitile variable
-    noInterrupts();
-    pulse_count_history[0] = _pulse_count;
-    interrupts();
+    pulse_count_history[0] = _count();
+    watchdogKick();
 
     // Remember moment of last detected pulse 
     if (pulse_count_history[0] > pulse_count_history[1]) {
-      time_of_last_pulse_ms = millis();
+      time_of_last_pulse_ms = clockMillis();
     }
     
     // Have we reached the maximum volume?
@@ -192,13 +398,13 @@ unsigned long FlowMeter::calibrate(unsigned short target_pulse_count, unsigned l
     }
 
     // Time out if it has been too long since last detected flow
-    if (millis() > time_of_last_pulse_ms + last_pulse_timeout_ms) {
+    if (clockMillis() > time_of_last_pulse_ms + last_pulse_timeout_ms) {
       //Serial.println("Timeout since last detected flow...");
       break;
     }
 
     // Time out if we have been reading for too long 
-    if (millis() >= start_time_ms + total_timeout_ms) {
+    if (clockMillis() >= start_time_ms + total_timeout_ms) {
       //Serial.println("Timeout since start of read...");
       break;
     }
@@ -207,7 +413,7 @@ unsigned long FlowMeter::calibrate(unsigned short target_pulse_count, unsigned l
     pulse_count_history[1] = pulse_count_history[0];
 
     // Wait for a bit
-    delay(delay_ms);
+    clockDelay(delay_ms);
   }
   
   // Detach flow meter interrupt
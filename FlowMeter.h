@@ -6,6 +6,20 @@
 #include <Arduino.h>
 #include "config.h"
 #include "pin_config.h"
+#include "FlowDiagnostics.h"
+
+#define FLOW_METER_MAX_INTERRUPTS 2 //!< External interrupts a meter can count on (INT0 and INT1 on an Uno)
+
+#ifdef SETTINGS_FLOW_ADAPTIVE_END
+#define FLOW_METER_POLL_MS 50              //!< Time between checks on a pour (the end of a pour is noticed within this)
+#define FLOW_METER_MIN_GAP_MS 1000         //!< Shortest time without flow that ends a pour (well above a patron's pause to tilt or swap a glass)
+#define FLOW_METER_MAX_LEARNED_GAP_MS 1500 //!< Longest time without flow the learned pauses may make it ...
+#define FLOW_METER_GAP_INTERVALS 4         //!< ... though this many times the time between pulses, as the flow was when it stopped, may be longer
+#define FLOW_METER_MIN_FIRST_PULSE_MS 1000 //!< Shortest time allowed for flow to start
+#define FLOW_METER_MAX_FIRST_PULSE_MS 8000 //!< Longest time allowed for flow to start (and longest gap learned)
+#else
+#define FLOW_METER_POLL_MS 250
+#endif
 
 /*! \brief Manages a flow meter who pulses on a digital input pin during flow.
  *  This class provides an interface to an interupt-based flow meter where the
@@ -33,9 +47,24 @@
  *  You can run this calibration a number of times to find the average
  *  value (if you're feeling so keen).
  *
- *  In the future, calibration information can be set on the server to
- *  avoid reprogramming the device, perhaps being returned along with
- *  the pour request information (max volume, etc.)
+ *  The AVR has no FPU, so volumes are kept as integer microlitres and k
+ *  is stored in microlitres per pulse. The default comes from
+ *  #SETTINGS_FLOW_UL_PER_PULSE at compile time and can be overridden at
+ *  run time (e.g. with a value provided by the server) via #setCalibration.
+ *
+ *  Pulses are counted with attachInterrupt() on an external interrupt
+ *  pin, or, with #SETTINGS_FLOW_PCINT, by a pin-change counter on any
+ *  pin (see PinChangeCounter.h). Each meter keeps its own count, so
+ *  several can pour at once (one per external interrupt, or any number
+ *  with pin-change counters).
+ *
+ *  With #SETTINGS_FLOW_ADAPTIVE_END, a pour ends as soon as it has
+ *  clearly ended, rather than a fixed time after the last pulse (see
+ *  #readVolume_uL).
+ *
+ *  With #SETTINGS_FLOW_DIAGNOSTICS, each pulse is also timed, and
+ *  #diagnostics tells how the last reading's pulses (and interrupts)
+ *  were spaced (see FlowDiagnostics.h).
  *
  *  \see #calibrate
  *  \see http://www.seeedstudio.com/depot/g12-water-flow-sensor-p-635.html
@@ -46,28 +75,79 @@ class FlowMeter {
     unsigned short _pulse_count; //!< Accumulates when flow meter pulses on #_interruptPin when interrupts are attached and enabled
     int _interrupt_pin; //!< The input pin attached to the flow meter's output
     int _interrupt_number; //!< The interrupt number used for the flow meter
+    unsigned long _ul_per_pulse; //!< Calibration constant, k, in microlitres per pulse
+#ifdef SETTINGS_FLOW_PCINT
+    int8_t _counter; //!< Pin-change counter for #_interrupt_pin (see PinChangeCounter.h)
+#endif
+#ifdef SETTINGS_FLOW_ADAPTIVE_END
+    /*! A smoothed time and its variation (ms), in fixed point, as ServerPool keeps round-trip times.
+     */
+    struct Estimate {
+      uint16_t avg_x8; //!< Smoothed time, times 8
+      uint16_t var_x4; //!< Variation, times 4
+      boolean sampled; //!< Whether there has been a sample yet
+    };
+    
+    Estimate _first_pulse; //!< Time from the valve opening to flow starting
+    Estimate _gap;         //!< Longest pause a pour's flow came back from
+    
+    static void _sample(Estimate& estimate, unsigned long ms);
+    static unsigned long _bound(Estimate const& estimate, unsigned long unsampled_ms); //!< The time, plus four times its variation
+#endif
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+    FlowDiagnostics _diagnostics; //!< Timings of the last reading's pulses
+#endif
     
-    void _startReading(); //!< Attach #_interruptPin to #pulse() using #_interruptNumber and set current flow meter to this instance
-    void _stopReading(); //!< Detach interrupts and clear the current flow meter reference
+    unsigned short _count(); //!< Pulses counted since #_startReading
+    
+    void _startReading(); //!< Attach #_interruptPin to #pulse() using #_interruptNumber and make this the interrupt's meter
+    void _stopReading(); //!< Detach interrupts and clear the interrupt's meter
+    
+#ifndef SETTINGS_FLOW_PCINT
+    static FlowMeter* volatile _reading[FLOW_METER_MAX_INTERRUPTS]; //!< Meter reading on each external interrupt, if any
+    static void _pulse0(); //!< INT0 handler
+    static void _pulse1(); //!< INT1 handler
+#endif
     
   public:
-    FlowMeter(int interrupt_pin, int interrupt_number);
+    static const unsigned long DEFAULT_UL_PER_PULSE = SETTINGS_FLOW_UL_PER_PULSE; //!< Compile-time calibration constant (uL/pulse)
+
+    FlowMeter(int interrupt_pin, int interrupt_number, unsigned long ul_per_pulse = DEFAULT_UL_PER_PULSE);
     ~FlowMeter(){ /**/ }
     
-    //!< Read flowed volume in mL until a maximum volume is reached, a given time since the meter read flow has passed, and/or a total time has passed
-    float readVolume_mL(int max_volume_mL, unsigned long last_pulse_timeout_ms = 2000, unsigned long total_timeout_ms = 30000, unsigned long delay_ms = 250);
+    boolean attached(); //!< Whether pulses can be counted (a meter that isn't reads nothing)
+    
+    //!< Read flowed volume in uL until a maximum volume is reached, a given time since the meter read flow has passed, and/or a total time has passed
+    unsigned long readVolume_uL(unsigned long max_volume_uL, unsigned long last_pulse_timeout_ms = 2000, unsigned long total_timeout_ms = 30000, unsigned long delay_ms = FLOW_METER_POLL_MS);
 
     //!< Will run until targetPulseCount is reached; the measured volume should give volume per pulse for a known targetPulseCount.
     unsigned long calibrate(unsigned short target_pulse_count = 200, unsigned long last_pulse_timeout_ms = 2000, unsigned long total_timeout_ms = 30000, unsigned long delay_ms = 250);
     
-    //!< Convert volume (in mL) to pulses
-    unsigned short volumeToPulseCount(float volume);
+    //!< Override the calibration constant (in uL per pulse) at run time; zero restores #DEFAULT_UL_PER_PULSE
+    void setCalibration(unsigned long ul_per_pulse);
+
+    //!< The calibration constant currently in use (in uL per pulse)
+    unsigned long calibration() { return _ul_per_pulse; }
     
-    //!< Convert # of pulses to volume (in mL)
-    float pulseCountToVolume(unsigned short count);
+    //!< Convert volume (in uL) to pulses
+    unsigned short volumeToPulseCount(unsigned long volume_uL);
+    
+    //!< Convert # of pulses to volume (in uL)
+    unsigned long pulseCountToVolume(unsigned short count);
+
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+    //!< Timings of the last (or current) reading's pulses
+    FlowDiagnostics const& diagnostics() { return _diagnostics; }
+#endif
+
+#ifdef SETTINGS_FLOW_STRESS
+    void startCounting() { _startReading(); }   //!< Count pulses with no end-of-pour logic (see test/isr_stress)
+    unsigned short counted() { return _count(); } //!< Pulses counted since #startCounting
+    void stopCounting() { _stopReading(); }     //!< Stop counting
+#endif
   
-    //!< Interrupt handler for a flow meter pulse.
-    static void pulse();
+    //!< Count a pulse for the meter reading on the given tap: its interrupt number (or pin-change counter, see #SETTINGS_FLOW_PCINT).
+    static void pulse(uint8_t tap);
 };
 
 #endif
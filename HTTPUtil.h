@@ -8,6 +8,9 @@
 #define HTTP_USER_AGENT "pourlogic/1.0 arduino/1.0"
 #define HTTP_HOSTNAME   "pourlogic.com"
 
+extern const char HTTP_ENDLINE[];   //!< "\r\n"
+extern const char HTTP_STATUS_OK[]; //!< "200"
+
 //!< Reads an HTTP line or until `maximumBytes' bytes are read.
 boolean readHTTPLine(Stream& stream, unsigned short maximum_bytes = 0, char* line = NULL);
 
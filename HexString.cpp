@@ -27,8 +27,13 @@ void bytesToHexString(char* result_string, const byte *bytes, int length) {
     result_string[length<<1] = '\0';
 }
 
+int hexDigitValue(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
 
-// FIXME not used afaict
 boolean hexStringToBytes(String const &hex_string, byte *buffer, int &result_length, int max_length) {
   
     char c = '\0';
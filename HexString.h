@@ -21,4 +21,8 @@ void bytesToHexString(char* result_string, const byte* bytes, int length);
  */
 boolean hexStringToBytes(String const &hex_string, byte *buffer, int &result_length, int max_length);
 
+/*! \brief The value of a hexidecimal digit (either case), or -1 if it isn't one.
+ */
+int hexDigitValue(int c);
+
 #endif // #ifndef POURLOGIC_HEX_STRING_H
@@ -0,0 +1,260 @@
+// See LICENSE.txt for license details.
+
+#include "Journal.h"
+
+#ifdef SETTINGS_JOURNAL
+
+#include "Clock.h"
+#include "HexString.h"
+
+#define JOURNAL_MAGIC 0x4C50 //!< "PL"
+#define JOURNAL_INDEX_MAGIC 0x49584C50UL //!< "PLXI"
+
+Journal* Journal::_instance = NULL;
+
+Journal::Journal(uint8_t cs_pin)
+  : _cs_pin(cs_pin), _ready(false), _first_block(0), _head_sequence(0),
+    _cached_sequence(0), _dirty(false), _dirty_ms(0)
+{
+  _instance = this;
+}
+
+void Journal::_released() {
+  if (_instance != NULL) {
+    _instance->flush();
+    _instance->_cached_sequence = 0;
+  }
+}
+
+/**
+ * Opens the journal, creating it if needed, and finds the last block written.
+ * \return False if there is no card, or the journal couldn't be opened or created.
+ */
+boolean Journal::begin() {
+  uint32_t group_sequence = 0;
+  IndexEntry* entries = NULL;
+  boolean opened;
+  
+  _ready = false;
+  _cached_sequence = 0;
+  _cache(); // the FAT code uses the block buffer too
+  
+  // The hardware SS pin must be an output for the AVR to stay SPI master
+  pinMode(SD_REQUIRED_PIN, OUTPUT);
+  
+  // The FAT code talks to the card directly rather than through SpiBusSdCard
+  spiBusAcquire(SPI_DEVICE_SD);
+  opened = _openFile();
+  spiBusRelease(SPI_DEVICE_SD);
+  
+  if (!opened) {
+    return false;
+  }
+  
+  // Find the newest group in the index
+  if (!_card.readBlock(_first_block, _cache()) || *(uint32_t*) _cache() != JOURNAL_INDEX_MAGIC) {
+    return false;
+  }
+  
+  entries = (IndexEntry*) (_cache() + sizeof(IndexEntry));
+  for (uint8_t g = 0; g < JOURNAL_GROUPS; g++) {
+    if (entries[g].sequence > group_sequence) {
+      group_sequence = entries[g].sequence;
+    }
+  }
+  
+  if (group_sequence == 0) {
+    // Nothing written yet
+    _head_sequence = 1;
+    _ready = _startBlock(_head_sequence, 0);
+    return _ready;
+  }
+  
+  // Follow the newest group to its last written block
+  _head_sequence = group_sequence;
+  while (_head_sequence - group_sequence + 1 < JOURNAL_GROUP_BLOCKS && _readBlock(_head_sequence + 1)) {
+    _head_sequence++;
+  }
+  
+  // The group's first block may never have been written (e.g. power was lost)
+  if (!_readBlock(_head_sequence)) {
+    _ready = _startBlock(_head_sequence, 0);
+    return _ready;
+  }
+  
+  _ready = true;
+  return _loadHead();
+}
+
+boolean Journal::_openFile() {
+  uint32_t last_block = 0;
+  
+  if (!_card.init(SPI_FULL_SPEED, _cs_pin) || !_volume.init(&_card) || !_root.openRoot(&_volume)) {
+    return false;
+  }
+  
+  // Open the journal, or create it as one contiguous run of blocks
+  if (!_file.open(&_root, JOURNAL_FILE_NAME, O_RDWR)) {
+    if (!_file.createContiguous(&_root, JOURNAL_FILE_NAME, (JOURNAL_DATA_BLOCKS + 1) * JOURNAL_BLOCK_SIZE)) {
+      return false;
+    }
+    
+    if (!_file.contiguousRange(&_first_block, &last_block)) {
+      return false;
+    }
+    
+    // Fresh journal: empty index
+    memset(_cache(), 0, JOURNAL_BLOCK_SIZE);
+    *(uint32_t*) _cache() = JOURNAL_INDEX_MAGIC;
+    return _card.writeBlock(_first_block, _cache());
+  }
+  
+  return _file.contiguousRange(&_first_block, &last_block) && last_block - _first_block >= JOURNAL_DATA_BLOCKS; // (else not something we wrote)
+}
+
+boolean Journal::_readBlock(uint32_t sequence) {
+  BlockHeader* header = (BlockHeader*) _cache();
+  
+  _cached_sequence = 0;
+  
+  if (!_card.readBlock(_blockOf(sequence), _cache())
+      || header->magic != JOURNAL_MAGIC
+      || header->sequence != sequence
+      || header->count > JOURNAL_RECORDS_PER_BLOCK) {
+    return false;
+  }
+  
+  _cached_sequence = sequence;
+  return true;
+}
+
+boolean Journal::_loadHead() {
+  if (_cached_sequence == _head_sequence) {
+    return true;
+  }
+  
+  if (!_readBlock(_head_sequence)) {
+    return false;
+  }
+  
+  // A full head block means the next record starts a new one
+  if (((BlockHeader*) _cache())->count >= JOURNAL_RECORDS_PER_BLOCK) {
+    return _startBlock(_head_sequence + 1, ((BlockHeader*) _cache())->first_nonce);
+  }
+  
+  return true;
+}
+
+boolean Journal::_writeIndexEntry(uint32_t sequence, uint32_t first_nonce) {
+  IndexEntry* entries = (IndexEntry*) (_cache() + sizeof(IndexEntry));
+  uint8_t group = ((sequence - 1) % JOURNAL_DATA_BLOCKS) / JOURNAL_GROUP_BLOCKS;
+  
+  _cached_sequence = 0;
+  
+  if (!_card.readBlock(_first_block, _cache())) {
+    return false;
+  }
+  
+  entries[group].sequence = sequence;
+  entries[group].first_nonce = first_nonce;
+  
+  return _card.writeBlock(_first_block, _cache());
+}
+
+boolean Journal::_startBlock(uint32_t sequence, uint32_t first_nonce) {
+  BlockHeader* header = NULL;
+  
+  // First block of a group? Note it in the index.
+  if (((sequence - 1) % JOURNAL_GROUP_BLOCKS) == 0 && !_writeIndexEntry(sequence, first_nonce)) {
+    return false;
+  }
+  
+  memset(_cache(), 0, JOURNAL_BLOCK_SIZE);
+  header = (BlockHeader*) _cache();
+  header->magic = JOURNAL_MAGIC;
+  header->sequence = sequence;
+  header->first_nonce = first_nonce;
+  
+  _head_sequence = sequence;
+  _cached_sequence = sequence;
+  return true;
+}
+
+/**
+ * Adds a record to the block being filled in RAM.
+ * \param type The #JournalRecordType.
+ * \param code A type-specific code.
+ * \param tag The patron's tag data (10 hex digits), or an empty String.
+ * \param nonce The client's current nonce.
+ * \param value A type-specific value.
+ */
+boolean Journal::append(uint8_t type, uint8_t code, String const& tag, uint32_t nonce, uint32_t value) {
+  BlockHeader* header = NULL;
+  JournalRecord* record = NULL;
+  int tag_length = 0;
+  
+  if (!_ready || !_loadHead()) {
+    return false;
+  }
+  
+  header = (BlockHeader*) _cache();
+  
+  // Block full and not yet written? #maintain wasn't called in time; write it now.
+  if (header->count >= JOURNAL_RECORDS_PER_BLOCK) {
+    if (!flush() || !_startBlock(_head_sequence + 1, nonce)) {
+      return false;
+    }
+    header = (BlockHeader*) _cache();
+  }
+  
+  if (header->count == 0) {
+    header->first_nonce = nonce;
+  }
+  
+  record = (JournalRecord*) (_cache() + sizeof(BlockHeader)) + header->count;
+  memset(record, 0, sizeof(JournalRecord));
+  record->type = type;
+  record->code = code;
+  record->nonce = nonce;
+  record->value = value;
+  hexStringToBytes(tag, record->tag, tag_length, sizeof(record->tag));
+  
+  header->count++;
+  
+  if (!_dirty) {
+    _dirty = true;
+    _dirty_ms = clockMillis();
+  }
+  
+  return true;
+}
+
+boolean Journal::maintain() {
+  if (!_dirty) {
+    return true;
+  }
+  
+  // A full block goes at once (the next append would write it anyway); a partly filled one once the bus is free, or has waited too long
+  if (((BlockHeader*) _cache())->count >= JOURNAL_RECORDS_PER_BLOCK
+      || (clockMillis() - _dirty_ms > JOURNAL_FLUSH_INTERVAL_MS && spiBusBulkAllowed())
+      || clockMillis() - _dirty_ms > JOURNAL_FLUSH_INTERVAL_MS + JOURNAL_FLUSH_DEFER_MS) {
+    return flush();
+  }
+  
+  return true;
+}
+
+boolean Journal::flush() {
+  if (!_dirty) {
+    return true;
+  }
+  
+  if (!_card.writeBlock(_blockOf(_head_sequence), _cache())) {
+    return false;
+  }
+  
+  _dirty = false;
+  return true;
+}
+
+#endif // #ifdef SETTINGS_JOURNAL
@@ -0,0 +1,135 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_JOURNAL_H
+#define POURLOGIC_JOURNAL_H
+
+#include <Arduino.h>
+#include <String.h>
+
+#include "config.h"
+
+#ifdef SETTINGS_JOURNAL
+
+#include <SD.h>
+
+#include "pin_config.h"
+#include "SdCache.h"
+#include "SpiBus.h"
+
+#define JOURNAL_FILE_NAME "JOURNAL.BIN" //!< Journal file in the card's root directory
+#define JOURNAL_BLOCK_SIZE 512           //!< SD sector size
+#define JOURNAL_GROUPS 63                //!< Index entries (one per group of blocks)
+#define JOURNAL_GROUP_BLOCKS 32          //!< Data blocks per index entry
+#define JOURNAL_DATA_BLOCKS ((unsigned long) JOURNAL_GROUPS * JOURNAL_GROUP_BLOCKS) //!< 2016 data blocks (~1 MB)
+#define JOURNAL_RECORDS_PER_BLOCK 31     //!< Records per data block (after the block header)
+#define JOURNAL_FLUSH_INTERVAL_MS 10000  //!< Longest a partly filled block is kept only in RAM, with the bus free
+#define JOURNAL_FLUSH_DEFER_MS 20000     //!< ... and longer still, while requests are in flight (see SpiBus.h)
+
+/*! Kinds of journal records.
+ */
+enum JournalRecordType {
+  JOURNAL_BOOT = 1, //!< Controller started (code: 1 after a watchdog reset)
+  JOURNAL_AUTH,     //!< Pour request answered (code: 1 allowed / 0 refused, value: max. volume in mL)
+  JOURNAL_POUR,     //!< Pour finished (code: tap, value: volume in uL)
+  JOURNAL_ERROR     //!< Request failed (code: #MetricsStage)
+};
+
+/*! A journal record (16 bytes).
+ */
+struct JournalRecord {
+  uint8_t type;     //!< #JournalRecordType
+  uint8_t code;     //!< Type-specific code
+  uint8_t tag[5];   //!< Packed RFID tag (10 hex digits), or zeros
+  uint8_t reserved;
+  uint32_t nonce;   //!< Client nonce when recorded (never decreases)
+  uint32_t value;   //!< Type-specific value
+};
+
+/*!
+ * The journal is a fixed-size, contiguous file on the SD card that is
+ * written with raw block writes, bypassing the FAT code after #begin.
+ * Records are collected in RAM and written a whole 512-byte block at a
+ * time, so appending a record never touches the card, and #maintain
+ * holds a partly filled block back while requests are in flight (see
+ * SpiBus.h). The RAM used is the
+ * SD library's own block cache (see SdCache.h), so the journal costs no
+ * extra SRAM for its buffer; if something else claims the cache, the
+ * block is written out first and read back when next needed.
+ *
+ * <pre>
+ *   block 0        index: { magic, { first sequence, first nonce } x 63 }
+ *   block 1..2016  data:  { magic, count, sequence, first nonce, 31 x record }
+ * </pre>
+ *
+ * Data blocks are written in sequence; block sequence s lives at block
+ * 1 + (s - 1) % 2016, so the journal wraps and overwrites its oldest
+ * group once full. The index records the first sequence and nonce of
+ * each group of 32 blocks. At #begin the newest group is scanned for the
+ * last block written. The controller only writes the journal; the index
+ * lets a reader find where a nonce starts without reading the whole
+ * journal (see test/journal, which replays a copy of the file).
+ *
+ * \brief An append-only, block-buffered audit trail on the SD card.
+ */
+class Journal {
+
+  public:
+    Journal(uint8_t cs_pin = SD_CS_PIN);
+    ~Journal() {}
+    
+    boolean begin(); //!< Open (or create) the journal and find where it ends
+    boolean ready() { return _ready; }
+    
+    //!< Add a record in RAM (never writes unless the block was already full and unflushed).
+    boolean append(uint8_t type, uint8_t code, String const& tag, uint32_t nonce, uint32_t value);
+    
+    //!< Write the current block if it is full, or has held unwritten records for too long.
+    boolean maintain();
+    
+    //!< Write the current block now.
+    boolean flush();
+    
+  private:
+    struct BlockHeader {
+      uint16_t magic;
+      uint8_t count;
+      uint8_t reserved;
+      uint32_t sequence;
+      uint32_t first_nonce;
+      uint32_t reserved2;
+    };
+    
+    struct IndexEntry {
+      uint32_t sequence;
+      uint32_t first_nonce;
+    };
+    
+    SpiBusSdCard _card;
+    SdVolume _volume;
+    SdFile _root;
+    SdFile _file;
+    uint8_t _cs_pin;
+    boolean _ready;
+    
+    uint32_t _first_block;       //!< Card block of the index
+    uint32_t _head_sequence;     //!< Sequence of the block being filled
+    uint32_t _cached_sequence;   //!< Data block held in the cache (0 if none)
+    boolean _dirty;              //!< Whether the head block has unwritten records
+    unsigned long _dirty_ms;     //!< When the head block first had unwritten records
+    
+    static Journal* _instance;  //!< The journal (told when the block buffer is claimed)
+    static void _released();     //!< Someone else claimed the block buffer: write the head block out and forget it
+    
+    uint8_t* _cache() { return sdCacheClaim(_released); } //!< The SD library's block buffer
+    uint32_t _blockOf(uint32_t sequence) { return _first_block + 1 + (sequence - 1) % JOURNAL_DATA_BLOCKS; }
+    
+    boolean _openFile();                    //!< Open (or create) the file and find its blocks, with the bus held
+    boolean _readBlock(uint32_t sequence);  //!< Read a data block into the cache; false if it isn't block #sequence
+    boolean _loadHead();                    //!< Make sure the cache holds the head block
+    boolean _startBlock(uint32_t sequence, uint32_t first_nonce); //!< Begin a new head block in the cache
+    boolean _writeIndexEntry(uint32_t sequence, uint32_t first_nonce); //!< Record the start of a group
+};
+
+#endif // #ifdef SETTINGS_JOURNAL
+
+#endif // #ifndef POURLOGIC_JOURNAL_H
@@ -0,0 +1,141 @@
+// See LICENSE.txt for license details.
+
+#include "Memory.h"
+
+#define MEMORY_PAINT_MARGIN 16 //!< Bytes below our own stack frame left unpainted (interrupts may be using them)
+
+extern unsigned int __heap_start; //!< Start of the heap (end of .bss), from the linker
+extern void *__brkval;            //!< Current top of the heap (NULL until malloc is first used)
+
+/*! avr-libc's free list entry (see malloc.c); a freed chunk's first bytes.
+ */
+struct __freelist {
+  size_t sz;
+  struct __freelist *nx;
+};
+
+extern struct __freelist *__flp; //!< avr-libc's free list, lowest address first
+
+static unsigned int stack_high_water[MEMORY_STAGE_COUNT];
+static unsigned int heap_high_water[MEMORY_STAGE_COUNT];
+static unsigned int least_headroom = 0xFFFF;
+
+//!< Stage names for #memoryPrint
+static const char MEMORY_IDLE_NAME[] PROGMEM = "idle";
+static const char MEMORY_AUTH_NAME[] PROGMEM = "auth";
+static const char MEMORY_POUR_NAME[] PROGMEM = "pour";
+static const char MEMORY_REPORT_NAME[] PROGMEM = "report";
+const char* const MEMORY_STAGE_NAMES[MEMORY_STAGE_COUNT] PROGMEM = {
+  MEMORY_IDLE_NAME, MEMORY_AUTH_NAME, MEMORY_POUR_NAME, MEMORY_REPORT_NAME
+};
+
+static uint8_t* _heapTop() {
+  return (__brkval == NULL) ? (uint8_t*) &__heap_start : (uint8_t*) __brkval;
+}
+
+int freeSRAM() {
+  int stack_top; // lives at the current bottom of the stack
+  
+  return (int) &stack_top - (int) _heapTop();
+}
+
+void memoryPaint() {
+  uint8_t stack_top; // lives at the current bottom of the stack
+  uint8_t* p = _heapTop();
+  
+  while (p < &stack_top - MEMORY_PAINT_MARGIN) {
+    *p++ = MEMORY_CANARY;
+  }
+}
+
+void memoryEndStage(MemoryStage stage) {
+  uint8_t stack_top;
+  uint8_t* p = _heapTop();
+  uint8_t* heap_peak = p;
+  uint8_t* run = p;
+  boolean painted = false;
+  
+  // Skip what the heap left behind, up to the first long run of paint...
+  while (p < &stack_top && !painted) {
+    if (*p != MEMORY_CANARY) {
+      heap_peak = ++p;
+      continue;
+    }
+    
+    for (run = p; p < &stack_top && *p == MEMORY_CANARY; p++);
+    
+    if (p - run >= MEMORY_MIN_RUN) {
+      painted = true;
+    }
+    else {
+      heap_peak = p;
+    }
+  }
+  
+  // .. which ends where the stack reached (if there's no paint left, they met)
+  if (!painted) {
+    run = p = heap_peak;
+  }
+  
+  stack_high_water[stage] = max(stack_high_water[stage], (unsigned int) ((uint8_t*) RAMEND + 1 - p));
+  heap_high_water[stage] = max(heap_high_water[stage], (unsigned int) (heap_peak - (uint8_t*) &__heap_start));
+  least_headroom = min(least_headroom, (unsigned int) (p - run));
+  
+  memoryPaint();
+}
+
+unsigned int memoryStackHighWater(MemoryStage stage) {
+  return stack_high_water[stage];
+}
+
+unsigned int memoryHeapHighWater(MemoryStage stage) {
+  return heap_high_water[stage];
+}
+
+unsigned int memoryLeastHeadroom() {
+  return least_headroom;
+}
+
+uint8_t memoryFragmentation(unsigned int& free_bytes, unsigned int& largest_bytes) {
+  unsigned int above_heap = max(freeSRAM(), 0);
+  
+  free_bytes = 0;
+  largest_bytes = above_heap;
+  
+  for (struct __freelist* chunk = __flp; chunk != NULL; chunk = chunk->nx) {
+    free_bytes += chunk->sz;
+    largest_bytes = max(largest_bytes, (unsigned int) chunk->sz);
+  }
+  
+  if (free_bytes + above_heap == 0) {
+    return 0;
+  }
+  
+  return 100 - (uint8_t) ((100UL * largest_bytes) / (free_bytes + above_heap));
+}
+
+void memoryPrint(Print& target) {
+  unsigned int free_bytes, largest_bytes;
+  uint8_t fragmentation = memoryFragmentation(free_bytes, largest_bytes);
+  
+  for (uint8_t stage = 0; stage < MEMORY_STAGE_COUNT; stage++) {
+    target.print(F("mem "));
+    target.print((const __FlashStringHelper*) pgm_read_word(&MEMORY_STAGE_NAMES[stage]));
+    target.print(F(" stack="));
+    target.print(stack_high_water[stage]);
+    target.print(F(" heap="));
+    target.println(heap_high_water[stage]);
+  }
+  
+  target.print(F("mem free="));
+  target.print(freeSRAM());
+  target.print(F(" headroom="));
+  target.print(least_headroom);
+  target.print(F(" free_list="));
+  target.print(free_bytes);
+  target.print(F(" largest="));
+  target.print(largest_bytes);
+  target.print(F(" fragmentation="));
+  target.print(fragmentation);
+  target.println('%');
+}
@@ -0,0 +1,71 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_MEMORY_H
+#define POURLOGIC_MEMORY_H
+
+#include <Arduino.h>
+
+/*! \file Memory.h
+ * \brief SRAM usage helpers.
+ *
+ * The heap (String, mostly) grows up from the end of .bss and the stack
+ * grows down from the top of SRAM; on an Uno there are rarely more than
+ * a few hundred bytes between them, and nothing stops them meeting.
+ *
+ * To see how close they come, the free region between them is painted
+ * with a canary byte (#memoryPaint). Whatever the heap or the stack
+ * later writes there replaces the canary, so scanning up from the top of
+ * the heap finds, first, anything the heap grew into (and has since
+ * freed), then the untouched canary, then the deepest the stack reached.
+ * #memoryEndStage does that scan for a stage of a pour, keeps the
+ * high-water marks for the stage, and repaints for the next stage.
+ *
+ * The heap's free list (chunks freed below the top of the heap) is also
+ * walked: a large free list with only small chunks in it is fragmentation,
+ * and a String that needs more than the largest chunk grows the heap
+ * toward the stack instead.
+ */
+
+#define MEMORY_CANARY 0xC5   //!< Paint for free SRAM
+#define MEMORY_MIN_RUN 8     //!< Shortest run of paint taken as untouched (rather than leftovers that happen to match)
+
+/*! Stages of the pour loop that memory use is tracked for.
+ */
+enum MemoryStage {
+  MEMORY_IDLE = 0, //!< Between patrons (background requests, metrics, reading RFID)
+  MEMORY_AUTH,     //!< Asking the server whether the patron may pour
+  MEMORY_POUR,     //!< Pouring
+  MEMORY_REPORT,   //!< Recording and queueing the pour's result
+  MEMORY_STAGE_COUNT
+};
+
+extern const char* const MEMORY_STAGE_NAMES[MEMORY_STAGE_COUNT] PROGMEM; //!< Stage names (in flash), e.g. for labels
+
+/*! \brief Bytes between the top of the heap and the bottom of the stack.
+ */
+int freeSRAM();
+
+/*! \brief Paint the free SRAM between the heap and the stack (call early in setup()).
+ */
+void memoryPaint();
+
+/*! \brief Record the stack and heap high-water marks since the last paint against a stage, and repaint.
+ */
+void memoryEndStage(MemoryStage stage);
+
+unsigned int memoryStackHighWater(MemoryStage stage); //!< Most stack used (bytes) during a stage
+unsigned int memoryHeapHighWater(MemoryStage stage);  //!< Largest the heap grew (bytes) during a stage
+unsigned int memoryLeastHeadroom();                   //!< Fewest bytes ever left between heap and stack
+
+/*! \brief Walk the heap's free list.
+ * \param free_bytes Set to the bytes in freed chunks below the top of the heap.
+ * \param largest_bytes Set to the largest single allocation that could succeed (a free chunk, or the space above the heap).
+ * \return Fragmentation: the percentage of free memory (free list and above the heap) not in the largest block.
+ */
+uint8_t memoryFragmentation(unsigned int& free_bytes, unsigned int& largest_bytes);
+
+/*! \brief Print all of the above, one line per stage.
+ */
+void memoryPrint(Print& target);
+
+#endif // #ifndef POURLOGIC_MEMORY_H
@@ -0,0 +1,243 @@
+// See LICENSE.txt for license details.
+
+#include "Metrics.h"
+
+#ifdef SETTINGS_METRICS
+
+#include "Clock.h"
+#include "Memory.h"
+#include "SpiBus.h"
+
+Metrics metrics;
+
+//!< Upper bounds (ms) of the finite authorization latency buckets
+static const unsigned int LATENCY_BOUNDS_MS[METRICS_LATENCY_BUCKETS] PROGMEM = {50, 100, 250, 500, 1000, 2000, 5000};
+
+//!< Label values for #MetricsStage
+static const char STAGE_SOCKET_NAME[] PROGMEM = "socket";
+static const char STAGE_CONNECT_NAME[] PROGMEM = "connect";
+static const char STAGE_RESPONSE_NAME[] PROGMEM = "response";
+static const char STAGE_STATUS_NAME[] PROGMEM = "status";
+static const char STAGE_AUTH_NAME[] PROGMEM = "auth";
+static const char STAGE_BREAKER_NAME[] PROGMEM = "breaker";
+static const char* const STAGE_NAMES[STAGE_COUNT] PROGMEM = {
+  STAGE_SOCKET_NAME, STAGE_CONNECT_NAME, STAGE_RESPONSE_NAME, STAGE_STATUS_NAME, STAGE_AUTH_NAME, STAGE_BREAKER_NAME
+};
+
+Metrics::Metrics()
+  : _pours(0), _latency_sum_ms(0), _timeouts(0), _retries(0), _hedges(0), _hedges_won(0), _tags_filtered(0), _offline_auths(0), _pulse_jitter_us(0), _blocked_us(0), _suspect_missed(0), _nonce(0)
+{
+  memset(_volume_uL, 0, sizeof(_volume_uL));
+  memset(_latency_buckets, 0, sizeof(_latency_buckets));
+  memset(_failures, 0, sizeof(_failures));
+}
+
+void Metrics::recordPour(uint8_t tap, unsigned long volume_uL) {
+  _pours++;
+  
+  if (tap < METRICS_MAX_TAPS) {
+    _volume_uL[tap] += volume_uL;
+  }
+}
+
+void Metrics::recordAuthLatency(unsigned long latency_ms) {
+  uint8_t bucket = 0;
+  
+  while (bucket < METRICS_LATENCY_BUCKETS && latency_ms > pgm_read_word(&LATENCY_BOUNDS_MS[bucket])) {
+    bucket++;
+  }
+  
+  _latency_buckets[bucket]++;
+  _latency_sum_ms += latency_ms;
+}
+
+void Metrics::recordPulseTiming(unsigned long max_jitter_us, unsigned int max_blocked_us, unsigned short suspect_missed) {
+  _pulse_jitter_us = max_jitter_us;
+  _blocked_us = max_blocked_us;
+  _suspect_missed += suspect_missed;
+}
+
+unsigned long Metrics::authLatencyPercentile(uint8_t percent) {
+  unsigned long total = 0;
+  unsigned long cumulative = 0;
+  
+  for (uint8_t bucket = 0; bucket <= METRICS_LATENCY_BUCKETS; bucket++) {
+    total += _latency_buckets[bucket];
+  }
+  
+  if (total == 0) {
+    return 0;
+  }
+  
+  for (uint8_t bucket = 0; bucket < METRICS_LATENCY_BUCKETS; bucket++) {
+    cumulative += _latency_buckets[bucket];
+    if (cumulative * 100 >= total * percent) {
+      return pgm_read_word(&LATENCY_BOUNDS_MS[bucket]);
+    }
+  }
+  
+  return 0;
+}
+
+//!< Print "# TYPE name type\n"
+static void _printType(Print& target, const __FlashStringHelper* name, const __FlashStringHelper* type) {
+  target.print(F("# TYPE "));
+  target.print(name);
+  target.print(' ');
+  target.println(type);
+}
+
+//!< Print "name value\n"
+static void _printSample(Print& target, const __FlashStringHelper* name, unsigned long value) {
+  target.print(name);
+  target.print(' ');
+  target.println(value);
+}
+
+/**
+ * Families are printed one at a time so a caller can interleave them with
+ * other work (see #MetricsServer).
+ * \param target Where to print.
+ * \param family The family to print, counting from zero.
+ * \return True if a family was printed, false once there are no more.
+ */
+boolean Metrics::printFamily(Print& target, uint8_t family) {
+  unsigned long cumulative = 0;
+  
+  switch (family) {
+    case 0:
+      _printType(target, F("pourlogic_pours_total"), F("counter"));
+      _printSample(target, F("pourlogic_pours_total"), _pours);
+      break;
+    
+    case 1:
+      _printType(target, F("pourlogic_poured_volume_microlitres_total"), F("counter"));
+      for (uint8_t tap = 0; tap < METRICS_MAX_TAPS; tap++) {
+        target.print(F("pourlogic_poured_volume_microlitres_total{tap=\""));
+        target.print(tap);
+        target.print(F("\"} "));
+        target.println(_volume_uL[tap]);
+      }
+      break;
+    
+    case 2:
+      _printType(target, F("pourlogic_auth_latency_milliseconds"), F("histogram"));
+      for (uint8_t bucket = 0; bucket <= METRICS_LATENCY_BUCKETS; bucket++) {
+        cumulative += _latency_buckets[bucket];
+        target.print(F("pourlogic_auth_latency_milliseconds_bucket{le=\""));
+        if (bucket < METRICS_LATENCY_BUCKETS) {
+          target.print(pgm_read_word(&LATENCY_BOUNDS_MS[bucket]));
+        }
+        else {
+          target.print(F("+Inf"));
+        }
+        target.print(F("\"} "));
+        target.println(cumulative);
+      }
+      _printSample(target, F("pourlogic_auth_latency_milliseconds_sum"), _latency_sum_ms);
+      _printSample(target, F("pourlogic_auth_latency_milliseconds_count"), cumulative);
+      break;
+    
+    case 3:
+      _printType(target, F("pourlogic_request_failures_total"), F("counter"));
+      for (uint8_t stage = 0; stage < STAGE_COUNT; stage++) {
+        target.print(F("pourlogic_request_failures_total{stage=\""));
+        target.print((const __FlashStringHelper*) pgm_read_word(&STAGE_NAMES[stage]));
+        target.print(F("\"} "));
+        target.println(_failures[stage]);
+      }
+      break;
+    
+    case 4:
+      _printType(target, F("pourlogic_request_timeouts_total"), F("counter"));
+      _printSample(target, F("pourlogic_request_timeouts_total"), _timeouts);
+      _printType(target, F("pourlogic_request_retries_total"), F("counter"));
+      _printSample(target, F("pourlogic_request_retries_total"), _retries);
+      _printType(target, F("pourlogic_hedged_requests_total"), F("counter"));
+      _printSample(target, F("pourlogic_hedged_requests_total"), _hedges);
+      _printType(target, F("pourlogic_hedged_requests_won_total"), F("counter"));
+      _printSample(target, F("pourlogic_hedged_requests_won_total"), _hedges_won);
+      _printType(target, F("pourlogic_tags_filtered_total"), F("counter"));
+      _printSample(target, F("pourlogic_tags_filtered_total"), _tags_filtered);
+      _printType(target, F("pourlogic_offline_authorizations_total"), F("counter"));
+      _printSample(target, F("pourlogic_offline_authorizations_total"), _offline_auths);
+      break;
+    
+    case 5:
+      _printType(target, F("pourlogic_nonce"), F("gauge"));
+      _printSample(target, F("pourlogic_nonce"), _nonce);
+      _printType(target, F("pourlogic_free_sram_bytes"), F("gauge"));
+      _printSample(target, F("pourlogic_free_sram_bytes"), freeSRAM());
+      // .. clockMillis() stands still while powered down (see Sleep.h), so this under-reports when idling
+      _printType(target, F("pourlogic_uptime_seconds"), F("gauge"));
+      _printSample(target, F("pourlogic_uptime_seconds"), clockMillis() / 1000UL);
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+      // .. the last pour's, and all pours' (see FlowDiagnostics.h)
+      _printType(target, F("pourlogic_flow_pulse_jitter_max_microseconds"), F("gauge"));
+      _printSample(target, F("pourlogic_flow_pulse_jitter_max_microseconds"), _pulse_jitter_us);
+      _printType(target, F("pourlogic_interrupts_blocked_max_microseconds"), F("gauge"));
+      _printSample(target, F("pourlogic_interrupts_blocked_max_microseconds"), _blocked_us);
+      _printType(target, F("pourlogic_flow_pulses_suspect_missed_total"), F("counter"));
+      _printSample(target, F("pourlogic_flow_pulses_suspect_missed_total"), _suspect_missed);
+#endif
+#ifdef SETTINGS_SPI_BUS
+      // .. how long, and how often, each device has held the SPI bus (see SpiBus.h)
+      _printType(target, F("pourlogic_spi_bus_milliseconds_total"), F("counter"));
+      for (uint8_t device = 0; device < SPI_DEVICE_COUNT; device++) {
+        target.print(F("pourlogic_spi_bus_milliseconds_total{device=\""));
+        target.print(device == SPI_DEVICE_ETHERNET ? F("ethernet") : F("sd"));
+        target.print(F("\"} "));
+        target.println(spiBusTime_ms((SpiDevice) device));
+      }
+      _printType(target, F("pourlogic_spi_bus_transfers_total"), F("counter"));
+      for (uint8_t device = 0; device < SPI_DEVICE_COUNT; device++) {
+        target.print(F("pourlogic_spi_bus_transfers_total{device=\""));
+        target.print(device == SPI_DEVICE_ETHERNET ? F("ethernet") : F("sd"));
+        target.print(F("\"} "));
+        target.println(spiBusTransfers((SpiDevice) device));
+      }
+#endif
+      break;
+    
+#ifdef SETTINGS_MEMORY_DIAGNOSTICS
+    case 6:
+      _printType(target, F("pourlogic_stack_high_water_bytes"), F("gauge"));
+      for (uint8_t stage = 0; stage < MEMORY_STAGE_COUNT; stage++) {
+        target.print(F("pourlogic_stack_high_water_bytes{stage=\""));
+        target.print((const __FlashStringHelper*) pgm_read_word(&MEMORY_STAGE_NAMES[stage]));
+        target.print(F("\"} "));
+        target.println(memoryStackHighWater((MemoryStage) stage));
+      }
+      _printType(target, F("pourlogic_heap_high_water_bytes"), F("gauge"));
+      for (uint8_t stage = 0; stage < MEMORY_STAGE_COUNT; stage++) {
+        target.print(F("pourlogic_heap_high_water_bytes{stage=\""));
+        target.print((const __FlashStringHelper*) pgm_read_word(&MEMORY_STAGE_NAMES[stage]));
+        target.print(F("\"} "));
+        target.println(memoryHeapHighWater((MemoryStage) stage));
+      }
+      break;
+    
+    case 7: {
+      unsigned int free_bytes, largest_bytes;
+      uint8_t fragmentation = memoryFragmentation(free_bytes, largest_bytes);
+      
+      _printType(target, F("pourlogic_sram_headroom_min_bytes"), F("gauge"));
+      _printSample(target, F("pourlogic_sram_headroom_min_bytes"), memoryLeastHeadroom());
+      _printType(target, F("pourlogic_heap_free_list_bytes"), F("gauge"));
+      _printSample(target, F("pourlogic_heap_free_list_bytes"), free_bytes);
+      _printType(target, F("pourlogic_heap_largest_free_bytes"), F("gauge"));
+      _printSample(target, F("pourlogic_heap_largest_free_bytes"), largest_bytes);
+      _printType(target, F("pourlogic_heap_fragmentation_percent"), F("gauge"));
+      _printSample(target, F("pourlogic_heap_fragmentation_percent"), fragmentation);
+      break;
+    }
+#endif
+    
+    default:
+      return false;
+  }
+  
+  return true;
+}
+
+#endif // #ifdef SETTINGS_METRICS
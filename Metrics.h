@@ -0,0 +1,105 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_METRICS_H
+#define POURLOGIC_METRICS_H
+
+#include <Arduino.h>
+
+#include "config.h"
+
+#define METRICS_MAX_TAPS 1 //!< Taps with their own poured-volume counter (the controller drives one)
+#define METRICS_LATENCY_BUCKETS 7   //!< Finite authorization latency buckets (see Metrics.cpp)
+
+/*! Stage of a request at which it failed.
+ */
+enum MetricsStage {
+  STAGE_SOCKET = 0, //!< No socket (or request slot) was free
+  STAGE_CONNECT,    //!< Could not connect
+  STAGE_RESPONSE,   //!< Connected, but no complete response
+  STAGE_STATUS,     //!< Unexpected HTTP status, or malformed headers
+  STAGE_AUTH,       //!< Response failed HMAC verification
+  STAGE_BREAKER,    //!< Not sent: no server could be reached (see CircuitBreaker.h)
+  STAGE_COUNT
+};
+
+/*!
+ * Counters are kept in RAM only and restart from zero on reset; the
+ * uptime gauge lets a scraper notice.
+ *
+ * Recording is cheap (an increment or two) so it can be done anywhere,
+ * including the pour pipeline. See #MetricsServer for publishing them.
+ * Without #SETTINGS_METRICS every method is an empty inline, so callers
+ * need no #ifdefs and nothing is left in the build.
+ *
+ * \brief Operational counters and histograms for this controller.
+ */
+#ifdef SETTINGS_METRICS
+
+class Metrics {
+
+  public:
+    Metrics();
+    
+    void recordPour(uint8_t tap, unsigned long volume_uL); //!< A pour finished on a tap
+    void recordAuthLatency(unsigned long latency_ms);      //!< A pour request was answered
+    void recordFailure(MetricsStage stage) { _failures[stage]++; } //!< A request failed at a stage
+    void recordTimeout() { _timeouts++; }                  //!< A request stage timed out
+    void recordRetry() { _retries++; }                     //!< A request was retried
+    void recordHedge() { _hedges++; }                      //!< A hedged (second) pour request was sent
+    void recordHedgeWon() { _hedges_won++; }               //!< A hedged pour request answered first
+    void recordTagFiltered() { _tags_filtered++; }         //!< A tag was turned away without asking the server (see TagFilter.h)
+    void recordOfflineAuth() { _offline_auths++; }         //!< A patron was allowed to pour by the patron table, with no server to ask (see PatronTable.h)
+    void recordPulseTiming(unsigned long max_jitter_us, unsigned int max_blocked_us, unsigned short suspect_missed); //!< How a pour's flow pulses were spaced (see FlowDiagnostics.h)
+    
+    //!< Upper bound of the latency bucket holding the given percentile of pour requests; 0 if unknown (no samples, or beyond the last finite bucket)
+    unsigned long authLatencyPercentile(uint8_t percent);
+    void setNonce(unsigned long nonce) { _nonce = nonce; } //!< The nonce most recently used
+
+    //!< Print one metric family (numbered from zero) in Prometheus text format. Returns false past the last family.
+    boolean printFamily(Print& target, uint8_t family);
+    
+  private:
+    unsigned long _pours;
+    unsigned long _volume_uL[METRICS_MAX_TAPS];
+    unsigned long _latency_buckets[METRICS_LATENCY_BUCKETS+1]; //!< Non-cumulative; the last is +Inf
+    unsigned long _latency_sum_ms;
+    unsigned long _failures[STAGE_COUNT];
+    unsigned long _timeouts;
+    unsigned long _retries;
+    unsigned long _hedges;
+    unsigned long _hedges_won;
+    unsigned long _tags_filtered;
+    unsigned long _offline_auths;
+    unsigned long _pulse_jitter_us;  //!< Last pour's
+    unsigned int _blocked_us;        //!< Last pour's
+    unsigned long _suspect_missed;
+    unsigned long _nonce;
+};
+
+extern Metrics metrics; //!< This controller's metrics
+
+#else
+
+class Metrics {
+
+  public:
+    void recordPour(uint8_t, unsigned long) {}
+    void recordAuthLatency(unsigned long) {}
+    void recordFailure(MetricsStage) {}
+    void recordTimeout() {}
+    void recordRetry() {}
+    void recordHedge() {}
+    void recordHedgeWon() {}
+    void recordTagFiltered() {}
+    void recordOfflineAuth() {}
+    void recordPulseTiming(unsigned long, unsigned int, unsigned short) {}
+    unsigned long authLatencyPercentile(uint8_t) { return 0; }
+    void setNonce(unsigned long) {}
+    boolean printFamily(Print&, uint8_t) { return false; }
+};
+
+static Metrics metrics; //!< Records nothing
+
+#endif // #ifdef SETTINGS_METRICS
+
+#endif // #ifndef POURLOGIC_METRICS_H
@@ -0,0 +1,98 @@
+// See LICENSE.txt for license details.
+
+#include "MetricsServer.h"
+
+#ifdef SETTINGS_METRICS_SERVER
+
+#include "Clock.h"
+#include "StreamUtil.h"
+#include "HTTPUtil.h"
+#include "SpiBus.h"
+#include <utility/socket.h>
+
+#define METRICS_SERVER_TIMEOUT_MS 5000       //!< A scrape taking longer than this is abandoned
+#define METRICS_SERVER_CLOSE_TIMEOUT_MS 1000 //!< Time allowed for a graceful close before the socket is closed outright
+
+MetricsServer::MetricsServer(uint16_t port)
+  : _server(port), _state(IDLE), _family(0), _sock(MAX_SOCK_NUM), _started_ms(0)
+{
+}
+
+void MetricsServer::begin() {
+  spiBusAcquire(SPI_DEVICE_ETHERNET);
+  _server.begin();
+  spiBusRelease(SPI_DEVICE_ETHERNET);
+}
+
+void MetricsServer::_finish() {
+  _sock = _client.getSocketNumber();
+  
+  // Send FIN and move on; the W5100 finishes closing on its own, and the
+  // server goes back to listening once it has (see #CLOSING).
+  if (_sock < MAX_SOCK_NUM) {
+    disconnect(_sock);
+  }
+  
+  _client = EthernetClient();
+  _started_ms = clockMillis();
+  _state = CLOSING;
+}
+
+/**
+ * Each step talks to the W5100 throughout (a byte or a field at a time),
+ * so it holds the bus for the whole step.
+ */
+void MetricsServer::poll() {
+  spiBusAcquire(SPI_DEVICE_ETHERNET);
+  
+  switch (_state) {
+    case IDLE:
+      _client = _server.available();
+      
+      if (_client) {
+        _state = HEADERS;
+        _family = 0;
+        _started_ms = clockMillis();
+      }
+      break;
+    
+    case HEADERS:
+      // Whatever was asked, the answer is the same; discard the request
+      readUntilUnavailable(_client);
+      
+      _client.print(F("HTTP/1.0 200 OK"));
+      printHTTPEndline(_client);
+      _client.print(F("Content-Type: text/plain; version=0.0.4"));
+      printHTTPEndline(_client);
+      _client.print(F("Connection: close"));
+      printHTTPEndline(_client);
+      printHTTPEndline(_client);
+      
+      _state = BODY;
+      break;
+    
+    case BODY:
+      if (!_client.connected() || (clockMillis() - _started_ms) > METRICS_SERVER_TIMEOUT_MS) {
+        _finish(); // scraper gave up
+      }
+      else if (!metrics.printFamily(_client, _family++)) {
+        _finish(); // all done
+      }
+      break;
+    
+    case CLOSING:
+      // Listening again before then would take a second socket from the request engine
+      if (_sock >= MAX_SOCK_NUM || W5100.readSnSR(_sock) == SnSR::CLOSED) {
+        _state = IDLE;
+      }
+      else if ((clockMillis() - _started_ms) > METRICS_SERVER_CLOSE_TIMEOUT_MS) {
+        close(_sock);
+        _state = IDLE;
+      }
+      break;
+  }
+  
+  spiBusRelease(SPI_DEVICE_ETHERNET);
+}
+
+#endif // #ifdef SETTINGS_METRICS_SERVER
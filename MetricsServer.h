@@ -0,0 +1,65 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_METRICS_SERVER_H
+#define POURLOGIC_METRICS_SERVER_H
+
+#include <Arduino.h>
+#include <Ethernet.h>
+
+#include "config.h"
+
+#ifdef SETTINGS_METRICS_SERVER
+
+#include "Metrics.h"
+
+/*!
+ * Any request on the metrics port is answered with the current #Metrics
+ * in the Prometheus text exposition format (version 0.0.4). Only one
+ * scrape is served at a time.
+ *
+ * #poll never waits on the network: each call either accepts a
+ * connection, or writes the next metric family of the response, or closes
+ * the finished connection. The pour pipeline calls #poll whenever it
+ * is waiting anyway, so a scrape never delays a patron.
+ *
+ * The server holds one of the W5100's four sockets, which leaves three
+ * for the #RequestEngine (ENGINE_MAX_REQUESTS). The scrape is served on
+ * the listening socket itself; looking for a connection
+ * (EthernetServer::available) opens a new listener on a free socket
+ * whenever the old one isn't listening, so that is only done once the
+ * last scrape's socket has closed (#CLOSING). Until then the port
+ * isn't listening, and a scraper retries.
+ *
+ * \brief Serves #Metrics over HTTP, one small piece at a time.
+ */
+class MetricsServer {
+
+  public:
+    MetricsServer(uint16_t port);
+    ~MetricsServer() {}
+    
+    void begin(); //!< Start listening
+    void poll();  //!< Do one small unit of work; never blocks
+    boolean busy() { return _state == HEADERS || _state == BODY; } //!< Whether a scrape is in progress
+    
+  private:
+    enum State {
+      IDLE = 0,   //!< Waiting for a scraper
+      HEADERS,    //!< Connected; response headers not yet written
+      BODY,       //!< Writing metric families
+      CLOSING,    //!< Waiting for the scrape's socket to close before listening again
+    };
+    
+    EthernetServer _server;
+    EthernetClient _client;
+    uint8_t _state;
+    uint8_t _family; //!< Next metric family to write
+    uint8_t _sock;   //!< Socket of the scrape (while #CLOSING)
+    unsigned long _started_ms; //!< When the scrape (or its #CLOSING) began
+    
+    void _finish(); //!< Start closing the connection without waiting for it to close
+};
+
+#endif // #ifdef SETTINGS_METRICS_SERVER
+
+#endif // #ifndef POURLOGIC_METRICS_SERVER_H
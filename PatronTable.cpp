@@ -0,0 +1,377 @@
+// See LICENSE.txt for license details.
+
+#include "PatronTable.h"
+
+#ifdef SETTINGS_PATRON_TABLE
+
+#include "HexString.h"
+
+#define FILE_BLOCKS (1UL + PATRON_TABLE_IMAGE_BLOCKS) //!< Header, then the table
+
+PatronTable::PatronTable(uint8_t cs_pin)
+  : _cs_pin(cs_pin), _ready(false), _first_block(0)
+{
+  memset(&_header, 0, sizeof(_header));
+}
+
+/**
+ * Opens the table, creating it (empty) if needed.
+ * \return False if there is no card, or the table couldn't be opened or created.
+ */
+boolean PatronTable::begin() {
+  uint8_t* buffer = sdCacheClaim(NULL); // the FAT code uses the block buffer
+  boolean opened;
+
+  _ready = false;
+
+  // The hardware SS pin must be an output for the AVR to stay SPI master
+  pinMode(SD_REQUIRED_PIN, OUTPUT);
+
+  // The FAT code talks to the card directly rather than through SpiBusSdCard
+  spiBusAcquire(SPI_DEVICE_SD);
+  opened = _openFile();
+  spiBusRelease(SPI_DEVICE_SD);
+
+  if (!opened) {
+    return false;
+  }
+
+  // Lookups read a few bytes at a time
+  _card.partialBlockRead(true);
+
+  if ((buffer = _readHeaderBlock()) == NULL) {
+    return false;
+  }
+  memcpy(&_header, buffer, sizeof(_header));
+
+  if (_header.magic != MAGIC || _header.queue_head >= PATRON_TABLE_QUEUE_SIZE || _header.queue_count > PATRON_TABLE_QUEUE_SIZE) {
+    // Fresh file (or not one we wrote): no table, nothing queued
+    memset(buffer, 0, PATRON_TABLE_BLOCK_SIZE);
+    memset(&_header, 0, sizeof(_header));
+    _header.magic = MAGIC;
+    if (!_writeHeaderBlock(buffer)) {
+      return false;
+    }
+  }
+
+  _ready = true;
+
+  if (_header.unverified) {
+    abandonSync(); // reset part way through a response; what it wrote can't be trusted
+  }
+
+  if (_header.state == VALID && !_loadTop()) {
+    _header.state = 0; // can't be read; sync again
+  }
+
+  return true;
+}
+
+boolean PatronTable::_openFile() {
+  SdVolume volume;
+  SdFile root;
+  SdFile file;
+  uint32_t last_block = 0;
+
+  if (!_card.init(SPI_FULL_SPEED, _cs_pin) || !volume.init(&_card) || !root.openRoot(&volume)) {
+    return false;
+  }
+
+  // Open the table, or create it as one contiguous run of blocks
+  if (file.open(&root, PATRON_TABLE_FILE_NAME, O_RDWR)) {
+    return file.contiguousRange(&_first_block, &last_block) && last_block - _first_block + 1 >= FILE_BLOCKS; // (else not something we wrote)
+  }
+
+  return file.createContiguous(&root, PATRON_TABLE_FILE_NAME, FILE_BLOCKS * PATRON_TABLE_BLOCK_SIZE)
+         && file.contiguousRange(&_first_block, &last_block);
+}
+
+uint8_t* PatronTable::_readHeaderBlock() {
+  uint8_t* buffer = sdCacheClaim(NULL);
+
+  return _card.readBlock(_first_block, buffer) ? buffer : NULL;
+}
+
+boolean PatronTable::_writeHeaderBlock(uint8_t* buffer) {
+  memcpy(buffer, &_header, sizeof(_header));
+  return _card.writeBlock(_first_block, buffer);
+}
+
+boolean PatronTable::_writeHeader() {
+  uint8_t* buffer = _readHeaderBlock(); // (keeping the queue)
+
+  return buffer != NULL && _writeHeaderBlock(buffer);
+}
+
+boolean PatronTable::_loadTop() {
+  boolean success = true;
+
+  for (uint8_t i = 0; i < _header.index_blocks && success; i++) {
+    success = _card.readData(_blockOf(i), 0, PATRON_TABLE_TAG_BYTES, _top[i]);
+  }
+  _card.readEnd();
+
+  return success;
+}
+
+/**
+ * Reads at most as far as the patron in one index block and one data
+ * block, a key or record at a time.
+ * \param key The packed tag.
+ * \param block The data block holding the patron (as a table block).
+ * \param slot The patron's slot in it.
+ * \param record The patron's record.
+ */
+boolean PatronTable::_find(uint8_t const* key, unsigned int& block, uint8_t& slot, PatronRecord& record) {
+  uint8_t probe[PATRON_TABLE_TAG_BYTES];
+  uint8_t index = _header.index_blocks;
+  uint8_t entry = 0;
+  int order = 1;
+
+  if (!valid()) {
+    return false;
+  }
+
+  // The last index block starting at or before the tag (in RAM)
+  while (index > 0 && memcmp(_top[index - 1], key, PATRON_TABLE_TAG_BYTES) > 0) {
+    index--;
+  }
+  if (index-- == 0) {
+    return false; // before the first patron
+  }
+
+  // .. its last data block starting at or before the tag
+  for (entry = 1; entry < PATRON_TABLE_KEYS_PER_INDEX; entry++) {
+    if (!_card.readData(_blockOf(index), entry * PATRON_TABLE_TAG_BYTES, PATRON_TABLE_TAG_BYTES, probe)) {
+      _card.readEnd();
+      return false;
+    }
+    if (memcmp(probe, key, PATRON_TABLE_TAG_BYTES) > 0) {
+      break; // (unused entries are all 0xFF, after every tag)
+    }
+  }
+  block = (unsigned int) index * PATRON_TABLE_KEYS_PER_INDEX + entry - 1;
+  if (block >= _header.data_blocks) {
+    _card.readEnd();
+    return false;
+  }
+  block += PATRON_TABLE_INDEX_BLOCKS;
+
+  // .. and the patron in it
+  for (slot = 0; slot < PATRON_TABLE_RECORDS_PER_BLOCK; slot++) {
+    if (!_card.readData(_blockOf(block), slot * sizeof(PatronRecord), sizeof(PatronRecord), (uint8_t*) &record)) {
+      order = 1;
+      break;
+    }
+    if ((order = memcmp(record.tag, key, PATRON_TABLE_TAG_BYTES)) >= 0) {
+      break;
+    }
+  }
+  _card.readEnd();
+
+  return order == 0;
+}
+
+boolean PatronTable::lookup(String const& tag, PatronRecord& record) {
+  uint8_t key[PATRON_TABLE_TAG_BYTES];
+  int length = 0;
+  unsigned int block;
+  uint8_t slot;
+
+  return hexStringToBytes(tag, key, length, sizeof(key)) && length == sizeof(key)
+      && _find(key, block, slot, record);
+}
+
+int PatronTable::allowance(PatronRecord const& record) {
+  unsigned long allowance_mL = min((unsigned long) record.max_pour_mL, (unsigned long) record.remaining_mL);
+
+  if (record.flags & PATRON_BLOCKED) {
+    return 0;
+  }
+
+  return (allowance_mL > 0x7FFF) ? 0x7FFF : (int) allowance_mL;
+}
+
+/**
+ * Rewrites the patron's data block. The table's version is left as it
+ * is: the server's next version has the patron as the server sees it,
+ * and the block is sent again once the pour has been recorded.
+ */
+boolean PatronTable::debit(String const& tag, unsigned long volume_mL) {
+  uint8_t key[PATRON_TABLE_TAG_BYTES];
+  int length = 0;
+  unsigned int block;
+  uint8_t slot;
+  PatronRecord record;
+  PatronRecord* stored = NULL;
+  uint8_t* buffer = NULL;
+
+  if (!hexStringToBytes(tag, key, length, sizeof(key)) || length != sizeof(key) || !_find(key, block, slot, record)) {
+    return false;
+  }
+
+  if (record.remaining_mL == 0xFFFFFFFFUL) {
+    return true; // no limit to take it off
+  }
+
+  buffer = sdCacheClaim(NULL);
+  if (!_card.readBlock(_blockOf(block), buffer)) {
+    return false;
+  }
+
+  stored = (PatronRecord*) buffer + slot;
+  stored->remaining_mL = (stored->remaining_mL > volume_mL) ? stored->remaining_mL - volume_mL : 0;
+
+  return _card.writeBlock(_blockOf(block), buffer);
+}
+
+/**
+ * A delta from version 0 is a whole table. Any other must be from the
+ * version held and, if another delta was part way in, to the same
+ * target.
+ * \param base The version the delta is from.
+ * \param target The version it leads to.
+ * \param index_blocks The index blocks the target uses.
+ * \param data_blocks The data blocks the target uses.
+ * \return False if the table doesn't fit (#SETTINGS_PATRON_TABLE_INDEX_BLOCKS) or the delta can't be applied.
+ */
+boolean PatronTable::beginSync(unsigned long base, unsigned long target, uint8_t index_blocks, unsigned int data_blocks) {
+  if (!_ready || target == 0 || index_blocks > PATRON_TABLE_INDEX_BLOCKS
+      || data_blocks > (unsigned int) index_blocks * PATRON_TABLE_KEYS_PER_INDEX) {
+    return false;
+  }
+
+  if (base != 0 && (base != _header.version || (_header.applied > 0 && target != _header.target) || _header.unverified)) {
+    return false;
+  }
+
+  if (base == 0 || index_blocks != _header.index_blocks || data_blocks != _header.data_blocks) {
+    _header.state = 0; // a new layout; not usable until it is all in
+  }
+
+  _header.version = base;
+  _header.index_blocks = index_blocks;
+  _header.data_blocks = data_blocks;
+  _header.target = target;
+  _header.applied = 0;
+
+  return _writeHeader();
+}
+
+/**
+ * Marks the table not valid and #unverified (on the card too) before the
+ * block is written, so a table part way through a sync is not used, and
+ * a block that never checks out is not kept.
+ */
+uint8_t* PatronTable::blockBuffer() {
+  if (_header.state == VALID || !_header.unverified) {
+    _header.state = 0;
+    _header.unverified = 1;
+    if (!_writeHeader()) {
+      return NULL;
+    }
+  }
+
+  return sdCacheClaim(NULL);
+}
+
+boolean PatronTable::writeBlock(unsigned int block) {
+  if (block >= PATRON_TABLE_IMAGE_BLOCKS || _header.state == VALID) {
+    return false;
+  }
+
+  return _card.writeBlock(_blockOf(block), sdCacheClaim(NULL));
+}
+
+boolean PatronTable::advanceSync(unsigned int applied) {
+  _header.applied = applied;
+  _header.unverified = 0;
+  return _writeHeader();
+}
+
+boolean PatronTable::finishSync() {
+  _header.version = _header.target;
+  _header.target = 0;
+  _header.applied = 0;
+  _header.state = VALID;
+
+  if (!_writeHeader() || !_loadTop()) {
+    _header.state = 0;
+    return false;
+  }
+
+  return true;
+}
+
+void PatronTable::abandonSync() {
+  _header.state = 0;
+  _header.version = 0;
+  _header.target = 0;
+  _header.applied = 0;
+  _header.unverified = 0;
+  _writeHeader();
+}
+
+/**
+ * \param tag The patron's tag data (10 hex digits).
+ * \param nonce The nonce keying the pour (see PourLogicClient#reportPouredVolume).
+ * \param volume_uL The volume poured.
+ * \return False if the queue is full (or the card can't be written).
+ */
+boolean PatronTable::queuePour(String const& tag, uint32_t nonce, uint32_t volume_uL) {
+  QueuedPour* pour = NULL;
+  uint8_t* buffer = NULL;
+  int length = 0;
+
+  if (!_ready || _header.queue_count >= PATRON_TABLE_QUEUE_SIZE || (buffer = _readHeaderBlock()) == NULL) {
+    return false;
+  }
+
+  pour = (QueuedPour*) (buffer + sizeof(Header)) + (_header.queue_head + _header.queue_count) % PATRON_TABLE_QUEUE_SIZE;
+  memset(pour, 0, sizeof(QueuedPour));
+  hexStringToBytes(tag, pour->tag, length, sizeof(pour->tag));
+  pour->nonce = nonce;
+  pour->volume_uL = volume_uL;
+
+  _header.queue_count++;
+  if (!_writeHeaderBlock(buffer)) {
+    _header.queue_count--;
+    return false;
+  }
+
+  return true;
+}
+
+boolean PatronTable::nextQueuedPour(String& tag, uint32_t& nonce, uint32_t& volume_uL) {
+  QueuedPour pour;
+  boolean success = false;
+
+  if (!_ready || _header.queue_count == 0) {
+    return false;
+  }
+
+  success = _card.readData(_first_block, sizeof(Header) + _header.queue_head * sizeof(QueuedPour), sizeof(QueuedPour), (uint8_t*) &pour);
+  _card.readEnd();
+
+  if (success) {
+    tag = bytesToHexString(pour.tag, sizeof(pour.tag));
+    tag.toUpperCase(); // as the reader sends it
+    nonce = pour.nonce;
+    volume_uL = pour.volume_uL;
+  }
+
+  return success;
+}
+
+boolean PatronTable::dequeuePour() {
+  if (!_ready || _header.queue_count == 0) {
+    return false;
+  }
+
+  _header.queue_head = (_header.queue_head + 1) % PATRON_TABLE_QUEUE_SIZE;
+  _header.queue_count--;
+
+  return _writeHeader();
+}
+
+#endif // #ifdef SETTINGS_PATRON_TABLE
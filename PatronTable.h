@@ -0,0 +1,178 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_PATRON_TABLE_H
+#define POURLOGIC_PATRON_TABLE_H
+
+#include <Arduino.h>
+#include <String.h>
+
+#include "config.h"
+
+#ifdef SETTINGS_PATRON_TABLE
+
+#ifndef SETTINGS_CIRCUIT_BREAKER
+#error "The patron table is gone by while no server can be reached; it needs SETTINGS_CIRCUIT_BREAKER to know when that is"
+#endif
+
+#include <SD.h>
+
+#include "pin_config.h"
+#include "SdCache.h"
+#include "SpiBus.h"
+
+#define PATRON_TABLE_FILE_NAME "PATRONS.BIN"                  //!< Table file in the card's root directory
+#define PATRON_TABLE_BLOCK_SIZE 512                           //!< SD sector size
+#define PATRON_TABLE_TAG_BYTES 5                              //!< Packed RFID tag (10 hex digits)
+#define PATRON_TABLE_INDEX_BLOCKS SETTINGS_PATRON_TABLE_INDEX_BLOCKS //!< Most index blocks
+#define PATRON_TABLE_KEYS_PER_INDEX 102                       //!< Data blocks each index block covers (a 5-byte key each)
+#define PATRON_TABLE_DATA_BLOCKS (PATRON_TABLE_INDEX_BLOCKS * PATRON_TABLE_KEYS_PER_INDEX) //!< Most data blocks
+#define PATRON_TABLE_RECORDS_PER_BLOCK 32                     //!< Patrons per data block
+#define PATRON_TABLE_IMAGE_BLOCKS (PATRON_TABLE_INDEX_BLOCKS + PATRON_TABLE_DATA_BLOCKS) //!< Blocks of the table as the server sends it
+#define PATRON_TABLE_QUEUE_SIZE 30                            //!< Pours granted offline that can wait on the card for the outbox
+
+#define PATRON_BLOCKED 0x01 //!< #PatronRecord flag: may not pour
+
+/*! A patron, as the server sends it (16 bytes, little-endian).
+ */
+struct PatronRecord {
+  uint8_t tag[PATRON_TABLE_TAG_BYTES]; //!< Packed RFID tag; all 0xFF for an unused slot
+  uint8_t flags;                       //!< PATRON_* flags
+  uint16_t max_pour_mL;                //!< Most the patron may pour at once
+  uint32_t remaining_mL;               //!< Allowance left (0xFFFFFFFF: no limit)
+  uint32_t reserved;
+};
+
+/*!
+ * The server's table of patrons, kept on the SD card so a patron can
+ * still be served while no server can be reached (see
+ * PourLogicClient#offline). Like the journal, it is a contiguous file
+ * read and written a block at a time, bypassing the FAT code after
+ * #begin:
+ *
+ * <pre>
+ *   block 0                    header { magic, state, index and data blocks used, version,
+ *                                       version being synced to, blocks of it applied, queue },
+ *                              then 30 x pour granted offline { tag, nonce, volume in uL }
+ *   block 1 ..                 index: { first tag of each data block } x 102
+ *   block 1 + INDEX_BLOCKS ..  data:  { #PatronRecord } x 32
+ * </pre>
+ *
+ * Records are sorted by packed tag, across blocks; the index blocks list
+ * the first tag of each data block (unused entries are all 0xFF), and
+ * the first tag of each index block is kept in RAM (5 bytes each). A
+ * #lookup finds the index block in RAM, then reads the index block and
+ * the data block as far as the tag, each a single sector read streamed
+ * a few bytes at a time, so it needs no block buffer and takes a couple
+ * of milliseconds.
+ *
+ * The table comes from the server as blocks laid out as above (the
+ * header aside), numbered from 0 for the first index block (see
+ * PourLogicClient#requestPatronTable). Like the tag filter (see
+ * TagFilter.h), the server numbers each table it makes and sends the
+ * blocks that differ between the version held and its latest, a few per
+ * signed response: #beginSync, #blockBuffer and #writeBlock for each
+ * block, #advanceSync once a response's HMAC checks out, and #finishSync
+ * after the last. A sync cut short carries on from the last response
+ * that checked out; one that doesn't check out starts over with
+ * #abandonSync. So does one cut short once a block of the response has
+ * been written: until the HMAC checks out, nothing vouches for the block,
+ * or that it is even one of the delta's, and only a sync from nothing is
+ * sure to overwrite it. The header notes such a block before it is
+ * written (#unverified), so a table found that way at #begin (the
+ * controller reset part way through a response) starts over too. The
+ * table isn't used from the time the first block is written until the
+ * sync finishes.
+ *
+ * While offline, a pour granted by the table is taken off the patron's
+ * remaining allowance (#debit) until the server's next version says
+ * otherwise, and its result waits in the header's queue (#queuePour) if
+ * the outbox is full, to be handed to the outbox once a server can be
+ * reached.
+ *
+ * Writing a block uses the SD library's block buffer (see SdCache.h),
+ * as the journal does; reading doesn't.
+ *
+ * \brief A sorted, block-indexed patron table on the SD card.
+ */
+class PatronTable {
+
+  public:
+    PatronTable(uint8_t cs_pin = SD_CS_PIN);
+    ~PatronTable() {}
+
+    boolean begin(); //!< Open (or create) the table file
+    boolean ready() { return _ready; }
+    boolean valid() { return _ready && _header.state == VALID; } //!< Whether there is a table to look patrons up in
+
+    //!< Find a patron by tag data (10 hex digits); false if not in the table (or no valid table).
+    boolean lookup(String const& tag, PatronRecord& record);
+
+    //!< The most a patron may pour now, in mL (0 if blocked or out of allowance).
+    static int allowance(PatronRecord const& record);
+
+    //!< Take a pour off a patron's remaining allowance.
+    boolean debit(String const& tag, unsigned long volume_mL);
+
+    unsigned long version() { return _header.version; }     //!< Version held (or, while syncing, synced from); 0 for none
+    unsigned long syncTarget() { return _header.target; }   //!< Version being synced to; 0 if not syncing
+    unsigned int syncApplied() { return _header.applied; }  //!< Blocks of the delta applied so far
+    boolean syncing() { return _header.target != 0; }       //!< Whether a sync is unfinished
+    boolean unverified() { return _header.unverified; }     //!< Whether a block may be on the card that no response has checked out
+
+    boolean beginSync(unsigned long base, unsigned long target, uint8_t index_blocks, unsigned int data_blocks); //!< A delta from #base to #target is starting; false if it can't be applied
+    uint8_t* blockBuffer();                  //!< A block of the delta is coming; where to put it (NULL on error). The table is #unverified from here
+    boolean writeBlock(unsigned int block);  //!< Write the block buffer to table block #block
+    boolean advanceSync(unsigned int applied); //!< A response checked out; the first #applied blocks of the delta are in, and verified
+    boolean finishSync();                    //!< The whole delta is in; the table is at the target version
+    void abandonSync();                      //!< The table can't be trusted; sync from version 0 next time
+
+    uint8_t queuedPours() { return _header.queue_count; } //!< Pours waiting on the card
+    boolean queuePour(String const& tag, uint32_t nonce, uint32_t volume_uL); //!< Keep a pour's result until the outbox has room
+    boolean nextQueuedPour(String& tag, uint32_t& nonce, uint32_t& volume_uL); //!< The pour that has waited longest
+    boolean dequeuePour();                   //!< ... has gone to the outbox
+
+  private:
+    struct Header {
+      uint32_t magic;
+      uint8_t state;
+      uint8_t index_blocks;   //!< Index blocks in use
+      uint16_t data_blocks;   //!< Data blocks in use
+      uint32_t version;
+      uint32_t target;
+      uint16_t applied;
+      uint8_t queue_head;     //!< Queue slot of the oldest pour
+      uint8_t queue_count;
+      uint8_t unverified;     //!< A block may have been written that no response has checked out
+      uint8_t reserved[11];
+    };
+
+    struct QueuedPour {
+      uint8_t tag[PATRON_TABLE_TAG_BYTES];
+      uint8_t reserved[3];
+      uint32_t nonce;
+      uint32_t volume_uL;
+    };
+
+    static const uint32_t MAGIC = 0x54504C50UL; //!< "PLPT"
+    static const uint8_t VALID = 0x5A;          //!< Arbitrary byte pattern marking a complete table
+
+    SpiBusSdCard _card;
+    uint8_t _cs_pin;
+    boolean _ready;
+    uint32_t _first_block;  //!< Card block of the header
+    Header _header;         //!< Copy of the header
+    uint8_t _top[PATRON_TABLE_INDEX_BLOCKS][PATRON_TABLE_TAG_BYTES]; //!< First tag of each index block
+
+    uint32_t _blockOf(unsigned int block) { return _first_block + 1 + block; } //!< Card block of a table block
+
+    boolean _openFile();                //!< Open (or create) the file and find its blocks, with the bus held
+    boolean _find(uint8_t const* key, unsigned int& block, uint8_t& slot, PatronRecord& record); //!< Find a patron's data block and slot
+    boolean _loadTop();                 //!< Read the first tag of each index block
+    uint8_t* _readHeaderBlock();        //!< Read block 0 into the block buffer
+    boolean _writeHeaderBlock(uint8_t* buffer); //!< Write the header (over the block buffer's) and block 0
+    boolean _writeHeader();             //!< Update the header on the card
+};
+
+#endif // #ifdef SETTINGS_PATRON_TABLE
+
+#endif // #ifndef POURLOGIC_PATRON_TABLE_H
@@ -0,0 +1,163 @@
+// See LICENSE.txt for license details.
+
+#include "PinChangeCounter.h"
+
+#ifdef SETTINGS_FLOW_PCINT
+
+#include "Trace.h"
+
+#define PIN_CHANGE_PORTS 3  //!< Pin-change interrupt vectors (ports) on the ATmega328P
+#define PIN_CHANGE_NONE 0xFF
+
+static volatile unsigned short counts[PIN_CHANGE_MAX_COUNTERS];
+static uint8_t counter_ports[PIN_CHANGE_MAX_COUNTERS]; //!< Port (PCICR bit) of each counter's pin
+static uint8_t counter_bits[PIN_CHANGE_MAX_COUNTERS];  //!< Bit (in its PCMSK) of each counter's pin
+static uint8_t counters_used = 0;
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+static FlowDiagnostics* counter_diagnostics[PIN_CHANGE_MAX_COUNTERS]; //!< Where each counter's edges are timed, if anywhere
+#endif
+
+static volatile uint8_t* port_inputs[PIN_CHANGE_PORTS];       //!< PINx register of each port (NULL until a pin on it is attached)
+static volatile uint8_t* port_enables[PIN_CHANGE_PORTS];      //!< PCMSKx register of each port
+static uint8_t port_counters[PIN_CHANGE_PORTS][8];            //!< Counter for each pin of each port
+static volatile uint8_t counted_masks[PIN_CHANGE_PORTS];      //!< Pins being counted on each port
+static volatile uint8_t last_states[PIN_CHANGE_PORTS];        //!< Each port when last seen
+
+//!< Count the pins on a port that rose since it last changed.
+static inline void _countRisingEdges(uint8_t port) {
+  uint8_t now, rising;
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+  unsigned long now_us = micros(); // before anything else, so the time is the handler's entry
+#endif
+  
+  if (counted_masks[port] == 0) {
+    return; // only here to wake us (see Sleep.h)
+  }
+  
+  now = *port_inputs[port];
+  rising = now & ~last_states[port] & counted_masks[port];
+  last_states[port] = now;
+  
+  for (uint8_t bit = 0; rising; bit++, rising >>= 1) {
+    if (rising & 1) {
+      counts[port_counters[port][bit]]++;
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+      if (counter_diagnostics[port_counters[port][bit]] != NULL) {
+        flowDiagnosticsPulse(*counter_diagnostics[port_counters[port][bit]], now_us);
+      }
+#endif
+#ifdef SETTINGS_TRACE_RECORD
+      traceRecorder.pulseFromISR(port_counters[port][bit]);
+#endif
+    }
+  }
+}
+
+ISR(PCINT0_vect) { _countRisingEdges(0); }
+ISR(PCINT1_vect) { _countRisingEdges(1); }
+ISR(PCINT2_vect) { _countRisingEdges(2); }
+
+int8_t pinChangeCounterAttach(uint8_t pin) {
+  uint8_t port = digitalPinToPCICRbit(pin);
+  uint8_t bit = digitalPinToPCMSKbit(pin);
+  int8_t counter;
+  
+  if (counters_used >= PIN_CHANGE_MAX_COUNTERS || port >= PIN_CHANGE_PORTS) {
+    return -1;
+  }
+  
+  // First pin on this port? Nothing counted there yet.
+  if (port_inputs[port] == NULL) {
+    memset(port_counters[port], PIN_CHANGE_NONE, sizeof(port_counters[port]));
+    port_inputs[port] = portInputRegister(digitalPinToPort(pin));
+    port_enables[port] = digitalPinToPCMSK(pin);
+  }
+  
+  counter = counters_used++;
+  counter_ports[counter] = port;
+  counter_bits[counter] = bit;
+  port_counters[port][bit] = counter;
+  
+  return counter;
+}
+
+void pinChangeCounterStart(int8_t counter) {
+  uint8_t port, mask;
+  
+  if (counter < 0 || counter >= counters_used) {
+    return; // never attached (see pinChangeCounterAttach)
+  }
+  
+  port = counter_ports[counter];
+  mask = _BV(counter_bits[counter]);
+  
+  noInterrupts();
+  counts[counter] = 0;
+  
+  // Start from the pin as it is now (other pins on the port may be mid-count)
+  last_states[port] = (last_states[port] & ~mask) | (*port_inputs[port] & mask);
+  counted_masks[port] |= mask;
+  
+  *port_enables[port] |= mask;
+  PCIFR = _BV(port); // forget changes from before
+  PCICR |= _BV(port);
+  interrupts();
+}
+
+void pinChangeCounterStop(int8_t counter) {
+  uint8_t port, mask;
+  
+  if (counter < 0 || counter >= counters_used) {
+    return; // never attached (see pinChangeCounterAttach)
+  }
+  
+  port = counter_ports[counter];
+  mask = _BV(counter_bits[counter]);
+  
+  noInterrupts();
+  counted_masks[port] &= ~mask;
+  *port_enables[port] &= ~mask;
+  
+  if (*port_enables[port] == 0) {
+    PCICR &= ~_BV(port);
+  }
+  interrupts();
+}
+
+unsigned short pinChangeCounterRead(int8_t counter) {
+  unsigned short count;
+  
+  if (counter < 0 || counter >= counters_used) {
+    return 0;
+  }
+  
+  noInterrupts();
+  count = counts[counter];
+  interrupts();
+  
+  return count;
+}
+
+void pinChangeCounterInject(int8_t counter) {
+  if (counter < 0 || counter >= counters_used) {
+    return;
+  }
+  
+  noInterrupts();
+  counts[counter]++;
+  interrupts();
+}
+
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+void pinChangeCounterDiagnose(int8_t counter, FlowDiagnostics* diagnostics) {
+  if (counter < 0 || counter >= counters_used) {
+    return;
+  }
+  
+  noInterrupts();
+  counter_diagnostics[counter] = diagnostics;
+  interrupts();
+}
+#endif
+
+#endif // #ifdef SETTINGS_FLOW_PCINT
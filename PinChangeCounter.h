@@ -0,0 +1,75 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_PIN_CHANGE_COUNTER_H
+#define POURLOGIC_PIN_CHANGE_COUNTER_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "pin_config.h"
+#include "FlowDiagnostics.h"
+
+/*! \file PinChangeCounter.h
+ * \brief Counting rising edges on any pins with pin-change interrupts.
+ *
+ * An Uno has only two external interrupts (pins 2 and 3), and
+ * attachInterrupt() dispatches through a function pointer on each edge.
+ * Pin-change interrupts are available on every pin, one vector per port
+ * (PCINT0: port B, PCINT1: port C, PCINT2: port D on the ATmega328P),
+ * and fire on any change of any enabled pin on the port.
+ *
+ * The handler for a port reads the port once and finds the pins that
+ * rose since the last change with a couple of bitwise operations:
+ *
+ * <pre>
+ *   rising = now & ~last & counted
+ * </pre>
+ *
+ * then increments the counter for each bit set. Its cost is bounded by
+ * the port width no matter how many counters are on the port, so one
+ * board can meter six or more taps. A pulse shorter than the handler's
+ * latency (a few microseconds) may be missed; flow meter pulses are
+ * milliseconds long.
+ *
+ * This module owns the PCINT vectors, so it cannot be used with
+ * SoftwareSerial (which claims them all); the vectors still wake the
+ * controller from sleep (see Sleep.h).
+ */
+
+#ifdef SETTINGS_FLOW_PCINT
+
+#ifdef RFID_USE_SOFTWARE_SERIAL
+#error "SoftwareSerial claims the pin-change interrupts SETTINGS_FLOW_PCINT needs"
+#endif
+
+#define PIN_CHANGE_MAX_COUNTERS 8 //!< Pins that can be counted
+
+/*! \brief Reserve a counter for rising edges on a pin; returns the counter, or -1 if none are left.
+ * The functions below do nothing with -1 (and read it as zero).
+ */
+int8_t pinChangeCounterAttach(uint8_t pin);
+
+/*! \brief Zero a counter and start counting.
+ */
+void pinChangeCounterStart(int8_t counter);
+
+/*! \brief Stop counting (the count is kept).
+ */
+void pinChangeCounterStop(int8_t counter);
+
+/*! \brief The count so far.
+ */
+unsigned short pinChangeCounterRead(int8_t counter);
+
+/*! \brief Count an edge that didn't come from the pin (e.g. a replayed trace).
+ */
+void pinChangeCounterInject(int8_t counter);
+
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+/*! \brief Time each edge a counter counts from its pin (see FlowDiagnostics.h); NULL to stop.
+ */
+void pinChangeCounterDiagnose(int8_t counter, FlowDiagnostics* diagnostics);
+#endif
+
+#endif // #ifdef SETTINGS_FLOW_PCINT
+
+#endif // #ifndef POURLOGIC_PIN_CHANGE_COUNTER_H
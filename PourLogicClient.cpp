@@ -1,53 +1,90 @@
 // See LICENSE.txt for license details.
 
 #include "PourLogicClient.h"
+#include "Clock.h"
 #include "StreamUtil.h"
 #include "HexString.h"
 #include "HTTPUtil.h"
+#include "Metrics.h"
+#include "Checkpoint.h"
 
-#define MAX_LINE_SIZE 256 //!< Length limit to an HTTP line (in bytes)
-static const char HTTP_ENDLINE[] = "\r\n";
-static const char HTTP_STATUS_OK[] = "200";
-static char line_buffer[MAX_LINE_SIZE];
 
 PourLogicClient::PourLogicClient(unsigned long api_id, const char* api_private_key)
-  : __id(api_id)
+  : __id(api_id), _last_failure(STAGE_SOCKET)
 {
-  // Initialize timeout
-  setTimeout(2000);
+  IPAddress server_ips[SETTINGS_SERVER_COUNT] = SETTINGS_SERVER_IPS;
+  uint16_t server_ports[SETTINGS_SERVER_COUNT] = SETTINGS_SERVER_PORTS;
+  
+  for (int i = 0; i < SETTINGS_SERVER_COUNT; i++) {
+    _servers.add(server_ips[i], server_ports[i]);
+  }
+
+  // No queued results
+  for (int i = 0; i < CLIENT_MAX_PENDING_RESULTS; i++) {
+    _results[i].queued = false;
+    _results[i].handle = -1;
+  }
+  
+#ifdef SETTINGS_CIRCUIT_BREAKER
+  _probe = -1;
+#endif
   
   // Initialize nonce
   _nonce.begin();
+#ifdef SETTINGS_NONCE_WINDOW
+  memset(_in_flight, 0, sizeof(_in_flight));
+  _nonce_floor = 0;
+#endif
   
   // Initialize key for use with HMAC
-  Sha1.init();
-  Sha1.print(api_private_key);
-  memcpy(_effective_key, Sha1.result(), _keySize());
+  CLIENT_HMAC.init();
+  CLIENT_HMAC.print(api_private_key);
+  memcpy(_effective_key, CLIENT_HMAC.result(), _keySize());
 }
 
 PourLogicClient::~PourLogicClient() {
-  stop();
+  shutdown();
 }
 
-unsigned long PourLogicClient::_printXPourLogicAuthHeader(Print& target) {
+unsigned long PourLogicClient::_printXPourLogicAuthHeader(Print& target, unsigned long nonce) {
   unsigned long bytes_sent = 0;
 
   bytes_sent += target.print(F(CLIENT_AUTH_HEADER_NAME ": "));
   bytes_sent += target.print(_id());
   bytes_sent += target.print(F(":"));
-  bytes_sent += target.print(_nonce.count());
+  bytes_sent += _printNoncePosition(target, nonce);
   bytes_sent += target.print(F(":"));
-  bytes_sent += target.print(bytesToHexString(Sha1.resultHmac(), _keySize()));
+  bytes_sent += target.print(bytesToHexString(CLIENT_HMAC.resultHmac(), _keySize()));
   bytes_sent += printHTTPEndline(target);
   
   return bytes_sent;
 }
 
-unsigned long PourLogicClient::_printPourRequestStatusLine(Print &target, String const& rfid) {
+/*! The nonce as signed and sent: NONCE, or with #SETTINGS_NONCE_WINDOW,
+ * STREAM:NONCE:FLOOR where FLOOR is the oldest nonce still in flight
+ * (see #_initializeAuth).
+ */
+unsigned long PourLogicClient::_printNoncePosition(Print& target, unsigned long nonce) {
+  unsigned long bytes_sent = 0;
+  
+#ifdef SETTINGS_NONCE_WINDOW
+  bytes_sent += target.print(SETTINGS_NONCE_STREAM);
+  bytes_sent += target.print(F(":"));
+  bytes_sent += target.print(nonce);
+  bytes_sent += target.print(F(":"));
+  bytes_sent += target.print(_nonce_floor);
+#else
+  bytes_sent += target.print(nonce);
+#endif
+  
+  return bytes_sent;
+}
+
+unsigned long PourLogicClient::_printPourRequestStatusLine(Print &target, const char* rfid) {
   unsigned long bytes_sent = 0;
 
   bytes_sent += printStatusLineHeadGet(target);
-  bytes_sent += target.print(SERVER_POUR_REQUEST_URI "?" CLIENT_POUR_REQUEST_PARAM_RFID "=");
+  bytes_sent += target.print(F(SERVER_POUR_REQUEST_URI "?" CLIENT_POUR_REQUEST_PARAM_RFID "="));
   bytes_sent += target.print(rfid); // TODO obfuscate rfid?
   bytes_sent += printStatusLineTail(target);
   //bytes_sent += printHTTPEndline(target);
@@ -59,30 +96,90 @@ unsigned long PourLogicClient::_printPourResultStatusLine(Print& target) {
   unsigned long bytes_sent = 0;
   
   bytes_sent += printStatusLineHeadPost(target);
-  bytes_sent += target.print(SERVER_POUR_RESULT_URI);
+  bytes_sent += target.print(F(SERVER_POUR_RESULT_URI));
   bytes_sent += printStatusLineTail(target);
   //bytes_sent += printHTTPEndline(target);
   
   return bytes_sent;
 }
 
-unsigned long PourLogicClient::_printPourResultMessageBody(Print &target, String const& rfid, float volume_in_mL) {
+unsigned long PourLogicClient::_printPourResultMessageBody(Print &target, PendingResult const& result) {
+  unsigned long bytes_sent = 0;
+  
+  bytes_sent += target.print(F(CLIENT_POUR_RESULT_PARAM_RFID "="));
+  bytes_sent += target.print(result.tag);
+  bytes_sent += target.print(F("&" CLIENT_POUR_RESULT_PARAM_VOLUME "="));
+  bytes_sent += target.print(reportedVolume_mL(result.volume_uL)); // integer mL (no float printing)
+#ifdef SETTINGS_IDEMPOTENT_RESULTS
+  bytes_sent += target.print(F("&" CLIENT_POUR_RESULT_PARAM_KEY "="));
+  bytes_sent += target.print(_id());
+  bytes_sent += target.print('-');
+  bytes_sent += target.print(result.key);
+#endif
+  
+  return bytes_sent;
+}
+
+#ifdef SETTINGS_TAG_FILTER
+unsigned long PourLogicClient::_printTagFilterStatusLine(Print &target, TagFilter& filter) {
   unsigned long bytes_sent = 0;
+
+  bytes_sent += printStatusLineHeadGet(target);
+  bytes_sent += target.print(F(SERVER_TAG_FILTER_URI "?" CLIENT_TAG_FILTER_PARAM_BYTES "="));
+  bytes_sent += target.print(TAG_FILTER_MAX_BYTES);
+  bytes_sent += target.print(F("&" CLIENT_TAG_FILTER_PARAM_FP "="));
+  bytes_sent += target.print(SETTINGS_TAG_FILTER_FP_PERMILLE);
+  bytes_sent += target.print(F("&" CLIENT_TAG_FILTER_PARAM_VERSION "="));
+  bytes_sent += target.print(filter.version());
+  bytes_sent += target.print(F("&" CLIENT_TAG_FILTER_PARAM_TARGET "="));
+  bytes_sent += target.print(filter.syncTarget());
+  bytes_sent += target.print(F("&" CLIENT_TAG_FILTER_PARAM_APPLIED "="));
+  bytes_sent += target.print(filter.syncApplied());
+  bytes_sent += target.print(F("&" CLIENT_TAG_FILTER_PARAM_CHUNK "="));
+  bytes_sent += target.print(CLIENT_TAG_FILTER_CHUNK);
+  bytes_sent += printStatusLineTail(target);
   
-  bytes_sent += target.print(CLIENT_POUR_RESULT_PARAM_RFID "=");
-  bytes_sent += target.print(rfid);
-  bytes_sent += target.print("&" CLIENT_POUR_RESULT_PARAM_VOLUME "=");
-  bytes_sent += target.print(volume_in_mL);
+  return bytes_sent;
+}
+#endif
+
+#ifdef SETTINGS_PATRON_TABLE
+unsigned long PourLogicClient::_printPatronTableStatusLine(Print &target, PatronTable& table) {
+  unsigned long bytes_sent = 0;
+
+  bytes_sent += printStatusLineHeadGet(target);
+  bytes_sent += target.print(F(SERVER_PATRON_TABLE_URI "?" CLIENT_PATRON_TABLE_PARAM_INDEX "="));
+  bytes_sent += target.print(PATRON_TABLE_INDEX_BLOCKS);
+  bytes_sent += target.print(F("&" CLIENT_PATRON_TABLE_PARAM_VERSION "="));
+  bytes_sent += target.print(table.version());
+  bytes_sent += target.print(F("&" CLIENT_PATRON_TABLE_PARAM_TARGET "="));
+  bytes_sent += target.print(table.syncTarget());
+  bytes_sent += target.print(F("&" CLIENT_PATRON_TABLE_PARAM_APPLIED "="));
+  bytes_sent += target.print(table.syncApplied());
+  bytes_sent += printStatusLineTail(target);
   
   return bytes_sent;
 }
+#endif
 
-void PourLogicClient::_initializeAuth() {
+unsigned long PourLogicClient::_initializeAuth() {
   // Initialize OTP for this request
   // .. increment counter
   _nonce.increment();
+#ifdef SETTINGS_NONCE_WINDOW
+  // .. the window starts at the oldest request still in flight (or this one)
+  _nonce_floor = _nonce.count();
+  for (int handle = 0; handle < ENGINE_MAX_REQUESTS; handle++) {
+    if (_in_flight[handle] != 0 && _in_flight[handle] < _nonce_floor) {
+      _nonce_floor = _in_flight[handle];
+    }
+  }
+#endif
   // .. initialize Sha*
-  Sha1.initHmac(_key(), _keySize());
+  CLIENT_HMAC.initHmac(_key(), _keySize());
+  
+  metrics.setNonce(_nonce.count());
+  return _nonce.count();
 }
 
 /*! A pour request is an HTTP GET request with the following parameters:
@@ -105,30 +202,30 @@ void PourLogicClient::_initializeAuth() {
  * MESSAGE BODY may be empty. If it is empty, then REQUEST LINE should
  * still end in a newline.
  */
-boolean PourLogicClient::_sendPourRequest(String const &tagData) {
+boolean PourLogicClient::_sendPourRequest(Print &target, const char* tag_data, unsigned long &nonce) {
   // Initialize HMAC
-  _initializeAuth();
+  nonce = _initializeAuth();
   
   // -- Feed HMAC digest --
-  Sha1.print(_nonce.count());                 // NONCE\n
-  Sha1.print('\n');
-  _printPourRequestStatusLine(Sha1, tagData); // REQUEST LINE\n
-  Sha1.print('\n');
-                                                // empty body
+  _printNoncePosition(CLIENT_HMAC, nonce);            // NONCE\n
+  CLIENT_HMAC.print('\n');
+  _printPourRequestStatusLine(CLIENT_HMAC, tag_data); // REQUEST LINE\n
+  CLIENT_HMAC.print('\n');
+                                               // empty body
   // -- done "Feed HMAC digest"
   
   // -- Send request to server --
   
   // Status/Request line
-  _printPourRequestStatusLine(*this, tagData);
-  printHTTPEndline(*this);
+  _printPourRequestStatusLine(target, tag_data);
+  printHTTPEndline(target);
   
   // HTTP headers
-  printHostHeader(*this);
-  printUserAgentHeader(*this);
-  printContentLengthHeader(*this, 0);
-  _printXPourLogicAuthHeader(*this);
-  printHTTPEndline(*this);
+  printHostHeader(target);
+  printUserAgentHeader(target);
+  printContentLengthHeader(target, 0);
+  _printXPourLogicAuthHeader(target, nonce);
+  printHTTPEndline(target);
   
   // Message Body
   // .. empty
@@ -140,7 +237,7 @@ boolean PourLogicClient::_sendPourRequest(String const &tagData) {
 
 /*! A pour result is an HTTP POST request with the following parameters:
  *   - user's RFID tag data (u)
- *   - the volume of the pour (v)
+ *   - the volume of the pour (v), as an integer number of millilitres
  *
  * The HTTP request must also include the X-Pourlogic-Auth header in the
  * following format:
@@ -160,40 +257,110 @@ boolean PourLogicClient::_sendPourRequest(String const &tagData) {
  * still end in a newline.
  *
  */
-boolean PourLogicClient::_sendPourResult(String const &tag_data, float pour_volume) {
+boolean PourLogicClient::_sendPourResult(Print &target, PendingResult const& result, unsigned long &nonce) {
   int content_length = 0; // Required for POST request
   
   // Initialize HMAC
-  _initializeAuth();
+  nonce = _initializeAuth();
   
   // -- Feed HMAC digest --
-  Sha1.print(_nonce.count());
-  Sha1.print('\n');
-  _printPourResultStatusLine(Sha1);
-  Sha1.print('\n');
-  content_length += _printPourResultMessageBody(Sha1, tag_data, pour_volume);
+  _printNoncePosition(CLIENT_HMAC, nonce);
+  CLIENT_HMAC.print('\n');
+  _printPourResultStatusLine(CLIENT_HMAC);
+  CLIENT_HMAC.print('\n');
+  content_length += _printPourResultMessageBody(CLIENT_HMAC, result);
   // -- done HMAC
   
   // Send request to server --
   // Status/Request line
-  _printPourResultStatusLine(*this);
-  printHTTPEndline(*this);
+  _printPourResultStatusLine(target);
+  printHTTPEndline(target);
   
   // HTTP headers
-  printHostHeader(*this);
-  printUserAgentHeader(*this);
-  _printXPourLogicAuthHeader(*this);
-  printContentLengthHeader(*this, content_length);
-  printHTTPEndline(*this);
+  printHostHeader(target);
+  printUserAgentHeader(target);
+  _printXPourLogicAuthHeader(target, nonce);
+  printContentLengthHeader(target, content_length);
+  printHTTPEndline(target);
   
   // Message Body
-  _printPourResultMessageBody(*this, tag_data, pour_volume);
+  _printPourResultMessageBody(target, result);
   
   // -- done sending request
   
   return true;
 } 
 
+#ifdef SETTINGS_TAG_FILTER
+/*! A tag filter request is an HTTP GET request with the following parameters:
+ *   - the most bytes the filter can take (b)
+ *   - the false-positive rate to size it for, per thousand (p)
+ *   - the version of the filter held, or 0 (v)
+ *   - the version being synced to, or 0 (s)
+ *   - the entries of that delta applied so far (o)
+ *   - the most entries to send (n)
+ *
+ * and the X-Pourlogic-Auth header, as for a pour request.
+ */
+boolean PourLogicClient::_sendTagFilterRequest(Print &target, TagFilter& filter, unsigned long &nonce) {
+  // Initialize HMAC
+  nonce = _initializeAuth();
+  
+  // -- Feed HMAC digest --
+  _printNoncePosition(CLIENT_HMAC, nonce);
+  CLIENT_HMAC.print('\n');
+  _printTagFilterStatusLine(CLIENT_HMAC, filter);
+  CLIENT_HMAC.print('\n');
+  // -- done HMAC
+  
+  // Send request to server --
+  _printTagFilterStatusLine(target, filter);
+  printHTTPEndline(target);
+  
+  printHostHeader(target);
+  printUserAgentHeader(target);
+  printContentLengthHeader(target, 0);
+  _printXPourLogicAuthHeader(target, nonce);
+  printHTTPEndline(target);
+  
+  return true;
+}
+#endif
+
+#ifdef SETTINGS_PATRON_TABLE
+/*! A patron table request is an HTTP GET request with the following parameters:
+ *   - the most index blocks the table can have (i)
+ *   - the version of the table held, or 0 (v)
+ *   - the version being synced to, or 0 (s)
+ *   - the blocks of that delta applied so far (o)
+ *
+ * and the X-Pourlogic-Auth header, as for a pour request.
+ */
+boolean PourLogicClient::_sendPatronTableRequest(Print &target, PatronTable& table, unsigned long &nonce) {
+  // Initialize HMAC
+  nonce = _initializeAuth();
+  
+  // -- Feed HMAC digest --
+  _printNoncePosition(CLIENT_HMAC, nonce);
+  CLIENT_HMAC.print('\n');
+  _printPatronTableStatusLine(CLIENT_HMAC, table);
+  CLIENT_HMAC.print('\n');
+  // -- done HMAC
+  
+  // Send request to server --
+  _printPatronTableStatusLine(target, table);
+  printHTTPEndline(target);
+  
+  printHostHeader(target);
+  printUserAgentHeader(target);
+  printContentLengthHeader(target, 0);
+  _printXPourLogicAuthHeader(target, nonce);
+  printHTTPEndline(target);
+  
+  return true;
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 
 /*! A pour request response includes a body in the following format:
@@ -214,38 +381,42 @@ boolean PourLogicClient::_sendPourResult(String const &tag_data, float pour_volu
  *   RESPONSE BODY
  * </pre>
  */
-boolean PourLogicClient::_getPourRequestResponse(int& max_volume_mL)
+boolean PourLogicClient::_getPourRequestResponse(Stream &response, unsigned long nonce, int& max_volume_mL, CLIENT_HMAC_CLASS const* prepared)
 { 
   String message_hmac;
-  char our_hmac[65];
   max_volume_mL = 0;
-  our_hmac[64]='\0';
   
   // Handle status line
-  if (!_checkResponseStatusLine(HTTP_STATUS_OK)) {
+  if (!_checkResponseStatusLine(response, HTTP_STATUS_OK)) {
+    _recordFailure(STAGE_STATUS);
     return false;
   }
   
   // Read headers
-  if (!_parseResponseHeaders(message_hmac)) {
+  if (!_parseResponseHeaders(response, message_hmac)) {
+    _recordFailure(STAGE_STATUS);
     return false;
   }
   
   // Read message body
   // .. maxVolume
-  max_volume_mL = parseInt();
+  max_volume_mL = response.parseInt();
 
   // Verify HMAC (server should have same count as us)
-  Sha1.initHmac(_key(), _keySize());
-  Sha1.print(_nonce.count()); // nonce
-  Sha1.print('\n');
-  Sha1.print(HTTP_STATUS_OK); // HTTP status
-  Sha1.print('\n');
-  Sha1.print(max_volume_mL); // message body
-  
-  bytesToHexString(our_hmac, Sha1.resultHmac(), _keySize());
+  if (prepared != NULL) {
+    CLIENT_HMAC = *prepared; // nonce and status, hashed while we waited
+  }
+  else {
+    _prepareResponseMac(nonce);
+  }
+  CLIENT_HMAC.print(max_volume_mL); // message body
  
-  return message_hmac.equalsIgnoreCase(our_hmac);
+  if (!_checkResponseMac(message_hmac, CLIENT_HMAC.resultHmac())) {
+    _recordFailure(STAGE_AUTH);
+    return false;
+  }
+  
+  return true;
 }
 
 /*! A pour result response verifies that the pour was recorded by responding
@@ -262,32 +433,335 @@ boolean PourLogicClient::_getPourRequestResponse(int& max_volume_mL)
  *   RESPONSE BODY
  * </pre>
  */
-boolean PourLogicClient::_getPourResultResponse()
+boolean PourLogicClient::_getPourResultResponse(Stream &response, const byte* expected_mac)
 { 
   String messageHmac;
   
   // Handle status line
-  if (!_checkResponseStatusLine(HTTP_STATUS_OK)) {
+  if (!_checkResponseStatusLine(response, HTTP_STATUS_OK)) {
+    _recordFailure(STAGE_STATUS);
     return false;
   }
 	
   // Read headers
-  if (!_parseResponseHeaders(messageHmac)) {
+  if (!_parseResponseHeaders(response, messageHmac)) {
+    _recordFailure(STAGE_STATUS);
     return false;
   }
 
   // Read message body
   //   (empty)
 	
-  // Verify HMAC (server should have same count as us)
-  Sha1.initHmac(_key(), _keySize());
-  Sha1.print(_nonce.count()); // nonce
-  Sha1.print('\n');
-  Sha1.print(HTTP_STATUS_OK); // HTTP status
-  Sha1.print('\n');
-  // empty message body
+  // Verify HMAC (server should have same count as us; worked out when the result was sent)
+  if (!_checkResponseMac(messageHmac, expected_mac)) {
+    _recordFailure(STAGE_AUTH);
+    return false;
+  }
+  
+  return true;
+}
 
-  return bytesToHexString(Sha1.resultHmac(), _keySize()).equalsIgnoreCase(messageHmac);
+#ifdef SETTINGS_TAG_FILTER
+/*! A tag filter response is a chunk of a delta, with a body in the following format:
+ *  <pre>
+ *    BASE TARGET HASHES BITS OFFSET COUNT TOTAL DIGEST\n
+ *    ENTRIES
+ *  </pre>
+ *
+ * The delta takes the filter from version BASE (0: from an empty
+ * filter) to version TARGET, a filter of HASHES (k) and BITS (m) (see
+ * TagFilter.h). It has TOTAL entries, in order of the byte they change;
+ * this chunk has COUNT of them from entry OFFSET. Each entry is four
+ * hexadecimal digits of the byte's index and two of its new value, with
+ * nothing between entries. DIGEST is the hash (SHA-1, or SHA-256 with
+ * #SETTINGS_AUTH_SHA256) of the filter's (m+7)/8 bytes at TARGET, in
+ * hexadecimal. The other fields are integers in ASCII representation.
+ * The response is signed as any other (see #_getPourRequestResponse).
+ *
+ * The server continues the delta the request says is under way (if it
+ * still can; otherwise it starts again from 0), or starts one from the
+ * version held to its latest. Entries are written to EEPROM as they
+ * are read, so a chunk needn't fit in SRAM, and the chunks applied are
+ * only counted once the HMAC checks out. After the last chunk the
+ * filter is hashed and must match DIGEST, which also catches anything
+ * an earlier chunk, cut short, left behind.
+ */
+boolean PourLogicClient::_getTagFilterResponse(Stream &response, unsigned long nonce, TagFilter& filter)
+{
+  String message_hmac;
+  long base, target, hashes, bits, offset, count, total;
+  byte digest[CLIENT_HASH_LENGTH];
+  
+  if (!_checkResponseStatusLine(response, HTTP_STATUS_OK)) {
+    _recordFailure(STAGE_STATUS);
+    return false;
+  }
+  
+  if (!_parseResponseHeaders(response, message_hmac)) {
+    _recordFailure(STAGE_STATUS);
+    return false;
+  }
+  
+  // Read message body
+  // .. which delta, and which part of it
+  base = response.parseInt();
+  target = response.parseInt();
+  hashes = response.parseInt();
+  bits = response.parseInt();
+  offset = response.parseInt();
+  count = response.parseInt();
+  total = response.parseInt();
+  if (response.read() != ' ' || base < 0 || target <= 0 || hashes <= 0 || hashes > 0xFF || bits <= 0 || bits > 0xFFFF
+      || offset < 0 || count < 0 || count > CLIENT_TAG_FILTER_CHUNK || total > 0xFFFF || offset + count > total) {
+    _recordFailure(STAGE_STATUS);
+    return false;
+  }
+  
+  _prepareResponseMac(nonce);
+  CLIENT_HMAC.print(base);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(target);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(hashes);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(bits);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(offset);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(count);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(total);
+  CLIENT_HMAC.print(' ');
+  
+  // .. the filter it makes
+  for (uint8_t i = 0; i < CLIENT_HASH_LENGTH; i++) {
+    int high = response.read();
+    int low = response.read();
+    
+    if (hexDigitValue(high) < 0 || hexDigitValue(low) < 0) {
+      _recordFailure(STAGE_STATUS);
+      return false;
+    }
+    
+    CLIENT_HMAC.write(high);
+    CLIENT_HMAC.write(low);
+    digest[i] = hexDigitValue(high) << 4 | hexDigitValue(low);
+  }
+  if (response.read() != '\n') {
+    _recordFailure(STAGE_STATUS);
+    return false;
+  }
+  CLIENT_HMAC.print('\n');
+  
+  // .. where it fits: a delta starts at its first entry, and goes on where the last chunk left off
+  if (offset == 0 ? !filter.beginSync(base, target, hashes, bits)
+                  : (unsigned long) base != filter.version() || (unsigned long) target != filter.syncTarget() || offset != filter.syncApplied()) {
+    filter.abandonSync(); // we don't agree on what we have; start over
+    _recordFailure(STAGE_STATUS);
+    return false;
+  }
+  
+  // .. its entries, straight to EEPROM
+  for (long i = 0; i < count; i++) {
+    unsigned int index = 0;
+    uint8_t value = 0;
+    
+    for (uint8_t d = 0; d < 6; d++) {
+      int c = response.read();
+      
+      if (hexDigitValue(c) < 0) {
+        _recordFailure(STAGE_STATUS);
+        return false; // cut short; carries on from this chunk next time
+      }
+      
+      CLIENT_HMAC.write(c);
+      if (d < 4) {
+        index = index << 4 | hexDigitValue(c);
+      }
+      else {
+        value = value << 4 | hexDigitValue(c);
+      }
+    }
+    
+    filter.update(index, value);
+  }
+  
+  if (!_checkResponseMac(message_hmac, CLIENT_HMAC.resultHmac())) {
+    filter.abandonSync(); // whatever it wrote can't be trusted
+    _recordFailure(STAGE_AUTH);
+    return false;
+  }
+  
+  filter.advanceSync(offset + count);
+  if (offset + count < total) {
+    return true; // more to come
+  }
+  
+  // Complete; is it the filter the server made?
+  CLIENT_HMAC.init();
+  filter.writeTo(CLIENT_HMAC);
+  if (memcmp(CLIENT_HMAC.result(), digest, CLIENT_HASH_LENGTH) != 0) {
+    filter.abandonSync();
+    _recordFailure(STAGE_AUTH);
+    return false;
+  }
+  
+  filter.finishSync();
+  return true;
+}
+#endif
+
+#ifdef SETTINGS_PATRON_TABLE
+/*! A patron table response is a chunk of a delta, with a body in the following format:
+ *  <pre>
+ *    BASE TARGET INDEX DATA OFFSET COUNT TOTAL\n
+ *    BLOCKS
+ *  </pre>
+ *
+ * The delta takes the table from version BASE (0: from nothing) to
+ * version TARGET, which has INDEX index blocks and DATA data blocks (see
+ * PatronTable.h). It has TOTAL blocks, in order; this chunk has COUNT of
+ * them (at most #CLIENT_PATRON_TABLE_CHUNK) from block OFFSET. Each block
+ * is four hexadecimal digits of its number, counting from the first
+ * index block (data blocks start at #PATRON_TABLE_INDEX_BLOCKS), then
+ * the 512 bytes of the block in hexadecimal, with nothing between
+ * blocks. The other fields are integers in ASCII representation. The
+ * response is signed as any other (see #_getPourRequestResponse).
+ *
+ * As for the tag filter (see #_getTagFilterResponse), the server carries
+ * on with the delta the request says is under way, if it can, each block
+ * is written to the card once read, and the blocks applied are only
+ * counted once the HMAC checks out. There is no digest of the whole
+ * table, as patrons' allowances change on the card between syncs (see
+ * PatronTable#debit). A response cut short before any of its blocks
+ * reaches the card is sent again when the sync carries on; once one has
+ * (PatronTable#blockBuffer), only the HMAC could vouch for it, so the
+ * sync starts over from nothing (see PatronTable.h).
+ */
+boolean PourLogicClient::_getPatronTableResponse(Stream &response, unsigned long nonce, PatronTable& table)
+{
+  String message_hmac;
+  long base, target, index_blocks, data_blocks, offset, count, total;
+  boolean intact = true; // the chunk's blocks were all read and written
+  
+  if (!_checkResponseStatusLine(response, HTTP_STATUS_OK)) {
+    _recordFailure(STAGE_STATUS);
+    return false;
+  }
+  
+  if (!_parseResponseHeaders(response, message_hmac)) {
+    _recordFailure(STAGE_STATUS);
+    return false;
+  }
+  
+  // Read message body
+  // .. which delta, and which part of it
+  base = response.parseInt();
+  target = response.parseInt();
+  index_blocks = response.parseInt();
+  data_blocks = response.parseInt();
+  offset = response.parseInt();
+  count = response.parseInt();
+  total = response.parseInt();
+  if (response.read() != '\n' || base < 0 || target <= 0 || index_blocks < 0 || index_blocks > 0xFF || data_blocks < 0 || data_blocks > 0xFFFF
+      || offset < 0 || count < 0 || count > CLIENT_PATRON_TABLE_CHUNK || total > 0xFFFF || offset + count > total) {
+    _recordFailure(STAGE_STATUS);
+    return false;
+  }
+  
+  _prepareResponseMac(nonce);
+  CLIENT_HMAC.print(base);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(target);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(index_blocks);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(data_blocks);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(offset);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(count);
+  CLIENT_HMAC.print(' ');
+  CLIENT_HMAC.print(total);
+  CLIENT_HMAC.print('\n');
+  
+  // .. where it fits: a delta starts at its first block, and goes on where the last chunk left off
+  if (offset == 0 ? !table.beginSync(base, target, index_blocks, data_blocks)
+                  : (unsigned long) base != table.version() || (unsigned long) target != table.syncTarget() || offset != table.syncApplied()) {
+    table.abandonSync(); // we don't agree on what we have; start over
+    _recordFailure(STAGE_STATUS);
+    return false;
+  }
+  
+  // .. its blocks, straight to the card
+  for (long i = 0; i < count && intact; i++) {
+    unsigned int block = 0;
+    uint8_t* buffer = NULL;
+    
+    for (uint8_t d = 0; d < 4 && intact; d++) {
+      int c = response.read();
+      
+      intact = hexDigitValue(c) >= 0;
+      CLIENT_HMAC.write(c);
+      block = block << 4 | hexDigitValue(c);
+    }
+    
+    if (!intact || (buffer = table.blockBuffer()) == NULL) {
+      intact = false;
+      break;
+    }
+    
+    for (unsigned int b = 0; b < PATRON_TABLE_BLOCK_SIZE && intact; b++) {
+      int high = response.read();
+      int low = response.read();
+      
+      intact = hexDigitValue(high) >= 0 && hexDigitValue(low) >= 0;
+      CLIENT_HMAC.write(high);
+      CLIENT_HMAC.write(low);
+      buffer[b] = hexDigitValue(high) << 4 | hexDigitValue(low);
+    }
+    
+    intact = intact && table.writeBlock(block);
+  }
+  
+  if (!intact) {
+    if (table.unverified()) {
+      table.abandonSync(); // a block is (or may be) on the card that nothing vouches for
+    }
+    _recordFailure(STAGE_STATUS);
+    return false; // cut short; if nothing was written, carries on from this chunk next time
+  }
+  
+  if (!_checkResponseMac(message_hmac, CLIENT_HMAC.resultHmac())) {
+    table.abandonSync(); // whatever it wrote can't be trusted
+    _recordFailure(STAGE_AUTH);
+    return false;
+  }
+  
+  if (!table.advanceSync(offset + count)) {
+    _recordFailure(STAGE_STATUS);
+    return false;
+  }
+  
+  return offset + count < total || table.finishSync();
+}
+#endif
+
+void PourLogicClient::_prepareResponseMac(unsigned long nonce) {
+  CLIENT_HMAC.initHmac(_key(), _keySize());
+  CLIENT_HMAC.print(nonce); // nonce
+  CLIENT_HMAC.print('\n');
+  CLIENT_HMAC.print(HTTP_STATUS_OK); // HTTP status
+  CLIENT_HMAC.print('\n');
+}
+
+boolean PourLogicClient::_checkResponseMac(String const& hmac, const byte* expected) {
+  byte received[CLIENT_HASH_LENGTH];
+  int length;
+  
+  return hexStringToBytes(hmac, received, length, CLIENT_HASH_LENGTH)
+      && length == CLIENT_HASH_LENGTH
+      && memcmp(received, expected, CLIENT_HASH_LENGTH) == 0;
 }
 
 /*!
@@ -310,67 +784,611 @@ boolean PourLogicClient::_parseXPourLogicAuthHeader(String const &line, String &
   return (hmac_result.length() == 2*_keySize());
 }
 
-boolean PourLogicClient::_checkResponseStatusLine(const char* expected_status) {
+boolean PourLogicClient::_checkResponseStatusLine(Stream &response, const char* expected_status) {
   // Read status line
-  if (!readHTTPLine(*this, MAX_LINE_SIZE, line_buffer)) {
+  if (!readHTTPLine(response, CLIENT_MAX_LINE_SIZE, _line_buffer)) {
     return false; // Could not read status line
   }
   
-  return (NULL != strstr(line_buffer, expected_status));
+  return (NULL != strstr(_line_buffer, expected_status));
 }
 
-boolean PourLogicClient::_parseResponseHeaders(String &hmac) {
+boolean PourLogicClient::_parseResponseHeaders(Stream &response, String &hmac) {
   
   for(;;) {
     // Read the next HTTP line
-    line_buffer[0] = '\0';
-    if (!readHTTPLine(*this, MAX_LINE_SIZE, line_buffer)) {
+    _line_buffer[0] = '\0';
+    if (!readHTTPLine(response, CLIENT_MAX_LINE_SIZE, _line_buffer)) {
       return false;
     }
 
     // Check headers
     // .. quit on empty line (i.e. \r\n)
     //if (line.startsWith(HTTP_ENDLINE)) {
-    if (strstr(line_buffer, HTTP_ENDLINE) == line_buffer) { // TODO strBeginWith()?
+    if (strstr(_line_buffer, HTTP_ENDLINE) == _line_buffer) { // TODO strBeginWith()?
       break;
     }
       
     // .. grab the response id, HMAC, and count
-    if (strstr(line_buffer, CLIENT_AUTH_HEADER_NAME) == line_buffer) {
-      _parseXPourLogicAuthHeader(line_buffer, hmac);
+    if (strstr(_line_buffer, CLIENT_AUTH_HEADER_NAME) == _line_buffer) {
+      _parseXPourLogicAuthHeader(_line_buffer, hmac);
+    }
+  }
+  
+  return true;
+}
+
+void PourLogicClient::_sent(int handle, unsigned long nonce) {
+#ifdef SETTINGS_NONCE_WINDOW
+  _in_flight[handle] = nonce;
+#endif
+  _engine.sent(handle);
+}
+
+void PourLogicClient::_release(int handle) {
+#ifdef SETTINGS_NONCE_WINDOW
+  _in_flight[handle] = 0;
+#endif
+  _engine.release(handle);
+}
+
+int PourLogicClient::_open(int avoid, unsigned long max_response_ms) {
+  int server = _servers.pick(avoid);
+  int handle = -1;
+  unsigned long response_ms = 0;
+  
+  if (server < 0) {
+    return -1;
+  }
+  
+  response_ms = _servers.responseTimeout(server);
+  if (max_response_ms > 0 && response_ms > max_response_ms) {
+    response_ms = max_response_ms;
+  }
+  
+  handle = _engine.open(_servers.ip(server), _servers.port(server), _servers.connectTimeout(server), response_ms);
+  
+  if (handle >= 0) {
+    _server[handle] = server;
+  }
+  
+  return handle;
+}
+
+void PourLogicClient::_recordOutcome(int handle, boolean answered) {
+  if (answered) {
+    _servers.succeeded(_server[handle], _engine.connectTime_ms(handle), _engine.responseTime_ms(handle));
+  }
+  else {
+    _servers.failed(_server[handle]);
+  }
+  
+#ifdef SETTINGS_CIRCUIT_BREAKER
+  // A response, even a bad one, means the server is there
+  if (_engine.state(handle) == RequestEngine::READY) {
+    _breaker.reached();
+  }
+  else {
+    _breaker.failed();
+  }
+#endif
+}
+
+unsigned long PourLogicClient::_hedgeDelay(int server) {
+#ifdef SETTINGS_HEDGE_AUTH
+  unsigned long delay_ms = metrics.authLatencyPercentile(SETTINGS_HEDGE_PERCENTILE);
+  unsigned long timeout_ms = _servers.connectTimeout(server) + _servers.responseTimeout(server);
+  
+  // Nothing to go on (or usually slower than that); hedge halfway to giving up
+  return (delay_ms > 0 && delay_ms < timeout_ms) ? delay_ms : timeout_ms / 2;
+#else
+  return 0;
+#endif
+}
+
+void PourLogicClient::_recordFailure(MetricsStage stage) {
+  _last_failure = stage;
+  metrics.recordFailure(stage);
+}
+
+void PourLogicClient::_recordFailure(int handle) {
+  _recordFailure(_engine.failedIn(handle) == RequestEngine::CONNECTING ? STAGE_CONNECT : STAGE_RESPONSE);
+}
+
+/*! Without #SETTINGS_NONCE_WINDOW the server takes a client's nonces
+ * strictly in order, so one request at a time may carry one: a request
+ * waits (CONNECTED) to be sent while another is AWAITING its answer.
+ */
+boolean PourLogicClient::_maySend() {
+#ifndef SETTINGS_NONCE_WINDOW
+  for (int handle = 0; handle < ENGINE_MAX_REQUESTS; handle++) {
+    if (_engine.state(handle) == RequestEngine::AWAITING) {
+      return false;
     }
   }
+#endif
   
   return true;
 }
 
+boolean PourLogicClient::_foregroundPending() {
+  for (int handle = 0; handle < ENGINE_MAX_REQUESTS; handle++) {
+    RequestEngine::State state = _engine.state(handle);
+    boolean background = false;
+    
+    if (state == RequestEngine::FREE || state == RequestEngine::CLOSING) {
+      continue;
+    }
+#ifdef SETTINGS_CIRCUIT_BREAKER
+    background = handle == _probe;
+#endif
+    for (int i = 0; i < CLIENT_MAX_PENDING_RESULTS && !background; i++) {
+      background = _results[i].queued && _results[i].handle == handle;
+    }
+    
+    if (!background) {
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+/*! Queued pour results each get their own request once a socket is
+ * free. A result that could not connect was never sent, so it cannot be
+ * counted twice: it is kept, and retried after a backoff, on another
+ * server if there is one. A result that fails once sent is dropped, as
+ * before, unless it is keyed (#SETTINGS_IDEMPOTENT_RESULTS): the server
+ * records it once however many times it arrives, so it is retried too.
+ *
+ * Without #SETTINGS_NONCE_WINDOW a result also waits for the sketch's
+ * own request (e.g. a pour request) to finish before it starts, or is
+ * sent if it has already connected, and the sketch's request waits for
+ * a result already sent (see #_maySend): one nonce at a time.
+ */
+void PourLogicClient::_serviceResults() {
+  boolean retry = false;
+  
+  for (int i = 0; i < CLIENT_MAX_PENDING_RESULTS; i++) {
+    PendingResult& result = _results[i];
+    
+    if (!result.queued) {
+      continue;
+    }
+    
+    // Not connecting yet? Try to start.
+    if (result.handle < 0) {
+#ifdef SETTINGS_CIRCUIT_BREAKER
+      if (_breaker.open()) {
+        continue; // wait for a server to be found, rather than fail again
+      }
+#endif
+      // Failed before? Wait a while, longer each time
+      if (result.retries > 0
+          && clockMillis() - result.failed_ms < min(CLIENT_RESULT_BACKOFF_MS << min(result.retries - 1, 6), CLIENT_RESULT_MAX_BACKOFF_MS)) {
+        continue;
+      }
+#ifndef SETTINGS_NONCE_WINDOW
+      if (_foregroundPending()) {
+        continue; // its nonce would overlap the sketch's request
+      }
+#endif
+#ifdef SETTINGS_IDEMPOTENT_RESULTS
+      result.handle = _open(result.server, CLIENT_RESULT_TIMEOUT_MS);
+#else
+      result.handle = _open(result.server);
+#endif
+      continue;
+    }
+    
+    switch (_engine.state(result.handle)) {
+      case RequestEngine::CONNECTED:
+#ifndef SETTINGS_NONCE_WINDOW
+        if (_foregroundPending()) {
+          break;
+        }
+#endif
+        if (!_maySend()) {
+          break;
+        }
+#ifdef SETTINGS_CHECKPOINT
+        pourCheckpoint.sent(result.key); // from here it may be recorded
+#endif
+        _sendPourResult(_engine.request(result.handle), result, result.nonce);
+        _sent(result.handle, result.nonce);
+        
+        // Its answer can only be one thing (the body is empty); work out its HMAC while it travels
+        _prepareResponseMac(result.nonce);
+        memcpy(result.expected_mac, CLIENT_HMAC.resultHmac(), CLIENT_HASH_LENGTH);
+        break;
+      
+      case RequestEngine::READY:
+        _recordOutcome(result.handle, _getPourResultResponse(_engine.response(result.handle), result.expected_mac));
+        _release(result.handle);
+        result.handle = -1;
+        result.queued = false;
+        break;
+      
+      case RequestEngine::FAILED:
+#ifdef SETTINGS_IDEMPOTENT_RESULTS
+        retry = true; // sent or not, it is recorded once
+#else
+        retry = _engine.failedIn(result.handle) == RequestEngine::CONNECTING; // never sent
+#endif
+        _recordFailure(result.handle);
+        _recordOutcome(result.handle, false);
+        result.server = _server[result.handle];
+        _release(result.handle);
+        result.handle = -1;
+        
+        if (retry) {
+          result.retries = min(result.retries + 1, 0xFF);
+          result.failed_ms = clockMillis();
+          metrics.recordRetry();
+        }
+        else {
+          result.queued = false;
+        }
+        break;
+      
+      default:
+        break;
+    }
+  }
+}
+
+#ifdef SETTINGS_CIRCUIT_BREAKER
+/*! The probe only connects (to the server the pool would pick, which,
+ * with them all down, is the one down the longest) and sends nothing, so
+ * it costs no nonce. Connecting closes the breaker.
+ */
+void PourLogicClient::_serviceProbe() {
+  if (_probe < 0) {
+    if (_breaker.probeDue()) {
+      _probe = _open(); // (no socket free? next time)
+    }
+    return;
+  }
+  
+  switch (_engine.state(_probe)) {
+    case RequestEngine::CONNECTED:
+      _breaker.reached();
+      _release(_probe);
+      _probe = -1;
+      break;
+    
+    case RequestEngine::FAILED:
+      _servers.failed(_server[_probe]);
+      _breaker.probeFailed();
+      _release(_probe);
+      _probe = -1;
+      break;
+    
+    default:
+      break;
+  }
+}
+#endif
+
+void PourLogicClient::poll() {
+  _engine.poll();
+#ifdef SETTINGS_CIRCUIT_BREAKER
+  _serviceProbe();
+#endif
+  _serviceResults();
+}
+
+int PourLogicClient::pendingResults() {
+  int count = 0;
+  
+  for (int i = 0; i < CLIENT_MAX_PENDING_RESULTS; i++) {
+    if (_results[i].queued) {
+      count++;
+    }
+  }
+  
+  return count;
+}
+
 //!< Request the max. volume for a pour for the user given by tagData.
 boolean PourLogicClient::requestMaxVolume(String const& tag_data, int& max_volume_mL) {
   boolean success = false;
+  unsigned long start_ms = clockMillis();
+  unsigned long hedge_ms = 0;
+  int handles[2] = {-1, -1}; // first request, and its hedge (or failover)
+  unsigned long nonces[2] = {0, 0};
+  uint8_t attempts = 1;
+  boolean hedged = false;
+  int answer_mL = 0;
+  CLIENT_HMAC_CLASS prepared; // the first request's response HMAC, up to the body (the hedge's is worked out when it answers)
+  
+  max_volume_mL = 0;
   
-  // Request pour
-  success = (connect(SETTINGS_SERVER_IP, SETTINGS_SERVER_PORT) &&
-             _sendPourRequest(tag_data)                        &&
-             _getPourRequestResponse(max_volume_mL));
+#ifdef SETTINGS_CIRCUIT_BREAKER
+  if (_breaker.open()) {
+    _recordFailure(STAGE_BREAKER);
+    return false; // No server to ask; don't keep the patron waiting to find out
+  }
+#endif
+  
+  handles[0] = _open();
+  if (handles[0] < 0) {
+    _recordFailure(STAGE_SOCKET);
+    return false; // No socket available
+  }
+  
+  hedge_ms = _hedgeDelay(_server[handles[0]]);
+  
+  // Request pour, keeping background requests moving while we wait
+  while (!success && (handles[0] >= 0 || handles[1] >= 0)) {
+    poll();
+    
+    // Slow to answer? Ask another server and take whichever answers first (the same server would only queue it behind the first)
+    if (hedge_ms > 0 && attempts == 1 && handles[0] >= 0 && clockMillis() - start_ms >= hedge_ms) {
+      attempts++;
+      if (_servers.pick(_server[handles[0]]) != _server[handles[0]] && (handles[1] = _open(_server[handles[0]])) >= 0) {
+        hedged = true;
+        metrics.recordHedge();
+      }
+    }
+    
+    for (uint8_t r = 0; r < 2 && !success; r++) {
+      int handle = handles[r];
+      
+      if (handle < 0) {
+        continue;
+      }
+      
+      switch (_engine.state(handle)) {
+        case RequestEngine::CONNECTED:
+          if (!_maySend()) {
+            break; // a pour result is still being answered
+          }
+          _sendPourRequest(_engine.request(handle), tag_data.c_str(), nonces[r]);
+          _sent(handle, nonces[r]);
+          if (r == 0) {
+            _prepareResponseMac(nonces[r]);
+            prepared = CLIENT_HMAC;
+          }
+          break;
+        
+        case RequestEngine::READY:
+          success = _getPourRequestResponse(_engine.response(handle), nonces[r], answer_mL, r == 0 ? &prepared : NULL);
+          _recordOutcome(handle, success);
+          _release(handle);
+          handles[r] = -1;
+          
+          if (success) {
+            max_volume_mL = answer_mL;
+            if (r == 1 && hedged) {
+              metrics.recordHedgeWon();
+            }
+          }
+          break;
+        
+        case RequestEngine::FAILED:
+          _recordFailure(handle);
+          _recordOutcome(handle, false);
+          _release(handle);
+          handles[r] = -1;
+          
+          // Nothing else in flight? Fail over to another server, once
+          if (handles[1 - r] < 0 && attempts < 2 && _servers.count() > 1) {
+            attempts++;
+            handles[1 - r] = _open(_server[handle]);
+          }
+          break;
+        
+        default:
+          break;
+      }
+    }
+  }
+  
+  // Abandon the slower request, if any
+  for (uint8_t r = 0; r < 2; r++) {
+    if (handles[r] >= 0) {
+      _release(handles[r]);
+    }
+  }
+  
+  if (success) {
+    metrics.recordAuthLatency(clockMillis() - start_ms);
+  }
   
-  shutdown();
   return success;
 }
 
-//!< Send the result of a pour to the server.
-boolean PourLogicClient::reportPouredVolume(String const& tag_data, float volume_mL) {
-  boolean success = false;
+//!< Queue the result of a pour to be sent to the server.
+boolean PourLogicClient::reportPouredVolume(String const& tag_data, unsigned long volume_uL, unsigned long pour_nonce) {
   
-  // Send pour results
-  success = (connect(SETTINGS_SERVER_IP, SETTINGS_SERVER_PORT) &&
-             _sendPourResult(tag_data, volume_mL)              &&
-             _getPourResultResponse());
+  for (int i = 0; i < CLIENT_MAX_PENDING_RESULTS; i++) {
+    PendingResult& result = _results[i];
+    
+    if (!result.queued) {
+      tag_data.toCharArray(result.tag, sizeof(result.tag));
+      result.volume_uL = volume_uL;
+      result.handle = -1;
+      result.retries = 0;
+      result.nonce = 0;
+      result.key = pour_nonce;
+      result.server = -1;
+      result.queued = true;
+      
+      // Get going straight away
+      poll();
+      return true;
+    }
+  }
+  
+  return false; // Queue full
+}
 
-  shutdown();
+void PourLogicClient::shutdown() {
+  _engine.abort();
+#ifdef SETTINGS_CIRCUIT_BREAKER
+  _probe = -1;
+#endif
+#ifdef SETTINGS_NONCE_WINDOW
+  memset(_in_flight, 0, sizeof(_in_flight));
+#endif
+  
+  for (int i = 0; i < CLIENT_MAX_PENDING_RESULTS; i++) {
+    _results[i].queued = false;
+    _results[i].handle = -1;
+  }
+}
+
+#ifdef SETTINGS_TAG_FILTER
+/**
+ * Asks for chunks of the delta from the filter held to the server's
+ * latest (see #_getTagFilterResponse) until it is all in. A filter that
+ * fails to arrive (or to check out) leaves the filter as it was, or, if
+ * it had started to change, leaves no filter to check tags against
+ * until a sync completes; the next call carries on from the last chunk
+ * that checked out.
+ */
+boolean PourLogicClient::requestTagFilter(TagFilter& filter) {
+  for (uint8_t chunk = 0; chunk < CLIENT_TAG_FILTER_MAX_CHUNKS; chunk++) {
+    if (!_requestTagFilterChunk(filter)) {
+      return false;
+    }
+    if (!filter.syncing()) {
+      return true;
+    }
+  }
+  
+  return false; // the server kept sending more; carry on next time
+}
+
+boolean PourLogicClient::_requestTagFilterChunk(TagFilter& filter) {
+  boolean success = false;
+  unsigned long nonce = 0;
+  int handle = -1;
+  
+#ifdef SETTINGS_CIRCUIT_BREAKER
+  if (_breaker.open()) {
+    _recordFailure(STAGE_BREAKER);
+    return false;
+  }
+#endif
+  
+  handle = _open();
+  if (handle < 0) {
+    _recordFailure(STAGE_SOCKET);
+    return false;
+  }
+  
+  while (handle >= 0) {
+    poll();
+    
+    switch (_engine.state(handle)) {
+      case RequestEngine::CONNECTED:
+        if (!_maySend()) {
+          break;
+        }
+        _sendTagFilterRequest(_engine.request(handle), filter, nonce);
+        _sent(handle, nonce);
+        break;
+      
+      case RequestEngine::READY:
+        success = _getTagFilterResponse(_engine.response(handle), nonce, filter);
+        _recordOutcome(handle, success);
+        _release(handle);
+        handle = -1;
+        break;
+      
+      case RequestEngine::FAILED:
+        _recordFailure(handle);
+        _recordOutcome(handle, false);
+        _release(handle);
+        handle = -1;
+        break;
+      
+      default:
+        break;
+    }
+  }
+  
   return success;
 }
+#endif
 
-void PourLogicClient::shutdown() {
-  stop();
-  readUntilUnavailable(*this); // flush receive buffer
+#ifdef SETTINGS_PATRON_TABLE
+/**
+ * Asks for blocks of the delta from the table held to the server's
+ * latest (see #_getPatronTableResponse), #CLIENT_PATRON_TABLE_MAX_CHUNKS
+ * responses at most, so as not to hold up patrons for long; a sync that
+ * isn't finished carries on with the next call. The table isn't used
+ * while a sync is unfinished.
+ * \return True if the table is up to date.
+ */
+boolean PourLogicClient::requestPatronTable(PatronTable& table) {
+  if (!table.ready()) {
+    return false;
+  }
+  
+  for (uint8_t chunk = 0; chunk < CLIENT_PATRON_TABLE_MAX_CHUNKS; chunk++) {
+    if (!_requestPatronTableChunk(table)) {
+      return false;
+    }
+    if (!table.syncing()) {
+      return true;
+    }
+  }
+  
+  return false; // more to come; carry on next time
+}
+
+boolean PourLogicClient::_requestPatronTableChunk(PatronTable& table) {
+  boolean success = false;
+  unsigned long nonce = 0;
+  int handle = -1;
+  
+#ifdef SETTINGS_CIRCUIT_BREAKER
+  if (_breaker.open()) {
+    _recordFailure(STAGE_BREAKER);
+    return false;
+  }
+#endif
+  
+  handle = _open();
+  if (handle < 0) {
+    _recordFailure(STAGE_SOCKET);
+    return false;
+  }
+  
+  while (handle >= 0) {
+    poll();
+    
+    switch (_engine.state(handle)) {
+      case RequestEngine::CONNECTED:
+        if (!_maySend()) {
+          break;
+        }
+        _sendPatronTableRequest(_engine.request(handle), table, nonce);
+        _sent(handle, nonce);
+        break;
+      
+      case RequestEngine::READY:
+        success = _getPatronTableResponse(_engine.response(handle), nonce, table);
+        _recordOutcome(handle, success);
+        _release(handle);
+        handle = -1;
+        break;
+      
+      case RequestEngine::FAILED:
+        _recordFailure(handle);
+        _recordOutcome(handle, false);
+        _release(handle);
+        handle = -1;
+        break;
+      
+      default:
+        break;
+    }
+  }
+  
+  return success;
 }
+#endif
@@ -6,21 +6,68 @@
 #include <Arduino.h>
 #include <String.h>
 #include <Ethernet.h>
-#include <sha1.h>
 
 #include "config.h"
+
+#ifdef SETTINGS_AUTH_SHA256
+#include <sha256.h>
+#define CLIENT_HMAC Sha256            //!< Cryptosuite hash used for HMACs
+#define CLIENT_HMAC_CLASS Sha256Class //!< ... and its class (to keep a copy of its state)
+#define CLIENT_HASH_LENGTH 32         //!< Its digest (and effective key) length
+#else
+#include <sha1.h>
+#define CLIENT_HMAC Sha1
+#define CLIENT_HMAC_CLASS Sha1Class
+#define CLIENT_HASH_LENGTH 20
+#endif
 #include "Nonce.h"
+#include "RequestEngine.h"
+#include "ServerPool.h"
+#include "CircuitBreaker.h"
+#include "Metrics.h"
+#include "TagFilter.h"
+#include "PatronTable.h"
 
 #define CLIENT_POUR_REQUEST_PARAM_RFID "u"
 #define CLIENT_POUR_RESULT_PARAM_RFID "u"
 #define CLIENT_POUR_RESULT_PARAM_VOLUME "v"
+#define CLIENT_POUR_RESULT_PARAM_KEY "k"
+#define CLIENT_TAG_FILTER_PARAM_BYTES "b"
+#define CLIENT_TAG_FILTER_PARAM_FP "p"
+#define CLIENT_TAG_FILTER_PARAM_VERSION "v"
+#define CLIENT_TAG_FILTER_PARAM_TARGET "s"
+#define CLIENT_TAG_FILTER_PARAM_APPLIED "o"
+#define CLIENT_TAG_FILTER_PARAM_CHUNK "n"
+#define CLIENT_PATRON_TABLE_PARAM_INDEX "i"
+#define CLIENT_PATRON_TABLE_PARAM_VERSION "v"
+#define CLIENT_PATRON_TABLE_PARAM_TARGET "s"
+#define CLIENT_PATRON_TABLE_PARAM_APPLIED "o"
 
 #define CLIENT_AUTH_HEADER_NAME "X-Pourlogic-Auth"
 
+#define CLIENT_MAX_TAG_LENGTH 10                             //!< Longest tag data kept for a queued pour result
+#define CLIENT_MAX_PENDING_RESULTS SETTINGS_OUTBOX_SIZE       //!< Queued pour results (one request slot is kept for pour requests)
+#define CLIENT_RESULT_BACKOFF_MS 1000UL                      //!< Wait before retrying a pour result that failed; doubled for each retry after ...
+#define CLIENT_RESULT_MAX_BACKOFF_MS 60000UL                 //!< ... up to this
+#ifdef SETTINGS_IDEMPOTENT_RESULTS
+#define CLIENT_RESULT_TIMEOUT_MS SETTINGS_RESULT_TIMEOUT_MS  //!< Longest wait for a pour result's answer
+#endif
+#define CLIENT_MAX_LINE_SIZE SETTINGS_HTTP_MAX_LINE           //!< Length limit to an HTTP line (in bytes)
+#ifdef SETTINGS_TAG_FILTER
+#define CLIENT_TAG_FILTER_CHUNK SETTINGS_TAG_FILTER_CHUNK     //!< Most tag filter delta entries asked for per request
+#define CLIENT_TAG_FILTER_MAX_CHUNKS ((TAG_FILTER_MAX_BYTES + CLIENT_TAG_FILTER_CHUNK - 1) / CLIENT_TAG_FILTER_CHUNK + 1) //!< Requests #requestTagFilter makes at most (enough for a delta from nothing)
+#endif
+#ifdef SETTINGS_PATRON_TABLE
+#define CLIENT_PATRON_TABLE_CHUNK 1                          //!< Table blocks per response (1 KB of hex each; a response must fit a W5100 socket's 2 KB buffer)
+#define CLIENT_PATRON_TABLE_MAX_CHUNKS SETTINGS_PATRON_TABLE_REQUESTS //!< Requests #requestPatronTable makes at most (a longer sync carries on next time)
+#endif
+
 // NOTE: Rake/Rails cannot reconstruct our request URI exactly as sent, so we omit the trailing slash here to match
 #define SERVER_POUR_REQUEST_URI "/pours/new" //!< URI to request when requesting to pour
 #define SERVER_POUR_RESULT_URI "/pours"      //!< URI to request when sending result
 #define SERVER_TEST_XAUTH_URI "/test/xauth"  //!< URI to test X-Pourlogic-Auth
+#define SERVER_TAG_FILTER_URI "/tags/filter" //!< URI to request the filter of enrolled tags (see TagFilter.h)
+#define SERVER_PATRON_TABLE_URI "/patrons/table" //!< URI to request the patron table (see PatronTable.h)
 
 /*!
  * At this time there are two different requests:
@@ -58,43 +105,181 @@
  * uses a persistent monotonic counter and a pre-shared-key.
  * (see #Nonce).
  *
- * \brief A Client with some convenience functions for our pourlogic application.
+ * Requests are driven through a #RequestEngine, so several can be in
+ * flight at once on separate W5100 sockets. A pour result is only queued
+ * by #reportPouredVolume and is reported in the background by #poll (and
+ * while #requestMaxVolume waits for its own response), so the next patron
+ * need not wait for the previous pour to be recorded. Each request keeps
+ * the nonce it was sent with to verify its response. Unless the server
+ * takes nonces out of order (#SETTINGS_NONCE_WINDOW, below), only one
+ * request is sent at a time: the others connect but wait to be sent, and
+ * a pour result doesn't start while a pour request is under way.
+ *
+ * Each request goes to the best server in a #ServerPool, which learns
+ * from how each request went, and is given the time that server usually
+ * needs to connect and to answer (see #ServerPool for the timeouts).
+ * With #SETTINGS_HEDGE_AUTH, a pour request that has not been answered
+ * within the usual time (a percentile of past pour requests) is sent
+ * again to another server, and the first correctly signed answer is
+ * taken. With only one server it isn't sent again: the second request
+ * would only wait behind the first.
+ *
+ * A pour result that could not connect was never sent, so it is kept
+ * and retried, on another server if there is one, waiting longer after
+ * each failure (#CLIENT_RESULT_BACKOFF_MS, doubling). A pour result that
+ * was sent but not answered may or may not have been recorded, so it is
+ * dropped rather than risk recording the pour twice.
+ * With #SETTINGS_IDEMPOTENT_RESULTS, each result also carries a key for
+ * its pour, ID-NONCE (k), where NONCE is the one the controller noted
+ * when the pour was granted (and keeps in its checkpoint), and the server
+ * records a key only once, answering a repeat as if it had recorded it.
+ * A result that goes unanswered is then kept and sent again (with a new
+ * nonce, as any request), on another server if there is one, backing off
+ * as for one that could not connect, until an answer arrives; each
+ * answer is waited for no longer than #SETTINGS_RESULT_TIMEOUT_MS. A pour
+ * reported again after a reset is recorded once too.
+ *
+ * With #SETTINGS_CIRCUIT_BREAKER, once several requests in a row have
+ * failed to reach any server, pour requests (and tag filter and patron
+ * table requests) fail at once and queued results wait, while #poll
+ * probes for a server in the background (see #CircuitBreaker); see
+ * #offline.
+ *
+ * With #SETTINGS_NONCE_WINDOW, each request also signs the oldest nonce
+ * still in flight (its "floor") and the controller's nonce stream:
+ *
+ *   X-Pourlogic-Auth: ID:STREAM:NONCE:FLOOR:HMAC
+ *
+ * with the HMAC over "STREAM:NONCE:FLOOR\nREQUEST LINE\nBODY". Rather than
+ * insisting on the next nonce, the server then takes any nonce of the
+ * stream it hasn't seen that is at or above the highest floor it has
+ * been sent (and within a window of the highest nonce), so a pour request
+ * can overtake a pour result sent before it, or two controllers can share
+ * an ID with a stream each, without replays getting through. Responses
+ * are signed as before. The stream is the controller's, not a tap's:
+ * there is one nonce counter, which a controller's taps share (as they
+ * share its requests).
+ *
+ * The HMAC a response should carry is worked out while waiting for it,
+ * as far as it can be: all of it for a pour result (its body is empty),
+ * and up to the body for a pour request (kept as a copy of the hash's
+ * state). Checking a response then only costs finishing the HMAC.
+ *
+ * \brief A client with some convenience functions for our pourlogic application.
  */
-class PourLogicClient : public EthernetClient {
+class PourLogicClient {
 
  private:
-  byte _effective_key[20]; //!< HMAC (effective) secret key
+  /*! A pour result waiting to be (or being) reported in the background.
+   */
+  struct PendingResult {
+    boolean queued;                         //!< Slot in use
+    int handle;                             //!< RequestEngine handle, or -1 if not yet connecting
+    uint8_t retries;                        //!< Attempts made after the first
+    unsigned long failed_ms;                //!< When the last attempt failed
+    char tag[CLIENT_MAX_TAG_LENGTH+1];      //!< Patron's RFID tag data
+    unsigned long volume_uL;                //!< Poured volume
+    unsigned long nonce;                    //!< Nonce the result was sent with
+    unsigned long key;                      //!< Nonce of the pour (keying the result, with #SETTINGS_IDEMPOTENT_RESULTS)
+    byte expected_mac[CLIENT_HASH_LENGTH];  //!< HMAC its response should carry (worked out once sent)
+    int8_t server;                          //!< Server last tried, or -1
+  };
+
+  byte _effective_key[CLIENT_HASH_LENGTH]; //!< HMAC (effective) secret key
   unsigned long __id;
+  RequestEngine _engine;
+  ServerPool _servers;
+  int8_t _server[ENGINE_MAX_REQUESTS]; //!< Server each request handle was sent to
+  PendingResult _results[CLIENT_MAX_PENDING_RESULTS];
+  MetricsStage _last_failure; //!< Why the last failed request failed
+  char _line_buffer[CLIENT_MAX_LINE_SIZE]; //!< The response line being parsed
+#ifdef SETTINGS_CIRCUIT_BREAKER
+  CircuitBreaker _breaker;
+  int _probe; //!< RequestEngine handle of the probe for a server, or -1
+#endif
+#ifdef SETTINGS_NONCE_WINDOW
+  unsigned long _in_flight[ENGINE_MAX_REQUESTS]; //!< Nonce each request handle was sent with, or 0
+  unsigned long _nonce_floor; //!< Oldest nonce in flight when the current request was signed
+#endif
   
   const byte* _key() { return _effective_key; };
-  int _keySize() { return 20; };
+  int _keySize() { return CLIENT_HASH_LENGTH; };
   unsigned long _id() { return __id; }
   
-  //!< Initializes HMAC for client-server authentication.
-  void _initializeAuth();
+  //!< Initializes HMAC for client-server authentication. Returns the request's nonce.
+  unsigned long _initializeAuth();
+  
+  //!< Note that a request handle was sent with a nonce, and tell the engine.
+  void _sent(int handle, unsigned long nonce);
+  
+  //!< Forget a request handle's nonce, and release it from the engine.
+  void _release(int handle);
+  
+  //!< Start a request to the best server (avoiding the given one, if possible), allowing it no longer than max_response_ms (if not 0) to answer; returns a RequestEngine handle or -1.
+  int _open(int avoid = -1, unsigned long max_response_ms = 0);
+
+  //!< Tell the server pool how a finished request went.
+  void _recordOutcome(int handle, boolean answered);
+
+  //!< Time to wait for a pour request (sent to the given server) to be answered before hedging it.
+  unsigned long _hedgeDelay(int server);
+
+  //!< Whether a request may be sent (take a nonce) now.
+  boolean _maySend();
+  
+  //!< Whether a request other than a pour result or the probe is under way.
+  boolean _foregroundPending();
   
-  //!< Called on communications failure. Disconnects and flushes receive buffer.
-  boolean _failure();
+  //!< Advance queued pour results through the request engine.
+  void _serviceResults();
+
+#ifdef SETTINGS_CIRCUIT_BREAKER
+  //!< Probe for a server while the breaker is open.
+  void _serviceProbe();
+#endif
+
+  //!< Record why a request failed (see #lastFailure and #metrics).
+  void _recordFailure(MetricsStage stage);
+  void _recordFailure(int handle);
+
+  //!< Start the HMAC a response to a request sent with the given nonce should carry, up to its body.
+  void _prepareResponseMac(unsigned long nonce);
+
+  //!< Whether a response's HMAC (hex, from its X-Pourlogic-Auth header) is the expected one.
+  boolean _checkResponseMac(String const& hmac, const byte* expected);
 
   //!< Grab the HMAC from an X-Pourlogic-Auth header
   boolean _parseXPourLogicAuthHeader(String const &line, String &hmac_result);
 
   //!< Parses HTTP server response line and returns whether it contains an expected status.
-  boolean _checkResponseStatusLine(const char* expected_status);
+  boolean _checkResponseStatusLine(Stream &response, const char* expected_status);
 
   //!< Parses HTTP headers from server response. Keeps HMAC from X-Pourlogic-Auth header.
-  boolean _parseResponseHeaders(String &hmac);
+  boolean _parseResponseHeaders(Stream &response, String &hmac);
   
-  unsigned long _printXPourLogicAuthHeader(Print& target); //!< Write out the X-Pourlogic-Auth header and data (assuming ready)
-  unsigned long _printPourRequestStatusLine(Print &target, String const& rfid); //!< Write the status line for a "pour request"
+  unsigned long _printXPourLogicAuthHeader(Print& target, unsigned long nonce); //!< Write out the X-Pourlogic-Auth header and data (assuming ready)
+  unsigned long _printNoncePosition(Print& target, unsigned long nonce); //!< Write the nonce (and with #SETTINGS_NONCE_WINDOW, its stream and floor) as signed
+  unsigned long _printPourRequestStatusLine(Print &target, const char* rfid); //!< Write the status line for a "pour request"
   unsigned long _printPourResultStatusLine(Print &target); //!< Write the status line for a "pour result"
-  unsigned long _printPourResultMessageBody(Print &target, String const& rfid, float volume_in_mL); // Write the "pour result" message body
+  unsigned long _printPourResultMessageBody(Print &target, PendingResult const& result); // Write the "pour result" message body
   
   // Request parts ////////////////////////////////////////////////////////////
-  boolean _sendPourRequest(String const &tagData);
-  boolean _getPourRequestResponse(int& max_volume);
-  boolean _sendPourResult(String const &tag_data, float pour_volume);
-  boolean _getPourResultResponse();
+  boolean _sendPourRequest(Print &target, const char* tag_data, unsigned long &nonce);
+  boolean _getPourRequestResponse(Stream &response, unsigned long nonce, int& max_volume, CLIENT_HMAC_CLASS const* prepared = NULL);
+  boolean _sendPourResult(Print &target, PendingResult const& result, unsigned long &nonce);
+  boolean _getPourResultResponse(Stream &response, const byte* expected_mac);
+#ifdef SETTINGS_TAG_FILTER
+  unsigned long _printTagFilterStatusLine(Print &target, TagFilter& filter); //!< Write the status line for a "tag filter" request
+  boolean _sendTagFilterRequest(Print &target, TagFilter& filter, unsigned long &nonce);
+  boolean _getTagFilterResponse(Stream &response, unsigned long nonce, TagFilter& filter);
+  boolean _requestTagFilterChunk(TagFilter& filter); //!< Fetch and apply one chunk of the filter's delta
+#endif
+#ifdef SETTINGS_PATRON_TABLE
+  unsigned long _printPatronTableStatusLine(Print &target, PatronTable& table); //!< Write the status line for a "patron table" request
+  boolean _sendPatronTableRequest(Print &target, PatronTable& table, unsigned long &nonce);
+  boolean _getPatronTableResponse(Stream &response, unsigned long nonce, PatronTable& table);
+  boolean _requestPatronTableChunk(PatronTable& table); //!< Fetch and apply one chunk of the table's delta
+#endif
   
  protected:
   Nonce _nonce;
@@ -103,14 +288,50 @@ class PourLogicClient : public EthernetClient {
   PourLogicClient(unsigned long api_id, const char* api_private_key);
   ~PourLogicClient();
   
-  //!< Close connection and flush the receive buffer
+  //!< Abort all outstanding requests (including queued pour results)
   void shutdown();
   
-  //!< Request the max. volume for a pour for the user given by tagData.
+  //!< Make progress on background requests (e.g. queued pour results); never blocks.
+  void poll();
+  
+  //!< Number of pour results still waiting to be reported.
+  int pendingResults();
+  
+  //!< The nonce most recently used.
+  unsigned long nonce() { return _nonce.count(); }
+  
+  //!< Continue from the given nonce (e.g. the one a replayed trace was recorded with).
+  void setNonce(unsigned long count) { _nonce.set(count); }
+  
+  //!< Take a nonce that no request will use (e.g. to key a pour granted without asking a server).
+  unsigned long reserveNonce() { _nonce.increment(); return _nonce.count(); }
+  
+  //!< The whole millilitres a pour is reported (and debited) as: rounded, but never 0 for a pour of anything.
+  static unsigned long reportedVolume_mL(unsigned long volume_uL) { return (volume_uL > 0 && volume_uL < 500UL) ? 1UL : (volume_uL + 500UL) / 1000UL; }
+  
+  //!< The stage at which the most recent failed request failed.
+  MetricsStage lastFailure() { return _last_failure; }
+  
+#ifdef SETTINGS_CIRCUIT_BREAKER
+  //!< Whether requests are failing at once, no server having been reachable (see #CircuitBreaker).
+  boolean offline() { return _breaker.open(); }
+#endif
+  
+  //!< Request the max. volume for a pour for the user given by tagData. Blocks, but keeps background requests moving.
   boolean requestMaxVolume(String const& tag_data, int& max_volume_mL);
   
-  //!< Send the result of a pour to the server.
-  boolean reportPouredVolume(String const& tag_data, float volume_mL);
+  //!< Queue the result of a pour (in uL) to be sent to the server in the background; pour_nonce is the #nonce noted when it was granted. False if the queue is full: the pour is still the caller's to keep.
+  boolean reportPouredVolume(String const& tag_data, unsigned long volume_uL, unsigned long pour_nonce);
+  
+#ifdef SETTINGS_TAG_FILTER
+  //!< Bring the given filter of enrolled tags up to date with the server's. Blocks, but keeps background requests moving.
+  boolean requestTagFilter(TagFilter& filter);
+#endif
+  
+#ifdef SETTINGS_PATRON_TABLE
+  //!< Bring the given patron table up to date with the server's, a few blocks at a time. Blocks, but keeps background requests moving.
+  boolean requestPatronTable(PatronTable& table);
+#endif
 };
 
 #endif // #ifndef POURLOGIC_CLIENT_H
@@ -1,7 +1,10 @@
 // See LICENSE.txt for license details.
 
 #include "RFID.h"
+#include "Clock.h"
 #include "StreamUtil.h"
+#include "Sleep.h"
+#include "Watchdog.h"
 
 RFID_EM41000::RFID_EM41000(Stream& rfid_serial, int enable_pin)
   : _enable_pin(enable_pin), _rfid_serial(rfid_serial)
@@ -15,7 +18,7 @@ RFID_EM41000::RFID_EM41000(Stream& rfid_serial, int enable_pin)
 }
 
 boolean RFID_EM41000::readRFID(String& rfid_result, unsigned long timeout_ms) { 
-  unsigned long start_time = millis();
+  unsigned long start_time = clockMillis();
   int bytes_read = -1;
   char tag_byte = '\0';
   char tag_data[RFID_LENGTH+1];
@@ -28,8 +31,18 @@ boolean RFID_EM41000::readRFID(String& rfid_result, unsigned long timeout_ms) {
   enableRFID();
   
   while(bytes_read <= RFID_LENGTH
-        && (timeout_ms == 0 || millis() - start_time < timeout_ms))
+        && (timeout_ms == 0 || clockMillis() - start_time < timeout_ms))
   { 
+    watchdogKick(); // waiting on a patron is progress
+    
+#ifdef SETTINGS_IDLE_SLEEP
+    // Nothing to read yet; doze until the next interrupt (e.g. a received byte)
+    if (!_rfid_serial.available()) {
+      sleepIdle();
+      continue;
+    }
+#endif
+
     // Read the byte from the RFID reader
     tag_byte = _rfid_serial.read();
     
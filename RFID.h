@@ -4,11 +4,14 @@
 #define POURLOGIC_RFID_H
 
 #include <Arduino.h>
-#include <SoftwareSerial.h>
 #include <String.h>
+#include "config.h"
 #include "pin_config.h"
 
-//#define RFID_USE_SOFTWARE_SERIAL
+#ifdef RFID_USE_SOFTWARE_SERIAL
+#include <SoftwareSerial.h>
+#endif
+
 #define RFID_BAUD_RATE 2400 
 
 /*!
@@ -21,7 +24,9 @@
  * The RFID reader is enabled (RFID_EM41000#enableRFID) by lowering the
  * digital pin connected to
  * \\ENABLE on the RFID board (RFID_EM41000#setPinEnable). Is is disabled
- * by setting the pin to high (RFID_EM41000#disableRFID).
+ * by setting the pin to high (RFID_EM41000#disableRFID). The reader is
+ * only enabled while RFID_EM41000#readRFID runs, so a timeout on
+ * RFID_EM41000#readRFID duty-cycles the reader.
  *
  * \brief A set of convenience functions for reading from a RFID_EM41000 reader.
  */
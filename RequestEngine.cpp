@@ -0,0 +1,406 @@
+// See LICENSE.txt for license details.
+
+#include "RequestEngine.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Watchdog.h"
+#include "SpiBus.h"
+#include <utility/socket.h>
+
+#define ENGINE_CLOSE_TIMEOUT_MS 1000 //!< Time allowed for a graceful close before the socket is closed outright
+#define ENGINE_FIRST_LOCAL_PORT 49152
+
+// Newer Ethernet libraries expect callers to own the SPI bus around raw W5100 accesses
+#if defined(SETTINGS_SPI_BUS)
+#define ENGINE_SPI_BEGIN() spiBusAcquire(SPI_DEVICE_ETHERNET)
+#define ENGINE_SPI_END()   spiBusRelease(SPI_DEVICE_ETHERNET)
+#elif defined(SPI_ETHERNET_SETTINGS)
+#define ENGINE_SPI_BEGIN() SPI.beginTransaction(SPI_ETHERNET_SETTINGS)
+#define ENGINE_SPI_END()   SPI.endTransaction()
+#else
+#define ENGINE_SPI_BEGIN()
+#define ENGINE_SPI_END()
+#endif
+
+static uint8_t _readSocketStatus(uint8_t sock) {
+  uint8_t status;
+  
+  ENGINE_SPI_BEGIN();
+  status = W5100.readSnSR(sock);
+  ENGINE_SPI_END();
+  
+  return status;
+}
+
+RequestEngine::RequestEngine()
+  : _received_handle(-1), _local_port(ENGINE_FIRST_LOCAL_PORT), _retransmission_time(ENGINE_DATA_RETRANSMISSION_TIME)
+{
+  for (int i = 0; i < ENGINE_MAX_REQUESTS; i++) {
+    _slots[i].state = FREE;
+    _slots[i].sock = MAX_SOCK_NUM;
+  }
+}
+
+RequestEngine::~RequestEngine() {
+  abort();
+}
+
+void RequestEngine::_setRetransmission(uint16_t time, uint8_t retries) {
+  ENGINE_SPI_BEGIN();
+  W5100.setRetransmissionTime(time);
+  W5100.setRetransmissionCount(retries);
+  ENGINE_SPI_END();
+  
+  _retransmission_time = time;
+}
+
+void RequestEngine::_enter(Slot& slot, State state) {
+  unsigned long now_ms = clockMillis();
+  
+  if (state == CONNECTED) {
+    slot.connect_ms = now_ms - slot.stage_ms;
+  }
+  else if (state == READY) {
+    slot.response_ms = now_ms - slot.stage_ms;
+  }
+  
+  slot.state = state;
+  slot.stage_ms = now_ms;
+}
+
+void RequestEngine::_close(Slot& slot) {
+  if (slot.sock < MAX_SOCK_NUM) {
+    spiBusAcquire(SPI_DEVICE_ETHERNET);
+    close(slot.sock);
+    spiBusRelease(SPI_DEVICE_ETHERNET);
+  }
+  slot.sock = MAX_SOCK_NUM;
+  slot.client = EthernetClient();
+}
+
+void RequestEngine::_fail(Slot& slot, boolean timed_out) {
+  if (timed_out) {
+    metrics.recordTimeout();
+  }
+  
+  slot.failed_in = slot.state;
+  _close(slot);
+  _enter(slot, FAILED);
+}
+
+boolean RequestEngine::_socketInUse(uint8_t sock) {
+  for (int i = 0; i < ENGINE_MAX_REQUESTS; i++) {
+    if (_slots[i].state != FREE && _slots[i].sock == sock) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Starts a (non-blocking) connection to a server.
+ * \param ip The server's address.
+ * \param port The server's port.
+ * \param connect_timeout_ms The time allowed for connecting (and for reading a response once it is READY).
+ * \param response_timeout_ms The time allowed, once sent, for the response to complete.
+ * \return A handle for the request, or -1 if no slot or socket is available.
+ */
+int RequestEngine::open(IPAddress const& ip, uint16_t port, unsigned long connect_timeout_ms, unsigned long response_timeout_ms) {
+  uint8_t address[4] = {ip[0], ip[1], ip[2], ip[3]};
+  int handle = -1;
+  uint8_t sock = MAX_SOCK_NUM;
+  
+  // Find a free slot...
+  for (int i = 0; i < ENGINE_MAX_REQUESTS; i++) {
+    if (_slots[i].state == FREE) {
+      handle = i;
+      break;
+    }
+  }
+  
+  if (handle < 0) {
+    return -1;
+  }
+  
+#ifdef SETTINGS_TRACE_REPLAY_NETWORK
+  // The trace says how the connection went
+  Slot& replayed = _slots[handle];
+  replayed.sock = MAX_SOCK_NUM;
+  replayed.client = EthernetClient();
+  replayed.connect_timeout_ms = connect_timeout_ms;
+  replayed.response_timeout_ms = response_timeout_ms;
+  replayed.opened_ms = clockMillis();
+  _enter(replayed, CONNECTING);
+  
+  return handle;
+#endif
+  
+  // .. and a closed socket nobody else (e.g. a server or DHCP) is using
+  for (uint8_t s = 0; s < MAX_SOCK_NUM; s++) {
+    if (!_socketInUse(s) && _readSocketStatus(s) == SnSR::CLOSED) {
+      sock = s;
+      break;
+    }
+  }
+  
+  if (sock == MAX_SOCK_NUM) {
+    return -1;
+  }
+  
+  // Pick a fresh local port so late packets from an old connection are ignored
+  if (++_local_port == 0) {
+    _local_port = ENGINE_FIRST_LOCAL_PORT;
+  }
+  
+  // Retransmit within the connect timeout: the W5100 doubles the retransmission time on each retry,
+  // so it gives up after (2^(retries+1) - 1) times the first (set in units of 100 us)
+  // (put back once nothing is connecting: see #poll)
+  _setRetransmission(min(connect_timeout_ms * 10UL / ((2UL << ENGINE_SYN_RETRIES) - 1), 0xFFFFUL), ENGINE_SYN_RETRIES);
+  
+  // Issue the SYN; don't wait for the connection to be established
+  spiBusAcquire(SPI_DEVICE_ETHERNET);
+  if (!socket(sock, SnMR::TCP, _local_port, 0) || !connect(sock, address, port)) {
+    close(sock);
+    spiBusRelease(SPI_DEVICE_ETHERNET);
+    return -1;
+  }
+  spiBusRelease(SPI_DEVICE_ETHERNET);
+  
+  Slot& slot = _slots[handle];
+  slot.sock = sock;
+  slot.client = EthernetClient(sock);
+  slot.connect_timeout_ms = connect_timeout_ms;
+  slot.response_timeout_ms = response_timeout_ms;
+  slot.opened_ms = clockMillis();
+  _enter(slot, CONNECTING);
+  
+  return handle;
+}
+
+void RequestEngine::sent(int handle) {
+  _sending.detach(); // (writing out the last of it)
+  
+  if (_slots[handle].state == CONNECTED) {
+    _enter(_slots[handle], AWAITING);
+  }
+}
+
+void RequestEngine::release(int handle) {
+  Slot& slot = _slots[handle];
+  
+  if (slot.state == FREE || slot.state == CLOSING) {
+    return;
+  }
+  
+  if (handle == _received_handle) {
+#ifdef SETTINGS_BENCHMARK
+    // "B P <us> <available> <reads> <peeks> <bytes>": parsing the response, and the calls it made on the client
+    Serial.print(F("B P "));
+    Serial.print(clockMicros() - _received_us);
+    Serial.print(' ');
+    Serial.print(_received.counts.available);
+    Serial.print(' ');
+    Serial.print(_received.counts.reads);
+    Serial.print(' ');
+    Serial.print(_received.counts.peeks);
+    Serial.print(' ');
+    Serial.println(_received.counts.bytes);
+#endif
+    _received.detach();
+    _received_handle = -1;
+  }
+  
+  if (slot.sock < MAX_SOCK_NUM && _readSocketStatus(slot.sock) != SnSR::CLOSED) {
+    // Say goodbye (FIN) and let #poll reap the socket
+    spiBusAcquire(SPI_DEVICE_ETHERNET);
+    disconnect(slot.sock);
+    spiBusRelease(SPI_DEVICE_ETHERNET);
+    _enter(slot, CLOSING);
+  }
+  else {
+    _close(slot);
+    _enter(slot, FREE);
+  }
+}
+
+void RequestEngine::abort() {
+  _received.detach();
+  _received_handle = -1;
+  
+  for (int i = 0; i < ENGINE_MAX_REQUESTS; i++) {
+    if (_slots[i].state != FREE) {
+      _close(_slots[i]);
+      _enter(_slots[i], FREE);
+    }
+  }
+}
+
+Print& RequestEngine::request(int handle) {
+  _sending.attach(_slots[handle].client);
+  return _sending;
+}
+
+Stream& RequestEngine::response(int handle) {
+#if defined(SETTINGS_TRACE_REPLAY_NETWORK)
+  return traceReplay.response(handle);
+#else
+  _received.attach(_slots[handle].client);
+  _received.setTimeout(0); // the server has closed, so the whole response is in; don't wait for more (e.g. in parseInt())
+  _received_handle = handle;
+#ifdef SETTINGS_BENCHMARK
+  _received_us = clockMicros();
+#endif
+#ifdef SETTINGS_TRACE_RECORD
+  return traceRecorder.response(_received, handle);
+#else
+  return _received;
+#endif
+#endif
+}
+
+int RequestEngine::pending() {
+  int count = 0;
+  
+  for (int i = 0; i < ENGINE_MAX_REQUESTS; i++) {
+    if (_slots[i].state != FREE) {
+      count++;
+    }
+  }
+  
+  return count;
+}
+
+#ifdef SETTINGS_TRACE_REPLAY_NETWORK
+
+void RequestEngine::poll() {
+  boolean waiting = false;
+  
+  watchdogKick();
+  
+  // The recording's own timeouts are in the trace; only its events move requests along
+  for (int i = 0; i < ENGINE_MAX_REQUESTS; i++) {
+    Slot& slot = _slots[i];
+    boolean timed_out = (clockMillis() - slot.stage_ms) > (slot.state == CONNECTING ? slot.connect_timeout_ms : slot.response_timeout_ms);
+    int outcome;
+    
+    switch (slot.state) {
+      case CONNECTING:
+        if ((outcome = traceReplay.netEvent(TRACE_NET_OPENED, i)) > 0) {
+          _enter(slot, CONNECTED);
+        }
+        else if (outcome == 0) {
+          _fail(slot, timed_out);
+        }
+        else {
+          waiting = true;
+        }
+        break;
+      
+      case AWAITING:
+        if ((outcome = traceReplay.netEvent(TRACE_NET_DONE, i)) > 0) {
+          _enter(slot, READY);
+        }
+        else if (outcome == 0) {
+          _fail(slot, timed_out);
+        }
+        else {
+          waiting = true;
+        }
+        break;
+      
+      default:
+        break;
+    }
+  }
+  
+  // Let virtual time pass until the server (as recorded) gets back to us
+  if (waiting) {
+    traceReplay.idle();
+  }
+}
+
+#else
+
+void RequestEngine::poll() {
+  boolean in_flight = false;
+  boolean connecting = false;
+  
+  // Every wait on the network comes through here; if the W5100 stops answering, the kicks stop
+  watchdogKick();
+  
+  for (int i = 0; i < ENGINE_MAX_REQUESTS; i++) {
+    Slot& slot = _slots[i];
+    boolean timed_out = (clockMillis() - slot.stage_ms) > (slot.state == CONNECTING ? slot.connect_timeout_ms : slot.response_timeout_ms);
+    uint8_t status;
+    
+    switch (slot.state) {
+      case CONNECTING:
+        status = _readSocketStatus(slot.sock);
+        
+        if (status == SnSR::ESTABLISHED) {
+          _enter(slot, CONNECTED);
+        }
+        else if (status == SnSR::CLOSED || timed_out) {
+          // Refused, or the W5100 gave up retransmitting our SYN
+          _fail(slot, status != SnSR::CLOSED);
+        }
+#ifdef SETTINGS_TRACE_RECORD
+        if (slot.state != CONNECTING) {
+          traceRecorder.record(TRACE_NET_OPENED, i, slot.state == CONNECTED);
+        }
+#endif
+        break;
+      
+      case AWAITING:
+        status = _readSocketStatus(slot.sock);
+        
+        if (status == SnSR::CLOSE_WAIT) {
+          // Server has said all it's going to say
+          _enter(slot, READY);
+        }
+        else if (status == SnSR::CLOSED) {
+          // Reset; whatever did arrive may still be usable
+          spiBusAcquire(SPI_DEVICE_ETHERNET);
+          if (slot.client.available()) {
+            _enter(slot, READY);
+          }
+          else {
+            _fail(slot, false);
+          }
+          spiBusRelease(SPI_DEVICE_ETHERNET);
+        }
+        else if (timed_out) {
+          _fail(slot, true);
+        }
+#ifdef SETTINGS_TRACE_RECORD
+        if (slot.state != AWAITING) {
+          traceRecorder.record(TRACE_NET_DONE, i, slot.state == READY);
+        }
+#endif
+        break;
+      
+      case CLOSING:
+        if (_readSocketStatus(slot.sock) == SnSR::CLOSED || (clockMillis() - slot.stage_ms) > ENGINE_CLOSE_TIMEOUT_MS) {
+          _close(slot);
+          _enter(slot, FREE);
+        }
+        break;
+      
+      default:
+        // FREE, CONNECTED, READY and FAILED wait on the owner
+        break;
+    }
+    
+    in_flight = in_flight || slot.state == CONNECTING || slot.state == CONNECTED || slot.state == AWAITING;
+    connecting = connecting || slot.state == CONNECTING;
+  }
+  
+  // The SYN retransmission time is too tight for a connected socket (a lost segment would reset it), and it's chip-wide
+  if (!connecting && _retransmission_time != ENGINE_DATA_RETRANSMISSION_TIME) {
+    _setRetransmission(ENGINE_DATA_RETRANSMISSION_TIME, ENGINE_DATA_RETRIES);
+  }
+  
+  spiBusSetNetworkBusy(in_flight);
+}
+
+#endif // #ifdef SETTINGS_TRACE_REPLAY_NETWORK
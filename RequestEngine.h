@@ -0,0 +1,130 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_REQUEST_ENGINE_H
+#define POURLOGIC_REQUEST_ENGINE_H
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <Ethernet.h>
+
+#include "config.h"
+#include "Clock.h"
+#include "BufferedStream.h"
+#include "BufferedPrint.h"
+
+#define ENGINE_MAX_REQUESTS (SETTINGS_OUTBOX_SIZE + 1) //!< Requests in flight at once: the outbox and a pour request (the W5100 has 4 sockets; one is left for DHCP/servers)
+#define ENGINE_SYN_RETRIES 2  //!< Times the W5100 retransmits a SYN before giving up on a connection
+#define ENGINE_DATA_RETRANSMISSION_TIME 2000 //!< First retransmission time once connected, in 100 us (the W5100's default, 200 ms)
+#define ENGINE_DATA_RETRIES 8 //!< Times the W5100 retransmits data once connected (its default)
+
+/*!
+ * EthernetClient::connect() blocks until the connection is established
+ * and only one EthernetClient was ever in use, so a single request could
+ * be in flight at a time. The W5100 has four hardware sockets, each with
+ * its own TCP state machine and buffers; the request engine drives
+ * several of them at once without ever blocking.
+ *
+ * A request is identified by a handle returned from #open and moves
+ * through the following states:
+ *
+ * <pre>
+ *   CONNECTING -> CONNECTED -> AWAITING -> READY
+ *        \\             \\          \\
+ *         +-------------+----------+---> FAILED
+ * </pre>
+ *
+ * When a request is CONNECTED the owner writes the request to #client
+ * and calls #sent. We speak HTTP/1.0, so the server closes the connection
+ * once the response is complete; the request is READY at that point, with
+ * the whole response waiting in the W5100's receive buffer to be parsed
+ * from #client. Connecting and awaiting the response each time out after
+ * the timeouts given to #open. READY and FAILED requests hold their slot
+ * until #release.
+ *
+ * The W5100's retransmission time is set from the connect timeout as
+ * each request is opened, so that its SYN is retried #ENGINE_SYN_RETRIES
+ * times, with the chip's exponential backoff, within that timeout. The
+ * setting is chip-wide, so it is put back to the chip's defaults
+ * (#ENGINE_DATA_RETRANSMISSION_TIME, #ENGINE_DATA_RETRIES) once no
+ * request is CONNECTING; until then it applies to requests already
+ * connected (and the metrics server) too.
+ *
+ * Responses are parsed through a #BufferedStream, which takes them from
+ * the W5100 in bursts rather than a byte (and a dozen SPI frames) at a
+ * time. There is one, so one response is parsed at a time. Likewise,
+ * requests are written through a #BufferedPrint, so a request goes out
+ * in a few segments rather than one per field printed.
+ *
+ * Each #poll tells the SPI bus whether any request is in flight, so bulk
+ * SD work can wait for them (see SpiBus.h).
+ *
+ * When tracing (see Trace.h) the engine records when each request
+ * connects and completes, and the bytes parsed through #response. When
+ * replaying, no sockets are used at all: those events come from the trace.
+ *
+ * \brief Drives several requests over the W5100's hardware sockets concurrently.
+ */
+class RequestEngine {
+
+  public:
+    enum State {
+      FREE = 0,   //!< Slot unused
+      CONNECTING, //!< SYN sent, waiting for the connection to be established
+      CONNECTED,  //!< Established; the owner should write the request then call #sent
+      AWAITING,   //!< Request sent, waiting for the server to finish responding
+      READY,      //!< The response is complete; the owner should parse it then #release
+      FAILED,     //!< Refused, reset or timed out; the owner should #release
+      CLOSING     //!< Released, waiting for the socket to finish closing
+    };
+    
+    RequestEngine();
+    ~RequestEngine();
+    
+    int open(IPAddress const& ip, uint16_t port, unsigned long connect_timeout_ms, unsigned long response_timeout_ms); //!< Start connecting; returns a handle, or -1 if no socket is free
+    void sent(int handle);    //!< The request has been written; wait for the response
+    void release(int handle); //!< Close the connection (if any) and recycle the slot
+    void abort();             //!< Release all requests
+    void poll();              //!< Advance all requests; never blocks
+    
+    State state(int handle) { return (State) _slots[handle].state; }
+    EthernetClient& client(int handle) { return _slots[handle].client; }
+    Print& request(int handle);   //!< Where to write a CONNECTED request (#client, buffered; written out by #sent)
+    Stream& response(int handle); //!< Where to parse a READY request's response from (#client, buffered, unless replaying)
+    unsigned long age_ms(int handle) { return clockMillis() - _slots[handle].opened_ms; } //!< Time since #open
+    State failedIn(int handle) { return (State) _slots[handle].failed_in; } //!< The state a FAILED request was in when it failed
+    unsigned long connectTime_ms(int handle) { return _slots[handle].connect_ms; }   //!< Time taken to connect (once CONNECTED)
+    unsigned long responseTime_ms(int handle) { return _slots[handle].response_ms; } //!< Time from #sent to the response being complete (once READY)
+    int pending(); //!< Number of slots in use
+    
+  private:
+    struct Slot {
+      uint8_t state;              //!< #State
+      uint8_t sock;               //!< W5100 socket number
+      uint8_t failed_in;          //!< #State the request failed in
+      EthernetClient client;      //!< Client bound to #sock
+      unsigned long opened_ms;    //!< Time of #open
+      unsigned long stage_ms;     //!< Time the current state was entered
+      uint16_t connect_timeout_ms;  //!< Time allowed for CONNECTING
+      uint16_t response_timeout_ms; //!< Time allowed for AWAITING
+      uint16_t connect_ms;        //!< Time spent CONNECTING
+      uint16_t response_ms;       //!< Time spent AWAITING
+    };
+    
+    Slot _slots[ENGINE_MAX_REQUESTS];
+    BufferedStream _received;  //!< The response being parsed
+    BufferedPrint _sending;    //!< The request being written
+    int8_t _received_handle;   //!< ... and whose it is, or -1
+#ifdef SETTINGS_BENCHMARK
+    unsigned long _received_us; //!< When parsing it began
+#endif
+    uint16_t _local_port; //!< Next local (ephemeral) port
+    uint16_t _retransmission_time; //!< The W5100's retransmission time, as last set
+    
+    void _enter(Slot& slot, State state); //!< Change state and restart the state's timer (noting how long the last took)
+    void _close(Slot& slot);              //!< Hard-close the slot's socket
+    void _fail(Slot& slot, boolean timed_out); //!< Hard-close and enter FAILED
+    boolean _socketInUse(uint8_t sock);   //!< Whether a slot owns the given socket
+    void _setRetransmission(uint16_t time, uint8_t retries); //!< Set the W5100's (chip-wide) retransmission time and count
+};
+
+#endif // #ifndef POURLOGIC_REQUEST_ENGINE_H
@@ -0,0 +1,32 @@
+// See LICENSE.txt for license details.
+
+#include "SdCache.h"
+#include "SpiBus.h"
+
+#if defined(SETTINGS_JOURNAL) || defined(SETTINGS_PATRON_TABLE)
+
+static SdCacheRelease holder = NULL; //!< Release of whoever claimed the buffer last
+
+/**
+ * The holder is still the holder while it lets go, so it can use the
+ * buffer one last time (e.g. to write it out).
+ */
+uint8_t* sdCacheClaim(SdCacheRelease release) {
+  uint8_t* buffer;
+  
+  if (release != holder) {
+    if (holder != NULL) {
+      holder();
+    }
+    holder = release;
+  }
+  
+  // (which writes out a block the FAT code left dirty)
+  spiBusAcquire(SPI_DEVICE_SD);
+  buffer = SdVolume::cacheClear();
+  spiBusRelease(SPI_DEVICE_SD);
+  
+  return buffer;
+}
+
+#endif // #if defined(SETTINGS_JOURNAL) || defined(SETTINGS_PATRON_TABLE)
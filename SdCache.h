@@ -0,0 +1,35 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_SD_CACHE_H
+#define POURLOGIC_SD_CACHE_H
+
+#include <Arduino.h>
+
+#include "config.h"
+
+#if defined(SETTINGS_JOURNAL) || defined(SETTINGS_PATRON_TABLE)
+
+#include <SD.h>
+
+/*! \file SdCache.h
+ * \brief Sharing the SD library's block buffer.
+ *
+ * The SD library keeps one 512-byte block buffer (SdVolume's cache,
+ * which is static, so every SdVolume has the same one). The journal keeps
+ * its unwritten records there (see Journal.h) and the patron table fills
+ * it to write a block (see PatronTable.h); neither can spare the SRAM for
+ * a buffer of its own. So each claims the buffer before using it, and
+ * whoever held it last is told to let it go first: the journal writes
+ * its records out, and reads its block back in when it next needs it.
+ */
+
+typedef void (*SdCacheRelease)(); //!< Let the buffer go; it is about to be overwritten
+
+/*! \brief The block buffer, once whoever held it (if anyone else) has let it go.
+ * \param release Called when someone else claims it (NULL if nothing need be done).
+ */
+uint8_t* sdCacheClaim(SdCacheRelease release);
+
+#endif // #if defined(SETTINGS_JOURNAL) || defined(SETTINGS_PATRON_TABLE)
+
+#endif // #ifndef POURLOGIC_SD_CACHE_H
@@ -0,0 +1,139 @@
+// See LICENSE.txt for license details.
+
+#include "ServerPool.h"
+#include "Clock.h"
+
+ServerPool::ServerPool()
+  : _count(0)
+{
+}
+
+boolean ServerPool::add(IPAddress const& ip, uint16_t port) {
+  if (_count >= SERVER_POOL_MAX_SERVERS) {
+    return false;
+  }
+  
+  Server& server = _servers[_count++];
+  server.ip = ip;
+  server.port = port;
+  server.connect.sampled = false;
+  server.response.sampled = false;
+  server.error = 0;
+  server.failures = 0;
+  server.down_since_ms = 0;
+  
+  return true;
+}
+
+boolean ServerPool::_up(uint8_t server) {
+  return _servers[server].failures < SERVER_POOL_MAX_FAILURES
+      || clockMillis() - _servers[server].down_since_ms >= SERVER_POOL_HOLDOFF_MS;
+}
+
+unsigned long ServerPool::rtt_ms(uint8_t server) {
+  Server& s = _servers[server];
+  
+  if (!s.connect.sampled || !s.response.sampled) {
+    return SERVER_POOL_INITIAL_RTT_MS;
+  }
+  
+  return (s.connect.srtt_x8 >> 3) + (s.response.srtt_x8 >> 3);
+}
+
+unsigned long ServerPool::_timeout(uint8_t server, Estimate const& estimate, unsigned long min_ms) {
+  unsigned long rto_ms;
+  
+  if (!estimate.sampled) {
+    return SERVER_POOL_INITIAL_RTO_MS;
+  }
+  
+  // SRTT + max(G, 4 RTTVAR), with a clock granularity, G, of 1 ms
+  rto_ms = (estimate.srtt_x8 >> 3) + max(1U, estimate.rttvar_x4);
+  rto_ms = max(rto_ms, min_ms);
+  
+  // Back off while it keeps failing
+  for (uint8_t i = 0; i < _servers[server].failures && rto_ms < SERVER_POOL_MAX_RTO_MS; i++) {
+    rto_ms <<= 1;
+  }
+  
+  return min(rto_ms, (unsigned long) SERVER_POOL_MAX_RTO_MS);
+}
+
+void ServerPool::_sample(Estimate& estimate, unsigned long rtt_ms) {
+  int delta;
+  
+  rtt_ms = min(rtt_ms, (unsigned long) SERVER_POOL_MAX_RTO_MS); // keeps the fixed point in range
+  
+  if (!estimate.sampled) {
+    estimate.srtt_x8 = rtt_ms << 3;
+    estimate.rttvar_x4 = rtt_ms << 1; // R/2, times 4
+    estimate.sampled = true;
+    return;
+  }
+  
+  // RTTVAR += (|SRTT - R| - RTTVAR) / 4, times 4
+  delta = (int) rtt_ms - (int) (estimate.srtt_x8 >> 3);
+  estimate.rttvar_x4 = estimate.rttvar_x4 - (estimate.rttvar_x4 >> 2) + abs(delta);
+  
+  // SRTT += (R - SRTT) / 8, times 8
+  estimate.srtt_x8 = estimate.srtt_x8 - (estimate.srtt_x8 >> 3) + rtt_ms;
+}
+
+unsigned long ServerPool::_score(uint8_t server) {
+  return rtt_ms(server) + ((SERVER_POOL_ERROR_PENALTY_MS * _servers[server].error) >> 8);
+}
+
+int ServerPool::pick(int exclude) {
+  int best = -1;
+  unsigned long oldest_ms = 0;
+  
+  // Lowest score among the servers that are up...
+  for (uint8_t i = 0; i < _count; i++) {
+    if (i != exclude && _up(i) && (best < 0 || _score(i) < _score(best))) {
+      best = i;
+    }
+  }
+  
+  // .. but keep to the order of preference unless it's clearly better
+  if (best >= 0) {
+    for (uint8_t i = 0; i < best; i++) {
+      if (i != exclude && _up(i) && _score(i) <= 2 * _score(best)) {
+        return i;
+      }
+    }
+    return best;
+  }
+  
+  // Everything else is down; try whichever has been left alone longest
+  for (uint8_t i = 0; i < _count; i++) {
+    if (i != exclude && (best < 0 || clockMillis() - _servers[i].down_since_ms > oldest_ms)) {
+      best = i;
+      oldest_ms = clockMillis() - _servers[i].down_since_ms;
+    }
+  }
+  
+  // .. or the excluded one, if it's all there is
+  return (best < 0 && exclude >= 0 && exclude < _count) ? exclude : best;
+}
+
+void ServerPool::succeeded(uint8_t server, unsigned long connect_ms, unsigned long response_ms) {
+  Server& s = _servers[server];
+  
+  _sample(s.connect, connect_ms);
+  _sample(s.response, response_ms);
+  s.error -= (s.error + 7) >> 3;
+  s.failures = 0;
+}
+
+void ServerPool::failed(uint8_t server) {
+  Server& s = _servers[server];
+  
+  s.error += (255 - s.error) >> 3;
+  
+  if (s.failures < SERVER_POOL_MAX_FAILURES) {
+    s.failures++;
+  }
+  if (s.failures >= SERVER_POOL_MAX_FAILURES) {
+    s.down_since_ms = clockMillis(); // (again, if this was a probe)
+  }
+}
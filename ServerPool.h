@@ -0,0 +1,105 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_SERVER_POOL_H
+#define POURLOGIC_SERVER_POOL_H
+
+#include <Arduino.h>
+#include <Ethernet.h>
+
+#define SERVER_POOL_MAX_SERVERS 4           //!< Servers that can be configured
+#define SERVER_POOL_MAX_FAILURES 3          //!< Consecutive failures before a server is considered down
+#define SERVER_POOL_HOLDOFF_MS 30000UL      //!< Time a down server is left alone before it is tried again
+#define SERVER_POOL_INITIAL_RTT_MS 250      //!< Assumed round-trip time of a server not yet heard from (for choosing)
+#define SERVER_POOL_INITIAL_RTO_MS 2000     //!< Timeouts for a server not yet heard from
+#define SERVER_POOL_MIN_CONNECT_RTO_MS 30   //!< Shortest connect timeout derived from measurements (a handshake is all network)
+#define SERVER_POOL_MIN_RESPONSE_RTO_MS 500 //!< Shortest response timeout derived from measurements (the server's own stalls don't show in a few samples)
+#define SERVER_POOL_MAX_RTO_MS 4000         //!< Longest timeout, including backoff
+#define SERVER_POOL_ERROR_PENALTY_MS 2000UL //!< Score added for a server that always fails (scaled by its error rate)
+
+/*!
+ * Servers are kept in order of preference. Each keeps a smoothed error
+ * rate (an exponentially weighted moving average out of 255, gain 1/8)
+ * and two round-trip time estimates, one for connecting (the TCP
+ * handshake: the network) and one from sending a request to having the
+ * whole response (mostly the server). Each estimate is a smoothed RTT
+ * and RTT variation, as TCP keeps for its retransmission timeout (RFC
+ * 6298), from which the timeouts for the next request are derived:
+ *
+ * <pre>
+ *   first sample R:  SRTT = R, RTTVAR = R/2
+ *   later samples:   RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+ *   timeout:         (SRTT + max(1, 4 RTTVAR)) * 2^(consecutive failures), within [MIN_RTO, MAX_RTO]
+ * </pre>
+ *
+ * So on a LAN, where a handshake takes a millisecond or two, a dead
+ * server is given up on after #SERVER_POOL_MIN_CONNECT_RTO_MS rather
+ * than after a fixed couple of seconds, while a slow one is still given
+ * the time it usually needs. Answering takes the server's own time,
+ * which a run of quick answers says little about (a pause to collect
+ * garbage or flush its database is rare but long), so the response
+ * timeout is never under #SERVER_POOL_MIN_RESPONSE_RTO_MS; giving up on
+ * a pour request the server would have answered costs the patron a
+ * retry and the server a stale nonce.
+ *
+ * A server's score is its round-trip times plus a penalty for its error
+ * rate; the best server is the first, in order of preference, whose
+ * score is no more than twice the lowest. So a backup is only used when
+ * it is clearly better, or when the servers before it are down.
+ *
+ * A server that fails #SERVER_POOL_MAX_FAILURES times in a row is down
+ * and is skipped for #SERVER_POOL_HOLDOFF_MS, after which the next
+ * request to it is a probe. If every server is down, the one that has
+ * been down the longest is tried anyway.
+ *
+ * \brief A list of servers with a running estimate of how each is doing.
+ */
+class ServerPool {
+
+  public:
+    ServerPool();
+    
+    boolean add(IPAddress const& ip, uint16_t port); //!< Add a server (after those already added, in order of preference)
+    uint8_t count() { return _count; }
+    
+    int pick(int exclude = -1); //!< The best server, avoiding exclude if there is any alternative; -1 if there are no servers
+    
+    IPAddress const& ip(uint8_t server) { return _servers[server].ip; }
+    uint16_t port(uint8_t server) { return _servers[server].port; }
+    unsigned long rtt_ms(uint8_t server);                                 //!< Smoothed time to connect and be answered
+    uint8_t errorRate(uint8_t server) { return _servers[server].error; } //!< Smoothed error rate, out of 255
+    
+    unsigned long connectTimeout(uint8_t server) { return _timeout(server, _servers[server].connect, SERVER_POOL_MIN_CONNECT_RTO_MS); }    //!< Time to allow for connecting
+    unsigned long responseTimeout(uint8_t server) { return _timeout(server, _servers[server].response, SERVER_POOL_MIN_RESPONSE_RTO_MS); } //!< Time to allow for the response, once sent
+    
+    void succeeded(uint8_t server, unsigned long connect_ms, unsigned long response_ms); //!< A request to the server was answered (correctly)
+    void failed(uint8_t server);                                                         //!< A request to the server failed
+    
+  private:
+    /*! Smoothed RTT and RTT variation (ms), in fixed point as TCP implementations keep them.
+     */
+    struct Estimate {
+      uint16_t srtt_x8;   //!< Smoothed RTT, times 8
+      uint16_t rttvar_x4; //!< RTT variation, times 4
+      boolean sampled;    //!< Whether there has been a sample yet
+    };
+    
+    struct Server {
+      IPAddress ip;
+      uint16_t port;
+      Estimate connect;            //!< Opening the connection
+      Estimate response;           //!< Sending the request to having the whole response
+      uint8_t error;               //!< Smoothed error rate, out of 255
+      uint8_t failures;            //!< Consecutive failures
+      unsigned long down_since_ms; //!< Time of the last failure that took it down
+    };
+    
+    Server _servers[SERVER_POOL_MAX_SERVERS];
+    uint8_t _count;
+    
+    boolean _up(uint8_t server);
+    unsigned long _score(uint8_t server);
+    unsigned long _timeout(uint8_t server, Estimate const& estimate, unsigned long min_ms);
+    static void _sample(Estimate& estimate, unsigned long rtt_ms);
+};
+
+#endif // #ifndef POURLOGIC_SERVER_POOL_H
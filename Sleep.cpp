@@ -0,0 +1,115 @@
+// See LICENSE.txt for license details.
+
+#include "Sleep.h"
+#include "pin_config.h"
+#include "Clock.h"
+#include "Trace.h"
+#include "Watchdog.h"
+
+/*! Pin-change masks (one per PCINT port) of the pins that wake us from power-down.
+ */
+static uint8_t wake_pin_masks[3] = {0, 0, 0};
+
+//!< Whether the watchdog (rather than a pin change) ended the last power-down.
+static volatile boolean wdt_woke = false;
+
+/*! The watchdog is only used as a wake-up timer here; note that it fired and return.
+ */
+ISR(WDT_vect) {
+  wdt_woke = true;
+}
+
+#if !defined(RFID_USE_SOFTWARE_SERIAL) && !defined(SETTINGS_FLOW_PCINT)
+// Pin changes only need to wake us. SoftwareSerial (or PinChangeCounter) owns these vectors when it is
+// linked in, and its handler is equally harmless for pins it isn't listening on.
+EMPTY_INTERRUPT(PCINT0_vect);
+EMPTY_INTERRUPT(PCINT1_vect);
+EMPTY_INTERRUPT(PCINT2_vect);
+#endif
+
+//!< Convert a WDTO_* constant into WDTCSR prescaler bits (WDP3 is not adjacent to WDP2..0).
+static uint8_t _wdtPrescalerBits(uint8_t wdt_period) {
+  return (wdt_period & 0x07) | ((wdt_period & 0x08) << 2);
+}
+
+void sleepWakeOnPinChange(uint8_t pin) {
+  wake_pin_masks[digitalPinToPCICRbit(pin)] |= _BV(digitalPinToPCMSKbit(pin));
+}
+
+#ifdef SETTINGS_TRACE_REPLAY
+
+// The trace arrives over the UART, which stops when powered down; sleeping is just waiting
+
+void sleepIdle() {
+  traceReplay.idle();
+}
+
+void sleepPowerDown(uint8_t wdt_period) {
+  clockDelay(16UL << wdt_period); // WDTO_* is log2(period / 16 ms)
+}
+
+#else
+
+void sleepIdle() {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_mode();
+}
+
+void sleepPowerDown(uint8_t wdt_period) {
+  uint8_t saved_pcicr, saved_pcmsk[3]; // others (e.g. SoftwareSerial) may own pin-change interrupts too
+  
+  // Let pending serial output drain; the UART stops when powered down
+  Serial.flush();
+  
+  noInterrupts();
+  saved_pcicr = PCICR;
+  saved_pcmsk[0] = PCMSK0;
+  saved_pcmsk[1] = PCMSK1;
+  saved_pcmsk[2] = PCMSK2;
+  
+  // Arm pin-change wake-up on watched pins
+  PCMSK0 |= wake_pin_masks[0];
+  PCMSK1 |= wake_pin_masks[1];
+  PCMSK2 |= wake_pin_masks[2];
+  PCIFR = _BV(PCIE0) | _BV(PCIE1) | _BV(PCIE2); // clear stale flags
+  PCICR |= (wake_pin_masks[0] ? _BV(PCIE0) : 0)
+         | (wake_pin_masks[1] ? _BV(PCIE1) : 0)
+         | (wake_pin_masks[2] ? _BV(PCIE2) : 0);
+  
+  // Arm the watchdog as a wake-up timer (interrupt, no reset)
+  MCUSR &= ~_BV(WDRF);
+  WDTCSR = _BV(WDCE) | _BV(WDE);
+  WDTCSR = _BV(WDIE) | _wdtPrescalerBits(wdt_period);
+  wdt_reset();
+  wdt_woke = false;
+  
+  // Sleep (interrupts are re-enabled immediately before sleeping so no wake-up is missed)
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  sleep_enable();
+#ifdef sleep_bod_disable
+  sleep_bod_disable();
+#endif
+  interrupts();
+  sleep_cpu();
+  sleep_disable();
+  
+  // Disarm wake-up sources
+#ifdef SETTINGS_WATCHDOG
+  watchdogResume(); // back to guarding the loop
+#else
+  wdt_disable();
+#endif
+  noInterrupts();
+  PCMSK0 = saved_pcmsk[0];
+  PCMSK1 = saved_pcmsk[1];
+  PCMSK2 = saved_pcmsk[2];
+  PCICR = saved_pcicr;
+  interrupts();
+  
+  // millis() stood still. The watchdog ran its period (give or take its oscillator's 10%); a pin change
+  // came at some unknown point in it, so count half.
+  unsigned long period_ms = 16UL << wdt_period; // WDTO_* is log2(period / 16 ms)
+  clockSlept(wdt_woke ? period_ms : period_ms / 2);
+}
+
+#endif // #ifdef SETTINGS_TRACE_REPLAY
@@ -0,0 +1,35 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_SLEEP_H
+#define POURLOGIC_SLEEP_H
+
+#include <Arduino.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+
+/*! \file Sleep.h
+ * \brief Low-power idling between patrons.
+ *
+ * Two sleep depths are offered:
+ *   - #sleepIdle stops the CPU clock only. The UART, timers and SPI keep
+ *     running, so the next received byte (or the millis() tick) wakes us.
+ *     This is used while waiting on a powered RFID reader.
+ *   - #sleepPowerDown stops everything but the watchdog and pin-change
+ *     logic. It is used between RFID listening windows, with the reader
+ *     switched off through #RFID_ENABLE_PIN (so it can't send anything to
+ *     wake us; a patron's tag is read in the next window).
+ *
+ * millis() does not advance while powered down; #sleepPowerDown adds the
+ * time slept to clockMillis() instead (see Clock.h).
+ */
+
+//!< Sleep (idle mode) until the next interrupt of any kind.
+void sleepIdle();
+
+//!< Sleep (power-down mode) until the watchdog period (e.g. WDTO_500MS) elapses or a watched pin changes.
+void sleepPowerDown(uint8_t wdt_period);
+
+//!< Wake from #sleepPowerDown when the given digital pin changes.
+void sleepWakeOnPinChange(uint8_t pin);
+
+#endif // #ifndef POURLOGIC_SLEEP_H
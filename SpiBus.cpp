@@ -0,0 +1,141 @@
+// See LICENSE.txt for license details.
+
+#include "SpiBus.h"
+
+#ifdef SETTINGS_SPI_BUS
+
+static int8_t holder = -1;                               //!< Device holding the bus, or -1
+static uint8_t depth = 0;                                //!< Nested acquisitions by the holder
+static unsigned long acquired_us;                        //!< When the holder took the bus
+static unsigned long held_ms[SPI_DEVICE_COUNT];          //!< Bus time per device ...
+static unsigned int held_us[SPI_DEVICE_COUNT];           //!< ... and the microseconds not yet a whole millisecond
+static unsigned long transfers[SPI_DEVICE_COUNT];
+static boolean network_busy = false;
+
+void spiBusBegin() {
+  pinMode(ETHERNET_CS_PIN, OUTPUT); // (the hardware SS pin, which keeps the AVR SPI master as an output)
+  digitalWrite(ETHERNET_CS_PIN, HIGH);
+  pinMode(SD_CS_PIN, OUTPUT);
+  digitalWrite(SD_CS_PIN, HIGH);
+}
+
+//!< The holder lets the bus go: count its time
+static void _end() {
+  unsigned long us = held_us[holder] + (micros() - acquired_us);
+
+  held_ms[holder] += us / 1000;
+  held_us[holder] = us % 1000;
+  holder = -1;
+  depth = 0;
+#ifdef SPI_HAS_TRANSACTION
+  SPI.endTransaction();
+#endif
+}
+
+/**
+ * A device acquired while another holds the bus takes it over; the other
+ * is counted as having let it go.
+ */
+void spiBusAcquire(SpiDevice device) {
+  if (holder == device) {
+    depth++;
+    return;
+  }
+
+  if (holder >= 0) {
+    _end();
+  }
+
+#ifdef SPI_HAS_TRANSACTION
+  if (device == SPI_DEVICE_ETHERNET) {
+    SPI.beginTransaction(SPISettings(SPI_BUS_ETHERNET_HZ, MSBFIRST, SPI_MODE0));
+  }
+  else {
+    SPI.beginTransaction(SPISettings(SPI_BUS_SD_HZ, MSBFIRST, SPI_MODE0));
+  }
+#else
+  // Both are within reach of the fastest divider; the SD library sets its own while initializing a card
+  SPI.setClockDivider(SPI_CLOCK_DIV2);
+#endif
+
+  holder = device;
+  depth = 1;
+  transfers[device]++;
+  acquired_us = micros();
+}
+
+void spiBusRelease(SpiDevice device) {
+  if (holder == device && --depth == 0) {
+    _end();
+  }
+}
+
+void spiBusSetNetworkBusy(boolean busy) {
+  network_busy = busy;
+}
+
+boolean spiBusBulkAllowed() {
+  return !network_busy;
+}
+
+unsigned long spiBusTime_ms(SpiDevice device) {
+  return held_ms[device];
+}
+
+unsigned long spiBusTransfers(SpiDevice device) {
+  return transfers[device];
+}
+
+#if defined(SETTINGS_JOURNAL) || defined(SETTINGS_PATRON_TABLE)
+
+uint8_t SpiBusSdCard::init(uint8_t sck_rate, uint8_t cs_pin) {
+  uint8_t success;
+
+  spiBusAcquire(SPI_DEVICE_SD);
+  success = Sd2Card::init(sck_rate, cs_pin);
+  spiBusRelease(SPI_DEVICE_SD);
+
+  return success;
+}
+
+uint8_t SpiBusSdCard::readBlock(uint32_t block, uint8_t* dst) {
+  uint8_t success;
+
+  spiBusAcquire(SPI_DEVICE_SD);
+  success = Sd2Card::readBlock(block, dst);
+  spiBusRelease(SPI_DEVICE_SD);
+
+  return success;
+}
+
+uint8_t SpiBusSdCard::readData(uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+  if (!_reading) {
+    spiBusAcquire(SPI_DEVICE_SD);
+    _reading = true;
+  }
+
+  return Sd2Card::readData(block, offset, count, dst);
+}
+
+void SpiBusSdCard::readEnd() {
+  Sd2Card::readEnd();
+
+  if (_reading) {
+    _reading = false;
+    spiBusRelease(SPI_DEVICE_SD);
+  }
+}
+
+uint8_t SpiBusSdCard::writeBlock(uint32_t block, const uint8_t* src) {
+  uint8_t success;
+
+  spiBusAcquire(SPI_DEVICE_SD);
+  success = Sd2Card::writeBlock(block, src);
+  spiBusRelease(SPI_DEVICE_SD);
+
+  return success;
+}
+
+#endif // #if defined(SETTINGS_JOURNAL) || defined(SETTINGS_PATRON_TABLE)
+
+#endif // #ifdef SETTINGS_SPI_BUS
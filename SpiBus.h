@@ -0,0 +1,115 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_SPI_BUS_H
+#define POURLOGIC_SPI_BUS_H
+
+#include <Arduino.h>
+#include <SPI.h>
+
+#include "config.h"
+#include "pin_config.h"
+
+#if defined(SETTINGS_JOURNAL) || defined(SETTINGS_PATRON_TABLE)
+#include <SD.h>
+#endif
+
+/*! \file SpiBus.h
+ * \brief Sharing the SPI bus between the W5100 and the SD card.
+ *
+ * The Ethernet shield's W5100 (#ETHERNET_CS_PIN) and its SD slot
+ * (#SD_CS_PIN) share the one SPI bus. With #SETTINGS_SPI_BUS:
+ *   - #spiBusBegin drives both chip selects high at boot, before either
+ *     library touches the bus, so a card that hasn't been initialized
+ *     (or isn't used) can't answer the W5100's frames.
+ *   - Every call the sketch makes into the Ethernet or SD library is
+ *     bracketed by #spiBusAcquire and #spiBusRelease: the request
+ *     engine's socket setup, status reads and closes, buffered reads and
+ *     writes, each step of the metrics server, Ethernet.begin (and DHCP)
+ *     at boot, opening the journal and patron table files, and SD block
+ *     transfers. These set the bus to the device's fastest clock (both
+ *     run at F_CPU / 2 on an Uno, where the Ethernet library leaves the
+ *     W5100 at F_CPU / 4 until the SD library speeds the bus up) and
+ *     count the time the device held it. A transfer must be finished
+ *     (e.g. an SD partial read ended) before another device is acquired.
+ *   - The time counted is how long the device held the bus, not how
+ *     long SPI was clocking: it includes the library's work between
+ *     frames and, for the W5100, DHCP's wait for a lease at boot. Each
+ *     acquisition counts as one transfer, however many frames it took.
+ *   - Transfers are made in bursts: responses are read through a
+ *     BufferedStream, requests written through a BufferedPrint, and the
+ *     SD card is read and written a block at a time.
+ *
+ * Nothing here preempts anything: the sketch runs one thing at a time,
+ * and a pour already has the bus to itself (it only counts pulses). What
+ * can wait is bulk logging: the request engine notes whether any of its
+ * requests are in flight (#spiBusSetNetworkBusy) and the journal holds a
+ * due write back until they are not (#spiBusBulkAllowed), so an SD
+ * write, which can keep the bus for tens of milliseconds, doesn't delay
+ * noticing a response, or a patron's pour request behind it.
+ *
+ * Without #SETTINGS_SPI_BUS every function is an empty inline and
+ * #SpiBusSdCard is plain Sd2Card, so callers need no #ifdefs.
+ */
+
+/*! A device on the bus.
+ */
+enum SpiDevice {
+  SPI_DEVICE_ETHERNET = 0, //!< The W5100
+  SPI_DEVICE_SD,           //!< The SD card
+  SPI_DEVICE_COUNT
+};
+
+#ifdef SETTINGS_SPI_BUS
+
+#define SPI_BUS_ETHERNET_HZ 14000000UL //!< Fastest SPI clock the W5100 takes
+#define SPI_BUS_SD_HZ 25000000UL       //!< Fastest SPI clock an SD card takes (once initialized)
+
+void spiBusBegin();                       //!< Deselect every device; call first thing in setup()
+void spiBusAcquire(SpiDevice device);     //!< A transfer with the device starts (may be nested)
+void spiBusRelease(SpiDevice device);     //!< ... and ends
+void spiBusSetNetworkBusy(boolean busy);  //!< Whether requests are in flight
+boolean spiBusBulkAllowed();              //!< Whether bulk work (journal writes) may take the bus now
+unsigned long spiBusTime_ms(SpiDevice device);    //!< Time the device has held the bus (see above: not only clocking)
+unsigned long spiBusTransfers(SpiDevice device);  //!< Times the device has taken the bus
+
+#if defined(SETTINGS_JOURNAL) || defined(SETTINGS_PATRON_TABLE)
+/*!
+ * An Sd2Card whose block reads and writes are counted as the SD card's
+ * bus time. A partial block read holds the bus from the first #readData
+ * until #readEnd.
+ *
+ * \brief An Sd2Card that takes the bus for each transfer.
+ */
+class SpiBusSdCard : public Sd2Card {
+
+  public:
+    SpiBusSdCard() : _reading(false) {}
+
+    uint8_t init(uint8_t sck_rate, uint8_t cs_pin);
+    uint8_t readBlock(uint32_t block, uint8_t* dst);
+    uint8_t readData(uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst);
+    void readEnd();
+    uint8_t writeBlock(uint32_t block, const uint8_t* src);
+
+  private:
+    boolean _reading; //!< A partial block read holds the bus
+};
+#endif
+
+#else
+
+inline void spiBusBegin() {}
+inline void spiBusAcquire(SpiDevice) {}
+inline void spiBusRelease(SpiDevice) {}
+inline void spiBusSetNetworkBusy(boolean) {}
+inline boolean spiBusBulkAllowed() { return true; }
+inline unsigned long spiBusTime_ms(SpiDevice) { return 0; }
+inline unsigned long spiBusTransfers(SpiDevice) { return 0; }
+
+#if defined(SETTINGS_JOURNAL) || defined(SETTINGS_PATRON_TABLE)
+typedef Sd2Card SpiBusSdCard;
+#endif
+
+#endif // #ifdef SETTINGS_SPI_BUS
+
+#endif // #ifndef POURLOGIC_SPI_BUS_H
@@ -1,6 +1,8 @@
 // See LICENSE.txt for license details.
 
 #include "StreamUtil.h"
+#include "Clock.h"
+#include "Watchdog.h"
 
 //bool readStreamUntil(Stream& stream, String const &pattern, String &body, int maximum_bytes) {
 bool readStreamUntil(Stream& stream, String const &pattern, unsigned short maximum_bytes, char *body) {
@@ -45,10 +47,11 @@ bool readStreamUntil(Stream& stream, String const &pattern, unsigned short maxim
 }
 
 bool waitForAvailable(Stream& stream, unsigned long timeout_ms) {
-  unsigned long startTime = millis();
+  unsigned long startTime = clockMillis();
   
   while (!stream.available()) {
-    if ((millis() - startTime) > timeout_ms) {
+    watchdogKick(); // bounded by timeout_ms, which may be longer than the watchdog's
+    if ((clockMillis() - startTime) > timeout_ms) {
       return false; // Timeout
     }
   }
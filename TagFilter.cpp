@@ -0,0 +1,185 @@
+// See LICENSE.txt for license details.
+
+#include "TagFilter.h"
+
+#ifdef SETTINGS_TAG_FILTER
+
+TagFilter tagFilter(SETTINGS_TAG_FILTER_EEPROM_OFFSET);
+
+//!< 32-bit FNV-1a of a tag's characters, continuing from #hash
+static uint32_t _fnv1a(String const& tag, uint32_t hash) {
+  for (unsigned int i = 0; i < tag.length(); i++) {
+    hash ^= (uint8_t) tag[i];
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+TagFilter::TagFilter(int base_offset)
+  : _base_offset(base_offset)
+{
+  uint8_t state = EEPROM.read(_base_offset + STATE_OFFSET);
+  boolean sized;
+  
+  _hashes = EEPROM.read(_base_offset + HASHES_OFFSET);
+  _bits = EEPROM.read(_base_offset + BITS_OFFSET) | (EEPROM.read(_base_offset + BITS_OFFSET + 1) << 8);
+  sized = _hashes > 0 && _hashes <= TAG_FILTER_MAX_HASHES
+       && _bits > 0 && _bits <= TAG_FILTER_MAX_BYTES * 8;
+  _valid = sized && state == VALID;
+  
+  if (sized && (state == VALID || state == 0)) { // complete, or part way through a sync
+    _version = _get(VERSION_OFFSET, 4);
+    _target = _get(TARGET_OFFSET, 4);
+    _applied = _get(APPLIED_OFFSET, 2);
+  }
+  else {
+    // Never synced (or kept in another layout); start from nothing
+    _version = _target = _applied = 0;
+  }
+}
+
+unsigned long TagFilter::_get(int offset, uint8_t length) {
+  unsigned long value = 0;
+  
+  for (uint8_t i = length; i > 0; i--) {
+    value = value << 8 | EEPROM.read(_base_offset + offset + i - 1); // little-endian
+  }
+  
+  return value;
+}
+
+void TagFilter::_put(int offset, unsigned long value, uint8_t length) {
+  for (uint8_t i = 0; i < length; i++, value >>= 8) {
+    if (EEPROM.read(_base_offset + offset + i) != (value & 0xFF)) {
+      EEPROM.write(_base_offset + offset + i, value & 0xFF);
+    }
+  }
+}
+
+/**
+ * Takes k EEPROM reads and two hashes of the tag; no network.
+ * \param tag The tag data, as read (see RFID_EM41000#readRFID).
+ */
+boolean TagFilter::mayContain(String const& tag) {
+  uint32_t h1, h2;
+  unsigned int bit, step;
+
+  if (!_valid) {
+    return true; // nothing to go on; ask the server
+  }
+
+  h1 = _fnv1a(tag, 2166136261UL);
+  h2 = _fnv1a(tag, h1) | 1;
+
+  // (h1 + i*h2) mod m, without overflowing
+  bit = h1 % _bits;
+  step = h2 % _bits;
+
+  for (uint8_t i = 0; i < _hashes; i++) {
+    if (!(EEPROM.read(_base_offset + FILTER_OFFSET + (bit >> 3)) & (1 << (bit & 7)))) {
+      return false;
+    }
+    bit += step;
+    if (bit >= _bits) {
+      bit -= _bits;
+    }
+  }
+
+  return true;
+}
+
+void TagFilter::_write(int offset, uint8_t value) {
+  if (EEPROM.read(_base_offset + offset) != value) {
+    if (_valid) {
+      _valid = false;
+      EEPROM.write(_base_offset + STATE_OFFSET, 0);
+    }
+    EEPROM.write(_base_offset + offset, value);
+  }
+}
+
+/**
+ * A delta from version 0 starts from an empty filter of the given size.
+ * Any other must be from the version held, for a filter of the same
+ * size, and, if another delta was part way in, to the same target.
+ * \param base The version the delta is from.
+ * \param target The version it leads to.
+ * \param hashes The number of bits each tag sets, k.
+ * \param bits The size of the filter, m, in bits.
+ * \return False if the filter doesn't fit (#SETTINGS_TAG_FILTER_BYTES) or the delta can't be applied.
+ */
+boolean TagFilter::beginSync(unsigned long base, unsigned long target, uint8_t hashes, unsigned int bits) {
+  if (hashes == 0 || hashes > TAG_FILTER_MAX_HASHES || bits == 0 || bits > TAG_FILTER_MAX_BYTES * 8 || target == 0) {
+    return false;
+  }
+  
+  if (base != 0) {
+    if (base != _version || hashes != _hashes || bits != _bits || (_applied > 0 && target != _target)) {
+      return false;
+    }
+  }
+  else {
+    // From nothing: forget the version first, so a reset part way through starts over
+    _put(VERSION_OFFSET, _version = 0, 4);
+    
+    _write(HASHES_OFFSET, hashes);
+    _write(BITS_OFFSET, bits & 0xFF);
+    _write(BITS_OFFSET + 1, bits >> 8);
+    _hashes = hashes;
+    _bits = bits;
+    
+    for (unsigned int i = 0; i < (_bits + 7) / 8; i++) {
+      _write(FILTER_OFFSET + i, 0);
+    }
+  }
+  
+  _put(TARGET_OFFSET, _target = target, 4);
+  _put(APPLIED_OFFSET, _applied = 0, 2);
+  
+  return true;
+}
+
+/**
+ * \param index The byte of the filter, counting from zero (up to (m+7)/8).
+ * \param value Its bits.
+ */
+void TagFilter::update(unsigned int index, uint8_t value) {
+  if (index < (_bits + 7) / 8) {
+    _write(FILTER_OFFSET + index, value);
+  }
+}
+
+void TagFilter::advanceSync(unsigned int applied) {
+  _put(APPLIED_OFFSET, _applied = applied, 2);
+}
+
+void TagFilter::finishSync() {
+  _put(VERSION_OFFSET, _version = _target, 4);
+  _put(TARGET_OFFSET, _target = 0, 4);
+  _put(APPLIED_OFFSET, _applied = 0, 2);
+  
+  if (!_valid) {
+    EEPROM.write(_base_offset + STATE_OFFSET, VALID);
+    _valid = true;
+  }
+}
+
+void TagFilter::abandonSync() {
+  if (_valid) {
+    _valid = false;
+    EEPROM.write(_base_offset + STATE_OFFSET, 0);
+  }
+  
+  _put(VERSION_OFFSET, _version = 0, 4);
+  _put(TARGET_OFFSET, _target = 0, 4);
+  _put(APPLIED_OFFSET, _applied = 0, 2);
+}
+
+void TagFilter::writeTo(Print& target) {
+  for (unsigned int i = 0; i < (_bits + 7) / 8; i++) {
+    target.write(EEPROM.read(_base_offset + FILTER_OFFSET + i));
+  }
+}
+
+#endif // #ifdef SETTINGS_TAG_FILTER
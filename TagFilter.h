@@ -0,0 +1,110 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_TAG_FILTER_H
+#define POURLOGIC_TAG_FILTER_H
+
+#include <Arduino.h>
+#include <String.h>
+#include <EEPROM.h>
+
+#include "config.h"
+
+#ifdef SETTINGS_TAG_FILTER
+
+#define TAG_FILTER_MAX_BYTES SETTINGS_TAG_FILTER_BYTES //!< Largest filter kept (its bits, in bytes)
+#define TAG_FILTER_MAX_HASHES 16                      //!< Most bits probed per tag
+#define TAG_FILTER_HEADER_BYTES 16                    //!< EEPROM kept ahead of the filter (see #TagFilter)
+
+#if SETTINGS_TAG_FILTER_EEPROM_OFFSET + TAG_FILTER_HEADER_BYTES + TAG_FILTER_MAX_BYTES > 1024
+#error "The tag filter must fit in an Uno's EEPROM (1 KB); reduce SETTINGS_TAG_FILTER_BYTES"
+#endif
+
+/*!
+ * A Bloom filter of the tags enrolled on the server, kept in EEPROM so
+ * a tag that can't be enrolled (a transit pass, a hotel key) is turned
+ * away without asking the server. A tag that is enrolled always passes;
+ * one that isn't passes (and is refused by the server as before) with
+ * the filter's false-positive rate, which the server sizes the filter
+ * for (see #SETTINGS_TAG_FILTER_FP_PERMILLE).
+ *
+ * <pre>
+ *   +0   state (valid or not)
+ *   +1   hashes, k
+ *   +2   bits, m (2 bytes)
+ *   +4   version of the filter (4 bytes; 0 for none)
+ *   +8   version being synced to (4 bytes; 0 if not syncing)
+ *   +12  entries of the delta applied so far (2 bytes)
+ *   +16  the filter (m bits, bit j in byte j/8 under mask 1 << j%8)
+ * </pre>
+ *
+ * A tag sets bits (h1 + i*h2) mod m for i = 0 .. k-1, where h1 is the
+ * 32-bit FNV-1a hash of the tag's characters and h2 the FNV-1a hash of
+ * them again, continuing from h1, with its lowest bit set.
+ *
+ * The server numbers each filter it makes, and sends the bytes that
+ * differ between the version held and its latest (a delta) in chunks
+ * (see PourLogicClient#requestTagFilter), each signed like any
+ * response. A delta from version 0 starts from an empty filter. The
+ * bytes are written as they are read: #beginSync, #update for each
+ * changed byte, #advanceSync once the chunk's HMAC checks out, and
+ * #finishSync once the last has and the filter is the one the server
+ * made. The versions and the entries applied are kept here, so a sync
+ * cut short (or a reset) carries on from the last chunk that checked
+ * out. A chunk that doesn't check out, or a filter that doesn't match
+ * the server's, can't be trusted, so #abandonSync starts over from
+ * version 0.
+ *
+ * The filter is marked not valid as soon as a byte differs from the one
+ * kept, so a filter part way through a sync is not used. Without a
+ * valid filter every tag passes. Bytes that don't change aren't written,
+ * so a sync costs EEPROM wear only where the filter changed.
+ *
+ * \brief Enrolled tags, for turning others away locally.
+ */
+class TagFilter {
+  public:
+    TagFilter(int base_offset);
+
+    boolean valid() { return _valid; } //!< Whether there is a filter to check tags against
+    boolean mayContain(String const& tag); //!< Whether a tag may be enrolled (always true without a valid filter)
+
+    unsigned long version() { return _version; } //!< Version held (or, while syncing, synced from); 0 for none
+    unsigned long syncTarget() { return _target; } //!< Version being synced to; 0 if not syncing
+    unsigned int syncApplied() { return _applied; } //!< Entries of the delta applied so far
+    boolean syncing() { return _target != 0; }      //!< Whether a sync is unfinished
+
+    boolean beginSync(unsigned long base, unsigned long target, uint8_t hashes, unsigned int bits); //!< A delta from #base to #target is starting; false if it can't be applied
+    void update(unsigned int index, uint8_t value); //!< Byte #index of the filter is now #value
+    void advanceSync(unsigned int applied);         //!< A chunk checked out; the first #applied entries of the delta are in
+    void finishSync();                              //!< The whole delta is in and checks out; the filter is at the target version
+    void abandonSync();                             //!< The filter can't be trusted; sync from version 0 next time
+    void writeTo(Print& target);                    //!< The filter's bytes (e.g. to hash them)
+
+  private:
+    static const int STATE_OFFSET = 0;
+    static const int HASHES_OFFSET = 1;
+    static const int BITS_OFFSET = 2;
+    static const int VERSION_OFFSET = 4;
+    static const int TARGET_OFFSET = 8;
+    static const int APPLIED_OFFSET = 12;
+    static const int FILTER_OFFSET = TAG_FILTER_HEADER_BYTES;
+    static const uint8_t VALID = 0x5B; //!< Arbitrary byte pattern marking a complete filter (of this layout)
+
+    void _write(int offset, uint8_t value); //!< Write a filter byte (if it has changed), marking the filter not valid first
+    void _put(int offset, unsigned long value, uint8_t length); //!< Write sync state (the bytes that have changed)
+    unsigned long _get(int offset, uint8_t length);
+
+    int _base_offset;
+    boolean _valid;
+    uint8_t _hashes;
+    unsigned int _bits;
+    unsigned long _version;
+    unsigned long _target;
+    unsigned int _applied;
+};
+
+extern TagFilter tagFilter; //!< Tags enrolled on the server (see #SETTINGS_TAG_FILTER)
+
+#endif // #ifdef SETTINGS_TAG_FILTER
+
+#endif // #ifndef POURLOGIC_TAG_FILTER_H
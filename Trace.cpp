@@ -0,0 +1,324 @@
+// See LICENSE.txt for license details.
+
+#include "Trace.h"
+#include "Clock.h"
+#include "FlowMeter.h"
+
+int TraceRecordingStream::read() {
+  int c = _source->read();
+  
+#ifdef SETTINGS_TRACE_RECORD
+  if (c >= 0) {
+    traceRecorder.record(_type, _arg, c);
+  }
+#endif
+  
+  return c;
+}
+
+// Recording ///////////////////////////////////////////////////////////////////
+
+#ifdef SETTINGS_TRACE_RECORD
+
+TraceRecorder traceRecorder(Serial);
+
+TraceRecorder::TraceRecorder(Print& sink)
+  : _sink(sink), _last_us(0), _response(TRACE_NET_DATA),
+    _pulse_head(0), _pulse_tail(0), _dropped(0)
+{
+}
+
+void TraceRecorder::begin(unsigned long nonce) {
+  _sink.print(F(TRACE_HEADER));
+  for (uint8_t i = 0; i < 4; i++) {
+    _sink.write((uint8_t) (nonce >> (8 * i)));
+  }
+  _last_us = micros();
+}
+
+void TraceRecorder::_write(uint8_t type, uint8_t arg, unsigned long time_us, int value) {
+  unsigned long delta_us = time_us - _last_us;
+  
+  // Stamped before the last event written (a pulse that came in while it was): write it as simultaneous
+  if ((long) delta_us < 0) {
+    delta_us = 0;
+  }
+  else {
+    _last_us = time_us;
+  }
+  
+  _sink.write((uint8_t) ((type << 4) | (arg & 0x0F)));
+  
+  // LEB128
+  while (delta_us >= 0x80) {
+    _sink.write((uint8_t) ((delta_us & 0x7F) | 0x80));
+    delta_us >>= 7;
+  }
+  _sink.write((uint8_t) delta_us);
+  
+  if (value >= 0) {
+    _sink.write((uint8_t) value);
+  }
+}
+
+void TraceRecorder::record(uint8_t type, uint8_t arg, int value) {
+  // Buffered pulses happened before now; keep the trace in order
+  service();
+  _write(type, arg, micros(), value);
+}
+
+void TraceRecorder::pulseFromISR(uint8_t tap) {
+  uint8_t next = (_pulse_head + 1) % TRACE_PULSE_RING;
+  
+  if (next == _pulse_tail) {
+    _dropped++;
+    return;
+  }
+  
+  _pulse_us[_pulse_head] = micros();
+  _pulse_tap[_pulse_head] = tap;
+  _pulse_head = next;
+}
+
+void TraceRecorder::service() {
+  unsigned long time_us;
+  uint8_t tap;
+  
+  while (_pulse_tail != _pulse_head) {
+    noInterrupts();
+    time_us = _pulse_us[_pulse_tail];
+    tap = _pulse_tap[_pulse_tail];
+    interrupts();
+    
+    _write(TRACE_PULSE, tap, time_us, -1);
+    _pulse_tail = (_pulse_tail + 1) % TRACE_PULSE_RING;
+  }
+}
+
+#endif // #ifdef SETTINGS_TRACE_RECORD
+
+// Replaying ///////////////////////////////////////////////////////////////////
+
+#ifdef SETTINGS_TRACE_REPLAY
+
+#ifdef SETTINGS_TRACE_REPLAY_FAST
+TraceReplay traceReplay(Serial, true, true);
+#else
+TraceReplay traceReplay(Serial, false, true);
+#endif
+
+unsigned long clockMillis() {
+  return traceReplay.micros() / 1000UL;
+}
+
+unsigned long clockMicros() {
+  return traceReplay.micros();
+}
+
+void clockDelay(unsigned long ms) {
+  traceReplay.delay(ms);
+}
+
+/**
+ * \param source Where the trace is read from.
+ * \param fast Replay as fast as possible (true) or in real time (false).
+ * \param request_chunks Ask for the trace a chunk at a time (for sources, like Serial, that can overrun).
+ */
+TraceReplay::TraceReplay(Stream& source, boolean fast, boolean request_chunks)
+  : _source(source), _fast(fast), _request_chunks(request_chunks),
+    _start_us(0), _now_us(0), _have_next(false),
+    _next_type(TRACE_END), _next_arg(0), _next_value(-1), _next_us(0),
+    _rfid_head(0), _rfid_count(0), _rfid(*this), _response(*this)
+{
+}
+
+boolean TraceReplay::begin(unsigned long& nonce) {
+  const char* header = TRACE_HEADER;
+  int c;
+  
+  while (*header) {
+    if (_readByte() != *header++) {
+      return false;
+    }
+  }
+  
+  nonce = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    if ((c = _readByte()) < 0) {
+      return false;
+    }
+    nonce |= (unsigned long) c << (8 * i);
+  }
+  
+  _start_us = ::micros();
+  _now_us = 0;
+  _fetch();
+  
+  return true;
+}
+
+int TraceReplay::_readByte() {
+  uint8_t b;
+  
+  if (_request_chunks && !_source.available()) {
+    _source.write(TRACE_CHUNK_REQUEST);
+  }
+  
+  // Stream::readBytes waits (in real time) up to the stream's timeout
+  return (_source.readBytes(&b, 1) == 1) ? b : -1;
+}
+
+void TraceReplay::_fetch() {
+  int c = _readByte();
+  unsigned long delta_us = 0;
+  uint8_t shift = 0;
+  
+  _have_next = false;
+  
+  if (c < 0 || (c >> 4) == TRACE_END) {
+    return; // End of trace
+  }
+  
+  _next_type = c >> 4;
+  _next_arg = c & 0x0F;
+  
+  // LEB128 delta
+  do {
+    if ((c = _readByte()) < 0) {
+      return; // Truncated
+    }
+    delta_us |= (unsigned long) (c & 0x7F) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  
+  _next_us += delta_us;
+  
+  // Payload
+  _next_value = -1;
+  if (_next_type != TRACE_PULSE && (_next_value = _readByte()) < 0) {
+    return; // Truncated
+  }
+  
+  _have_next = true;
+}
+
+unsigned long TraceReplay::micros() {
+  return _fast ? _now_us : (::micros() - _start_us);
+}
+
+void TraceReplay::_deliver() {
+  while (_due()) {
+    if (_next_type == TRACE_PULSE) {
+      FlowMeter::pulse(_next_arg);
+    }
+    else if (_next_type == TRACE_RFID && _rfid_count < TRACE_RFID_RING) {
+      _rfid_ring[(_rfid_head + _rfid_count++) % TRACE_RFID_RING] = _next_value;
+    }
+#ifdef SETTINGS_TRACE_LIVE_NETWORK
+    else if (_next_type == TRACE_RFID) {
+      // Nobody is reading the reader (e.g. mid-pour); overrun, as the UART would, rather than hold up the pulses behind
+    }
+#endif
+    else {
+      break; // Network events wait for their request (as do RFID bytes for room)
+    }
+    _fetch();
+  }
+}
+
+void TraceReplay::delay(unsigned long ms) {
+  unsigned long until_us = micros() + ms * 1000UL;
+  
+  if (_fast) {
+    // Step through the events on the way so each arrives at its own time
+    while (_have_next && (long) (_next_us - until_us) <= 0 && (long) (_next_us - _now_us) > 0) {
+      _now_us = _next_us;
+      _deliver();
+    }
+    _now_us = until_us;
+    _deliver();
+  }
+  else {
+    while ((long) (micros() - until_us) < 0) {
+      _deliver();
+    }
+  }
+}
+
+void TraceReplay::idle() {
+  if (_fast) {
+    if (_have_next && (long) (_next_us - _now_us) > 0) {
+      _now_us = _next_us; // skip ahead to the next event
+    }
+    else {
+      _now_us += TRACE_IDLE_STEP_US; // nothing coming (or it's waiting on someone else); let timeouts run
+    }
+  }
+  
+  _deliver();
+}
+
+int TraceReplay::netEvent(uint8_t type, uint8_t handle) {
+  int value;
+  
+  _deliver();
+  
+  if (!_due() || _next_type != type || _next_arg != handle) {
+    return -1;
+  }
+  
+  value = _next_value;
+  _fetch();
+  _deliver();
+  
+  return value;
+}
+
+int TraceRfidStream::available() {
+  _replay._deliver();
+  return _replay._rfid_count;
+}
+
+int TraceRfidStream::peek() {
+  return available() ? _replay._rfid_ring[_replay._rfid_head] : -1;
+}
+
+int TraceRfidStream::read() {
+  int c = peek();
+  
+  if (c < 0) {
+    _replay.idle(); // polling an empty reader is waiting
+    return -1;
+  }
+  
+  _replay._rfid_head = (_replay._rfid_head + 1) % TRACE_RFID_RING;
+  _replay._rfid_count--;
+  return c;
+}
+
+int TraceResponseStream::available() {
+  // The response was complete in the W5100 when it was recorded, so its bytes are never "late"
+  if (_replay._have_next && _replay._next_type == TRACE_NET_DATA && _replay._next_arg == _handle) {
+    return 1;
+  }
+  
+  _replay.idle(); // nothing more is coming; let the reader's timeout run
+  return 0;
+}
+
+int TraceResponseStream::peek() {
+  return available() ? _replay._next_value : -1;
+}
+
+int TraceResponseStream::read() {
+  int c = peek();
+  
+  if (c >= 0) {
+    _replay._fetch();
+    _replay._deliver();
+  }
+  
+  return c;
+}
+
+#endif // #ifdef SETTINGS_TRACE_REPLAY
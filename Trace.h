@@ -0,0 +1,214 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_TRACE_H
+#define POURLOGIC_TRACE_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/*! \file Trace.h
+ * \brief Recording and replaying the controller's inputs.
+ *
+ * Problems seen at the bar depend on exactly what the RFID reader sent,
+ * when the flow meter pulsed and what the server answered. A trace
+ * captures those inputs, with timestamps, so a session can be replayed
+ * offline against the same code.
+ *
+ * A trace is the header "PLT1", the nonce counter at the start of the
+ * recording (4 bytes, little-endian; server responses are only valid
+ * for the nonces they were sent with) and then events:
+ *
+ * <pre>
+ *   event  := kind delta [payload]
+ *   kind   := 1 byte; type in the high nibble, argument (tap/handle) in the low nibble
+ *   delta  := microseconds since the previous event, unsigned LEB128 (7 bits per byte, low first)
+ * </pre>
+ *
+ * | Type                | Argument | Payload               |
+ * |---------------------|----------|-----------------------|
+ * | #TRACE_RFID         | 0        | byte read from reader |
+ * | #TRACE_PULSE        | tap      | (none)                |
+ * | #TRACE_NET_OPENED   | handle   | 1 connected, 0 failed |
+ * | #TRACE_NET_DONE     | handle   | 1 ready, 0 failed     |
+ * | #TRACE_NET_DATA     | handle   | response byte read    |
+ * | #TRACE_END          | 0        | (none)                |
+ *
+ * With #SETTINGS_TRACE_RECORD the trace is written to Serial as it
+ * happens. With #SETTINGS_TRACE_REPLAY the trace is read from Serial (see
+ * test/trace/trace_tool.py) and stands in for the RFID reader, the flow
+ * meter interrupt and the network, while #clockMillis and friends follow
+ * the trace's timestamps instead of the hardware timers.
+ *
+ * With #SETTINGS_TRACE_LIVE_NETWORK as well, only the RFID reader and the
+ * flow meter come from the trace (which then needs no network events)
+ * and requests go to the real servers, in real time. This is how the
+ * scenarios in test/benchmark drive the loop against a stand-in server.
+ */
+
+#define TRACE_RFID        0x1
+#define TRACE_PULSE       0x2
+#define TRACE_NET_OPENED  0x3
+#define TRACE_NET_DONE    0x4
+#define TRACE_NET_DATA    0x5
+#define TRACE_END         0xF
+
+#define TRACE_HEADER "PLT1"
+#define TRACE_CHUNK_REQUEST '>' //!< Sent by the replayer when it wants the next chunk of the trace
+#define TRACE_CHUNK_SIZE 32     //!< Bytes sent per chunk request
+
+/*! Stream that records each byte read from another stream as a trace event.
+ */
+class TraceRecordingStream : public Stream {
+  public:
+    TraceRecordingStream(uint8_t type) : _type(type), _arg(0), _source(NULL) {}
+    
+    void attach(Stream& source, uint8_t arg = 0) { _source = &source; _arg = arg; }
+    
+    virtual int available() { return _source->available(); }
+    virtual int peek() { return _source->peek(); }
+    virtual int read();
+    virtual size_t write(uint8_t b) { return _source->write(b); }
+    virtual void flush() { _source->flush(); }
+    
+  private:
+    uint8_t _type;
+    uint8_t _arg;
+    Stream* _source;
+};
+
+#ifdef SETTINGS_TRACE_RECORD
+
+#define TRACE_PULSE_RING 32 //!< Pulses that can be buffered between trace writes
+
+/*! \brief Writes a trace of the controller's inputs.
+ */
+class TraceRecorder {
+  public:
+    TraceRecorder(Print& sink);
+    
+    void begin(unsigned long nonce); //!< Write the trace header and start the trace's clock
+    void record(uint8_t type, uint8_t arg, int value = -1); //!< Write an event (value < 0: no payload)
+    void pulseFromISR(uint8_t tap); //!< Buffer a flow pulse (safe from an interrupt handler)
+    void service(); //!< Write out buffered pulses
+    
+    //!< A stream that records response bytes read through it for a request.
+    Stream& response(Stream& source, uint8_t handle) { _response.attach(source, handle); return _response; }
+    
+    unsigned int dropped() { return _dropped; } //!< Pulses lost to a full buffer
+    
+  private:
+    Print& _sink;
+    unsigned long _last_us;
+    TraceRecordingStream _response;
+    
+    volatile unsigned long _pulse_us[TRACE_PULSE_RING];
+    volatile uint8_t _pulse_tap[TRACE_PULSE_RING];
+    volatile uint8_t _pulse_head;
+    volatile uint8_t _pulse_tail;
+    volatile unsigned int _dropped;
+    
+    void _write(uint8_t type, uint8_t arg, unsigned long time_us, int value);
+};
+
+extern TraceRecorder traceRecorder;
+
+#endif // #ifdef SETTINGS_TRACE_RECORD
+
+#ifdef SETTINGS_TRACE_REPLAY
+
+#define TRACE_RFID_RING 16          //!< RFID bytes delivered but not yet read
+#define TRACE_IDLE_STEP_US 10000UL  //!< Time that passes per idle call once there is nothing left to wait for
+
+class TraceReplay;
+
+/*! RFID reader as seen through a trace.
+ */
+class TraceRfidStream : public Stream {
+  public:
+    TraceRfidStream(TraceReplay& replay) : _replay(replay) {}
+    virtual int available();
+    virtual int peek();
+    virtual int read();
+    virtual size_t write(uint8_t) { return 1; }
+  private:
+    TraceReplay& _replay;
+};
+
+/*! A request's response as seen through a trace.
+ */
+class TraceResponseStream : public Stream {
+  public:
+    TraceResponseStream(TraceReplay& replay) : _replay(replay), _handle(0) {}
+    void attach(uint8_t handle) { _handle = handle; }
+    virtual int available();
+    virtual int peek();
+    virtual int read();
+    virtual size_t write(uint8_t) { return 1; }
+  private:
+    TraceReplay& _replay;
+    uint8_t _handle;
+};
+
+/*!
+ * The replayer decodes one event ahead. RFID bytes and flow pulses are
+ * delivered as soon as virtual time reaches them; network events wait
+ * for the #RequestEngine (or the response parser) to ask for them, so
+ * the order of the recording is kept.
+ *
+ * When replaying as fast as possible, virtual time only moves when the
+ * code waits: #clockDelay adds its delay and #idle jumps straight to the
+ * next event. A pour that ends on a 30 s timeout replays in the time it
+ * takes to run the loop 120 times. Otherwise virtual time follows micros().
+ *
+ * \brief Drives the controller from a recorded trace under a virtual clock.
+ */
+class TraceReplay {
+  public:
+    TraceReplay(Stream& source, boolean fast, boolean request_chunks);
+    
+    boolean begin(unsigned long& nonce); //!< Read the trace header (and the recording's starting nonce) and start the virtual clock
+    boolean finished() { return !_have_next; } //!< Whether the whole trace has been delivered
+    
+    unsigned long micros();          //!< Virtual time
+    void delay(unsigned long ms);    //!< Let virtual time pass
+    void idle();                     //!< Nothing to do until the next event; let time pass until then
+    
+    int netEvent(uint8_t type, uint8_t handle); //!< Take a due network event for a request: its value, or -1 if none
+    
+    Stream& rfid() { return _rfid; }
+    Stream& response(uint8_t handle) { _response.attach(handle); return _response; }
+    
+  private:
+    friend class TraceRfidStream;
+    friend class TraceResponseStream;
+    
+    Stream& _source;
+    boolean _fast;
+    boolean _request_chunks;
+    unsigned long _start_us;   //!< micros() at #begin (real-time replay)
+    unsigned long _now_us;     //!< Virtual time (fast replay)
+    
+    boolean _have_next;        //!< Whether the next event has been decoded
+    uint8_t _next_type;
+    uint8_t _next_arg;
+    int _next_value;
+    unsigned long _next_us;    //!< Virtual time of the next event
+    
+    uint8_t _rfid_ring[TRACE_RFID_RING];
+    uint8_t _rfid_head;
+    uint8_t _rfid_count;
+    
+    TraceRfidStream _rfid;
+    TraceResponseStream _response;
+    
+    int _readByte();                //!< Next trace byte, or -1 at the end
+    void _fetch();                  //!< Decode the next event
+    void _deliver();                //!< Deliver due RFID bytes and pulses
+    boolean _due() { return _have_next && (long) (micros() - _next_us) >= 0; }
+};
+
+extern TraceReplay traceReplay;
+
+#endif // #ifdef SETTINGS_TRACE_REPLAY
+
+#endif // #ifndef POURLOGIC_TRACE_H
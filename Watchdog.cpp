@@ -0,0 +1,41 @@
+// See LICENSE.txt for license details.
+
+#include "Watchdog.h"
+
+#ifdef SETTINGS_WATCHDOG
+
+/*! MCUSR as found at reset (before anyone clears it).
+ */
+static uint8_t reset_flags __attribute__((section(".noinit")));
+
+static boolean armed = false;
+
+/*! Runs from the C runtime's start-up code, before the core's init() and
+ * long before a 15 ms watchdog left over from a watchdog reset would fire.
+ */
+void watchdogEarlyInit() __attribute__((naked, used, section(".init3")));
+void watchdogEarlyInit() {
+  reset_flags = MCUSR;
+  MCUSR = 0;
+  wdt_disable();
+}
+
+void watchdogBegin() {
+  armed = true;
+  watchdogResume();
+}
+
+void watchdogResume() {
+  if (armed) {
+    wdt_enable(SETTINGS_WATCHDOG_PERIOD);
+  }
+  else {
+    wdt_disable();
+  }
+}
+
+boolean watchdogCausedReset() {
+  return (reset_flags & _BV(WDRF)) != 0;
+}
+
+#endif // #ifdef SETTINGS_WATCHDOG
@@ -0,0 +1,44 @@
+// See LICENSE.txt for license details.
+
+#ifndef POURLOGIC_WATCHDOG_H
+#define POURLOGIC_WATCHDOG_H
+
+#include <Arduino.h>
+#include <avr/wdt.h>
+
+#include "config.h"
+
+/*! \file Watchdog.h
+ * \brief Resetting the controller when it stops making progress.
+ *
+ * Once armed (#watchdogBegin), the watchdog resets the controller unless
+ * #watchdogKick is called at least every #SETTINGS_WATCHDOG_PERIOD. It is
+ * kicked where the controller waits: each pass of the loop, each poll of
+ * the #RequestEngine, while listening to the RFID reader and while
+ * pouring. Each of those waits is bounded, so only a wedged stage (e.g.
+ * the W5100 no longer answering on SPI) goes a whole period without one.
+ *
+ * #sleepPowerDown borrows the watchdog as its wake-up timer and hands it
+ * back with #watchdogResume.
+ *
+ * A watchdog reset leaves the watchdog running at its shortest period,
+ * so it is switched off first thing after reset, before the Arduino core
+ * starts up. The reset flags are kept for #watchdogCausedReset (some
+ * bootloaders clear them first, in which case it never knows).
+ */
+
+#ifdef SETTINGS_WATCHDOG
+
+void watchdogBegin();           //!< Arm the watchdog to reset the controller
+void watchdogResume();          //!< Arm it again after something else (see #sleepPowerDown) used it
+boolean watchdogCausedReset();  //!< Whether the watchdog caused the last reset
+
+inline void watchdogKick() { wdt_reset(); } //!< Note progress
+
+#else
+
+inline void watchdogKick() {}
+
+#endif // #ifdef SETTINGS_WATCHDOG
+
+#endif // #ifndef POURLOGIC_WATCHDOG_H
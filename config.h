@@ -9,13 +9,63 @@
  * must be recompiled and flashed onto the device.
  */
 
+// Build profile
+// .. which subsystems are compiled in; those left out cost no flash or SRAM (see test/size_report/ for a tally of each)
+#define SETTINGS_PROFILE_MINIMAL  1 //!< Authorize, pour and report (one result queued at a time)
+#define SETTINGS_PROFILE_STANDARD 2 //!< ... plus metrics (served for scraping), hedged pour requests (with SETTINGS_NONCE_WINDOW) and a deeper outbox
+#define SETTINGS_PROFILE_FULL     3 //!< ... plus the SD card journal (its 512-byte block buffer doesn't leave an Uno's 2 KB of SRAM room for the stack)
+
+#ifndef SETTINGS_PROFILE
+#define SETTINGS_PROFILE SETTINGS_PROFILE_STANDARD //!< Profile to build (or pass e.g. -DSETTINGS_PROFILE=1 to the compiler)
+#endif
+
 // Client configuration
 // .. client info
 #define SETTINGS_CLIENT_ID 0         //!< Your bot ID
 #define SETTINGS_CLIENT_KEY "secret" //!< Keep this a secret
+//#define SETTINGS_AUTH_SHA256       //!< Sign requests with HMAC-SHA256 rather than HMAC-SHA1 (the server must agree)
+
+// .. protocol (the server must speak the same one; see PourLogicClient.h)
+#define SETTINGS_PROTOCOL_BASIC    1 //!< ID:NONCE:HMAC, nonces strictly in order; a pour result whose answer is lost is dropped
+#define SETTINGS_PROTOCOL_WINDOWED 2 //!< ... nonces taken out of order within a signed window (#SETTINGS_NONCE_WINDOW)
+#define SETTINGS_PROTOCOL_KEYED    3 //!< ... and pour results keyed by their pour, resent until answered (#SETTINGS_IDEMPOTENT_RESULTS)
+
+#ifndef SETTINGS_PROTOCOL
+#define SETTINGS_PROTOCOL SETTINGS_PROTOCOL_BASIC //!< Protocol to speak (or pass e.g. -DSETTINGS_PROTOCOL=2 to the compiler)
+#endif
+
+#if SETTINGS_PROTOCOL >= SETTINGS_PROTOCOL_WINDOWED
+#define SETTINGS_NONCE_WINDOW        //!< Sign the oldest nonce still in flight so the server can take requests out of order
+#endif
+#define SETTINGS_NONCE_STREAM 0      //!< ... and which of the client's nonce counters this controller's is (e.g. controllers sharing an ID; one per controller, so a controller's taps share it)
 
 // .. flow meter tunables
-#define SETTINGS_FLOW_PULSES_TO_ML 2.16 //!< This depends on your meter and should be determined experimentally based on your setup (TODO from server)
+#define SETTINGS_FLOW_UL_PER_PULSE 2160UL //!< Microlitres per pulse. This depends on your meter and should be determined experimentally based on your setup (see FlowMeter#setCalibration)
+//#define SETTINGS_FLOW_PCINT     //!< Count flow pulses with port-wide pin-change interrupts (any pin, many taps) rather than attachInterrupt() (pins 2 and 3 only)
+#define SETTINGS_FLOW_ADAPTIVE_END        //!< End a pour once flow has clearly stopped, judging by its rate and this tap's past pours, rather than after a fixed time without flow (never under a second; see FlowMeter#readVolume_uL)
+#define SETTINGS_FLOW_FIRST_PULSE_MS 2000 //!< ... and allow this long for flow to start until the tap has learned how long patrons take
+//#define SETTINGS_FLOW_DIAGNOSTICS         //!< Time every flow pulse, and how long interrupts are held off, while pouring (see FlowDiagnostics.h; takes Timer1)
+
+// .. power
+#define SETTINGS_IDLE_SLEEP                        //!< Sleep between patrons rather than busy-polling the RFID reader
+#define SETTINGS_IDLE_LISTEN_MS 250                //!< Time the RFID reader is powered and listened to per idle cycle (ms)
+#define SETTINGS_IDLE_SLEEP_PERIOD WDTO_500MS      //!< Time spent powered-down (reader off) per idle cycle
+
+// .. recovery
+#define SETTINGS_WATCHDOG                          //!< Reset the controller when it stops making progress (e.g. a wedged network request)
+#define SETTINGS_WATCHDOG_PERIOD WDTO_8S           //!< ... after this long without progress
+#define SETTINGS_CHECKPOINT                        //!< Keep the pour in progress in EEPROM so a reset doesn't lose it (see Checkpoint.h)
+#define SETTINGS_CHECKPOINT_PERIOD_MS 5000         //!< Shortest time between saves of the poured volume (EEPROM wears out)
+#define SETTINGS_CHECKPOINT_EEPROM_OFFSET 8        //!< EEPROM address of the checkpoint (the nonce uses 0-4)
+
+// .. enrolled tags
+//#define SETTINGS_TAG_FILTER                      //!< Turn away tags the server hasn't enrolled without asking it (see TagFilter.h; the server must serve SERVER_TAG_FILTER_URI)
+#define SETTINGS_TAG_FILTER_BYTES 256              //!< Largest filter kept (in EEPROM), in bytes
+#define SETTINGS_TAG_FILTER_FP_PERMILLE 10         //!< False-positive rate the server should size the filter for, per thousand unenrolled tags
+#define SETTINGS_TAG_FILTER_REFRESH_MS 600000UL    //!< Time between fetching the filter (a newly enrolled tag is turned away until then)
+#define SETTINGS_TAG_FILTER_RETRY_MS 30000UL       //!< Time before carrying on with a sync that was cut short
+#define SETTINGS_TAG_FILTER_CHUNK 64               //!< Most changed bytes asked for per request (6 body bytes each)
+#define SETTINGS_TAG_FILTER_EEPROM_OFFSET 64       //!< EEPROM address of the filter (after the checkpoint)
 
 // .. ethernet
 #define SETTINGS_ETHERNET_USE_DHCP //!< Use DHCP for this device
@@ -23,8 +73,107 @@
 #define SETTINGS_ETHERNET_MAC {0x00, 0x00, 0x00, 0x00, 0x00, 0x00} //!< Device's MAC address
 #define SETTINGS_ETHERNET_IP  IPAddress(192, 168, 0, 100)          //!< Device's IP address (if not using DHCP)
 
+// .. metrics
+#if SETTINGS_PROFILE >= SETTINGS_PROFILE_STANDARD
+#define SETTINGS_METRICS            //!< Keep counters and histograms (see Metrics.h)
+#define SETTINGS_METRICS_SERVER     //!< Serve them (Prometheus text format) for scraping
+#endif
+#define SETTINGS_METRICS_PORT 9100  //!< Port to serve metrics on
+
+// .. memory diagnostics (see Memory.h)
+#if SETTINGS_PROFILE >= SETTINGS_PROFILE_STANDARD
+#define SETTINGS_MEMORY_DIAGNOSTICS      //!< Track stack and heap high-water marks per pour stage (exported with the metrics)
+#endif
+//#define SETTINGS_MEMORY_SERIAL_REPORT  //!< ... and print them to Serial after each pour (slow if Serial is the RFID reader's)
+
+// .. SD card journal
+#if SETTINGS_PROFILE >= SETTINGS_PROFILE_FULL
+#define SETTINGS_JOURNAL //!< Keep an audit trail of pours, authorizations and errors on the SD card
+#endif
+
+// .. SD card patron table (see PatronTable.h)
+//#define SETTINGS_PATRON_TABLE                    //!< Keep the server's patron table on the SD card, and go by it while no server can be reached (needs SETTINGS_CIRCUIT_BREAKER; the server must serve SERVER_PATRON_TABLE_URI)
+#define SETTINGS_PATRON_TABLE_INDEX_BLOCKS 4       //!< Most index blocks (each covers 102 blocks of 32 patrons, and takes 5 bytes of SRAM)
+#define SETTINGS_PATRON_TABLE_REQUESTS 8           //!< Most blocks fetched per sync attempt (a larger delta carries on over several)
+#define SETTINGS_PATRON_TABLE_REFRESH_MS 300000UL  //!< Time between syncs
+#define SETTINGS_PATRON_TABLE_RETRY_MS 2000UL      //!< Time before carrying on with a sync that isn't finished
+
+// .. shared SPI bus (see SpiBus.h)
+#if SETTINGS_PROFILE >= SETTINGS_PROFILE_FULL
+#define SETTINGS_SPI_BUS //!< Deselect the W5100 and SD card at boot, run each at its fastest clock, hold journal writes back while requests are in flight, and count each device's bus time
+#endif
+
+// .. input traces (see Trace.h; at most one of these)
+//#define SETTINGS_TRACE_RECORD        //!< Write a trace of RFID reads, flow pulses and server responses to Serial
+//#define SETTINGS_TRACE_REPLAY        //!< Take RFID reads, flow pulses and server responses from a trace on Serial
+#define SETTINGS_TRACE_REPLAY_FAST     //!< Replay as fast as possible (virtual time skips ahead while waiting)
+#define SETTINGS_TRACE_BAUD_RATE 115200 //!< Serial baud rate while recording or replaying
+//#define SETTINGS_TRACE_LIVE_NETWORK  //!< ... but talk to the real servers rather than taking their answers from the trace (replays in real time)
+
+// .. benchmarking (see test/benchmark)
+//#define SETTINGS_BENCHMARK           //!< Print a timestamped mark to Serial at each step of serving a patron
+//#define SETTINGS_FLOW_STRESS         //!< Serve no patrons; count a tone() on FLOW_STRESS_PIN (wired to FLOW1_PIN) at rates asked for on Serial (see test/isr_stress)
+
 // .. server info
-#define SETTINGS_SERVER_IP   IPAddress(192, 168, 0, 101) //!< Server IP
-#define SETTINGS_SERVER_PORT 80                          //!< Server port
+#define SETTINGS_SERVER_COUNT 1                          //!< Number of servers (up to SERVER_POOL_MAX_SERVERS)
+#define SETTINGS_SERVER_IPS   {IPAddress(192, 168, 0, 101)} //!< Server IPs, in order of preference (e.g. {IPAddress(192, 168, 0, 101), IPAddress(192, 168, 0, 102)})
+#define SETTINGS_SERVER_PORTS {80}                        //!< Server ports, in the same order
+
+#if SETTINGS_PROFILE >= SETTINGS_PROFILE_STANDARD
+#define SETTINGS_HEDGE_AUTH          //!< Send a second pour request to another server (if there is one) when the first is slow to answer (needs SETTINGS_NONCE_WINDOW)
+#define SETTINGS_OUTBOX_SIZE 2       //!< Pour results that can wait to be reported (each takes a request slot and a socket)
+#else
+#define SETTINGS_OUTBOX_SIZE 1
+#endif
+#define SETTINGS_HEDGE_PERCENTILE 95 //!< ... slower than this percentile of pour requests so far
+
+#define SETTINGS_CIRCUIT_BREAKER                //!< Fail pour requests at once while no server can be reached, probing for one in the background (see CircuitBreaker.h)
+#define SETTINGS_BREAKER_FAILURES 3             //!< ... once this many requests in a row have failed to reach one
+#define SETTINGS_BREAKER_PROBE_MS 2000UL        //!< ... probing this long after, then twice as long after each failed probe
+#define SETTINGS_BREAKER_MAX_PROBE_MS 60000UL   //!< ... up to this long
+
+#if SETTINGS_PROTOCOL >= SETTINGS_PROTOCOL_KEYED
+#define SETTINGS_IDEMPOTENT_RESULTS             //!< Key each pour result by its pour, and resend any whose answer is lost until one arrives (the server records a key once)
+#endif
+#define SETTINGS_RESULT_TIMEOUT_MS 750UL        //!< ... waiting no longer than this for each answer
+
+#define SETTINGS_HTTP_MAX_LINE 256   //!< Longest HTTP response line (status or header) that can be parsed
+#if SETTINGS_PROFILE >= SETTINGS_PROFILE_STANDARD
+#define SETTINGS_HTTP_RX_BUFFER 64   //!< Response bytes taken from the W5100 at a time (see BufferedStream.h; 0 for a byte at a time)
+#define SETTINGS_HTTP_TX_BUFFER 64   //!< Request bytes written to the W5100 at a time (see BufferedPrint.h; 0 for a field at a time)
+#else
+#define SETTINGS_HTTP_RX_BUFFER 32
+#define SETTINGS_HTTP_TX_BUFFER 32
+#endif
+
+// Derived settings (don't edit)
+#ifndef SETTINGS_METRICS
+#undef SETTINGS_METRICS_SERVER // nothing to serve
+#endif
+
+#if defined(SETTINGS_TRACE_REPLAY) && !defined(SETTINGS_TRACE_LIVE_NETWORK)
+#define SETTINGS_TRACE_REPLAY_NETWORK // server answers come from the trace too
+#endif
+
+#ifndef SETTINGS_NONCE_WINDOW
+#undef SETTINGS_HEDGE_AUTH // a hedge overlaps the first request; strictly ordered nonces take one at a time
+#endif
+
+#ifdef SETTINGS_TRACE_REPLAY_NETWORK
+#undef SETTINGS_METRICS_SERVER // nobody to scrape without a network
+#endif
+
+#ifdef SETTINGS_TRACE_REPLAY
+#undef SETTINGS_CHECKPOINT // a replay must not report (or overwrite) a real pour
+#undef SETTINGS_TAG_FILTER // nor turn away a tag the recording asked the server about
+#endif
+
+#ifdef SETTINGS_FLOW_STRESS
+#define SETTINGS_FLOW_DIAGNOSTICS // the point of the exercise
+#endif
+
+#ifdef SETTINGS_TRACE_LIVE_NETWORK
+#undef SETTINGS_TRACE_REPLAY_FAST // real servers take real time
+#endif
 
 #endif // #ifndef POURLOGIC_CLIENT_CONFIG_H
@@ -9,11 +9,14 @@
 #define RFID_RX_PIN 0 //!< RFID soft-serial TX pin
 #define RFID_TX_PIN 1 //!< RFID soft-serial TX pin
 #define RFID_ENABLE_PIN 5 //!< RFID reader ~enable pin
+//#define RFID_USE_SOFTWARE_SERIAL //!< Talk to the RFID reader over RFID_RX_PIN/RFID_TX_PIN rather than Serial
 #define VALVE1_PIN 6 //!< Valve (1) open/close pin
 #define VALVE2_PIN 7 //!< Valve (2) open/close pin
 #define SD_REQUIRED_PIN 10 //< SD card required pin
+#define ETHERNET_CS_PIN 10 //!< W5100 CS pin (the hardware SS pin)
 #define SD_CS_PIN 4 //!< SD card CS pin
 #define PIEZO_PIN 8 //!< Piezo element output pin (requires PWM)
+#define FLOW_STRESS_PIN 9 //!< Test signal output pin, wired to FLOW1_PIN (see SETTINGS_FLOW_STRESS)
 
 // Pin interrupts
 #define FLOW1_INTERRUPT 0
@@ -3,29 +3,89 @@
 // General
 #include <Arduino.h>
 #include <SPI.h>
-#include <SoftwareSerial.h>
 #include <EEPROM.h>
 #include <String.h>
 
 // Ethernet
 #include <Ethernet.h>
-#include <sha1.h> // SHA Hashing (https://github.com/jkiv/Cryptosuite/)
 
 // PourLogic
 #include "config.h"
 #include "pin_config.h"
 
+// .. libraries the profile needs
+#ifdef SETTINGS_AUTH_SHA256
+#include <sha256.h> // SHA Hashing (https://github.com/jkiv/Cryptosuite/)
+#else
+#include <sha1.h>   // SHA Hashing (https://github.com/jkiv/Cryptosuite/)
+#endif
+#if defined(SETTINGS_JOURNAL) || defined(SETTINGS_PATRON_TABLE)
+#include <SD.h>
+#endif
+
 #include "StreamUtil.h"
 #include "HTTPUtil.h"
 #include "HexString.h"
 
+#include "Sleep.h"
 #include "RFID.h"
 #include "FlowMeter.h"
+#include "FlowDiagnostics.h"
 #include "Valve.h"
+#include "RequestEngine.h"
 #include "PourLogicClient.h"
+#include "Metrics.h"
+#include "MetricsServer.h"
+#include "Journal.h"
+#include "Memory.h"
+#include "Clock.h"
+#include "Trace.h"
+#include "Watchdog.h"
+#include "Checkpoint.h"
+#include "TagFilter.h"
+#include "PatronTable.h"
+#include "SpiBus.h"
 
+#define METRICS_SERVER_SLICE_MS 20 //!< Time the loop may spend serving a scrape per iteration
+#define OFFLINE_TONE_HZ 220        //!< Tone telling a patron the server can't be reached (see PourLogicClient#offline)
+#define OFFLINE_TONE_MS 600        //!< ... and its length
 
-#ifdef RFID_USE_SOFTWARE_SERIAL
+#ifdef SETTINGS_MEMORY_DIAGNOSTICS
+#define MEMORY_END_STAGE(stage) memoryEndStage(stage) //!< Note memory high-water marks for a stage of the loop
+#else
+#define MEMORY_END_STAGE(stage)
+#endif
+
+#ifdef SETTINGS_BENCHMARK
+#define BENCHMARK_MARK(mark) benchmarkMark(mark) //!< Print a timestamped step of serving a patron (see test/benchmark)
+#else
+#define BENCHMARK_MARK(mark)
+#endif
+
+
+#if SETTINGS_PROFILE >= SETTINGS_PROFILE_FULL && defined(__AVR_ATmega328P__)
+#error "The full profile needs about 2 KB of SRAM before the stack, more than an Uno has (see test/size_report)"
+#endif
+
+#if defined(SETTINGS_TRACE_RECORD) && !defined(RFID_USE_SOFTWARE_SERIAL)
+#error "Recording a trace needs Serial to itself; define RFID_USE_SOFTWARE_SERIAL"
+#endif
+
+#if defined(SETTINGS_BENCHMARK) && defined(SETTINGS_TRACE_RECORD)
+#error "Benchmark marks would corrupt a trace being recorded on Serial"
+#endif
+
+#if defined(SETTINGS_FLOW_STRESS) && (defined(SETTINGS_TRACE_RECORD) || defined(SETTINGS_TRACE_REPLAY))
+#error "A flow stress run needs Serial to itself"
+#endif
+
+#if defined(SETTINGS_TRACE_REPLAY)
+static RFID_EM41000 rfidReader(traceReplay.rfid(), RFID_ENABLE_PIN);
+#elif defined(SETTINGS_TRACE_RECORD)
+static SoftwareSerial RFIDSerial(RFID_RX_PIN, RFID_TX_PIN);
+static TraceRecordingStream RFIDTrace(TRACE_RFID);
+static RFID_EM41000 rfidReader(RFIDTrace, RFID_ENABLE_PIN);
+#elif defined(RFID_USE_SOFTWARE_SERIAL)
 static SoftwareSerial RFIDSerial(RFID_RX_PIN, RFID_TX_PIN);
 static RFID_EM41000 rfidReader(RFIDSerial, RFID_ENABLE_PIN);
 #else
@@ -35,23 +95,246 @@ static FlowMeter flowMeter(FLOW1_PIN, FLOW1_INTERRUPT);
 static Valve valve(VALVE1_PIN);
 static PourLogicClient client(SETTINGS_CLIENT_ID, SETTINGS_CLIENT_KEY);
 static byte mac[6] = SETTINGS_ETHERNET_MAC; // MAC address of ethernet shield
+#ifdef SETTINGS_METRICS_SERVER
+static MetricsServer metricsServer(SETTINGS_METRICS_PORT);
+#endif
+#ifdef SETTINGS_JOURNAL
+static Journal journal(SD_CS_PIN);
+#endif
+#ifdef SETTINGS_PATRON_TABLE
+static PatronTable patronTable(SD_CS_PIN);
+#endif
+
+#ifdef SETTINGS_BENCHMARK
+/*! Print "B <mark> <ms>" to Serial. The marks are:
+ *   - T: tag read
+ *   - O: valve opened
+ *   - C: valve closed
+ *   - R: ready for the next patron
+ */
+static void benchmarkMark(char mark) {
+  Serial.print(F("B "));
+  Serial.print(mark);
+  Serial.print(' ');
+  Serial.println(clockMillis());
+}
+#endif
+
+#ifdef SETTINGS_CHECKPOINT
+/*! Queue the result of the pour kept in the checkpoint, if there is room.
+ * \return False if the outbox (and the patron table's queue) is still full.
+ */
+static boolean queueCheckpointedPour() {
+  String tag;
+  uint32_t nonce;
+  unsigned long volume_uL;
+  boolean queued;
+  
+  if (!pourCheckpoint.recover(tag, nonce, volume_uL)) {
+    return true; // nothing kept
+  }
+  
+  queued = client.reportPouredVolume(tag, volume_uL, nonce);
+#ifdef SETTINGS_PATRON_TABLE
+  if (!queued) {
+    queued = patronTable.queuePour(tag, nonce, volume_uL);
+  }
+#endif
+  if (queued) {
+    pourCheckpoint.finish(volume_uL);
+  }
+  
+  return queued;
+}
+#endif
+
+#ifdef SETTINGS_FLOW_STRESS
+#define FLOW_STRESS_SETTLE_MS 20      //!< Time allowed after the tone for its last edges to be counted
+#define FLOW_STRESS_MAX_BLOCK_US 16383 //!< Longest delayMicroseconds() can wait
+
+/*! Serve stress runs asked for on Serial (see test/isr_stress). For
+ *   "S <hz> <ms> <block us> <soft serial>"
+ * play a tone of <hz> for <ms> on FLOW_STRESS_PIN, counting it on
+ * FLOW1_PIN, while turning interrupts off for <block us> every
+ * millisecond or so (and, if <soft serial> isn't 0 and the RFID reader
+ * is on SoftwareSerial, sending it a byte as often), then print
+ *   "F <hz> <ms> <expected> <counted> <diagnostics>"
+ * with the diagnostics as flowDiagnosticsPrint() prints them.
+ */
+static void flowStress() {
+  unsigned long hz, duration_ms, block_us, start_ms;
+#ifdef RFID_USE_SOFTWARE_SERIAL
+  boolean soft_serial;
+#endif
+  
+  if (!Serial.find((char*) "S")) {
+    return;
+  }
+  
+  hz = Serial.parseInt();
+  duration_ms = Serial.parseInt();
+  block_us = min((unsigned long) Serial.parseInt(), (unsigned long) FLOW_STRESS_MAX_BLOCK_US);
+#ifdef RFID_USE_SOFTWARE_SERIAL
+  soft_serial = Serial.parseInt() != 0;
+#else
+  Serial.parseInt(); // no SoftwareSerial to load
+#endif
+  
+  flowMeter.startCounting();
+  tone(FLOW_STRESS_PIN, hz, duration_ms);
+  
+  start_ms = clockMillis();
+  while (clockMillis() - start_ms < duration_ms + FLOW_STRESS_SETTLE_MS) {
+    if (block_us > 0) {
+      noInterrupts();
+      delayMicroseconds(block_us);
+      interrupts();
+    }
+#ifdef RFID_USE_SOFTWARE_SERIAL
+    if (soft_serial) {
+      RFIDSerial.write((uint8_t) 0x55); // interrupts are off while each byte goes out
+    }
+#endif
+    clockDelay(1);
+  }
+  
+  flowMeter.stopCounting();
+  
+  Serial.print(F("F "));
+  Serial.print(hz);
+  Serial.print(' ');
+  Serial.print(duration_ms);
+  Serial.print(' ');
+  Serial.print(hz * duration_ms / 1000); // tone() plays whole periods for the duration
+  Serial.print(' ');
+  Serial.print(flowMeter.counted());
+  Serial.print(' ');
+  flowDiagnosticsPrint(Serial, flowMeter.diagnostics());
+  Serial.println();
+}
+#endif
 
 //!<Setup the PourLogic controller environment and settings
 void setup() {
 
-#ifdef RFID_USE_SOFTWARE_SERIAL
+#ifdef SETTINGS_FLOW_STRESS
+  // Nothing else; see flowStress()
+  pinMode(FLOW_STRESS_PIN, OUTPUT);
+  Serial.begin(SETTINGS_TRACE_BAUD_RATE);
+  return;
+#endif
+
+#ifdef SETTINGS_MEMORY_DIAGNOSTICS
+  memoryPaint();
+#endif
+
+  // Neither the W5100 nor the SD card may listen in while the other has the bus
+  spiBusBegin();
+
+#if defined(SETTINGS_TRACE_REPLAY)
+  unsigned long trace_nonce;
+  
+  // Wait for a trace; everything from here on runs on its clock
+  Serial.begin(SETTINGS_TRACE_BAUD_RATE);
+  while (!traceReplay.begin(trace_nonce)) {}
+#ifdef SETTINGS_TRACE_REPLAY_NETWORK
+  client.setNonce(trace_nonce); // the recorded answers are only valid for the recorded nonces
+#endif
+#elif defined(SETTINGS_TRACE_RECORD)
+  RFIDSerial.begin(RFID_BAUD_RATE);
+  RFIDTrace.attach(RFIDSerial);
+  Serial.begin(SETTINGS_TRACE_BAUD_RATE);
+#elif defined(RFID_USE_SOFTWARE_SERIAL)
   RFIDSerial.begin(RFID_BAUD_RATE);
   Serial.begin(9600);
 #else
   Serial.begin(RFID_BAUD_RATE);
 #endif
     
-#ifdef SETTINGS_ETHERNET_USE_DHCP
+#if defined(SETTINGS_TRACE_REPLAY_NETWORK)
+  // No network; the trace speaks for the server
+#elif defined(SETTINGS_ETHERNET_USE_DHCP)
+    // (the W5100 holds the bus while DHCP waits for a lease, too)
+    spiBusAcquire(SPI_DEVICE_ETHERNET);
     while (Ethernet.begin(mac) == 0) {
       delay(1000);
     }
+    spiBusRelease(SPI_DEVICE_ETHERNET);
 #else
+    spiBusAcquire(SPI_DEVICE_ETHERNET);
     Ethernet.begin(mac, SETTINGS_ETHERNET_IP);
+    spiBusRelease(SPI_DEVICE_ETHERNET);
+#endif
+
+#ifdef SETTINGS_METRICS_SERVER
+  metricsServer.begin();
+#endif
+
+#ifdef SETTINGS_PATRON_TABLE
+  // Carry on without one (refusing patrons while offline) if there's no card
+  patronTable.begin();
+#endif
+
+#ifdef SETTINGS_JOURNAL
+  // Carry on without a journal if there's no card
+  if (journal.begin()) {
+#ifdef SETTINGS_WATCHDOG
+    journal.append(JOURNAL_BOOT, watchdogCausedReset(), "", client.nonce(), 0);
+#else
+    journal.append(JOURNAL_BOOT, 0, "", client.nonce(), 0);
+#endif
+  }
+#endif
+
+#ifdef SETTINGS_CHECKPOINT
+  // Report a pour that a reset cut short (or whose result hadn't gone yet) before serving anyone
+  String recovered_tag;
+  uint32_t recovered_nonce;
+  unsigned long recovered_uL;
+  
+  if (pourCheckpoint.recover(recovered_tag, recovered_nonce, recovered_uL)) {
+#ifndef SETTINGS_IDEMPOTENT_RESULTS
+    if (pourCheckpoint.state() == CHECKPOINT_SENT) {
+      recovered_uL = 0; // it may have been recorded; sending it again could bill it twice
+    }
+#endif
+    if (recovered_uL > 0) {
+      if (pourCheckpoint.state() == CHECKPOINT_POURING) { // otherwise it was recorded before the reset
+        metrics.recordPour(0, recovered_uL);
+#ifdef SETTINGS_JOURNAL
+        journal.append(JOURNAL_POUR, 0, recovered_tag, recovered_nonce, recovered_uL);
+#endif
+      }
+      queueCheckpointedPour(); // (the outbox is empty)
+    }
+    else {
+      pourCheckpoint.clear();
+    }
+  }
+#endif
+
+#ifdef SETTINGS_TRACE_RECORD
+  traceRecorder.begin(client.nonce());
+#endif
+
+#ifdef SETTINGS_TAG_FILTER
+  // Carry on with the filter kept in EEPROM (or none) if the server can't be reached
+  client.requestTagFilter(tagFilter);
+#endif
+
+#ifdef SETTINGS_PATRON_TABLE
+  // Start bringing the patron table up to date (a large sync carries on from loop())
+  client.requestPatronTable(patronTable);
+#endif
+
+#ifdef SETTINGS_IDLE_SLEEP
+  // Wake from power-down on flow (the reader is off while powered down, so it has nothing to wake us with)
+  sleepWakeOnPinChange(FLOW1_PIN);
+#endif
+
+#ifdef SETTINGS_WATCHDOG
+  // From here on, every wait is bounded (see Watchdog.h)
+  watchdogBegin();
 #endif
 
   // TODO Grab any settings from the server that might be of interest (e.g. flow conversion?)
@@ -62,38 +345,248 @@ void setup() {
 void loop()
 {
   int max_volume_in_mL = 0;
-  float poured_volume_in_mL = 0.f;
+  boolean authorized = false;
+  unsigned long poured_volume_in_uL = 0;
+  unsigned long pour_nonce = 0;
+  boolean queued = false;
   String tag_data;
+#ifdef SETTINGS_PATRON_TABLE
+  boolean offline = false; // allowed by the patron table, with no server to ask
+  PatronRecord patron;
+  String queued_tag;
+  uint32_t queued_nonce;
+  uint32_t queued_uL;
+#endif
+#ifdef SETTINGS_BENCHMARK
+  static boolean serving = false; // a patron was served since the last "ready" mark
+#endif
+
+#ifdef SETTINGS_FLOW_STRESS
+  flowStress();
+  return;
+#endif
+
+  watchdogKick();
+  
+  // Report earlier pours in the background
+  client.poll();
+
+#ifdef SETTINGS_PATRON_TABLE
+  // Hand pours granted offline that are waiting on the card to the outbox, as it empties
+  if (!client.offline() && client.pendingResults() < CLIENT_MAX_PENDING_RESULTS
+      && patronTable.nextQueuedPour(queued_tag, queued_nonce, queued_uL)
+      && client.reportPouredVolume(queued_tag, queued_uL, queued_nonce)) {
+    patronTable.dequeuePour();
+  }
+#endif
+
+#ifdef SETTINGS_CHECKPOINT
+  // The last pour's result has gone; nothing left to recover
+  if ((pourCheckpoint.state() == CHECKPOINT_REPORTING || pourCheckpoint.state() == CHECKPOINT_SENT) && client.pendingResults() == 0) {
+    pourCheckpoint.clear();
+  }
+#endif
+
+#ifdef SETTINGS_TRACE_RECORD
+  // Write out pulses buffered during the last pour
+  traceRecorder.service();
+#endif
+
+#ifdef SETTINGS_TRACE_REPLAY
+  // Report how the replayed session went, once
+  static boolean replay_reported = false;
+  if (traceReplay.finished() && client.pendingResults() == 0 && !replay_reported) {
+    for (uint8_t family = 0; metrics.printFamily(Serial, family); family++);
+    replay_reported = true;
+  }
+#endif
+
+#ifdef SETTINGS_JOURNAL
+  // Write journal records out between patrons
+  journal.maintain();
+#endif
+
+#ifdef SETTINGS_TAG_FILTER
+  // Pick up newly enrolled tags (and drop withdrawn ones) every so often, and sooner to finish a sync cut short
+  static unsigned long tag_filter_ms = clockMillis();
+  if (clockMillis() - tag_filter_ms >= (tagFilter.syncing() ? SETTINGS_TAG_FILTER_RETRY_MS : SETTINGS_TAG_FILTER_REFRESH_MS)) {
+    client.requestTagFilter(tagFilter);
+    tag_filter_ms = clockMillis();
+  }
+#endif
+
+#ifdef SETTINGS_PATRON_TABLE
+  // Keep the patron table up to date, a few blocks at a time
+  static unsigned long patron_table_ms = clockMillis();
+  if (clockMillis() - patron_table_ms >= (patronTable.syncing() ? SETTINGS_PATRON_TABLE_RETRY_MS : SETTINGS_PATRON_TABLE_REFRESH_MS)) {
+    client.requestPatronTable(patronTable);
+    patron_table_ms = clockMillis();
+  }
+#endif
+
+#ifdef SETTINGS_METRICS_SERVER
+  // Serve any scrape a piece at a time, for a bounded time per loop
+  unsigned long slice_start_ms = clockMillis();
+  do {
+    metricsServer.poll();
+  } while (metricsServer.busy() && clockMillis() - slice_start_ms < METRICS_SERVER_SLICE_MS);
+#endif
+
+#ifdef SETTINGS_BENCHMARK
+  // Back to listening for the next patron
+  if (serving) {
+    BENCHMARK_MARK('R');
+    serving = false;
+  }
+#endif
+
+#ifdef SETTINGS_CHECKPOINT
+  // The last pour's result found no room in the outbox: no one else pours until it has some
+  if (pourCheckpoint.state() == CHECKPOINT_POURING && !queueCheckpointedPour()) {
+    return;
+  }
+#endif
 
+#ifdef SETTINGS_IDLE_SLEEP
+  // Listen for RFID briefly, then power down (reader off) until the watchdog or flow wakes us
+  if (!rfidReader.readRFID(tag_data, SETTINGS_IDLE_LISTEN_MS)) {
+    MEMORY_END_STAGE(MEMORY_IDLE);
+    sleepPowerDown(SETTINGS_IDLE_SLEEP_PERIOD);
+    return; // RFID read timed-out or failed.
+  }
+#else
   // Restrict loop timing
-  delay(1000);
+  clockDelay(1000);
   
   // Wait for RFID
   if (!rfidReader.readRFID(tag_data)) {
+    MEMORY_END_STAGE(MEMORY_IDLE);
     return; // RFID read timed-out or failed.
   }
+#endif
+  MEMORY_END_STAGE(MEMORY_IDLE);
+  BENCHMARK_MARK('T');
+#ifdef SETTINGS_BENCHMARK
+  serving = true;
+#endif
+  
+#ifdef SETTINGS_TAG_FILTER
+  // Not enrolled? No need to ask the server
+  if (!tagFilter.mayContain(tag_data)) {
+    metrics.recordTagFiltered();
+    return;
+  }
+#endif
   
   // Get the max volume the patron can pour
-  if (!client.requestMaxVolume(tag_data, max_volume_in_mL)) {
+  authorized = client.requestMaxVolume(tag_data, max_volume_in_mL);
+  MEMORY_END_STAGE(MEMORY_AUTH);
+  
+#ifdef SETTINGS_PATRON_TABLE
+  // No server to ask? Go by the patron table, as long as the pour's result can wait for one
+  if (!authorized && client.offline()
+      && (client.pendingResults() < CLIENT_MAX_PENDING_RESULTS || patronTable.queuedPours() < PATRON_TABLE_QUEUE_SIZE)
+      && patronTable.lookup(tag_data, patron)) {
+    authorized = offline = true;
+    max_volume_in_mL = PatronTable::allowance(patron);
+    metrics.recordOfflineAuth();
+  }
+#endif
+  
+  if (!authorized) {
+#ifdef SETTINGS_CIRCUIT_BREAKER
+    // Tell the patron there's no server to ask, rather than leave them wondering
+    if (client.offline()) {
+      tone(PIEZO_PIN, OFFLINE_TONE_HZ, OFFLINE_TONE_MS);
+    }
+#endif
+#ifdef SETTINGS_JOURNAL
+    journal.append(JOURNAL_ERROR, client.lastFailure(), tag_data, client.nonce(), 0);
+#endif
     return; // Request failed
   }
   
+#ifdef SETTINGS_JOURNAL
+  journal.append(JOURNAL_AUTH, max_volume_in_mL > 0, tag_data, client.nonce(), max_volume_in_mL);
+#endif
+  
   // Can the patron pour?
-  if (max_volume_in_mL == 0) {
+  if (max_volume_in_mL <= 0) {
     return; // The patron cannot pour
   }
   
+  // Identifies the pour to the server, however often its result is sent
+  pour_nonce = client.nonce();
+#ifdef SETTINGS_PATRON_TABLE
+  if (offline) {
+    pour_nonce = client.reserveNonce(); // no request of its own
+  }
+#endif
+  
+#ifdef SETTINGS_CHECKPOINT
+  pourCheckpoint.begin(tag_data, pour_nonce);
+#endif
+  
   // Open valve
   valve.open();
+  BENCHMARK_MARK('O');
   
   // Read flow meter
-  poured_volume_in_mL = flowMeter.readVolume_mL(max_volume_in_mL);
+  poured_volume_in_uL = flowMeter.readVolume_uL(max_volume_in_mL * 1000UL);
 
   // Close valve
   valve.close();
+  BENCHMARK_MARK('C');
+  MEMORY_END_STAGE(MEMORY_POUR);
   
-  // Send pour data to be logged on the server
-  if (poured_volume_in_mL > 0) {
-    client.reportPouredVolume(tag_data, poured_volume_in_mL);
+#ifdef SETTINGS_FLOW_DIAGNOSTICS
+  // How the pour's pulses were spaced, and whether any look to have been missed
+  metrics.recordPulseTiming(flowMeter.diagnostics().max_jitter_us, flowMeter.diagnostics().max_blocked_us, flowMeter.diagnostics().suspect_missed);
+#ifdef SETTINGS_BENCHMARK
+  Serial.print(F("B F "));
+  flowDiagnosticsPrint(Serial, flowMeter.diagnostics());
+  Serial.println();
+#endif
+#endif
+  
+  // Queue pour data to be logged on the server
+  if (poured_volume_in_uL > 0) {
+    metrics.recordPour(0, poured_volume_in_uL);
+#ifdef SETTINGS_JOURNAL
+    journal.append(JOURNAL_POUR, 0, tag_data, pour_nonce, poured_volume_in_uL);
+#endif
+    queued = client.reportPouredVolume(tag_data, poured_volume_in_uL, pour_nonce);
+#ifdef SETTINGS_PATRON_TABLE
+    if (!queued) {
+      queued = patronTable.queuePour(tag_data, pour_nonce, poured_volume_in_uL); // the outbox is full; wait on the card
+    }
+    if (offline) {
+      patronTable.debit(tag_data, PourLogicClient::reportedVolume_mL(poured_volume_in_uL));
+    }
+#endif
+#ifdef SETTINGS_CHECKPOINT
+    if (queued) {
+      pourCheckpoint.finish(poured_volume_in_uL);
+    }
+    else {
+      pourCheckpoint.hold(poured_volume_in_uL); // queued once there is room, before anyone else pours
+    }
+#else
+    // Nowhere to keep it but here; wait for room
+    while (!queued) {
+      client.poll();
+      queued = client.reportPouredVolume(tag_data, poured_volume_in_uL, pour_nonce);
+    }
+#endif
+  }
+#ifdef SETTINGS_CHECKPOINT
+  else {
+    pourCheckpoint.clear(); // nothing poured, nothing to report
   }
+#endif
+  MEMORY_END_STAGE(MEMORY_REPORT);
+  
+#if defined(SETTINGS_MEMORY_SERIAL_REPORT) && !defined(SETTINGS_TRACE_RECORD) && !defined(SETTINGS_TRACE_REPLAY)
+  memoryPrint(Serial);
+#endif
 }
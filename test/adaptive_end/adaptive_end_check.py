@@ -0,0 +1,125 @@
+#!/usr/bin/env python
+
+# Runs FlowMeter's adaptive end of pour (SETTINGS_FLOW_ADAPTIVE_END) over
+# simulated pours, with the same fixed-point estimator and polling as
+# FlowMeter::readVolume_uL, and checks that it ends pours sooner than the
+# fixed timeout without cutting off the pauses a tap's patrons make.
+
+import sys
+import random
+import argparse
+
+POLL_MS = 50                # FLOW_METER_POLL_MS
+MIN_GAP_MS = 1000           # FLOW_METER_MIN_GAP_MS
+MAX_LEARNED_GAP_MS = 1500   # FLOW_METER_MAX_LEARNED_GAP_MS
+GAP_INTERVALS = 4           # FLOW_METER_GAP_INTERVALS
+MIN_FIRST_PULSE_MS = 1000   # FLOW_METER_MIN_FIRST_PULSE_MS
+MAX_FIRST_PULSE_MS = 8000   # FLOW_METER_MAX_FIRST_PULSE_MS
+FIRST_PULSE_MS = 2000       # SETTINGS_FLOW_FIRST_PULSE_MS
+LAST_PULSE_TIMEOUT_MS = 2000 # readVolume_uL's default
+UL_PER_PULSE = 2160         # SETTINGS_FLOW_UL_PER_PULSE
+
+def int16(value):
+  return (value + 0x8000) % 0x10000 - 0x8000
+
+class Estimate(object):
+  """FlowMeter::Estimate, with FlowMeter::_sample and _bound (uint16_t fields, 16-bit int delta)."""
+  def __init__(self):
+    self.avg_x8 = self.var_x4 = 0
+    self.sampled = False
+
+  def sample(self, ms):
+    ms = min(ms, MAX_FIRST_PULSE_MS)
+    if not self.sampled:
+      self.avg_x8, self.var_x4, self.sampled = (ms << 3) & 0xFFFF, (ms << 1) & 0xFFFF, True
+      return
+    delta = int16(ms - (self.avg_x8 >> 3))
+    self.var_x4 = (self.var_x4 - (self.var_x4 >> 2) + abs(delta)) & 0xFFFF
+    self.avg_x8 = (self.avg_x8 - (self.avg_x8 >> 3) + ms) & 0xFFFF
+
+  def bound(self, unsampled_ms):
+    return (self.avg_x8 >> 3) + self.var_x4 if self.sampled else unsampled_ms
+
+class Meter(object):
+  def __init__(self):
+    self.first_pulse = Estimate()
+    self.gap = Estimate()
+
+  def read(self, pulses_ms):
+    """readVolume_uL over pulses at the given times (ms after the valve opened; no volume limit).
+    Returns (pulses counted, ms from the last pulse to the end of the pour)."""
+    first_pulse_ms = max(MIN_FIRST_PULSE_MS, min(self.first_pulse.bound(FIRST_PULSE_MS), MAX_FIRST_PULSE_MS))
+    now = last = 0
+    history = 0
+    interval_x8 = longest_gap_ms = 0
+    while True:
+      count = sum(1 for t in pulses_ms if t <= now)
+      if count > history:
+        if history == 0:
+          self.first_pulse.sample(now)
+        else:
+          gap_ms = now - last
+          interval_ms = gap_ms // (count - history)
+          longest_gap_ms = max(longest_gap_ms, gap_ms)
+          interval_x8 = interval_ms << 3 if interval_x8 == 0 else interval_x8 - (interval_x8 >> 3) + interval_ms
+        last = now
+      if count == 0:
+        if now > first_pulse_ms:
+          break
+      else:
+        end_gap_ms = min(self.gap.bound(MAX_LEARNED_GAP_MS), MAX_LEARNED_GAP_MS)
+        end_gap_ms = max(end_gap_ms, GAP_INTERVALS * (interval_x8 >> 3))
+        end_gap_ms = max(MIN_GAP_MS, min(end_gap_ms, LAST_PULSE_TIMEOUT_MS))
+        if now - last > end_gap_ms:
+          break
+      history = count
+      now += POLL_MS
+    if longest_gap_ms > 0:
+      self.gap.sample(longest_gap_ms)
+    return count, now - (max(pulses_ms) if count else 0)
+
+def pour(rng, ml, ml_s, pause_ms=0, tail_s=0.0):
+  """Pulse times for a pour: a start after the patron's reaction, steady flow (with one pause part way), then a tail tapering off."""
+  t = rng.uniform(400, 1200)
+  times = []
+  pulses = int(ml * 1000 / UL_PER_PULSE)
+  for i in range(pulses):
+    if pause_ms and i == pulses // 2:
+      t += pause_ms
+    times.append(int(t))
+    rate = ml_s * 1000.0 / UL_PER_PULSE
+    if tail_s and i > pulses * 0.8:
+      rate *= max(0.08, 1 - (i - pulses * 0.8) / (pulses * 0.2))
+    t += 1000.0 / rate
+  return times
+
+SCENARIOS = [
+  ('cut off sharply', dict(ml_s=60)),
+  ('pauses 300 ms', dict(ml_s=60, pause_ms=300)),
+  ('pauses 900 ms', dict(ml_s=60, pause_ms=900)),
+  ('tails off', dict(ml_s=60, tail_s=1.0)),
+  ('trickles', dict(ml_s=1.5)),
+]
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser()
+  parser.add_argument('--pours', type=int, default=40, help='pours per scenario, at one tap')
+  parser.add_argument('--seed', type=int, default=1)
+  options = parser.parse_args()
+
+  rng = random.Random(options.seed)
+  failed = False
+  print('{0:<18} {1:>14} {2:>14} {3:>8}'.format('scenario', 'end ms first', 'end ms last', 'cut off'))
+  for name, shape in SCENARIOS:
+    meter = Meter()
+    ends = []
+    cut = 0
+    for _ in range(options.pours):
+      times = pour(rng, rng.uniform(150, 500), **shape)
+      counted, end_ms = meter.read(times)
+      cut += counted < len(times)
+      ends.append(end_ms)
+    print('{0:<18} {1:>14} {2:>14} {3:>8}'.format(name, ends[0], ends[-1], cut))
+    # A pause under a second is never cut off; a pour that stops sharply ends well before the fixed timeout
+    failed = failed or cut > 0 or (name != 'trickles' and ends[-1] >= LAST_PULSE_TIMEOUT_MS)
+  exit(1 if failed else 0)
@@ -0,0 +1,178 @@
+#!/usr/bin/env python
+
+# Runs patron scenarios through a controller built with SETTINGS_TRACE_REPLAY,
+# SETTINGS_TRACE_LIVE_NETWORK and SETTINGS_BENCHMARK, and reports how long
+# patrons wait on it.
+
+import os
+import sys
+import random
+import argparse
+import tempfile
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'trace'))
+import trace_tool
+
+RFID = 0x1
+PULSE = 0x2
+RFID_START = 0x0A
+RFID_END = 0x0D
+RFID_BYTE_US = 10 * 1000000 // 2400 # a byte (with start and stop bits) at RFID_BAUD_RATE
+
+# W5100 register accesses (one SPI frame each) per EthernetClient call, in the Ethernet 1.x library:
+#   available()      received size, read until it reads the same twice    4
+#   read(buf, n)     received size, read pointer, n bytes, read pointer,
+#                    RECV command and waiting for it                      10 + n
+#   peek()           available(), read pointer, 1 byte                    7
+FRAMES_PER_AVAILABLE = 4
+FRAMES_PER_READ = 10
+FRAMES_PER_PEEK = 7
+
+def scenario(options):
+  """Yields (swipe_us, tag, volume_mL) for each patron, from a seeded sequence."""
+  rng = random.Random(options.seed)
+  now_us = int(options.first_s * 1e6)
+  for patron in range(options.patrons):
+    tag = '{0:010X}'.format(rng.randrange(16 ** 10))
+    volume_mL = rng.randint(options.min_ml, options.max_ml)
+    yield now_us, tag, volume_mL
+    pour_us = volume_mL * 1000.0 / options.flow_ml_s * 1000
+    # The next patron turns up once this one has finished (and walked off), give or take
+    now_us += int(options.reaction_ms * 1000 + pour_us + rng.expovariate(1.0 / (options.gap_s * 1e6)))
+
+def trace_events(patrons, options):
+  """The RFID frames and flow pulses of the patrons, in time order."""
+  pulse_us = options.ul_per_pulse / (options.flow_ml_s * 1000.0) * 1e6
+  all_events = []
+  for swipe_us, tag, volume_mL in patrons:
+    # The reader repeats the tag for as long as the card is held to it
+    frame = bytearray([RFID_START]) + bytearray(tag.encode()) + bytearray([RFID_END])
+    for frame_us in range(swipe_us, swipe_us + options.hold_ms * 1000, options.repeat_ms * 1000):
+      for i, b in enumerate(frame):
+        all_events.append((frame_us + i * RFID_BYTE_US, RFID, 0, b))
+    # Flow starts once the patron sees the valve open (a pulse before then never happened)
+    start_us = swipe_us + options.reaction_ms * 1000
+    for i in range(int(volume_mL * 1000 // options.ul_per_pulse)):
+      all_events.append((int(start_us + i * pulse_us), PULSE, 0, None))
+  all_events.sort(key=lambda e: e[0])
+  return all_events
+
+class Marks(object):
+  """Collects "B <mark> <ms>", "B P ..." (see RequestEngine::release) and "B F ..." (see FlowDiagnostics.h) lines from the controller; passes anything else through."""
+  def __init__(self, passthrough):
+    self.passthrough = passthrough
+    self.marks = []
+    self.responses = []
+    self.pulse_timings = []
+    self.line = ''
+
+  def write(self, text):
+    for c in text:
+      if c != '\n':
+        self.line += c
+        continue
+      fields = self.line.strip().split()
+      if len(fields) == 7 and fields[:2] == ['B', 'P']:
+        self.responses.append([int(f) for f in fields[2:]])
+      elif len(fields) == 9 and fields[:2] == ['B', 'F']:
+        self.pulse_timings.append([int(f) for f in fields[2:]])
+      elif len(fields) == 3 and fields[0] == 'B':
+        self.marks.append((fields[1], int(fields[2])))
+      elif self.passthrough:
+        self.passthrough.write(self.line + '\n')
+      self.line = ''
+
+  def flush(self):
+    pass
+
+def served(patrons, marks):
+  """Pairs each tag read (T) with the patron who swiped for it; returns dicts of the patrons' marks in ms."""
+  swipes_ms = [swipe_us / 1000.0 for swipe_us, tag, volume_mL in patrons]
+  results = []
+  for mark, ms in marks:
+    if mark == 'T':
+      earlier = [s for s in swipes_ms if s <= ms]
+      if earlier:
+        results.append({'S': earlier[-1], 'T': ms})
+    elif results:
+      results[-1].setdefault(mark, ms)
+  return results
+
+def percentile(values, percent):
+  ranked = sorted(values)
+  return ranked[max(0, -(-len(ranked) * percent // 100) - 1)]
+
+def report(patrons, results, taps, out):
+  opened = [r for r in results if 'O' in r and 'C' in r and 'R' in r]
+  out.write('patrons {0}, served {1}, poured {2}\n'.format(len(patrons), len(results), len(opened)))
+  if not opened:
+    return
+  rows = [
+    ('swipe to tag read', [r['T'] - r['S'] for r in opened]),
+    ('swipe to valve open', [r['O'] - r['S'] for r in opened]),
+    ('valve close to ready', [r['R'] - r['C'] for r in opened]),
+  ]
+  out.write('{0:<22} {1:>8} {2:>8} {3:>8} {4:>8}\n'.format('ms', 'p50', 'p90', 'p99', 'max'))
+  for name, values in rows:
+    out.write('{0:<22} {1:>8.0f} {2:>8.0f} {3:>8.0f} {4:>8.0f}\n'.format(name, percentile(values, 50), percentile(values, 90), percentile(values, 99), max(values)))
+  # Back to back: a patron takes from their swipe until the controller is ready for the next
+  busy_ms = sum(r['R'] - r['S'] for r in opened) / float(len(opened))
+  out.write('pours per hour per tap (back to back) {0:.0f}\n'.format(3600000.0 / busy_ms / taps))
+
+def report_responses(responses, out):
+  """Time spent parsing each response, and the SPI frames it took to read it from the W5100."""
+  if not responses:
+    return
+  parse_us = [r[0] for r in responses]
+  frames = [FRAMES_PER_AVAILABLE * available + FRAMES_PER_READ * reads + FRAMES_PER_PEEK * peeks + read_bytes
+            for us, available, reads, peeks, read_bytes in responses]
+  total_bytes = sum(r[4] for r in responses)
+  out.write('responses {0}, {1:.0f} bytes each\n'.format(len(responses), total_bytes / float(len(responses))))
+  out.write('{0:<22} {1:>8} {2:>8} {3:>8} {4:>8}\n'.format('', 'p50', 'p90', 'p99', 'max'))
+  out.write('{0:<22} {1:>8.0f} {2:>8.0f} {3:>8.0f} {4:>8.0f}\n'.format('parse (us)', percentile(parse_us, 50), percentile(parse_us, 90), percentile(parse_us, 99), max(parse_us)))
+  out.write('{0:<22} {1:>8.0f} {2:>8.0f} {3:>8.0f} {4:>8.0f}\n'.format('SPI frames', percentile(frames, 50), percentile(frames, 90), percentile(frames, 99), max(frames)))
+  if total_bytes:
+    out.write('SPI frames per byte {0:.1f}\n'.format(sum(frames) / float(total_bytes)))
+
+def report_pulse_timings(timings, out):
+  """How each pour's flow pulses were spaced (with SETTINGS_FLOW_DIAGNOSTICS)."""
+  if not timings:
+    return
+  out.write('pours timed {0}, pulses {1}, suspect missed {2}\n'.format(len(timings), sum(t[0] for t in timings), sum(t[5] for t in timings)))
+  out.write('max pulse jitter {0} us, max interrupts blocked {1} us\n'.format(max(t[3] for t in timings), max(t[6] for t in timings)))
+
+def main():
+  parser = argparse.ArgumentParser(description='Patron scenario benchmark')
+  parser.add_argument('port', help='serial port of the controller')
+  parser.add_argument('--seed', type=int, default=1, help='seed for the scenario (the same seed gives the same patrons)')
+  parser.add_argument('--patrons', type=int, default=20)
+  parser.add_argument('--first-s', type=float, default=2, help='time of the first swipe')
+  parser.add_argument('--gap-s', type=float, default=4, help='mean time between one patron finishing and the next swiping')
+  parser.add_argument('--hold-ms', type=int, default=1000, help='time the card is held to the reader')
+  parser.add_argument('--repeat-ms', type=int, default=100, help='time between the reader sending the tag again while it is held')
+  parser.add_argument('--reaction-ms', type=int, default=1500, help='time from swipe to the patron starting to pour')
+  parser.add_argument('--min-ml', type=int, default=150)
+  parser.add_argument('--max-ml', type=int, default=500)
+  parser.add_argument('--flow-ml-s', type=float, default=60, help='flow rate while pouring')
+  parser.add_argument('--ul-per-pulse', type=int, default=2160, help='SETTINGS_FLOW_UL_PER_PULSE')
+  parser.add_argument('--taps', type=int, default=1, help='taps served by the controller')
+  parser.add_argument('--save-trace', help='keep the scenario trace here (see trace_tool.py dump)')
+  parser.add_argument('--quiet', action='store_true', help="don't pass the controller's other output through")
+  options = parser.parse_args()
+
+  patrons = list(scenario(options))
+  data = trace_tool.encode(0, trace_events(patrons, options))
+  path = options.save_trace or tempfile.mktemp(suffix='.trace')
+  open(path, 'wb').write(data)
+
+  marks = Marks(None if options.quiet else sys.stderr)
+  trace_tool.play(options.port, path, marks, settle_s=10)
+  report(patrons, served(patrons, marks.marks), options.taps, sys.stdout)
+  report_responses(marks.responses, sys.stdout)
+  report_pulse_timings(marks.pulse_timings, sys.stdout)
+
+  if not options.save_trace:
+    os.remove(path)
+
+if __name__ == '__main__':
+  main()
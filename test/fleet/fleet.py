@@ -0,0 +1,553 @@
+#!/usr/bin/env python
+
+# Load-tests a PourLogic server (or ../stand_in_server) with a fleet of
+# simulated controllers, each speaking the controller's protocol with its own
+# client id and nonce, and reports how the fleet fares as it grows. How each
+# controller behaves (protocol, outbox, hedging, retries) is read from the
+# sketch's own config.h and PourLogicClient.h, so the two stay in step.
+
+import os
+import re
+import sys
+import math
+import time
+import hmac
+import random
+import socket
+import struct
+import hashlib
+import argparse
+import threading
+
+try:
+  import queue
+except ImportError:
+  import Queue as queue
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SKETCH = os.path.join(HERE, '..', '..')
+sys.path.insert(0, os.path.join(HERE, '..', 'stand_in_server'))
+import stand_in_server
+
+AUTH_HEADER = 'X-Pourlogic-Auth'
+POUR_REQUEST_URI = '/pours/new'
+POUR_RESULT_URI = '/pours'
+HOST_HEADER = 'Host: pourlogic.com'
+USER_AGENT_HEADER = 'User-Agent: pourlogic/1.0 arduino/1.0'
+
+# Outcomes of a request
+OK = 'ok'
+UNAUTHORIZED = 'unauthorized' # 401, or an answer whose X-Pourlogic-Auth doesn't check out
+STALE = 'stale'               # 409: the server had seen a newer nonce
+FAILED = 'failed'             # no connection, no answer in time, or any other answer
+
+class Build(object):
+  """The settings a build of the sketch gets: config.h and PourLogicClient.h's #defines, as the preprocessor would see them given -D defines."""
+  DIRECTIVE = re.compile(r'^\s*#\s*(\w+)\s*(.*)$')
+
+  def __init__(self, defines, paths=(os.path.join(SKETCH, 'config.h'), os.path.join(SKETCH, 'PourLogicClient.h'))):
+    self.macros = dict(defines)
+    self.given = set(self.macros)
+    for path in paths:
+      self._read(path)
+
+  def _read(self, path):
+    stack = [] # (this branch is taken, a branch of this #if has been taken)
+    with open(path) as f:
+      for line in f:
+        match = self.DIRECTIVE.match(re.sub(r'^((?:[^"/]|"[^"]*"|/(?!/))*)//.*$', r'\1', line))
+        if not match:
+          continue
+        directive, rest = match.group(1), match.group(2).strip()
+        active = all(taken for taken, _ in stack)
+        if directive in ('if', 'ifdef', 'ifndef'):
+          if directive == 'if':
+            taken = active and bool(self._eval(rest))
+          else:
+            taken = active and ((rest in self.macros) == (directive == 'ifdef'))
+          stack.append((taken, taken))
+        elif directive == 'else':
+          outer = all(taken for taken, _ in stack[:-1])
+          stack[-1] = (outer and not stack[-1][1], True)
+        elif directive == 'endif':
+          stack.pop()
+        elif not active:
+          continue
+        elif directive == 'define':
+          name, _, value = rest.partition(' ')
+          if name not in self.given: # -D wins, as config.h's #ifndef guards mean it to
+            self.macros[name] = value.strip()
+        elif directive == 'undef':
+          self.macros.pop(rest, None)
+
+  def _expand(self, text, depth=0):
+    text = re.sub(r'defined\s*\(?\s*(\w+)\s*\)?', lambda m: '1' if m.group(1) in self.macros else '0', text)
+    text = re.sub(r'\b(\d+)[UL]+\b', r'\1', text)
+    if depth > 8:
+      return text
+    return re.sub(r'\b[A-Za-z_]\w*\b', lambda m: '({0})'.format(self._expand(self.macros[m.group(0)] or '1', depth + 1)) if m.group(0) in self.macros else '0', text)
+
+  def _eval(self, text):
+    expression = self._expand(text).replace('&&', ' and ').replace('||', ' or ')
+    expression = re.sub(r'!(?!=)', ' not ', expression)
+    return eval(expression, {'__builtins__': {}})
+
+  def defined(self, name):
+    return name in self.macros
+
+  def value(self, name):
+    text = self.macros[name]
+    if text.startswith('"'):
+      return text.strip('"')
+    return self._eval(text)
+
+class Settings(object):
+  """What a controller of this build does, from its #defines."""
+  def __init__(self, build):
+    self.profile = build.value('SETTINGS_PROFILE')
+    self.protocol = build.value('SETTINGS_PROTOCOL')
+    self.window = build.defined('SETTINGS_NONCE_WINDOW')
+    self.keyed = build.defined('SETTINGS_IDEMPOTENT_RESULTS')
+    self.hedge = build.defined('SETTINGS_HEDGE_AUTH')
+    self.hedge_percentile = build.value('SETTINGS_HEDGE_PERCENTILE')
+    self.outbox = build.value('SETTINGS_OUTBOX_SIZE')
+    self.result_timeout_s = build.value('CLIENT_RESULT_TIMEOUT_MS') / 1000.0 if build.defined('CLIENT_RESULT_TIMEOUT_MS') else None
+    self.backoff_s = build.value('CLIENT_RESULT_BACKOFF_MS') / 1000.0
+    self.max_backoff_s = build.value('CLIENT_RESULT_MAX_BACKOFF_MS') / 1000.0
+    self.secret = build.value('SETTINGS_CLIENT_KEY')
+    with open(os.path.join(SKETCH, 'Metrics.cpp')) as f:
+      self.latency_bounds_ms = [int(n) for n in re.search(r'LATENCY_BOUNDS_MS\[[^]]*\][^{]*\{([^}]*)\}', f.read()).group(1).split(',')]
+    self.sha256 = build.defined('SETTINGS_AUTH_SHA256')
+
+  def describe(self):
+    return 'profile {0}, protocol {1}: nonces {2}, outbox of {3}, results {4}, hedging {5}'.format(
+      self.profile, self.protocol, 'in a signed window' if self.window else 'strictly in order, one at a time', self.outbox,
+      'keyed and resent until answered' if self.keyed else 'dropped once sent if the answer is lost', 'on' if self.hedge else 'off')
+
+class Eeprom(object):
+  """A controller's EEPROM image, as far as #Nonce uses it: an initialized marker (0xAA) and a little-endian count."""
+  INITIALIZED = 0xAA
+  SIZE = 5
+
+  def __init__(self, path=None):
+    self.path = path
+    self.image = bytearray(self.SIZE)
+    if path and os.path.exists(path):
+      with open(path, 'rb') as f:
+        self.image = bytearray(f.read(self.SIZE).ljust(self.SIZE, b'\0'))
+
+  def next_nonce(self):
+    """Nonce::increment() then Nonce::count()"""
+    count = 0
+    if self.image[0] == self.INITIALIZED:
+      count = struct.unpack('<I', bytes(self.image[1:5]))[0]
+    count = (count + 1) & 0xFFFFFFFF
+    self.image[0] = self.INITIALIZED
+    self.image[1:5] = bytearray(struct.pack('<I', count))
+    return count
+
+  def save(self):
+    if self.path:
+      with open(self.path, 'wb') as f:
+        f.write(bytes(self.image))
+
+class Stats(object):
+  """What the fleet saw during one step of the sweep."""
+  def __init__(self):
+    self.lock = threading.Lock()
+    self.auth_ms = []
+    self.result_ms = []
+    self.wait_s = []
+    self.outcomes = {}
+    self.pours = 0   # pour results answered
+    self.queued = 0  # pour results handed to an outbox
+    self.lost = 0    # ... given up on (dropped once sent, or still failing when the step ended)
+    self.hedges = 0
+
+  def request(self, kind, outcome, ms):
+    with self.lock:
+      self.outcomes[outcome] = self.outcomes.get(outcome, 0) + 1
+      if outcome == OK:
+        (self.auth_ms if kind == 'auth' else self.result_ms).append(ms)
+        if kind == 'result':
+          self.pours += 1
+
+  def count(self, name):
+    with self.lock:
+      setattr(self, name, getattr(self, name) + 1)
+
+  def waited(self, seconds):
+    with self.lock:
+      self.wait_s.append(seconds)
+
+  def requests(self):
+    return sum(self.outcomes.values())
+
+class Protocol(object):
+  """Requests as #PourLogicClient sends them, and checks on the answers."""
+  def __init__(self, options, settings):
+    self.options = options
+    self.digest = hashlib.sha256 if settings.sha256 else hashlib.sha1
+    self.effective_key = self.digest(options.secret.encode()).digest()
+
+  def sign(self, text):
+    return hmac.new(self.effective_key, text.encode(), self.digest).hexdigest()
+
+  def request(self, controller, server, request_line, body, foreground, timeout_s):
+    """Connects, then takes a nonce from the controller (as the sketch does once CONNECTED) and sends; returns (outcome, response body, nonce sent with or None)."""
+    try:
+      connection = socket.create_connection(server, timeout_s)
+    except (socket.error, socket.timeout):
+      return FAILED, None, None
+    try:
+      nonce, position = controller.take_nonce(foreground)
+      try:
+        return self._exchange(connection, controller.client_id, nonce, position, request_line, body, timeout_s) + (nonce,)
+      finally:
+        controller.settle(nonce)
+    finally:
+      connection.close()
+
+  def _exchange(self, connection, client_id, nonce, position, request_line, body, timeout_s):
+    headers = [request_line, HOST_HEADER, USER_AGENT_HEADER,
+               '{0}: {1}:{2}:{3}'.format(AUTH_HEADER, client_id, position, self.sign('{0}\n{1}\n{2}'.format(position, request_line, body)))]
+    if body:
+      headers.append('Content-Length: {0}'.format(len(body)))
+    message = '\r\n'.join(headers) + '\r\n\r\n' + body
+    try:
+      connection.settimeout(timeout_s)
+      connection.sendall(message.encode())
+      chunks = []
+      while True:
+        chunk = connection.recv(1024)
+        if not chunk:
+          break
+        chunks.append(chunk)
+    except (socket.error, socket.timeout):
+      return FAILED, None
+    return self.check(nonce, b''.join(chunks).decode('latin-1'))
+
+  def check(self, nonce, response):
+    head, _, body = response.partition('\r\n\r\n')
+    lines = head.split('\r\n')
+    status = lines[0].split(' ')
+    if len(status) < 2:
+      return FAILED, None
+    if status[1] == '401':
+      return UNAUTHORIZED, None
+    if status[1] == '409':
+      return STALE, None
+    if status[1] != '200':
+      return FAILED, None
+    mac = ''
+    for line in lines[1:]:
+      name, _, value = line.partition(':')
+      if name.strip().lower() == AUTH_HEADER.lower():
+        mac = value.strip().lower()
+    if not hmac.compare_digest(self.sign('{0}\n200\n{1}'.format(nonce, body)), mac):
+      return UNAUTHORIZED, None
+    return OK, body
+
+class Controller(threading.Thread):
+  """One controller: serves patrons at its tap as they arrive, one at a time, and reports pour results from its own outbox in the background."""
+  def __init__(self, client_id, stream, eeprom, fleet):
+    threading.Thread.__init__(self)
+    self.daemon = True
+    self.client_id = client_id
+    self.stream = stream
+    self.eeprom = eeprom
+    self.fleet = fleet
+    self.settings = fleet.settings
+    self.nonces = threading.Condition() # the outbox takes nonces too
+    self.in_flight = set()
+    self.foreground = False # a pour request is under way (see PourLogicClient::_foregroundPending)
+    self.auth_ms = []       # this controller's answered pour requests (see Metrics::authLatencyPercentile)
+    self.outbox = queue.Queue()
+    self.room = threading.Semaphore(self.settings.outbox) # free outbox slots
+    self.rng = random.Random((fleet.options.seed * 1000003 + client_id) * 31 + stream)
+    self.tags = ['{0:010X}'.format(self.rng.randrange(16 ** 10)) for i in range(fleet.options.patrons)]
+    for i in range(self.settings.outbox):
+      worker = threading.Thread(target=self.report_results)
+      worker.daemon = True
+      worker.start()
+
+  def take_nonce(self, foreground):
+    """The next nonce, and how it is signed: NONCE, or with a nonce window, STREAM:NONCE:FLOOR (see PourLogicClient::_printNoncePosition).
+    Without a window only one request is sent at a time (see PourLogicClient::_maySend), and the outbox lets a pour request go first."""
+    with self.nonces:
+      while not self.settings.window and (self.in_flight or (not foreground and self.foreground)):
+        self.nonces.wait()
+      nonce = self.eeprom.next_nonce()
+      self.in_flight.add(nonce)
+      if not self.settings.window:
+        return nonce, str(nonce)
+      return nonce, '{0}:{1}:{2}'.format(self.stream, nonce, min(self.in_flight))
+
+  def settle(self, nonce):
+    with self.nonces:
+      self.in_flight.discard(nonce)
+      self.nonces.notify_all()
+
+  def set_foreground(self, foreground):
+    with self.nonces:
+      self.foreground = foreground
+      self.nonces.notify_all()
+
+  def sim_sleep(self, sim_s):
+    """Sleep for a simulated time; returns False if the step ended meanwhile."""
+    return not self.fleet.stop.wait(sim_s / self.fleet.options.speed)
+
+  def sim_now(self):
+    return (time.time() - self.fleet.started) * self.fleet.options.speed
+
+  def hedge_delay_s(self):
+    """PourLogicClient::_hedgeDelay: the latency bucket holding the hedge percentile of pour requests so far (Metrics::authLatencyPercentile), or halfway to giving up."""
+    timeout_s = self.fleet.options.timeout_s
+    total = len(self.auth_ms)
+    for bound_ms in self.settings.latency_bounds_ms:
+      if total and sum(1 for ms in self.auth_ms if ms <= bound_ms) * 100 >= total * self.settings.hedge_percentile:
+        if bound_ms / 1000.0 < timeout_s:
+          return bound_ms / 1000.0
+        break
+    return timeout_s / 2
+
+  def authorize(self, tag):
+    """PourLogicClient::requestMaxVolume: ask the first server, hedging to another if it is slow (or failing over to it once if it fails). Returns the answer's body and the nonce it was asked with, or None."""
+    servers = self.fleet.servers
+    line = 'GET {0}?u={1} HTTP/1.0'.format(POUR_REQUEST_URI, tag)
+    answers = queue.Queue()
+    def attempt(server):
+      sent = time.time()
+      outcome, body, nonce = self.fleet.protocol.request(self, servers[server], line, '', True, self.fleet.options.timeout_s)
+      answers.put((outcome, body, nonce, (time.time() - sent) * 1000))
+    def start(server):
+      thread = threading.Thread(target=attempt, args=(server,))
+      thread.daemon = True
+      thread.start()
+
+    self.set_foreground(True)
+    try:
+      started = time.time()
+      hedge_s = self.hedge_delay_s() if self.settings.hedge and len(servers) > 1 else None
+      start(0)
+      attempts, outstanding = 1, 1
+      while outstanding > 0:
+        try:
+          wait_s = None if hedge_s is None or attempts > 1 else max(0.0, started + hedge_s - time.time())
+          outcome, body, nonce, ms = answers.get(timeout=wait_s)
+        except queue.Empty:
+          # Slow to answer? Ask another server and take whichever answers first
+          attempts, outstanding = 2, outstanding + 1
+          self.fleet.stats.count('hedges')
+          start(1)
+          continue
+        outstanding -= 1
+        self.fleet.stats.request('auth', outcome, ms)
+        if outcome == OK:
+          self.auth_ms.append((time.time() - started) * 1000)
+          return body, nonce # (the slower request, if any, is abandoned)
+        # Nothing else in flight? Fail over to another server, once
+        if outstanding == 0 and attempts < 2 and len(servers) > 1:
+          attempts, outstanding = 2, 1
+          start(1)
+      return None, None
+    finally:
+      self.set_foreground(False)
+
+  def run(self):
+    options = self.fleet.options
+    arrival = self.sim_now()
+    while True:
+      arrival = self.fleet.next_arrival(self.rng, arrival)
+      if not self.sim_sleep(max(0.0, arrival - self.sim_now())):
+        return
+      tag = self.rng.choice(self.tags)
+      body, pour_nonce = self.authorize(tag)
+      if body is None or int(body or 0) <= 0:
+        continue
+      # Patron waited from arriving (perhaps behind others) until the valve opened
+      self.fleet.stats.waited(self.sim_now() - arrival)
+      volume_mL = min(int(body), self.rng.randint(options.min_ml, options.max_ml))
+      if not self.sim_sleep(options.reaction_s + volume_mL / options.flow_ml_s + options.end_of_pour_s):
+        return
+      # No room in the outbox? No one else pours until there is
+      while not self.room.acquire(False):
+        if not self.sim_sleep(0.05 * options.speed):
+          return
+      self.fleet.stats.count('queued')
+      self.outbox.put((tag, volume_mL, pour_nonce))
+
+  def report_results(self):
+    """An outbox slot: reports pour results as PourLogicClient::_serviceResults does. A result that failed to connect is retried, backing off;
+    one that failed once sent is dropped, unless results are keyed, when it is retried too (a server records a key once)."""
+    settings = self.settings
+    while True:
+      tag, volume_mL, pour_nonce = self.outbox.get()
+      body = 'u={0}&v={1}'.format(tag, volume_mL)
+      if settings.keyed:
+        body += '&k={0}-{1}'.format(self.client_id, pour_nonce)
+      timeout_s = min(self.fleet.options.timeout_s, settings.result_timeout_s or self.fleet.options.timeout_s)
+      server, retries = 0, 0
+      while True:
+        sent = time.time()
+        outcome, _, nonce = self.fleet.protocol.request(self, self.fleet.servers[server], 'POST {0} HTTP/1.0'.format(POUR_RESULT_URI), body, False, timeout_s)
+        self.fleet.stats.request('result', outcome, (time.time() - sent) * 1000)
+        if outcome != FAILED:
+          break # answered (even if not with 200): done with, as the sketch is
+        if nonce is not None and not settings.keyed:
+          self.fleet.stats.count('lost')
+          break
+        # Wait a while, longer each time, then try another server if there is one
+        retries += 1
+        server = (server + 1) % len(self.fleet.servers)
+        if self.fleet.stop.wait(min(settings.backoff_s * (1 << min(retries - 1, 6)), settings.max_backoff_s)):
+          self.fleet.stats.count('lost') # the step is over
+          break
+      self.room.release()
+      self.outbox.task_done()
+
+class Fleet(object):
+  def __init__(self, options, settings, servers):
+    self.options = options
+    self.settings = settings
+    self.servers = servers
+    self.protocol = Protocol(options, settings)
+    self.stop = threading.Event()
+    self.stats = Stats()
+    self.started = time.time()
+
+  def next_arrival(self, rng, after_s):
+    """The next patron to arrive at a tap, in simulated seconds: a Poisson process, with its rate swinging up to --rush times the mean over --rush-period-s."""
+    mean_rate = self.options.patrons_per_hour / 3600.0
+    peak_rate = mean_rate * max(1.0, self.options.rush)
+    t = after_s
+    while True:
+      t += rng.expovariate(peak_rate)
+      # Thin the peak-rate process down to the rate at time t
+      rate = mean_rate * (1 + (max(1.0, self.options.rush) - 1) * (1 - math.cos(2 * math.pi * t / self.options.rush_period_s)) / 2)
+      if rng.random() * peak_rate <= rate:
+        return t
+
+  def step(self, controllers):
+    self.stats = Stats()
+    self.stop.clear()
+    self.started = time.time()
+    threads = [Controller(client_id, stream, eeprom, self) for client_id, stream, eeprom in controllers]
+    for thread in threads:
+      thread.start()
+    time.sleep(self.options.duration_s)
+    self.stop.set()
+    for thread in threads:
+      thread.join()
+      thread.outbox.join()
+    return self.stats, time.time() - self.started
+
+def percentile(values, percent):
+  if not values:
+    return float('nan')
+  ranked = sorted(values)
+  return ranked[max(0, -(-len(ranked) * percent // 100) - 1)]
+
+def report_header(out):
+  out.write('{0:>7} {1:>8} {2:>8} {3:>20} {4:>20} {5:>7} {6:>7} {7:>7} {8:>7} {9:>7} {10:>7}\n'.format(
+    'clients', 'pours/s', 'req/s', 'auth ms p50/90/99', 'result ms p50/90/99', 'wait s', 'auth %', 'nonce %', 'fail %', 'lost %', 'hedge %'))
+
+def report_row(clients, stats, elapsed_s, out):
+  requests = max(1, stats.requests())
+  def spread(values):
+    return '/'.join('{0:.0f}'.format(percentile(values, p)) for p in (50, 90, 99))
+  def rate(outcome):
+    return 100.0 * stats.outcomes.get(outcome, 0) / requests
+  out.write('{0:>7} {1:>8.2f} {2:>8.2f} {3:>20} {4:>20} {5:>7.1f} {6:>7.2f} {7:>7.2f} {8:>7.2f} {9:>7.2f} {10:>7.2f}\n'.format(
+    clients, stats.pours / elapsed_s, stats.requests() / elapsed_s, spread(stats.auth_ms), spread(stats.result_ms),
+    percentile(stats.wait_s, 90), rate(UNAUTHORIZED), rate(STALE), rate(FAILED),
+    100.0 * stats.lost / max(1, stats.queued), 100.0 * stats.hedges / max(1, len(stats.auth_ms))))
+
+def address(text):
+  host, _, port = text.rpartition(':')
+  return (host or '127.0.0.1', int(port))
+
+def define(text):
+  name, _, value = text.partition('=')
+  return name, value or '1'
+
+def main():
+  parser = argparse.ArgumentParser(description='PourLogic fleet load test')
+  parser.add_argument('--clients', default='1,5,10,20,50', help='comma-separated fleet sizes to sweep')
+  parser.add_argument('--duration-s', type=float, default=30, help='wall time to run each fleet size for')
+  parser.add_argument('--speed', type=float, default=60, help='simulated seconds per wall second (pours and arrivals; not the network)')
+  parser.add_argument('-D', dest='defines', type=define, action='append', default=[], metavar='NAME[=VALUE]', help='build the controllers as the compiler would with this -D (e.g. -D SETTINGS_PROTOCOL=2); the rest comes from config.h')
+  parser.add_argument('--first-id', type=int, default=1, help='client id of the first controller')
+  parser.add_argument('--taps-per-id', type=int, default=1, help='(SETTINGS_NONCE_WINDOW) controllers sharing a client id, each with its own nonce stream')
+  parser.add_argument('--eeprom-dir', help='keep each controller\'s EEPROM image (its nonce) here between runs')
+  parser.add_argument('--seed', type=int, default=1)
+  parser.add_argument('--patrons', type=int, default=50, help='regulars per tap (their tags)')
+  parser.add_argument('--patrons-per-hour', type=float, default=30, help='mean arrival rate at each tap')
+  parser.add_argument('--rush', type=float, default=1, help='peak arrival rate, as a multiple of the mean (1: steady)')
+  parser.add_argument('--rush-period-s', type=float, default=3600, help='time from one peak to the next')
+  parser.add_argument('--reaction-s', type=float, default=1.5, help='time from the valve opening to the patron pouring')
+  parser.add_argument('--end-of-pour-s', type=float, default=3, help='time from flow stopping to the valve closing')
+  parser.add_argument('--min-ml', type=int, default=150)
+  parser.add_argument('--max-ml', type=int, default=500)
+  parser.add_argument('--flow-ml-s', type=float, default=60)
+  parser.add_argument('--timeout-s', type=float, default=10, help='time to wait for a connection or an answer (a keyed pour result waits no longer than the build\'s SETTINGS_RESULT_TIMEOUT_MS)')
+  parser.add_argument('--server', type=address, action='append', help='host:port of a server to test, in order of preference (repeat for more); without it, stand-in servers are run here')
+  parser.add_argument('--stand-ins', type=int, default=1, help='stand-in servers to run, sharing one record of nonces and results (hedging and failover need two)')
+  parser.add_argument('--secret', help='SETTINGS_CLIENT_KEY (default: config.h\'s)')
+  parser.add_argument('--delay-ms', type=float, default=0, help='(stand-in server) time to hold each answer back')
+  parser.add_argument('--jitter-ms', type=float, default=0, help='(stand-in server) ... give or take up to this much')
+  parser.add_argument('--lose-answers', type=float, default=0, help='(stand-in server) percentage of pour results recorded but answered too late to count')
+  options = parser.parse_args()
+
+  settings = Settings(Build(options.defines))
+  if options.secret is None:
+    options.secret = settings.secret
+  if options.taps_per_id > 1 and not settings.window:
+    parser.error('controllers can only share a client id with SETTINGS_NONCE_WINDOW (e.g. -D SETTINGS_PROTOCOL=2)')
+  sys.stderr.write('controllers: {0}\n'.format(settings.describe()))
+
+  stand_ins = []
+  if options.server is None:
+    server_options = stand_in_server.parser().parse_args(
+      ['--check-nonces', '--secret', options.secret, '--delay-ms', str(options.delay_ms), '--jitter-ms', str(options.jitter_ms),
+       '--lose-answers', str(options.lose_answers), '--lose-ms', str(options.timeout_s * 1000 + 1000), '--seed', str(options.seed)] +
+      (['--sha256'] if settings.sha256 else []))
+    for i in range(max(1, options.stand_ins)):
+      server = stand_in_server.StandInServer(('127.0.0.1', 0), server_options)
+      if stand_ins:
+        # One database behind them all, as a real server's replicas would share
+        first = stand_ins[0]
+        server.lock, server.keys, server.poured, server.last_nonce, server.windows = first.lock, first.keys, first.poured, first.last_nonce, first.windows
+      thread = threading.Thread(target=server.serve_forever)
+      thread.daemon = True
+      thread.start()
+      stand_ins.append(server)
+    options.server = [server.server_address for server in stand_ins]
+
+  sizes = [int(n) for n in options.clients.split(',')]
+  controllers = []
+  for i in range(max(sizes)):
+    client_id, stream = options.first_id + i // options.taps_per_id, i % options.taps_per_id
+    path = os.path.join(options.eeprom_dir, '{0}-{1}.eep'.format(client_id, stream)) if options.eeprom_dir else None
+    controllers.append((client_id, stream, Eeprom(path)))
+
+  fleet = Fleet(options, settings, options.server)
+  report_header(sys.stdout)
+  try:
+    for size in sizes:
+      stats, elapsed_s = fleet.step(controllers[:size])
+      report_row(size, stats, elapsed_s, sys.stdout)
+      sys.stdout.flush()
+  finally:
+    for client_id, stream, eeprom in controllers:
+      eeprom.save()
+
+  for server in stand_ins:
+    server.shutdown()
+  if stand_ins:
+    sys.stderr.write('stand-in servers: answered {0}, rejected {1}, stale {2}, results recorded {3} (duplicates {4})\n'.format(
+      sum(s.answered for s in stand_ins), sum(s.rejected for s in stand_ins), sum(s.stale for s in stand_ins),
+      sum(s.recorded for s in stand_ins), sum(s.duplicates for s in stand_ins)))
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,60 @@
+#!/usr/bin/env python
+
+# Drives a controller built with SETTINGS_FLOW_STRESS through a sweep of pulse
+# rates and interrupt loads, and reports how many of the pulses it counted.
+
+import sys
+import time
+import argparse
+
+import serial
+
+FIELDS = ('hz', 'ms', 'expected', 'counted', 'timed', 'min_us', 'max_us', 'jitter_us', 'long', 'missed', 'blocked_us')
+
+def run(port, hz, duration_ms, block_us, soft_serial):
+  """One run (see flowStress in pourlogic_client.ino); returns its "F ..." line as a dict."""
+  port.write('S {0} {1} {2} {3}\n'.format(hz, duration_ms, block_us, 1 if soft_serial else 0).encode())
+  deadline = time.time() + duration_ms / 1000.0 + 5
+  while time.time() < deadline:
+    fields = port.readline().decode('ascii', 'replace').split()
+    if len(fields) == len(FIELDS) + 1 and fields[0] == 'F':
+      return dict(zip(FIELDS, [int(f) for f in fields[1:]]))
+  raise RuntimeError('no answer for {0} Hz'.format(hz))
+
+def parse_list(text):
+  return [int(v) for v in text.split(',') if v]
+
+def main():
+  parser = argparse.ArgumentParser(description='Flow meter interrupt stress test')
+  parser.add_argument('port', help='serial port of the controller')
+  parser.add_argument('--baud', type=int, default=115200, help='SETTINGS_TRACE_BAUD_RATE')
+  parser.add_argument('--rates', type=parse_list, default=list(range(1000, 10001, 1000)), help='pulse rates to try (Hz, comma separated)')
+  parser.add_argument('--duration-ms', type=int, default=2000, help='length of each run (at most 65535 pulses)')
+  parser.add_argument('--block-us', type=parse_list, default=[0], help='interrupts-off windows to try, every millisecond or so (us, comma separated)')
+  parser.add_argument('--soft-serial', action='store_true', help='also send to the RFID reader over SoftwareSerial during each run')
+  parser.add_argument('--repeat', type=int, default=1, help='runs of each rate and load')
+  options = parser.parse_args()
+
+  port = serial.Serial(options.port, options.baud, timeout=1)
+  time.sleep(2) # opening the port resets the board
+  port.reset_input_buffer()
+
+  out = sys.stdout
+  out.write('{0:>6} {1:>6} {2:>8} {3:>8} {4:>9} {5:>7} {6:>9} {7:>5} {8:>7} {9:>8}\n'.format(
+    'Hz', 'block', 'expected', 'counted', 'accuracy', 'lost', 'jitter us', 'long', 'missed?', 'blocked'))
+  worst = 100.0
+  for block_us in options.block_us:
+    for hz in options.rates:
+      for _ in range(options.repeat):
+        r = run(port, hz, options.duration_ms, block_us, options.soft_serial)
+        accuracy = 100.0 * r['counted'] / r['expected'] if r['expected'] else 100.0
+        worst = min(worst, accuracy)
+        # "missed?" is the controller's own guess (see FlowDiagnostics.h); "lost" is the truth
+        out.write('{0:>6} {1:>6} {2:>8} {3:>8} {4:>8.2f}% {5:>7} {6:>9} {7:>5} {8:>7} {9:>8}\n'.format(
+          hz, block_us, r['expected'], r['counted'], accuracy, r['expected'] - r['counted'],
+          r['jitter_us'], r['long'], r['missed'], r['blocked_us']))
+        out.flush()
+  out.write('worst accuracy {0:.2f}%\n'.format(worst))
+
+if __name__ == '__main__':
+  main()
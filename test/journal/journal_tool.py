@@ -0,0 +1,65 @@
+#!/usr/bin/env python
+
+# Replays a copy of a PourLogic controller's SD card journal (see Journal.h).
+
+import sys
+import struct
+
+BLOCK_SIZE = 512
+GROUPS = 63
+GROUP_BLOCKS = 32
+DATA_BLOCKS = GROUPS * GROUP_BLOCKS
+RECORDS_PER_BLOCK = 31
+MAGIC = 0x4C50        # "PL"
+INDEX_MAGIC = 0x49584C50  # "PLXI"
+
+TYPES = {1: 'boot', 2: 'auth', 3: 'pour', 4: 'error'}
+
+def block(data, n):
+  return data[n * BLOCK_SIZE:(n + 1) * BLOCK_SIZE]
+
+def data_block(data, sequence):
+  """Returns the records of data block #sequence, or None if it isn't that block (not written, or overwritten since)."""
+  raw = block(data, 1 + (sequence - 1) % DATA_BLOCKS)
+  if len(raw) < BLOCK_SIZE:
+    return None
+  magic, count, _, block_sequence, _ = struct.unpack_from('<HBBII', raw)
+  if magic != MAGIC or block_sequence != sequence or count > RECORDS_PER_BLOCK:
+    return None
+  return [struct.unpack_from('<BB5sBII', raw, 16 + 16 * i) for i in range(count)]
+
+def start_sequence(data, nonce):
+  """The newest group starting at or before the nonce (else the oldest group), as the index has it."""
+  index = block(data, 0)
+  if struct.unpack_from('<I', index)[0] != INDEX_MAGIC:
+    raise ValueError('not a PourLogic journal')
+  groups = [struct.unpack_from('<II', index, 8 + 8 * g) for g in range(GROUPS)]
+  groups = [(sequence, first_nonce) for sequence, first_nonce in groups if sequence != 0]
+  if not groups:
+    return None
+  before = [sequence for sequence, first_nonce in groups if first_nonce <= nonce]
+  return max(before) if before else min(sequence for sequence, _ in groups)
+
+def replay(data, nonce):
+  """Yields (type, code, tag, nonce, value) for each record at or after the nonce, in the order written."""
+  sequence = start_sequence(data, nonce)
+  while sequence is not None:
+    records = data_block(data, sequence)
+    if records is None:
+      return
+    for record_type, code, tag, _, record_nonce, value in records:
+      if record_nonce >= nonce:
+        yield record_type, code, tag, record_nonce, value
+    sequence += 1
+
+def hex_tag(tag):
+  return ''.join('{0:02X}'.format(b) for b in bytearray(tag))
+
+if __name__ == "__main__":
+  if len(sys.argv) not in (2, 3):
+    sys.stderr.write("Usage: {0} JOURNAL.BIN [nonce]\n".format(sys.argv[0]))
+    exit(1)
+  with open(sys.argv[1], 'rb') as f:
+    data = f.read()
+  for record_type, code, tag, record_nonce, value in replay(data, int(sys.argv[2]) if len(sys.argv) == 3 else 0):
+    print('{0:<6} {1:>3} {2} {3:>10} {4:>10}'.format(TYPES.get(record_type, record_type), code, hex_tag(tag), record_nonce, value))
@@ -0,0 +1,86 @@
+#!/usr/bin/env python
+
+# Breaks down flash and SRAM use per module for a PourLogic controller build.
+
+import os
+import sys
+import subprocess
+import tempfile
+
+FQBN = 'arduino:avr:uno'
+FLASH_BYTES = 32256 # less the bootloader
+SRAM_BYTES = 2048
+
+def module_sizes(elf):
+  """Returns {module: [flash, sram]} from an elf's symbols (with line info when built with -g)."""
+  modules = {}
+  output = subprocess.check_output(['avr-nm', '--print-size', '--size-sort', '--line-numbers', '-C', elf]).decode()
+  for line in output.splitlines():
+    parts = line.split('\t')
+    fields = parts[0].split(None, 3)
+    if len(fields) < 4:
+      continue
+    size, kind = int(fields[1], 16), fields[2].lower()
+    location = parts[1] if len(parts) > 1 else ''
+    module = os.path.basename(location.rsplit(':', 1)[0]) if location else '(libraries/core)'
+    sizes = modules.setdefault(module, [0, 0])
+    if kind in 'tr':   # code, constants
+      sizes[0] += size
+    elif kind == 'd':  # initialized data: its initial values live in flash
+      sizes[0] += size
+      sizes[1] += size
+    elif kind == 'b':  # zeroed data
+      sizes[1] += size
+  return modules
+
+def totals(elf):
+  """Returns (flash, sram) as avr-size has them: .text + .data, and .data + .bss."""
+  output = subprocess.check_output(['avr-size', elf]).decode()
+  text, data, bss = [int(field) for field in output.splitlines()[1].split()[:3]]
+  return text + data, data + bss
+
+def report(elf, title):
+  modules = module_sizes(elf)
+  print(title)
+  print('  {0:<28} {1:>8} {2:>8}'.format('module', 'flash', 'sram'))
+  for module, (flash, sram) in sorted(modules.items(), key=lambda m: -m[1][0]):
+    print('  {0:<28} {1:>8} {2:>8}'.format(module, flash, sram))
+  flash = sum(m[0] for m in modules.values())
+  sram = sum(m[1] for m in modules.values())
+  print('  {0:<28} {1:>8} {2:>8}'.format('total (symbols)', flash, sram))
+  print('  {0:<28} {1:>7}% {2:>7}%'.format('of an Uno', 100 * flash // FLASH_BYTES, 100 * sram // SRAM_BYTES))
+  print(subprocess.check_output(['avr-size', elf]).decode())
+
+def build(sketch, profile, protocol):
+  build_path = tempfile.mkdtemp(prefix='pourlogic-size-')
+  flags = '-DSETTINGS_PROFILE={0} -DSETTINGS_PROTOCOL={1}'.format(profile, protocol)
+  subprocess.check_call(['arduino-cli', 'compile', '--fqbn', FQBN, '--build-path', build_path,
+                         '--build-property', 'compiler.cpp.extra_flags=' + flags,
+                         sketch])
+  return os.path.join(build_path, os.path.basename(os.path.abspath(sketch)) + '.ino.elf')
+
+def summary(builds):
+  """One line per build: (title, (flash, sram))."""
+  print('Summary')
+  print('  {0:<28} {1:>8} {2:>5} {3:>8} {4:>5}'.format('build', 'flash', '', 'sram', ''))
+  for title, (flash, sram) in builds:
+    print('  {0:<28} {1:>8} {2:>4}% {3:>8} {4:>4}%'.format(title, flash, 100 * flash // FLASH_BYTES, sram, 100 * sram // SRAM_BYTES))
+
+if __name__ == "__main__":
+  args = sys.argv[1:]
+  protocol = 1
+  if len(args) >= 2 and args[0] == '--protocol':
+    protocol, args = int(args[1]), args[2:]
+  if len(args) >= 3 and args[0] == '--build':
+    builds = []
+    for profile in args[2:]:
+      title = 'Profile {0}, protocol {1}'.format(profile, protocol)
+      elf = build(args[1], profile, protocol)
+      report(elf, title)
+      builds.append((title, totals(elf)))
+    summary(builds)
+  elif len(args) == 1:
+    report(args[0], args[0])
+  else:
+    sys.stderr.write("Usage: {0} file.elf | [--protocol n] --build sketch_dir profile...\n".format(sys.argv[0]))
+    exit(1)
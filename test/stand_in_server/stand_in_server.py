@@ -0,0 +1,358 @@
+#!/usr/bin/env python
+
+# A stand-in PourLogic server: checks X-Pourlogic-Auth on pour requests,
+# pour results and tag filter requests (and, optionally, that nonces only go
+# up) and answers them, signed, after a configurable delay. Tag filters and
+# patron tables are sent as chunked deltas between versions it remembers.
+
+import sys
+import math
+import time
+import hmac
+import struct
+import binascii
+import random
+import hashlib
+import argparse
+import threading
+
+try:
+  from http.server import BaseHTTPRequestHandler, HTTPServer
+  from socketserver import ThreadingMixIn
+except ImportError:
+  from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+  from SocketServer import ThreadingMixIn
+
+AUTH_HEADER = 'X-Pourlogic-Auth'
+POUR_REQUEST_URI = '/pours/new'
+POUR_RESULT_URI = '/pours'
+TAG_FILTER_URI = '/tags/filter'
+TAG_FILTER_MAX_HASHES = 16
+TAG_FILTER_VERSIONS = 16 # versions of each filter kept to make deltas from
+PATRON_TABLE_URI = '/patrons/table'
+PATRON_TABLE_VERSIONS = 16
+PATRON_TABLE_CHUNK = 1   # blocks per response (CLIENT_PATRON_TABLE_CHUNK)
+BLOCK_SIZE = 512
+KEYS_PER_INDEX = 102     # data blocks listed by an index block (5-byte keys)
+RECORDS_PER_BLOCK = 32   # 16-byte patron records per data block
+NO_LIMIT = 0xFFFFFFFF
+
+def fnv1a(tag, hash):
+  for c in bytearray(tag.encode()):
+    hash = ((hash ^ c) * 16777619) & 0xFFFFFFFF
+  return hash
+
+def filter_bits(tag, hashes, bits):
+  """The bits a tag sets in a filter (see TagFilter.h)."""
+  h1 = fnv1a(tag, 2166136261)
+  h2 = fnv1a(tag, h1) | 1
+  return [(h1 % bits + i * (h2 % bits)) % bits for i in range(hashes)]
+
+def tag_filter(tags, max_bytes, fp_permille):
+  """A filter of tags as (HASHES, BITS, bytes), sized for the false-positive rate if it fits in max_bytes."""
+  n = max(1, len(tags))
+  p = min(max(fp_permille, 1), 999) / 1000.0
+  bits = int(math.ceil(-n * math.log(p) / math.log(2) ** 2))
+  bits = max(8, min(bits, max_bytes * 8))
+  hashes = int(max(1, min(TAG_FILTER_MAX_HASHES, round(float(bits) / n * math.log(2)))))
+  data = bytearray((bits + 7) // 8)
+  for tag in tags:
+    for bit in filter_bits(tag, hashes, bits):
+      data[bit >> 3] |= 1 << (bit & 7)
+  return hashes, bits, data
+
+def tag_filter_delta(base, target, digest, offset, count):
+  """The body of a tag filter response: "BASE TARGET HASHES BITS OFFSET COUNT TOTAL DIGEST\nENTRIES" (see PourLogicClient.cpp).
+
+  base and target are (VERSION, HASHES, BITS, bytes); a base of None is the empty filter, version 0."""
+  version, hashes, bits, data = target
+  if base is None:
+    base = (0, hashes, bits, bytearray(len(data)))
+  entries = [(i, data[i]) for i in range(len(data)) if data[i] != base[3][i]]
+  chunk = entries[offset:offset + count]
+  return '{0} {1} {2} {3} {4} {5} {6} {7}\n{8}'.format(base[0], version, hashes, bits, offset, len(chunk), len(entries),
+    digest(bytes(data)).hexdigest(), ''.join('{0:04x}{1:02x}'.format(i, b) for i, b in chunk))
+
+def patron_table(patrons, index_blocks):
+  """A table of patrons (tag -> (flags, max pour mL, remaining mL)) as (INDEX, DATA, {block number: bytes}) (see PatronTable.h).
+
+  Patrons past what index_blocks can list are left out (and so refused while the controller is offline)."""
+  records = sorted((binascii.unhexlify(tag), patrons[tag]) for tag in patrons)
+  records = records[:index_blocks * KEYS_PER_INDEX * RECORDS_PER_BLOCK]
+  data = [records[i:i + RECORDS_PER_BLOCK] for i in range(0, len(records), RECORDS_PER_BLOCK)]
+  index = [data[i:i + KEYS_PER_INDEX] for i in range(0, len(data), KEYS_PER_INDEX)]
+  pad = lambda packed: packed + b'\xff' * (BLOCK_SIZE - len(packed))
+  blocks = {}
+  for i, listed in enumerate(index):
+    blocks[i] = pad(b''.join(block[0][0] for block in listed))
+  for d, block in enumerate(data):
+    blocks[index_blocks + d] = pad(b''.join(struct.pack('<5sBHII', key, flags, max_mL, remaining_mL, 0)
+                                            for key, (flags, max_mL, remaining_mL) in block))
+  return len(index), len(data), blocks
+
+def patron_table_delta(base, target, offset, count):
+  """The body of a patron table response: "BASE TARGET INDEX DATA OFFSET COUNT TOTAL\nBLOCKS" (see PourLogicClient.cpp).
+
+  base and target are (VERSION, INDEX, DATA, blocks); a base of None is no table, version 0."""
+  version, index, data, blocks = target
+  held = base[3] if base is not None else {}
+  changed = [n for n in sorted(blocks) if blocks[n] != held.get(n)]
+  chunk = changed[offset:offset + count]
+  return '{0} {1} {2} {3} {4} {5} {6}\n{7}'.format(base[0] if base is not None else 0, version, index, data, offset, len(chunk), len(changed),
+    ''.join('{0:04x}'.format(n) + binascii.hexlify(blocks[n]).decode() for n in chunk))
+
+class NonceWindow(object):
+  """The nonces of one stream of one client: any not yet seen at or above the highest floor it has signed, within a window of the highest."""
+  def __init__(self, size):
+    self.size = size
+    self.floor = 0
+    self.highest = 0
+    self.seen = set()
+
+  def accept(self, nonce, floor):
+    if floor > nonce or nonce < self.floor or nonce <= self.highest - self.size or nonce in self.seen:
+      return False
+    self.floor = max(self.floor, floor)
+    self.highest = max(self.highest, nonce)
+    self.seen.add(nonce)
+    self.seen = set(n for n in self.seen if n >= self.floor and n > self.highest - self.size)
+    return True
+
+class StandInServer(ThreadingMixIn, HTTPServer):
+  daemon_threads = True
+
+  def __init__(self, address, options):
+    HTTPServer.__init__(self, address, Handler)
+    self.options = options
+    self.digest = hashlib.sha256 if options.sha256 else hashlib.sha1
+    self.effective_key = self.digest(options.secret.encode()).digest()
+    self.random = random.Random(options.seed)
+    self.lock = threading.Lock()
+    self.answered = 0
+    self.rejected = 0
+    self.stale = 0
+    self.recorded = 0
+    self.duplicates = 0
+    self.keys = set()    # idempotency keys of the pour results recorded
+    self.poured = {}     # tag -> mL recorded
+    self.last_nonce = {} # client id -> highest nonce accepted
+    self.windows = {}    # (client id, stream) -> NonceWindow
+    self.enrolled = None # any tag may pour
+    if options.enrolled is not None:
+      self.enrolled = set(tag.strip() for tag in options.enrolled.split(',') if tag.strip())
+    self.filters = {}    # (max bytes, fp permille) -> [(version, hashes, bits, bytes), ...], oldest first
+    self.tables = {}     # index blocks -> [(version, index, data, blocks), ...], oldest first
+    self.last_version = 0
+
+  def enrolled_tags(self):
+    """The enrolled tags, as of now: --enrolled-file is read again for every request, so enrollment can change under a controller."""
+    if self.options.enrolled_file is not None:
+      with open(self.options.enrolled_file) as f:
+        return set(tag.strip() for tag in f.read().replace(',', '\n').split('\n') if tag.strip())
+    return self.enrolled
+
+  def tag_filter_versions(self, max_bytes, fp_permille):
+    """The versions of the filter sized so, the latest (made now, from the enrolled tags) last."""
+    hashes, bits, data = tag_filter(sorted(self.enrolled_tags()), max_bytes, fp_permille)
+    with self.lock:
+      versions = self.filters.setdefault((max_bytes, fp_permille), [])
+      if not versions or versions[-1][1:] != (hashes, bits, data):
+        self.last_version += 1
+        versions.append((self.last_version, hashes, bits, data))
+        del versions[:-TAG_FILTER_VERSIONS]
+      return list(versions)
+
+  def remaining(self, tag):
+    """The mL of a patron's --allowance not yet poured (NO_LIMIT without one)."""
+    if self.options.allowance is None:
+      return NO_LIMIT
+    with self.lock:
+      return max(0, self.options.allowance - self.poured.get(tag, 0))
+
+  def allowance(self, tag):
+    """The mL a patron may pour now: --max-volume, or less if --allowance is running out."""
+    return min(self.options.max_volume, self.remaining(tag))
+
+  def patron_table_versions(self, index_blocks):
+    """The versions of the table as a controller that can keep index_blocks index blocks holds it, the latest (made now) last."""
+    patrons = {}
+    for tag in self.enrolled_tags():
+      if len(tag) == 10 and all(c in '0123456789abcdefABCDEF' for c in tag):
+        patrons[tag] = (0, self.options.max_volume, self.remaining(tag))
+    index, data, blocks = patron_table(patrons, index_blocks)
+    with self.lock:
+      versions = self.tables.setdefault(index_blocks, [])
+      if not versions or versions[-1][1:] != (index, data, blocks):
+        self.last_version += 1
+        versions.append((self.last_version, index, data, blocks))
+        del versions[:-PATRON_TABLE_VERSIONS]
+      return list(versions)
+
+  def delay(self):
+    """Seconds to hold a response back: the configured delay plus jitter, from a seeded sequence."""
+    with self.lock:
+      jitter_ms = self.random.uniform(-self.options.jitter_ms, self.options.jitter_ms)
+    return max(0.0, self.options.delay_ms + jitter_ms) / 1000.0
+
+  def record_result(self, body):
+    """Record a pour result once per key (k), if it has one; returns the seconds to hold its answer back (to lose it, sometimes)."""
+    params = dict(p.partition('=')[::2] for p in body.split('&') if p)
+    with self.lock:
+      key = params.get('k')
+      if key is not None and key in self.keys:
+        self.duplicates += 1
+      else:
+        self.recorded += 1
+        if key is not None:
+          self.keys.add(key)
+        try:
+          self.poured[params.get('u')] = self.poured.get(params.get('u'), 0) + int(params.get('v', 0))
+        except ValueError:
+          pass
+      lost = self.random.uniform(0, 100) < self.options.lose_answers
+    return self.options.lose_ms / 1000.0 if lost else 0.0
+
+  def sign(self, text):
+    return hmac.new(self.effective_key, text.encode(), self.digest).hexdigest()
+
+  def accept_nonce(self, client_id, nonce, stream=None, floor=None):
+    """Whether a nonce is newer than any the client has used (or, signed with a stream and floor, is in its window), remembering it if so."""
+    if not self.options.check_nonces:
+      return True
+    with self.lock:
+      if stream is not None:
+        window = self.windows.setdefault((client_id, stream), NonceWindow(self.options.nonce_window))
+        return window.accept(nonce, floor)
+      if nonce <= self.last_nonce.get(client_id, -1):
+        return False
+      self.last_nonce[client_id] = nonce
+      return True
+
+class Handler(BaseHTTPRequestHandler):
+  protocol_version = 'HTTP/1.0'
+
+  def do_GET(self):
+    path, _, query = self.path.partition('?')
+    params = dict(p.partition('=')[::2] for p in query.split('&') if p)
+    if path == POUR_REQUEST_URI:
+      enrolled_tags = self.server.enrolled_tags()
+      enrolled = enrolled_tags is None or params.get('u') in enrolled_tags
+      self.handle_request('', str(self.server.allowance(params.get('u')) if enrolled else 0))
+    elif path == TAG_FILTER_URI and self.server.enrolled_tags() is not None:
+      try:
+        versions = self.server.tag_filter_versions(int(params['b']), int(params['p']))
+        held, syncing, applied, count = int(params['v']), int(params['s']), int(params['o']), int(params['n'])
+      except (KeyError, ValueError):
+        return self.answer(400)
+      known = dict((v[0], v) for v in versions)
+      base = known.get(held)
+      if syncing in known and applied > 0 and (base is None) == (held == 0):
+        target = known[syncing] # carry on with the delta under way
+      else:
+        target, applied = versions[-1], 0 # start one to the latest (from nothing, if the version held is gone or differently sized)
+        if base is not None and base[1:3] != target[1:3]:
+          base = None
+      self.handle_request('', tag_filter_delta(base, target, self.server.digest, applied, count))
+    elif path == PATRON_TABLE_URI and self.server.enrolled_tags() is not None:
+      try:
+        versions = self.server.patron_table_versions(int(params['i']))
+        held, syncing, applied = int(params['v']), int(params['s']), int(params['o'])
+      except (KeyError, ValueError):
+        return self.answer(400)
+      known = dict((v[0], v) for v in versions)
+      base = known.get(held)
+      if syncing in known and applied > 0 and (base is None) == (held == 0):
+        target = known[syncing] # carry on with the delta under way
+      else:
+        target, applied = versions[-1], 0 # start one to the latest (from nothing, if the version held is gone or laid out differently)
+        if base is not None and base[1:3] != target[1:3]:
+          base = None
+      self.handle_request('', patron_table_delta(base, target, applied, PATRON_TABLE_CHUNK))
+    else:
+      self.answer(404)
+
+  def do_POST(self):
+    if self.path != POUR_RESULT_URI:
+      return self.answer(404)
+    length = int(self.headers.get('Content-Length', 0))
+    self.handle_request(self.rfile.read(length).decode(), '', record=True)
+
+  def handle_request(self, request_body, response_body, record=False):
+    # X-Pourlogic-Auth: ID:NONCE:HMAC over "NONCE\nREQUEST LINE\nBODY",
+    # or ID:STREAM:NONCE:FLOOR:HMAC over "STREAM:NONCE:FLOOR\nREQUEST LINE\nBODY" (SETTINGS_NONCE_WINDOW)
+    fields = self.headers.get(AUTH_HEADER, '').strip().split(':')
+    stream = floor = None
+    try:
+      if len(fields) == 5:
+        client_id, stream, nonce, floor, mac = fields
+        stream, floor = int(stream), int(floor)
+      else:
+        client_id, nonce, mac = fields
+      int(nonce)
+    except ValueError:
+      return self.answer(401)
+    expected = self.server.sign('{0}\n{1}\n{2}'.format(':'.join(fields[1:-1]), self.requestline, request_body))
+    if not hmac.compare_digest(expected, mac.lower()):
+      return self.answer(401)
+    # A replayed (or overtaken) request is genuine but stale
+    if not self.server.accept_nonce(client_id, int(nonce), stream, floor):
+      return self.answer(409)
+    held = self.server.record_result(request_body) if record else 0.0
+    time.sleep(self.server.delay() + held)
+    self.answer(200, response_body, self.server.sign('{0}\n200\n{1}'.format(nonce, response_body)))
+
+  def answer(self, status, body='', mac=None):
+    with self.server.lock:
+      if status == 200:
+        self.server.answered += 1
+      elif status == 409:
+        self.server.stale += 1
+      else:
+        self.server.rejected += 1
+    self.send_response(status)
+    self.send_header('Content-Length', str(len(body)))
+    if mac is not None:
+      self.send_header(AUTH_HEADER, mac)
+    self.end_headers()
+    try:
+      self.wfile.write(body.encode())
+    except (IOError, OSError):
+      pass # the controller gave up on it
+
+  def log_message(self, format, *args):
+    if self.server.options.verbose:
+      BaseHTTPRequestHandler.log_message(self, format, *args)
+
+def parser():
+  parser = argparse.ArgumentParser(description='Stand-in PourLogic server')
+  parser.add_argument('--host', default='0.0.0.0')
+  parser.add_argument('--port', type=int, default=80)
+  parser.add_argument('--secret', default='secret', help='SETTINGS_CLIENT_KEY')
+  parser.add_argument('--sha256', action='store_true', help='the controller was built with SETTINGS_AUTH_SHA256')
+  parser.add_argument('--max-volume', type=int, default=500, help='mL granted to every patron')
+  parser.add_argument('--delay-ms', type=float, default=0, help='time to hold each answer back (e.g. to stand in for a WAN round trip)')
+  parser.add_argument('--jitter-ms', type=float, default=0, help='... give or take up to this much')
+  parser.add_argument('--seed', type=int, default=1, help='seed for the jitter')
+  parser.add_argument('--enrolled', help='comma-separated tags that may pour (others are granted 0 mL), and that tag filters are made of; without it, every tag may pour and there is no tag filter')
+  parser.add_argument('--enrolled-file', help='... or a file of them (a tag per line), read again for every request')
+  parser.add_argument('--allowance', type=int, help='mL each patron may pour in all (less what has been recorded for them), served in patron tables too; without it, there is no limit')
+  parser.add_argument('--check-nonces', action='store_true', help='answer 409 to a request whose nonce is not above the last one its client used (or, for SETTINGS_NONCE_WINDOW, is not in its window)')
+  parser.add_argument('--nonce-window', type=int, default=32, help='(SETTINGS_NONCE_WINDOW) nonces below the highest a stream has used that may still be taken')
+  parser.add_argument('--lose-answers', type=float, default=0, help='percentage of pour results recorded but answered too late (after --lose-ms), as if the answer were lost')
+  parser.add_argument('--lose-ms', type=float, default=5000, help='... holding those answers back this long')
+  parser.add_argument('--verbose', action='store_true')
+  return parser
+
+def main():
+  options = parser().parse_args()
+
+  server = StandInServer((options.host, options.port), options)
+  try:
+    server.serve_forever()
+  except KeyboardInterrupt:
+    pass
+  sys.stderr.write('answered {0}, rejected {1}, stale {2}\n'.format(server.answered, server.rejected, server.stale))
+  sys.stderr.write('pour results recorded {0}, duplicates {1}\n'.format(server.recorded, server.duplicates))
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,61 @@
+#!/usr/bin/env python
+
+# Checks the stand-in server's tag filters against TagFilter's lookup: no
+# enrolled tag may be turned away, and unenrolled tags should pass at about
+# the false-positive rate the filter was sized for.
+
+import os
+import sys
+import random
+import argparse
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'stand_in_server'))
+from stand_in_server import fnv1a, tag_filter
+
+def may_contain(tag, hashes, bits, data):
+  """TagFilter::mayContain, step for step (unsigned int is 16 bits on an Uno)."""
+  h1 = fnv1a(tag, 2166136261)
+  h2 = fnv1a(tag, h1) | 1
+  bit = (h1 % bits) & 0xFFFF
+  step = (h2 % bits) & 0xFFFF
+  for i in range(hashes):
+    if not data[bit >> 3] & (1 << (bit & 7)):
+      return False
+    bit = (bit + step) & 0xFFFF
+    if bit >= bits:
+      bit = (bit - bits) & 0xFFFF
+  return True
+
+def random_tag(rng):
+  """Tag data as RFID_EM41000 reads it: 10 upper-case hex digits."""
+  return '{0:010X}'.format(rng.getrandbits(40))
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser()
+  parser.add_argument('--tags', type=int, nargs='+', default=[50, 150, 300], help='numbers of enrolled tags to try')
+  parser.add_argument('--bytes', type=int, default=256, help='largest filter the controller keeps (SETTINGS_TAG_FILTER_BYTES)')
+  parser.add_argument('--permille', type=int, default=10, help='false-positive rate asked for (SETTINGS_TAG_FILTER_FP_PERMILLE)')
+  parser.add_argument('--probes', type=int, default=100000, help='unenrolled tags to look up')
+  parser.add_argument('--seed', type=int, default=1)
+  options = parser.parse_args()
+
+  rng = random.Random(options.seed)
+  failed = False
+  print('{0:>6} {1:>6} {2:>6} {3:>10} {4:>10}'.format('tags', 'hashes', 'bits', 'false neg', 'false pos'))
+  for count in options.tags:
+    enrolled = set()
+    while len(enrolled) < count:
+      enrolled.add(random_tag(rng))
+    hashes, bits, data = tag_filter(sorted(enrolled), options.bytes, options.permille)
+
+    false_negatives = sum(1 for tag in enrolled if not may_contain(tag, hashes, bits, data))
+    probed = passed = 0
+    while probed < options.probes:
+      tag = random_tag(rng)
+      if tag not in enrolled:
+        probed += 1
+        passed += may_contain(tag, hashes, bits, data)
+
+    print('{0:>6} {1:>6} {2:>6} {3:>10} {4:>9.2f}%'.format(count, hashes, bits, false_negatives, 100.0 * passed / probed))
+    failed = failed or false_negatives > 0
+  exit(1 if failed else 0)
@@ -0,0 +1,117 @@
+#!/usr/bin/env python
+
+# Records, dumps and plays PourLogic controller traces (see Trace.h).
+
+import sys
+import time
+import struct
+
+HEADER = b'PLT1'
+CHUNK_REQUEST = b'>'
+CHUNK_SIZE = 32
+BAUD_RATE = 115200
+END = b'\xf0'
+
+NAMES = {0x1: 'rfid', 0x2: 'pulse', 0x3: 'net-opened', 0x4: 'net-done', 0x5: 'net-data', 0xF: 'end'}
+
+def open_port(port):
+  import serial
+  s = serial.Serial(port, BAUD_RATE, timeout=0.1)
+  time.sleep(2) # the board resets when the port opens
+  return s
+
+def record(port, path):
+  s = open_port(port)
+  with open(path, 'wb') as f:
+    try:
+      while True:
+        f.write(s.read(256))
+    except KeyboardInterrupt:
+      pass
+
+def events(data):
+  """Yields (time_us, type, arg, value) for each event in a trace."""
+  i = len(HEADER) + 4
+  now_us = 0
+  while i < len(data):
+    kind = bytearray(data[i:i+1])[0]
+    i += 1
+    event_type, arg = kind >> 4, kind & 0x0F
+    if event_type == 0xF:
+      return
+    delta_us, shift = 0, 0
+    while True:
+      b = bytearray(data[i:i+1])[0]
+      i += 1
+      delta_us |= (b & 0x7F) << shift
+      shift += 7
+      if not b & 0x80:
+        break
+    now_us += delta_us
+    value = None
+    if event_type != 0x2:
+      value = bytearray(data[i:i+1])[0]
+      i += 1
+    yield now_us, event_type, arg, value
+
+def encode(nonce, trace_events):
+  """Builds a trace from a nonce and (time_us, type, arg, value) events, in time order."""
+  data = bytearray(HEADER) + bytearray(struct.pack('<I', nonce))
+  last_us = 0
+  for now_us, event_type, arg, value in trace_events:
+    delta_us, last_us = now_us - last_us, now_us
+    data.append((event_type << 4) | arg)
+    while True:
+      b = delta_us & 0x7F
+      delta_us >>= 7
+      data.append(b | (0x80 if delta_us else 0))
+      if not delta_us:
+        break
+    if event_type != 0x2:
+      data.append(value)
+  return bytes(data)
+
+def dump(path):
+  data = open(path, 'rb').read()
+  if data[:len(HEADER)] != HEADER:
+    sys.stderr.write("Not a trace: {0}\n".format(path))
+    exit(1)
+  print("nonce {0}".format(struct.unpack('<I', data[len(HEADER):len(HEADER)+4])[0]))
+  for now_us, event_type, arg, value in events(data):
+    shown = '' if value is None else (repr(chr(value)) if event_type in (0x1, 0x5) else str(value))
+    print("{0:12.6f} {1:<10} {2} {3}".format(now_us / 1e6, NAMES.get(event_type, '?'), arg, shown))
+
+def play(port, path, output=sys.stdout, settle_s=5):
+  """Plays a trace to the board, writing whatever else it says to output until it has been quiet for settle_s."""
+  data = open(path, 'rb').read() + END
+  s = open_port(port)
+  sent = 0
+  quiet_since = None
+  # Send a chunk per request; echo anything else the controller says
+  while True:
+    incoming = s.read(256)
+    for c in bytearray(incoming):
+      if c == ord(CHUNK_REQUEST) and sent < len(data):
+        s.write(data[sent:sent+CHUNK_SIZE])
+        sent += CHUNK_SIZE
+      else:
+        output.write(chr(c))
+    output.flush()
+    if sent >= len(data):
+      if incoming:
+        quiet_since = None
+      elif quiet_since is None:
+        quiet_since = time.time()
+      elif time.time() - quiet_since > settle_s:
+        break
+
+if __name__ == "__main__":
+  if len(sys.argv) == 3 and sys.argv[1] == 'dump':
+    dump(sys.argv[2])
+  elif len(sys.argv) == 4 and sys.argv[1] == 'record':
+    record(sys.argv[2], sys.argv[3])
+  elif len(sys.argv) == 4 and sys.argv[1] == 'play':
+    play(sys.argv[2], sys.argv[3])
+  else:
+    sys.stderr.write("Usage: {0} record port file | dump file | play port file\n".format(sys.argv[0]))
+    exit(1)